@@ -0,0 +1,96 @@
+// Two connections to one database file: a call that fails because the
+// other connection holds a lock, then the same object used again once the
+// lock is released; and a schema change made by the other connection.
+//
+//   g++ -std=c++17 -Iinclude example_connections.cpp -lsqlite3 -pthread -o example_connections
+#include "include/rdb.h"
+#include <cstdio>
+#include <iostream>
+
+// A KVStore whose get() and put() hit SQLITE_BUSY keeps working afterwards:
+// its statements are reset on the way out of the failed call
+void kvStoreAfterBusy(rdb::Database& db, rdb::Database& other) {
+    rdb::KVStore kv(db, "settings");
+    kv.put("theme", "light");
+    kv.put("font", "serif");
+
+    other.execute("BEGIN EXCLUSIVE;");
+    try {
+        kv.get("font");
+        std::cout << "get while locked: succeeded\n";
+    } catch (const rdb::SQLiteException& e) {
+        std::cout << "get while locked: " << e.what() << "\n";
+    }
+    try {
+        kv.put("theme", "dark");
+        std::cout << "put while locked: succeeded\n";
+    } catch (const rdb::SQLiteException& e) {
+        std::cout << "put while locked: " << e.what() << "\n";
+    }
+    other.execute("COMMIT;");
+
+    // Fresh arguments: a statement left mid-step would reject these
+    // bindings and run again with the failed call's
+    kv.put("font", "mono");
+    std::cout << "after the lock is released: theme = " << kv.get("theme").value_or("(missing)")
+              << ", font = " << kv.get("font").value_or("(missing)") << "\n";
+}
+
+// The same for a Queue: enqueue() and ack() fail while the other
+// connection holds the lock, then work on their next call
+void queueAfterBusy(rdb::Database& db, rdb::Database& other) {
+    rdb::Queue queue(db, "jobs");
+    queue.enqueue("first");
+    auto claimed = queue.claim(1);
+
+    other.execute("BEGIN EXCLUSIVE;");
+    try {
+        queue.enqueue("lost");
+        std::cout << "enqueue while locked: succeeded\n";
+    } catch (const rdb::SQLiteException& e) {
+        std::cout << "enqueue while locked: " << e.what() << "\n";
+    }
+    try {
+        queue.ack(claimed.at(0));
+        std::cout << "ack while locked: succeeded\n";
+    } catch (const rdb::SQLiteException& e) {
+        std::cout << "ack while locked: " << e.what() << "\n";
+    }
+    other.execute("COMMIT;");
+
+    queue.enqueue("second");
+    std::cout << "after the lock is released: ack " << (queue.ack(claimed.at(0)) ? "removed" : "did not remove")
+              << " the claimed job, queued:";
+    for (const auto& job : queue.claim(10)) std::cout << " " << job.payload;
+    std::cout << "\n";
+}
+
+// A table created through the other connection is seen by the next
+// does_table_exist() call; names match exactly, views are not tables
+void tableFromOtherConnection(rdb::Database& other) {
+    rdb::DBConnect conn;
+    conn.open("connections.db");
+    std::cout << "orders before: " << conn.does_table_exist("orders") << "\n";
+
+    other.execute("CREATE TABLE orders(id INTEGER PRIMARY KEY, total REAL);"
+                  "CREATE VIEW big_orders AS SELECT * FROM orders WHERE total > 100;");
+    std::cout << "orders after the other connection created it: " << conn.does_table_exist("orders") << "\n";
+    std::cout << "ORDERS: " << conn.does_table_exist("ORDERS") << ", big_orders (a view): "
+              << conn.does_table_exist("big_orders") << "\n";
+}
+
+int main() {
+    std::remove("connections.db");
+    try {
+        rdb::Database db("connections.db");
+        rdb::Database other("connections.db");   // no busy timeout: lock conflicts fail at once
+
+        kvStoreAfterBusy(db, other);
+        queueAfterBusy(db, other);
+        tableFromOtherConnection(other);
+    } catch (const rdb::SQLiteException& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
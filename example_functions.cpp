@@ -0,0 +1,56 @@
+// Integer types through registered SQL functions: each value is passed in
+// as an argument, returned as the result and read back, and the program
+// exits with 1 if any comes back changed.
+//
+//   g++ -std=c++17 -Iinclude example_functions.cpp -lsqlite3 -pthread -o example_functions
+#include "include/rdb.h"
+#include <cstdint>
+#include <iostream>
+
+namespace {
+
+int failures = 0;
+
+void check(const std::string& what, const std::string& got, const std::string& expected) {
+    std::cout << what << ": " << got << (got == expected ? "" : "  (expected " + expected + ")") << "\n";
+    if (got != expected) ++failures;
+}
+
+// The value of a SQL expression and its type, "3000000000 integer"
+std::string scalar(rdb::Database& db, const std::string& expr) {
+    auto stmt = db.prepare("SELECT " + expr + ", typeof(" + expr + ");");
+    stmt->step();
+    return stmt->getText(0) + " " + stmt->getText(1);
+}
+
+} // namespace
+
+int main() {
+    try {
+        rdb::Database db(":memory:");
+
+        // uint32_t values above INT_MAX keep their value both ways
+        db.createFunction("u32", [](uint32_t x) { return x; });
+        db.createFunction("u32max", []() { return std::numeric_limits<uint32_t>::max(); });
+        check("u32(3000000000)", scalar(db, "u32(3000000000)"), "3000000000 integer");
+        check("u32max()", scalar(db, "u32max()"), "4294967295 integer");
+
+        // Narrower and signed types are unchanged
+        db.createFunction("i32", [](int32_t x) { return x; });
+        db.createFunction("u16", [](uint16_t x) { return x; });
+        check("i32(-2147483648)", scalar(db, "i32(-2147483648)"), "-2147483648 integer");
+        check("u16(65535)", scalar(db, "u16(65535)"), "65535 integer");
+
+        // uint64_t up to INT64_MAX is an integer; above it, a REAL rather
+        // than a negative integer
+        db.createFunction("u64", [](int64_t x) { return static_cast<uint64_t>(x); });
+        db.createFunction("u64max", []() { return std::numeric_limits<uint64_t>::max(); });
+        check("u64(9223372036854775807)", scalar(db, "u64(9223372036854775807)"), "9223372036854775807 integer");
+        check("u64max() = 2^64 as a REAL", scalar(db, "u64max() = 18446744073709551616.0"), "1 integer");
+        check("typeof(u64max())", scalar(db, "typeof(u64max())"), "real text");
+    } catch (const rdb::SQLiteException& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,84 @@
+// KeyFilter on a table before and after build(): before, every key is a
+// "maybe" answered by SQLite, including rows inserted through the
+// connection; after, absent keys are answered by the filter. Then a saved
+// filter loaded after appends (accepted) and after a delete or a VACUUM
+// (refused, so the caller rebuilds). Exits with 1 if any answer is wrong.
+//
+//   g++ -std=c++17 -Iinclude example_keyfilter.cpp -lsqlite3 -pthread -o example_keyfilter
+#include "include/rdb.h"
+#include <cstdio>
+#include <iostream>
+
+namespace {
+
+int failures = 0;
+
+void check(const std::string& what, bool got, bool expected) {
+    std::cout << what << ": " << got << (got == expected ? "" : expected ? "  (expected 1)" : "  (expected 0)") << "\n";
+    if (got != expected) ++failures;
+}
+
+void insert(rdb::Database& db, const std::string& key) {
+    auto stmt = db.prepare("INSERT INTO events(dedup_key) VALUES (?);");
+    stmt->bindText(1, key);
+    stmt->step();
+}
+
+// Use before build(): nothing is answered from the empty filter
+void beforeBuild(rdb::Database& db) {
+    rdb::KeyFilter seen(db, "events", "dedup_key");
+    insert(db, "b");
+    check("before build, contains(\"a\") (existing row)", seen.contains("a"), true);
+    check("before build, contains(\"b\") (inserted after the filter)", seen.contains("b"), true);
+    check("before build, contains(\"zz\")", seen.contains("zz"), false);
+    check("before build, mightContain(\"zz\")", seen.mightContain("zz"), true);
+
+    seen.build();
+    insert(db, "c");
+    check("after build, contains(\"a\")", seen.contains("a"), true);
+    check("after build, contains(\"c\") (inserted after build)", seen.contains("c"), true);
+    check("after build, contains(\"zz\")", seen.contains("zz"), false);
+    std::cout << "answered without SQLite: " << seen.stats().definiteMisses << " of " << seen.stats().queries
+              << " queries\n";
+}
+
+// A sidecar saved by one KeyFilter and loaded by the next, with the
+// table changed in between while no filter was attached
+bool reload(rdb::Database& db, const std::string& change) {
+    {
+        rdb::KeyFilter seen(db, "events", "dedup_key");
+        seen.build();
+        seen.save("keyfilter.bloom");
+    }
+    db.execute(change);
+    rdb::KeyFilter seen(db, "events", "dedup_key");
+    return seen.load("keyfilter.bloom");
+}
+
+void sidecar(rdb::Database& db) {
+    check("load after an append", reload(db, "INSERT INTO events(dedup_key) VALUES ('d');"), true);
+    rdb::KeyFilter seen(db, "events", "dedup_key");
+    seen.load("keyfilter.bloom");
+    check("after load, contains(\"d\") (appended while saved)", seen.contains("d"), true);
+
+    check("load after a delete", reload(db, "DELETE FROM events WHERE dedup_key = 'b';"), false);
+    check("load after a VACUUM", reload(db, "VACUUM;"), false);
+}
+
+} // namespace
+
+int main() {
+    std::remove("keyfilter.db");
+    std::remove("keyfilter.bloom");
+    try {
+        rdb::Database db("keyfilter.db");
+        db.execute("CREATE TABLE events(id INTEGER PRIMARY KEY, dedup_key TEXT);"
+                   "INSERT INTO events(dedup_key) VALUES ('a');");
+        beforeBuild(db);
+        sidecar(db);
+    } catch (const rdb::SQLiteException& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    return failures ? 1 : 0;
+}
@@ -3,185 +3,7534 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 #include <stdexcept>
 #include <memory>
 #include <functional>
 #include <iostream>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <algorithm>
+#include <new>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <cctype>
+#include <fstream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Builds without exception support (-fno-exceptions) get the same API;
+// errors that would throw print a message and abort instead, so code
+// that must keep running uses the non-throwing try* calls.
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+#define RDB_EXCEPTIONS 1
+#define RDB_THROW(e) throw e
+#else
+#define RDB_EXCEPTIONS 0
+#define RDB_THROW(e) ::rdb::detail::fail(e)
+#endif
 
 namespace rdb {
 
-class SQLiteException : public std::runtime_error {
+template<typename Row> struct VirtualColumn;
+
+class SQLiteException : public std::runtime_error {
+public:
+    SQLiteException(const std::string& msg) : std::runtime_error(msg) {}
+};
+
+namespace detail {
+
+[[noreturn]] inline void fail(const std::exception& e) {
+    std::fprintf(stderr, "rdb: %s\n", e.what());
+    std::abort();
+}
+
+} // namespace detail
+
+// Outcome of a non-throwing call: SQLite's primary result code plus the
+// extended code (e.g. SQLITE_CONSTRAINT / SQLITE_CONSTRAINT_UNIQUE).
+// Database::errorMessage() has the detailed text until the next call.
+struct Status {
+    int code = SQLITE_OK;
+    int extendedCode = SQLITE_OK;
+
+    Status() = default;
+    Status(int primary, int extended) : code(primary), extendedCode(extended) {}
+
+    bool ok() const { return code == SQLITE_OK || code == SQLITE_ROW || code == SQLITE_DONE; }
+    explicit operator bool() const { return ok(); }
+    bool row() const { return code == SQLITE_ROW; }
+    bool done() const { return code == SQLITE_DONE; }
+    bool busy() const { return code == SQLITE_BUSY || code == SQLITE_LOCKED; }
+    bool constraint() const { return code == SQLITE_CONSTRAINT; }
+    const char* message() const { return sqlite3_errstr(extendedCode); }
+};
+
+// A value or the Status explaining why there is none
+template<typename T>
+class Result {
+    std::optional<T> value_;
+    Status status_;
+
+public:
+    Result(T value) : value_(std::move(value)) {}
+    Result(Status status) : status_(status) {}
+
+    bool ok() const { return value_.has_value(); }
+    explicit operator bool() const { return ok(); }
+    const Status& status() const { return status_; }
+    int code() const { return status_.code; }
+    int extendedCode() const { return status_.extendedCode; }
+
+    T& value() { return *value_; }
+    T& operator*() { return *value_; }
+    T* operator->() { return &*value_; }
+};
+
+namespace detail {
+
+// Split a result code from sqlite3_step/exec/prepare into primary and extended parts
+inline Status status(sqlite3* db, int rc) {
+    if (rc == SQLITE_OK || rc == SQLITE_ROW || rc == SQLITE_DONE) return Status(rc, rc);
+    return Status(rc & 0xff, db ? sqlite3_extended_errcode(db) : rc);
+}
+
+} // namespace detail
+
+// ---------------------------------
+// SQL function plumbing (argument decoding / result encoding)
+// ---------------------------------
+namespace detail {
+
+template<typename T> struct is_optional : std::false_type {};
+template<typename T> struct is_optional<std::optional<T>> : std::true_type {};
+
+// Decode a SQL argument into the C++ parameter type, resolved at compile time
+template<typename T>
+T fromValue(sqlite3_value* v) {
+    if constexpr (is_optional<T>::value) {
+        if (sqlite3_value_type(v) == SQLITE_NULL) return std::nullopt;
+        return fromValue<typename T::value_type>(v);
+    } else if constexpr (std::is_same_v<T, bool>) {
+        return sqlite3_value_int(v) != 0;
+    } else if constexpr (std::is_integral_v<T>) {
+        // Unsigned types as wide as int do not fit in one
+        if constexpr (sizeof(T) < sizeof(int) || (sizeof(T) == sizeof(int) && std::is_signed_v<T>))
+            return static_cast<T>(sqlite3_value_int(v));
+        else return static_cast<T>(sqlite3_value_int64(v));
+    } else if constexpr (std::is_floating_point_v<T>) {
+        return static_cast<T>(sqlite3_value_double(v));
+    } else if constexpr (std::is_same_v<T, std::string_view>) {
+        const char* txt = reinterpret_cast<const char*>(sqlite3_value_text(v));
+        return txt ? std::string_view(txt, sqlite3_value_bytes(v)) : std::string_view();
+    } else if constexpr (std::is_same_v<T, std::string>) {
+        const char* txt = reinterpret_cast<const char*>(sqlite3_value_text(v));
+        return txt ? std::string(txt, sqlite3_value_bytes(v)) : std::string();
+    } else if constexpr (std::is_same_v<T, std::vector<unsigned char>>) {
+        auto data = static_cast<const unsigned char*>(sqlite3_value_blob(v));
+        return data ? T(data, data + sqlite3_value_bytes(v)) : T();
+    } else {
+        static_assert(sizeof(T) == 0, "unsupported SQL function argument type");
+    }
+}
+
+// Encode a C++ return value as the SQL function result
+template<typename T>
+void setResult(sqlite3_context* ctx, const T& val) {
+    if constexpr (is_optional<T>::value) {
+        if (val) setResult(ctx, *val);
+        else sqlite3_result_null(ctx);
+    } else if constexpr (std::is_same_v<T, std::nullptr_t>) {
+        sqlite3_result_null(ctx);
+    } else if constexpr (std::is_same_v<T, bool>) {
+        sqlite3_result_int(ctx, val ? 1 : 0);
+    } else if constexpr (std::is_integral_v<T>) {
+        if constexpr (sizeof(T) < sizeof(int) || (sizeof(T) == sizeof(int) && std::is_signed_v<T>)) {
+            sqlite3_result_int(ctx, static_cast<int>(val));
+        } else if constexpr (std::is_unsigned_v<T> && sizeof(T) >= sizeof(sqlite3_int64)) {
+            // Above INT64_MAX the value becomes a REAL, as SQLite does for
+            // an integer literal out of range, rather than wrapping negative
+            if (val > static_cast<T>(std::numeric_limits<sqlite3_int64>::max()))
+                sqlite3_result_double(ctx, static_cast<double>(val));
+            else sqlite3_result_int64(ctx, static_cast<sqlite3_int64>(val));
+        } else {
+            sqlite3_result_int64(ctx, static_cast<sqlite3_int64>(val));
+        }
+    } else if constexpr (std::is_floating_point_v<T>) {
+        sqlite3_result_double(ctx, static_cast<double>(val));
+    } else if constexpr (std::is_convertible_v<T, std::string_view>) {
+        std::string_view sv(val);
+        sqlite3_result_text(ctx, sv.data(), static_cast<int>(sv.size()), SQLITE_TRANSIENT);
+    } else if constexpr (std::is_same_v<T, std::vector<unsigned char>>) {
+        sqlite3_result_blob(ctx, val.data(), static_cast<int>(val.size()), SQLITE_TRANSIENT);
+    } else {
+        static_assert(sizeof(T) == 0, "unsupported SQL function result type");
+    }
+}
+
+// Signature of a callable (lambda, functor, function pointer or member function)
+template<typename F> struct CallableTraits : CallableTraits<decltype(&F::operator())> {};
+template<typename R, typename... A> struct CallableTraits<R(*)(A...)> {
+    using Result = R;
+    using Args = std::tuple<std::decay_t<A>...>;
+    static constexpr int arity = sizeof...(A);
+};
+template<typename R, typename... A> struct CallableTraits<R(A...)> : CallableTraits<R(*)(A...)> {};
+template<typename C, typename R, typename... A> struct CallableTraits<R(C::*)(A...)> : CallableTraits<R(*)(A...)> {};
+template<typename C, typename R, typename... A> struct CallableTraits<R(C::*)(A...) const> : CallableTraits<R(*)(A...)> {};
+
+template<typename Args, typename F, size_t... I>
+decltype(auto) invokeWithValues(F&& fn, sqlite3_value** argv, std::index_sequence<I...>) {
+    return fn(fromValue<std::tuple_element_t<I, Args>>(argv[I])...);
+}
+
+// Report exceptions escaping a callback as a SQL error instead of
+// unwinding through SQLite
+template<typename F>
+void guarded(sqlite3_context* ctx, F&& body) {
+#if RDB_EXCEPTIONS
+    try {
+        body();
+    } catch (const std::exception& e) {
+        sqlite3_result_error(ctx, e.what(), -1);
+    }
+#else
+    (void)ctx;
+    body();
+#endif
+}
+
+template<typename F>
+void invokeScalar(F& fn, sqlite3_context* ctx, sqlite3_value** argv) {
+    using Traits = CallableTraits<F>;
+    using Seq = std::make_index_sequence<Traits::arity>;
+    guarded(ctx, [&] {
+        if constexpr (std::is_void_v<typename Traits::Result>) {
+            invokeWithValues<typename Traits::Args>(fn, argv, Seq{});
+            sqlite3_result_null(ctx);
+        } else {
+            setResult(ctx, invokeWithValues<typename Traits::Args>(fn, argv, Seq{}));
+        }
+    });
+}
+
+// Aggregate state lives in a heap object owned through sqlite3_aggregate_context
+template<typename T>
+T* aggregateState(sqlite3_context* ctx, bool create) {
+    auto slot = static_cast<T**>(sqlite3_aggregate_context(ctx, create ? sizeof(T*) : 0));
+    if (!slot) return nullptr;
+    if (!*slot && create) *slot = new T();
+    return *slot;
+}
+
+template<typename T>
+void aggregateStep(sqlite3_context* ctx, int, sqlite3_value** argv) {
+    guarded(ctx, [&] {
+        T* state = aggregateState<T>(ctx, true);
+        if (!state) { sqlite3_result_error_nomem(ctx); return; }
+        using Traits = CallableTraits<decltype(&T::step)>;
+        invokeWithValues<typename Traits::Args>(
+            [state](auto&&... a) { return state->step(std::forward<decltype(a)>(a)...); },
+            argv, std::make_index_sequence<Traits::arity>{});
+    });
+}
+
+template<typename T>
+void aggregateInverse(sqlite3_context* ctx, int, sqlite3_value** argv) {
+    guarded(ctx, [&] {
+        T* state = aggregateState<T>(ctx, true);
+        if (!state) { sqlite3_result_error_nomem(ctx); return; }
+        using Traits = CallableTraits<decltype(&T::inverse)>;
+        invokeWithValues<typename Traits::Args>(
+            [state](auto&&... a) { return state->inverse(std::forward<decltype(a)>(a)...); },
+            argv, std::make_index_sequence<Traits::arity>{});
+    });
+}
+
+template<typename T>
+void aggregateValue(sqlite3_context* ctx) {
+    guarded(ctx, [&] {
+        T* state = aggregateState<T>(ctx, false);
+        if (state) setResult(ctx, state->value());
+        else setResult(ctx, T().value());
+    });
+}
+
+template<typename T>
+void aggregateFinal(sqlite3_context* ctx) {
+    aggregateValue<T>(ctx);
+    std::unique_ptr<T> owned(aggregateState<T>(ctx, false));
+}
+
+} // namespace detail
+
+// ---------------------------------
+// Array parameters (rdb_array table-valued function)
+// ---------------------------------
+namespace detail {
+
+inline const char* arrayPointerType() { return "rdb_array"; }
+
+// Borrowed view of a caller-owned array bound to a statement parameter
+struct ArrayBinding {
+    enum Type { Int64, Double, Text } type = Int64;
+    const void* data = nullptr;
+    size_t count = 0;
+    std::vector<std::string_view> views;  // only for arrays of std::string
+};
+
+struct ArrayCursor {
+    sqlite3_vtab_cursor base;
+    const ArrayBinding* array = nullptr;
+    size_t pos = 0;
+};
+
+// SELECT value FROM rdb_array(?1) -- ?1 bound with Statement::bindArray
+inline int registerArrayModule(sqlite3* handle) {
+    static sqlite3_module module = [] {
+        sqlite3_module m{};
+        m.xConnect = [](sqlite3* db, void*, int, const char* const*, sqlite3_vtab** out, char**) {
+            int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(value, ptr HIDDEN)");
+            if (rc != SQLITE_OK) return rc;
+            auto vtab = static_cast<sqlite3_vtab*>(sqlite3_malloc(sizeof(sqlite3_vtab)));
+            if (!vtab) return SQLITE_NOMEM;
+            *vtab = sqlite3_vtab{};
+            *out = vtab;
+            return SQLITE_OK;
+        };
+        m.xBestIndex = [](sqlite3_vtab*, sqlite3_index_info* info) {
+            for (int i = 0; i < info->nConstraint; ++i) {
+                const auto& c = info->aConstraint[i];
+                if (c.usable && c.iColumn == 1 && c.op == SQLITE_INDEX_CONSTRAINT_EQ) {
+                    info->aConstraintUsage[i].argvIndex = 1;
+                    info->aConstraintUsage[i].omit = 1;
+                    info->idxNum = 1;
+                    info->estimatedCost = 1;
+                    info->estimatedRows = 100;
+                    return SQLITE_OK;
+                }
+            }
+            info->estimatedCost = 2147483647;
+            info->estimatedRows = 2147483647;
+            return SQLITE_OK;
+        };
+        m.xDisconnect = [](sqlite3_vtab* vtab) { sqlite3_free(vtab); return SQLITE_OK; };
+        m.xOpen = [](sqlite3_vtab*, sqlite3_vtab_cursor** out) {
+            auto cur = new (std::nothrow) ArrayCursor();
+            if (!cur) return SQLITE_NOMEM;
+            *out = &cur->base;
+            return SQLITE_OK;
+        };
+        m.xClose = [](sqlite3_vtab_cursor* cur) { delete reinterpret_cast<ArrayCursor*>(cur); return SQLITE_OK; };
+        m.xFilter = [](sqlite3_vtab_cursor* base, int idxNum, const char*, int argc, sqlite3_value** argv) {
+            auto cur = reinterpret_cast<ArrayCursor*>(base);
+            cur->array = idxNum == 1 && argc == 1
+                ? static_cast<const ArrayBinding*>(sqlite3_value_pointer(argv[0], arrayPointerType()))
+                : nullptr;
+            cur->pos = 0;
+            return SQLITE_OK;
+        };
+        m.xNext = [](sqlite3_vtab_cursor* cur) { ++reinterpret_cast<ArrayCursor*>(cur)->pos; return SQLITE_OK; };
+        m.xEof = [](sqlite3_vtab_cursor* base) {
+            auto cur = reinterpret_cast<ArrayCursor*>(base);
+            return !cur->array || cur->pos >= cur->array->count ? 1 : 0;
+        };
+        m.xColumn = [](sqlite3_vtab_cursor* base, sqlite3_context* ctx, int col) {
+            auto cur = reinterpret_cast<ArrayCursor*>(base);
+            if (col != 0) { sqlite3_result_null(ctx); return SQLITE_OK; }
+            const ArrayBinding& a = *cur->array;
+            switch (a.type) {
+            case ArrayBinding::Int64:
+                sqlite3_result_int64(ctx, static_cast<const int64_t*>(a.data)[cur->pos]);
+                break;
+            case ArrayBinding::Double:
+                sqlite3_result_double(ctx, static_cast<const double*>(a.data)[cur->pos]);
+                break;
+            case ArrayBinding::Text: {
+                const std::string_view& sv = static_cast<const std::string_view*>(a.data)[cur->pos];
+                sqlite3_result_text(ctx, sv.data(), static_cast<int>(sv.size()), SQLITE_STATIC);
+                break;
+            }
+            }
+            return SQLITE_OK;
+        };
+        m.xRowid = [](sqlite3_vtab_cursor* cur, sqlite3_int64* rowid) {
+            *rowid = static_cast<sqlite3_int64>(reinterpret_cast<ArrayCursor*>(cur)->pos);
+            return SQLITE_OK;
+        };
+        return m;
+    }();
+    return sqlite3_create_module(handle, "rdb_array", &module, nullptr);
+}
+
+} // namespace detail
+
+// ---------------------------------
+// Connection hooks
+// ---------------------------------
+
+// Allocations counted on one thread: by SQLite's allocator once
+// AllocationProfile::install() has wrapped it, and by operator new in
+// programs where one source file defines RDB_COUNT_NEW before including
+// rdb.h. Connection hooks report the difference across a statement.
+struct AllocationCount {
+    uint64_t sqliteAllocations = 0;
+    uint64_t sqliteBytes = 0;
+    uint64_t heapAllocations = 0;
+    uint64_t heapBytes = 0;
+
+    AllocationCount operator-(const AllocationCount& o) const {
+        return {sqliteAllocations - o.sqliteAllocations, sqliteBytes - o.sqliteBytes,
+                heapAllocations - o.heapAllocations, heapBytes - o.heapBytes};
+    }
+    AllocationCount& operator+=(const AllocationCount& o) {
+        sqliteAllocations += o.sqliteAllocations;
+        sqliteBytes += o.sqliteBytes;
+        heapAllocations += o.heapAllocations;
+        heapBytes += o.heapBytes;
+        return *this;
+    }
+};
+
+namespace detail {
+
+inline thread_local AllocationCount allocationCount;
+
+// SQLite keeps a single update hook per connection; listeners registered
+// through Database share it. Heap-allocated so the pointer handed to
+// SQLite survives moves of the owning Database, and shared with the
+// Statements prepared through it, which report timings to it and may
+// outlive the Database.
+struct ConnectionHooks {
+    using UpdateListener = std::function<void(int op, const char* dbName, const char* table, int64_t rowid)>;
+    using TransactionListener = std::function<void()>;
+    using TraceListener = std::function<void(unsigned type, void* p, void* x)>;
+    enum class Timing { Prepare, Step, Finish, Execute };
+    using TimingListener = std::function<void(Timing event, sqlite3_stmt* stmt, const char* sql, uint64_t ns)>;
+    using BusyListener = std::function<void(int count, uint64_t sleptNs)>;
+    using AllocationListener = std::function<void(Timing event, sqlite3_stmt* stmt, const char* sql, const AllocationCount& delta)>;
+    using ProgressListener = std::function<bool()>;
+    using CheckpointListener = std::function<void(const char* schema, int logFrames, int checkpointedFrames, uint64_t ns)>;
+    struct Trace {
+        unsigned mask;
+        TraceListener fn;
+    };
+    struct Progress {
+        int ops;
+        int pending;   // instructions since this listener was last called
+        ProgressListener fn;
+    };
+    int nextId = 1;
+    std::vector<std::pair<int, UpdateListener>> update;
+    std::vector<std::pair<int, TransactionListener>> commit;
+    std::vector<std::pair<int, TransactionListener>> rollback;
+    std::vector<std::pair<int, Trace>> trace;
+    std::vector<std::pair<int, TimingListener>> timing;
+    std::vector<std::pair<int, BusyListener>> busy;
+    std::vector<std::pair<int, AllocationListener>> allocation;
+    std::vector<std::pair<int, Progress>> progress;
+    std::vector<std::pair<int, CheckpointListener>> checkpoint;
+    int walAutocheckpoint = 0;   // honoured by onWal while checkpoint listeners replace SQLite's WAL hook
+    int busyTimeoutMs = 0;   // honoured by onBusy while busy listeners replace sqlite3_busy_timeout
+
+    static void onUpdate(void* self, int op, const char* dbName, const char* table, sqlite3_int64 rowid) {
+        for (auto& l : static_cast<ConnectionHooks*>(self)->update) l.second(op, dbName, table, rowid);
+    }
+    static int onCommit(void* self) {
+        for (auto& l : static_cast<ConnectionHooks*>(self)->commit) l.second();
+        return 0;
+    }
+    static void onRollback(void* self) {
+        for (auto& l : static_cast<ConnectionHooks*>(self)->rollback) l.second();
+    }
+    static int onTrace(unsigned type, void* self, void* p, void* x) {
+        for (auto& l : static_cast<ConnectionHooks*>(self)->trace)
+            if (l.second.mask & type) l.second.fn(type, p, x);
+        return 0;
+    }
+    // sqlite3_busy_timeout's delay schedule, reporting each wait (and a
+    // final call with sleptNs 0 when the timeout is used up)
+    static int onBusy(void* self, int count) {
+        auto& h = *static_cast<ConnectionHooks*>(self);
+        static const int delays[] = {1, 2, 5, 10, 15, 20, 25, 25, 25, 50, 50, 100};
+        constexpr int n = static_cast<int>(sizeof delays / sizeof delays[0]);
+        int delay, prior;
+        if (count < n) {
+            delay = delays[count];
+            prior = 0;
+            for (int i = 0; i < count; ++i) prior += delays[i];
+        } else {
+            delay = delays[n - 1];
+            prior = 228 + delay * (count - (n - 1));   // 228 = sum of delays[0..n-2]
+        }
+        if (prior + delay > h.busyTimeoutMs) delay = h.busyTimeoutMs - prior;
+        uint64_t slept = 0;
+        if (delay > 0) {
+            auto start = std::chrono::steady_clock::now();
+            sqlite3_sleep(delay);
+            slept = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count());
+        }
+        for (auto& l : h.busy) l.second(count, slept);
+        return delay > 0;
+    }
+    // SQLite's autocheckpoint WAL hook (a passive checkpoint once the log
+    // reaches walAutocheckpoint frames), timed and reported
+    static int onWal(void* self, sqlite3* db, const char* schema, int frames) {
+        auto& h = *static_cast<ConnectionHooks*>(self);
+        if (h.walAutocheckpoint <= 0 || frames < h.walAutocheckpoint) return SQLITE_OK;
+        auto start = std::chrono::steady_clock::now();
+        int log = 0, done = 0;
+        sqlite3_wal_checkpoint_v2(db, schema, SQLITE_CHECKPOINT_PASSIVE, &log, &done);
+        auto ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+        for (auto& l : h.checkpoint) l.second(schema, log, done, ns);
+        return SQLITE_OK;
+    }
+    // Installed with the smallest interval among the listeners; each one
+    // is called once its own interval has passed, and any true interrupts
+    static int onProgress(void* self) {
+        auto& h = *static_cast<ConnectionHooks*>(self);
+        int ops = h.progressOps();
+        bool interrupt = false;
+        for (auto& l : h.progress) {
+            if ((l.second.pending += ops) < l.second.ops) continue;
+            l.second.pending = 0;
+            interrupt |= l.second.fn();
+        }
+        return interrupt;
+    }
+    void onTiming(Timing event, sqlite3_stmt* stmt, const char* sql, std::chrono::steady_clock::duration d) {
+        auto ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+        for (auto& l : timing) l.second(event, stmt, sql, ns);
+    }
+    // The calling thread's allocations since `since`, taken before any
+    // listener runs
+    void onAllocation(Timing event, sqlite3_stmt* stmt, const char* sql, const AllocationCount& since) {
+        AllocationCount delta = allocationCount - since;
+        for (auto& l : allocation) l.second(event, stmt, sql, delta);
+    }
+    unsigned traceMask() const {
+        unsigned mask = 0;
+        for (auto& l : trace) mask |= l.second.mask;
+        return mask;
+    }
+    int progressOps() const {
+        int ops = 0;
+        for (auto& l : progress) ops = ops ? std::min(ops, l.second.ops) : l.second.ops;
+        return ops;
+    }
+
+    template<typename L>
+    static void erase(std::vector<std::pair<int, L>>& v, int id) {
+        v.erase(std::remove_if(v.begin(), v.end(), [id](const auto& l) { return l.first == id; }), v.end());
+    }
+};
+
+} // namespace detail
+
+// ---------------------------------
+// Database
+// ---------------------------------
+class Database {
+    sqlite3* db_ = nullptr;
+    std::shared_ptr<detail::ConnectionHooks> hooks_;
+
+    detail::ConnectionHooks& hooks() {
+        if (!hooks_) hooks_ = std::make_shared<detail::ConnectionHooks>();
+        return *hooks_;
+    }
+
+    // Takes a handle that already has the rdb_array module registered
+    explicit Database(sqlite3* db) : db_(db) {}
+
+    int exec(const std::string& sql, char** errmsg) {
+        if (!hooks_ || (hooks_->timing.empty() && hooks_->allocation.empty()))
+            return sqlite3_exec(db_, sql.c_str(), nullptr, nullptr, errmsg);
+        AllocationCount allocated = detail::allocationCount;
+        auto start = std::chrono::steady_clock::now();
+        int rc = sqlite3_exec(db_, sql.c_str(), nullptr, nullptr, errmsg);
+        auto end = std::chrono::steady_clock::now();
+        if (!hooks_->allocation.empty())
+            hooks_->onAllocation(detail::ConnectionHooks::Timing::Execute, nullptr, sql.c_str(), allocated);
+        if (!hooks_->timing.empty())
+            hooks_->onTiming(detail::ConnectionHooks::Timing::Execute, nullptr, sql.c_str(), end - start);
+        return rc;
+    }
+
+public:
+    Database(const std::string& filename) {
+        if (sqlite3_open(filename.c_str(), &db_) != SQLITE_OK) {
+            RDB_THROW(SQLiteException(sqlite3_errmsg(db_)));
+        }
+        // bindArray queries depend on rdb_array; failing here beats
+        // "no such table" from every one of them later
+        if (detail::registerArrayModule(db_) != SQLITE_OK) {
+            std::string message = std::string("cannot register rdb_array: ") + sqlite3_errmsg(db_);
+            sqlite3_close(db_);
+            db_ = nullptr;
+            RDB_THROW(SQLiteException(message));
+        }
+    }
+
+    // Non-throwing open
+    static Result<Database> tryOpen(const std::string& filename) {
+        sqlite3* db = nullptr;
+        int rc = sqlite3_open(filename.c_str(), &db);
+        if (rc == SQLITE_OK) rc = detail::registerArrayModule(db);
+        if (rc != SQLITE_OK) {
+            Status st = detail::status(db, rc);
+            sqlite3_close(db);
+            return st;
+        }
+        return Database(db);
+    }
+
+    // close_v2: a Statement still alive keeps the connection open until
+    // it is finalized, instead of the close failing and leaking it
+    ~Database() { if (db_) sqlite3_close_v2(db_); }
+
+    Database(const Database&) = delete;
+    Database& operator=(const Database&) = delete;
+
+    Database(Database&& other) noexcept : db_(other.db_), hooks_(std::move(other.hooks_)) { other.db_ = nullptr; }
+    Database& operator=(Database&& other) noexcept {
+        if (db_) sqlite3_close_v2(db_);
+        db_ = other.db_;
+        hooks_ = std::move(other.hooks_);
+        other.db_ = nullptr;
+        return *this;
+    }
+
+    sqlite3* get() { return db_; }
+
+    // How long to retry when another connection holds a lock (0 disables)
+    void setBusyTimeout(int ms) {
+        if (hooks_ && !hooks_->busy.empty()) hooks_->busyTimeoutMs = ms;
+        else sqlite3_busy_timeout(db_, ms);
+    }
+
+    // WAL size in frames at which a commit runs a passive checkpoint (0
+    // disables), as PRAGMA wal_autocheckpoint
+    void setWalAutocheckpoint(int frames) {
+        if (hooks_ && !hooks_->checkpoint.empty()) hooks_->walAutocheckpoint = frames;
+        else sqlite3_wal_autocheckpoint(db_, frames);
+    }
+
+    // Row change notifications (sqlite3_update_hook) for rowid tables and
+    // transaction end notifications (commit/rollback hooks). Listeners run
+    // inside SQLite and must not use the connection; defer any queries
+    // until the statement has finished. Each returns an id for removeListener().
+    using UpdateListener = detail::ConnectionHooks::UpdateListener;
+    using TransactionListener = detail::ConnectionHooks::TransactionListener;
+    int addUpdateListener(UpdateListener fn) {
+        auto& h = hooks();
+        if (h.update.empty()) sqlite3_update_hook(db_, &detail::ConnectionHooks::onUpdate, &h);
+        h.update.emplace_back(h.nextId, std::move(fn));
+        return h.nextId++;
+    }
+    int addCommitListener(TransactionListener fn) {
+        auto& h = hooks();
+        if (h.commit.empty()) sqlite3_commit_hook(db_, &detail::ConnectionHooks::onCommit, &h);
+        h.commit.emplace_back(h.nextId, std::move(fn));
+        return h.nextId++;
+    }
+    int addRollbackListener(TransactionListener fn) {
+        auto& h = hooks();
+        if (h.rollback.empty()) sqlite3_rollback_hook(db_, &detail::ConnectionHooks::onRollback, &h);
+        h.rollback.emplace_back(h.nextId, std::move(fn));
+        return h.nextId++;
+    }
+    // Statement tracing (sqlite3_trace_v2); mask is a set of SQLITE_TRACE_*
+    // events, and p/x are passed through as documented for the event
+    using TraceListener = detail::ConnectionHooks::TraceListener;
+    int addTraceListener(unsigned mask, TraceListener fn) {
+        auto& h = hooks();
+        h.trace.emplace_back(h.nextId, detail::ConnectionHooks::Trace{mask, std::move(fn)});
+        sqlite3_trace_v2(db_, h.traceMask(), &detail::ConnectionHooks::onTrace, &h);
+        return h.nextId++;
+    }
+    // Wall-clock timings of work done through this Database and the
+    // Statements it prepares (not statements built directly on get()):
+    //   Prepare   each prepare()/tryPrepare()
+    //   Step      each step()/tryStep()
+    //   Finish    from the start of a statement's first step to the end of
+    //             its last (SQLITE_DONE, an error, or the step before a
+    //             reset() part way through)
+    //   Execute   each execute()/tryExecute() script; stmt is null and sql
+    //             is the script
+    // Timing is skipped entirely while no listener is registered.
+    using Timing = detail::ConnectionHooks::Timing;
+    using TimingListener = detail::ConnectionHooks::TimingListener;
+    int addTimingListener(TimingListener fn) {
+        auto& h = hooks();
+        h.timing.emplace_back(h.nextId, std::move(fn));
+        return h.nextId++;
+    }
+    // Called after each wait of the busy timeout (setBusyTimeout), with the
+    // number of earlier waits for this lock and the time slept; sleptNs is
+    // 0 on the last call, when the timeout is used up and SQLITE_BUSY is
+    // returned. Listeners take over the connection's busy handler, so set
+    // the timeout with setBusyTimeout() rather than PRAGMA busy_timeout.
+    using BusyListener = detail::ConnectionHooks::BusyListener;
+    int addBusyListener(BusyListener fn) {
+        auto& h = hooks();
+        if (h.busy.empty()) {
+            sqlite3_stmt* stmt = nullptr;
+            h.busyTimeoutMs = 0;
+            if (sqlite3_prepare_v2(db_, "PRAGMA busy_timeout", -1, &stmt, nullptr) == SQLITE_OK &&
+                sqlite3_step(stmt) == SQLITE_ROW)
+                h.busyTimeoutMs = sqlite3_column_int(stmt, 0);
+            sqlite3_finalize(stmt);
+            sqlite3_busy_handler(db_, &detail::ConnectionHooks::onBusy, &h);
+        }
+        h.busy.emplace_back(h.nextId, std::move(fn));
+        return h.nextId++;
+    }
+    // Allocations made on the calling thread (see AllocationCount) during
+    // Prepare, Finish (first step to last, including the caller's own work
+    // between steps) and Execute, reported as for timing listeners
+    using AllocationListener = detail::ConnectionHooks::AllocationListener;
+    int addAllocationListener(AllocationListener fn) {
+        auto& h = hooks();
+        h.allocation.emplace_back(h.nextId, std::move(fn));
+        return h.nextId++;
+    }
+    // Called after each automatic checkpoint in WAL mode with the log size
+    // and frames copied, both in frames, and the time it took. Listeners
+    // take over the connection's WAL hook and run the checkpoints
+    // themselves, so set the threshold with setWalAutocheckpoint() rather
+    // than PRAGMA wal_autocheckpoint or sqlite3_wal_hook.
+    using CheckpointListener = detail::ConnectionHooks::CheckpointListener;
+    int addCheckpointListener(CheckpointListener fn) {
+        auto& h = hooks();
+        if (h.checkpoint.empty()) {
+            sqlite3_stmt* stmt = nullptr;
+            h.walAutocheckpoint = 0;
+            if (sqlite3_prepare_v2(db_, "PRAGMA wal_autocheckpoint", -1, &stmt, nullptr) == SQLITE_OK &&
+                sqlite3_step(stmt) == SQLITE_ROW)
+                h.walAutocheckpoint = sqlite3_column_int(stmt, 0);
+            sqlite3_finalize(stmt);
+            sqlite3_wal_hook(db_, &detail::ConnectionHooks::onWal, &h);
+        }
+        h.checkpoint.emplace_back(h.nextId, std::move(fn));
+        return h.nextId++;
+    }
+    // Called about every `ops` virtual machine instructions of a running
+    // statement; returning true interrupts it (SQLITE_INTERRUPT). Listeners
+    // take over the connection's progress handler, so register them here
+    // rather than with sqlite3_progress_handler.
+    using ProgressListener = detail::ConnectionHooks::ProgressListener;
+    int addProgressListener(int ops, ProgressListener fn) {
+        auto& h = hooks();
+        h.progress.emplace_back(h.nextId, detail::ConnectionHooks::Progress{std::max(1, ops), 0, std::move(fn)});
+        sqlite3_progress_handler(db_, h.progressOps(), &detail::ConnectionHooks::onProgress, &h);
+        return h.nextId++;
+    }
+    void removeListener(int id) {
+        if (!hooks_) return;
+        auto& h = *hooks_;
+        detail::ConnectionHooks::erase(h.allocation, id);
+        bool progress = !h.progress.empty();
+        detail::ConnectionHooks::erase(h.progress, id);
+        if (int ops = h.progressOps()) sqlite3_progress_handler(db_, ops, &detail::ConnectionHooks::onProgress, &h);
+        else if (progress) sqlite3_progress_handler(db_, 0, nullptr, nullptr);
+        bool busy = !h.busy.empty();
+        detail::ConnectionHooks::erase(h.busy, id);
+        if (busy && h.busy.empty()) sqlite3_busy_timeout(db_, h.busyTimeoutMs);
+        bool checkpoint = !h.checkpoint.empty();
+        detail::ConnectionHooks::erase(h.checkpoint, id);
+        if (checkpoint && h.checkpoint.empty()) sqlite3_wal_autocheckpoint(db_, h.walAutocheckpoint);
+        detail::ConnectionHooks::erase(h.update, id);
+        detail::ConnectionHooks::erase(h.commit, id);
+        detail::ConnectionHooks::erase(h.rollback, id);
+        detail::ConnectionHooks::erase(h.trace, id);
+        detail::ConnectionHooks::erase(h.timing, id);
+        if (h.update.empty()) sqlite3_update_hook(db_, nullptr, nullptr);
+        if (h.commit.empty()) sqlite3_commit_hook(db_, nullptr, nullptr);
+        if (h.rollback.empty()) sqlite3_rollback_hook(db_, nullptr, nullptr);
+        if (unsigned mask = h.traceMask()) sqlite3_trace_v2(db_, mask, &detail::ConnectionHooks::onTrace, &h);
+        else sqlite3_trace_v2(db_, 0, nullptr, nullptr);
+    }
+
+    std::unique_ptr<class Statement> prepare(const std::string& sql);
+
+    // Non-throwing counterparts of prepare() and execute() for paths where
+    // failures such as SQLITE_BUSY or constraint violations are expected;
+    // flags are SQLITE_PREPARE_* (e.g. PERSISTENT for long-lived statements)
+    Result<std::unique_ptr<class Statement>> tryPrepare(const std::string& sql, unsigned flags = 0);
+    Status tryExecute(const std::string& sql) {
+        return detail::status(db_, exec(sql, nullptr));
+    }
+
+    // Text of the most recent error on this connection
+    const char* errorMessage() { return sqlite3_errmsg(db_); }
+
+    void execute(const std::string& sql) {
+        char* errmsg = nullptr;
+        if (exec(sql, &errmsg) != SQLITE_OK) {
+            std::string msg = errmsg ? errmsg : "Unknown error";
+            sqlite3_free(errmsg);
+            RDB_THROW(SQLiteException(msg));
+        }
+    }
+
+    // Register a C++ callable as a scalar SQL function; argument and
+    // result types are taken from the callable's signature.
+    //   db.createFunction("twice", [](double x) { return x * 2; });
+    template<typename F>
+    void createFunction(const std::string& name, F fn, bool deterministic = true) {
+        using Fn = std::decay_t<F>;
+        int flags = SQLITE_UTF8 | (deterministic ? SQLITE_DETERMINISTIC : 0);
+        int rc = sqlite3_create_function_v2(db_, name.c_str(), detail::CallableTraits<Fn>::arity, flags,
+            new Fn(std::move(fn)),
+            [](sqlite3_context* ctx, int, sqlite3_value** argv) {
+                detail::invokeScalar(*static_cast<Fn*>(sqlite3_user_data(ctx)), ctx, argv);
+            },
+            nullptr, nullptr,
+            [](void* p) { delete static_cast<Fn*>(p); });
+        if (rc != SQLITE_OK) RDB_THROW(SQLiteException(sqlite3_errmsg(db_)));
+    }
+
+    // Register an aggregate. T is default-constructed per group and must
+    // provide step(args...) and value(); it is destroyed when the group ends.
+    template<typename T>
+    void createAggregate(const std::string& name, bool deterministic = true) {
+        int flags = SQLITE_UTF8 | (deterministic ? SQLITE_DETERMINISTIC : 0);
+        int rc = sqlite3_create_function_v2(db_, name.c_str(),
+            detail::CallableTraits<decltype(&T::step)>::arity, flags, nullptr,
+            nullptr, &detail::aggregateStep<T>, &detail::aggregateFinal<T>, nullptr);
+        if (rc != SQLITE_OK) RDB_THROW(SQLiteException(sqlite3_errmsg(db_)));
+    }
+
+    // Register an aggregate window function. In addition to step() and
+    // value(), T must provide inverse(args...) to remove rows leaving the frame.
+    template<typename T>
+    void createWindowFunction(const std::string& name, bool deterministic = true) {
+        int flags = SQLITE_UTF8 | (deterministic ? SQLITE_DETERMINISTIC : 0);
+        int rc = sqlite3_create_window_function(db_, name.c_str(),
+            detail::CallableTraits<decltype(&T::step)>::arity, flags, nullptr,
+            &detail::aggregateStep<T>, &detail::aggregateFinal<T>,
+            &detail::aggregateValue<T>, &detail::aggregateInverse<T>, nullptr);
+        if (rc != SQLITE_OK) RDB_THROW(SQLiteException(sqlite3_errmsg(db_)));
+    }
+
+    // Expose a contiguous container of structs (std::vector, std::array, ...)
+    // as a read-only table named `name`. Rows are read in place, so the
+    // container must outlive the connection and not be resized during a query.
+    template<typename Container, typename Row = typename Container::value_type>
+    void createVirtualTable(const std::string& name, const Container& rows,
+                            std::vector<VirtualColumn<Row>> columns);
+    // A temporary container would be gone before the first query
+    template<typename Container, typename Row = typename Container::value_type>
+    void createVirtualTable(const std::string& name, const Container&& rows,
+                            std::vector<VirtualColumn<Row>> columns) = delete;
+
+    // RAII transaction
+    class Transaction {
+        Database& db_;
+        bool active_ = true;
+    public:
+        // Immediate takes the write lock up front, so a writer waits in
+        // BEGIN (honouring the busy timeout) instead of failing mid-transaction
+        enum Mode { Deferred, Immediate, Exclusive };
+
+        Transaction(Database& db, Mode mode = Deferred) : db_(db) {
+            db_.execute(mode == Immediate ? "BEGIN IMMEDIATE;" : mode == Exclusive ? "BEGIN EXCLUSIVE;" : "BEGIN;");
+        }
+        ~Transaction() { if(active_) db_.execute("ROLLBACK;"); }
+        void commit() { db_.execute("COMMIT;"); active_ = false; }
+        // A busy COMMIT leaves the transaction open so it can be retried
+        Status tryCommit() {
+            Status st = db_.tryExecute("COMMIT;");
+            if (st) active_ = false;
+            return st;
+        }
+        void rollback() { db_.execute("ROLLBACK;"); active_ = false; }
+    };
+};
+
+// ---------------------------------
+// Statement
+// ---------------------------------
+class Statement {
+    friend class DBConnect;
+    friend class Database;
+    sqlite3_stmt* stmt_ = nullptr;
+    std::shared_ptr<detail::ConnectionHooks> hooks_;   // set when prepared through a Database
+    bool running_ = false;                       // stepped since the last finish, for timing
+    std::chrono::steady_clock::time_point started_, lastStep_;
+    AllocationCount allocatedAt_;                // before the first step, for allocation listeners
+    std::vector<std::unique_ptr<detail::ArrayBinding>> arrays_;  // by parameter index
+
+    void bindArray(int index, detail::ArrayBinding::Type type, const void* data, size_t count) {
+        if (index <= 0) return;
+        if (arrays_.size() <= static_cast<size_t>(index)) arrays_.resize(index + 1);
+        if (!arrays_[index]) arrays_[index] = std::make_unique<detail::ArrayBinding>();
+        detail::ArrayBinding& a = *arrays_[index];
+        a.type = type;
+        a.data = data;
+        a.count = count;
+        checkBind(sqlite3_bind_pointer(stmt_, index, &a, detail::arrayPointerType(), nullptr));
+    }
+
+    void checkBind(int rc) {
+        if (rc != SQLITE_OK) RDB_THROW(SQLiteException(sqlite3_errmsg(sqlite3_db_handle(stmt_))));
+    }
+
+public:
+    Statement(sqlite3* db, const std::string& sql) {
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt_, nullptr) != SQLITE_OK) {
+            RDB_THROW(SQLiteException(sqlite3_errmsg(db)));
+        }
+    }
+
+    // Take ownership of an already prepared statement
+    explicit Statement(sqlite3_stmt* stmt) noexcept : stmt_(stmt) {}
+
+    ~Statement() {
+        if(stmt_) {
+            finished();
+            sqlite3_finalize(stmt_);
+        }
+    }
+
+    Statement(const Statement&) = delete;
+    Statement& operator=(const Statement&) = delete;
+
+    Statement(Statement&& other) noexcept
+        : stmt_(other.stmt_), hooks_(std::move(other.hooks_)), running_(other.running_), started_(other.started_),
+          lastStep_(other.lastStep_), allocatedAt_(other.allocatedAt_), arrays_(std::move(other.arrays_)) {
+        other.stmt_ = nullptr;
+        other.running_ = false;
+    }
+    Statement& operator=(Statement&& other) noexcept {
+        if(stmt_) {
+            finished();
+            sqlite3_finalize(stmt_);
+        }
+        stmt_ = other.stmt_;
+        hooks_ = std::move(other.hooks_);
+        running_ = other.running_;
+        started_ = other.started_;
+        lastStep_ = other.lastStep_;
+        allocatedAt_ = other.allocatedAt_;
+        other.running_ = false;
+        arrays_ = std::move(other.arrays_);
+        other.stmt_ = nullptr;
+        return *this;
+    }
+
+    // Positional binding. A bind that fails throws: SQLITE_RANGE, SQLITE_TOOBIG,
+    // or SQLITE_MISUSE on a statement that was not reset after an error,
+    // which would otherwise run again with its previous values.
+    void bind(int index, int val) { checkBind(sqlite3_bind_int(stmt_, index, val)); }
+    void bind(int index, double val) { checkBind(sqlite3_bind_double(stmt_, index, val)); }
+    void bind(int index, const std::string& val) {
+        checkBind(sqlite3_bind_text(stmt_, index, val.c_str(), -1, SQLITE_TRANSIENT));
+    }
+    void bindInt64(int index, int64_t val) { checkBind(sqlite3_bind_int64(stmt_, index, val)); }
+    void bindText(int index, std::string_view val) {
+        checkBind(sqlite3_bind_text(stmt_, index, val.data(), static_cast<int>(val.size()), SQLITE_TRANSIENT));
+    }
+    void bindBlob(int index, const void* data, int size) {
+        checkBind(sqlite3_bind_blob(stmt_, index, data, size, SQLITE_TRANSIENT));
+    }
+    void bindBlob(int index, const std::vector<unsigned char>& val) {
+        bindBlob(index, val.data(), static_cast<int>(val.size()));
+    }
+    // Reserve a zero-filled blob of the given size, to be filled with BlobStream
+    void bindZeroBlob(int index, int64_t bytes) {
+        checkBind(sqlite3_bind_zeroblob64(stmt_, index, static_cast<sqlite3_uint64>(bytes)));
+    }
+
+    // Named binding; names the statement does not use are ignored
+    void bind(const std::string& name, int val) {
+        int idx = sqlite3_bind_parameter_index(stmt_, name.c_str());
+        if(idx) checkBind(sqlite3_bind_int(stmt_, idx, val));
+    }
+    void bind(const std::string& name, double val) {
+        int idx = sqlite3_bind_parameter_index(stmt_, name.c_str());
+        if(idx) checkBind(sqlite3_bind_double(stmt_, idx, val));
+    }
+    void bind(const std::string& name, const std::string& val) {
+        int idx = sqlite3_bind_parameter_index(stmt_, name.c_str());
+        if(idx) checkBind(sqlite3_bind_text(stmt_, idx, val.c_str(), -1, SQLITE_TRANSIENT));
+    }
+
+    // Array binding for use with the rdb_array table-valued function:
+    //   SELECT * FROM users WHERE id IN rdb_array(?1);
+    // The values are not copied; they must stay alive until the statement
+    // is reset or the parameter is rebound.
+    void bindArray(int index, const int64_t* values, size_t count) {
+        bindArray(index, detail::ArrayBinding::Int64, values, count);
+    }
+    void bindArray(int index, const double* values, size_t count) {
+        bindArray(index, detail::ArrayBinding::Double, values, count);
+    }
+    void bindArray(int index, const std::string_view* values, size_t count) {
+        bindArray(index, detail::ArrayBinding::Text, values, count);
+    }
+    void bindArray(int index, const std::vector<int64_t>& values) { bindArray(index, values.data(), values.size()); }
+    void bindArray(int index, const std::vector<double>& values) { bindArray(index, values.data(), values.size()); }
+    void bindArray(int index, const std::vector<std::string_view>& values) { bindArray(index, values.data(), values.size()); }
+    void bindArray(int index, const std::vector<std::string>& values) {
+        if (index <= 0) return;
+        bindArray(index, detail::ArrayBinding::Text, nullptr, 0);
+        detail::ArrayBinding& a = *arrays_[index];
+        a.views.assign(values.begin(), values.end());
+        a.data = a.views.data();
+        a.count = a.views.size();
+    }
+
+    bool step() {
+        int rc = timedStep();
+        if(rc == SQLITE_ROW) return true;
+        if(rc == SQLITE_DONE) return false;
+        RDB_THROW(SQLiteException(sqlite3_errmsg(sqlite3_db_handle(stmt_))));
+    }
+
+    // Non-throwing step: row() while rows remain, done() at the end,
+    // otherwise the error (the statement must be reset before reuse)
+    Status tryStep() {
+        int rc = timedStep();
+        return detail::status(sqlite3_db_handle(stmt_), rc);
+    }
+
+private:
+    // Only the step's own two clock reads: a statement's Finish time is
+    // derived from its first step's start and last step's end
+    int timedStep() {
+        if (!hooks_ || (hooks_->timing.empty() && hooks_->allocation.empty())) return sqlite3_step(stmt_);
+        bool timed = !hooks_->timing.empty();
+        if (!running_) allocatedAt_ = detail::allocationCount;
+        auto start = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+        int rc = sqlite3_step(stmt_);
+        auto end = timed ? std::chrono::steady_clock::now() : start;
+        if (!running_) {
+            running_ = true;
+            started_ = start;
+        }
+        lastStep_ = end;
+        if (rc != SQLITE_ROW) {
+            running_ = false;
+            if (!hooks_->allocation.empty())
+                hooks_->onAllocation(detail::ConnectionHooks::Timing::Finish, stmt_, nullptr, allocatedAt_);
+        }
+        if (timed) {
+            hooks_->onTiming(detail::ConnectionHooks::Timing::Step, stmt_, nullptr, end - start);
+            if (rc != SQLITE_ROW) hooks_->onTiming(detail::ConnectionHooks::Timing::Finish, stmt_, nullptr, end - started_);
+        }
+        return rc;
+    }
+
+    // A statement reset or finalized before SQLITE_DONE finishes at its last step
+    void finished() noexcept {
+        if (!running_) return;
+        running_ = false;
+        if (!hooks_) return;
+        if (!hooks_->allocation.empty())
+            hooks_->onAllocation(detail::ConnectionHooks::Timing::Finish, stmt_, nullptr, allocatedAt_);
+        if (!hooks_->timing.empty())
+            hooks_->onTiming(detail::ConnectionHooks::Timing::Finish, stmt_, nullptr, lastStep_ - started_);
+    }
+
+public:
+
+    void reset() {
+        finished();
+        sqlite3_reset(stmt_);
+    }
+
+    sqlite3_stmt* get() { return stmt_; }
+
+    int getInt(int col) { return sqlite3_column_int(stmt_, col); }
+    int64_t getInt64(int col) { return sqlite3_column_int64(stmt_, col); }
+    double getDouble(int col) { return sqlite3_column_double(stmt_, col); }
+    std::string getText(int col) {
+        const char* txt = reinterpret_cast<const char*>(sqlite3_column_text(stmt_, col));
+        return txt ? txt : "";
+    }
+    std::vector<unsigned char> getBlob(int col) {
+        auto data = static_cast<const unsigned char*>(sqlite3_column_blob(stmt_, col));
+        return data ? std::vector<unsigned char>(data, data + sqlite3_column_bytes(stmt_, col))
+                    : std::vector<unsigned char>();
+    }
+    // Zero-copy blob access; the pointer is valid until the next step()/reset()
+    const void* getBlobData(int col) { return sqlite3_column_blob(stmt_, col); }
+    int getBytes(int col) { return sqlite3_column_bytes(stmt_, col); }
+
+    // Map each row using a lambda
+    void forEachRow(const std::function<void(Statement&)>& fn) {
+        while(step()) fn(*this);
+        reset();
+    }
+
+    // Generic row-to-struct mapping
+    template<typename T>
+    std::vector<T> mapRows(std::function<T(Statement&)> mapper) {
+        std::vector<T> results;
+        forEachRow([&](Statement& row){ results.push_back(mapper(row)); });
+        return results;
+    }
+
+    // Fetch single column as vector
+    template<typename T>
+    std::vector<T> column(int colIndex);
+};
+
+namespace detail {
+
+// Resets a cached statement and clears its bindings however the scope is
+// left. A step that threw leaves the statement halted; reused as is, its
+// next bind fails with SQLITE_MISUSE and sqlite3_step re-runs it with the
+// previous call's parameters.
+class ResetOnExit {
+public:
+    explicit ResetOnExit(Statement& stmt) : stmt_(stmt) {}
+    ~ResetOnExit() {
+        stmt_.reset();
+        sqlite3_clear_bindings(stmt_.get());
+    }
+
+    ResetOnExit(const ResetOnExit&) = delete;
+    ResetOnExit& operator=(const ResetOnExit&) = delete;
+
+private:
+    Statement& stmt_;
+};
+
+} // namespace detail
+
+// ---------------------------------
+// Database::prepare
+// ---------------------------------
+inline std::unique_ptr<Statement> Database::prepare(const std::string& sql) {
+    auto prepared = tryPrepare(sql);
+    if (!prepared) RDB_THROW(SQLiteException(sqlite3_errmsg(db_)));
+    return std::move(*prepared);
+}
+
+inline Result<std::unique_ptr<Statement>> Database::tryPrepare(const std::string& sql, unsigned flags) {
+    auto& h = hooks();
+    AllocationCount allocated = h.allocation.empty() ? AllocationCount() : detail::allocationCount;
+    auto start = h.timing.empty() ? std::chrono::steady_clock::time_point() : std::chrono::steady_clock::now();
+    sqlite3_stmt* stmt = nullptr;
+    int rc = sqlite3_prepare_v3(db_, sql.c_str(), -1, flags, &stmt, nullptr);
+    if (rc != SQLITE_OK) return detail::status(db_, rc);
+    auto end = h.timing.empty() ? start : std::chrono::steady_clock::now();
+    if (!h.allocation.empty() && stmt) h.onAllocation(detail::ConnectionHooks::Timing::Prepare, stmt, nullptr, allocated);
+    if (!h.timing.empty() && stmt) h.onTiming(detail::ConnectionHooks::Timing::Prepare, stmt, nullptr, end - start);
+    auto s = std::make_unique<Statement>(stmt);
+    s->hooks_ = hooks_;
+    return s;
+}
+
+// ---------------------------------
+// Template specializations
+// ---------------------------------
+template<>
+inline std::vector<int> Statement::column<int>(int colIndex) {
+    std::vector<int> res;
+    while(step()) res.push_back(getInt(colIndex));
+    reset();
+    return res;
+}
+
+template<>
+inline std::vector<double> Statement::column<double>(int colIndex) {
+    std::vector<double> res;
+    while(step()) res.push_back(getDouble(colIndex));
+    reset();
+    return res;
+}
+
+template<>
+inline std::vector<std::string> Statement::column<std::string>(int colIndex) {
+    std::vector<std::string> res;
+    while(step()) res.push_back(getText(colIndex));
+    reset();
+    return res;
+}
+
+// ---------------------------------
+// Incremental blob I/O
+// ---------------------------------
+
+// Handle on one blob cell (sqlite3_blob_open). Reads and writes go
+// straight to the pages, so large values stream through a fixed-size
+// buffer instead of being materialised as a whole. A blob cannot change
+// size this way: reserve it first with zeroblob(N) / Statement::bindZeroBlob.
+// The handle is invalidated if its row is changed by anything else;
+// later reads and writes then throw.
+class BlobStream {
+    sqlite3* db_ = nullptr;
+    sqlite3_blob* blob_ = nullptr;
+    int64_t pos_ = 0;
+
+    void check(int rc) {
+        if (rc != SQLITE_OK) RDB_THROW(SQLiteException(sqlite3_errmsg(db_)));
+    }
+
+public:
+    BlobStream(Database& db, const std::string& table, const std::string& column,
+               int64_t rowid, bool writable = false, const std::string& schema = "main")
+        : db_(db.get()) {
+        check(sqlite3_blob_open(db_, schema.c_str(), table.c_str(), column.c_str(),
+                                rowid, writable ? 1 : 0, &blob_));
+    }
+
+    ~BlobStream() { if (blob_) sqlite3_blob_close(blob_); }
+
+    BlobStream(const BlobStream&) = delete;
+    BlobStream& operator=(const BlobStream&) = delete;
+
+    BlobStream(BlobStream&& other) noexcept : db_(other.db_), blob_(other.blob_), pos_(other.pos_) {
+        other.blob_ = nullptr;
+    }
+    BlobStream& operator=(BlobStream&& other) noexcept {
+        if (blob_) sqlite3_blob_close(blob_);
+        db_ = other.db_;
+        blob_ = other.blob_;
+        pos_ = other.pos_;
+        other.blob_ = nullptr;
+        return *this;
+    }
+
+    sqlite3_blob* get() { return blob_; }
+
+    // Point the handle at another row of the same table and column; much
+    // cheaper than opening a new handle. Rewinds to the start.
+    void reopen(int64_t rowid) {
+        check(sqlite3_blob_reopen(blob_, rowid));
+        pos_ = 0;
+    }
+
+    int64_t size() const { return sqlite3_blob_bytes(blob_); }
+
+    // Positioned access; the range must lie inside the blob
+    void readAt(int64_t offset, void* buffer, size_t bytes) { check(tryReadAt(offset, buffer, bytes).code); }
+    void writeAt(int64_t offset, const void* data, size_t bytes) { check(tryWriteAt(offset, data, bytes).code); }
+    Status tryReadAt(int64_t offset, void* buffer, size_t bytes) {
+        return detail::status(db_, sqlite3_blob_read(blob_, buffer, static_cast<int>(bytes), static_cast<int>(offset)));
+    }
+    Status tryWriteAt(int64_t offset, const void* data, size_t bytes) {
+        return detail::status(db_, sqlite3_blob_write(blob_, data, static_cast<int>(bytes), static_cast<int>(offset)));
+    }
+
+    // Sequential access from the current position. read() returns the
+    // number of bytes read, 0 at the end of the blob.
+    size_t read(void* buffer, size_t bytes) {
+        size_t n = static_cast<size_t>(std::min<int64_t>(static_cast<int64_t>(bytes), size() - pos_));
+        if (n) readAt(pos_, buffer, n);
+        pos_ += n;
+        return n;
+    }
+    void write(const void* data, size_t bytes) {
+        if (pos_ + static_cast<int64_t>(bytes) > size())
+            RDB_THROW(SQLiteException("BlobStream: write past end of blob"));
+        writeAt(pos_, data, bytes);
+        pos_ += bytes;
+    }
+    size_t read(std::vector<unsigned char>& buffer) { return read(buffer.data(), buffer.size()); }
+    void write(const std::vector<unsigned char>& data) { write(data.data(), data.size()); }
+    void write(std::string_view data) { write(data.data(), data.size()); }
+
+    void seek(int64_t pos) { pos_ = std::clamp<int64_t>(pos, 0, size()); }
+    int64_t tell() const { return pos_; }
+
+    // Stream the rest of the blob to / fill it from a C++ stream in
+    // chunkSize pieces; returns the number of bytes copied
+    int64_t copyTo(std::ostream& out, size_t chunkSize = 64 * 1024) {
+        std::vector<char> chunk(chunkSize);
+        int64_t total = 0;
+        while (size_t n = read(chunk.data(), chunk.size())) {
+            out.write(chunk.data(), static_cast<std::streamsize>(n));
+            total += n;
+        }
+        return total;
+    }
+    int64_t copyFrom(std::istream& in, size_t chunkSize = 64 * 1024) {
+        std::vector<char> chunk(chunkSize);
+        int64_t total = 0;
+        while (pos_ < size() && in) {
+            size_t want = static_cast<size_t>(std::min<int64_t>(static_cast<int64_t>(chunk.size()), size() - pos_));
+            in.read(chunk.data(), static_cast<std::streamsize>(want));
+            size_t n = static_cast<size_t>(in.gcount());
+            if (!n) break;
+            write(chunk.data(), n);
+            total += n;
+        }
+        return total;
+    }
+
+    // std::streambuf adapter so a blob can back an std::istream/std::ostream:
+    //   rdb::BlobStream::Buffer buf(blob);
+    //   std::istream in(&buf);
+    // SQLite errors set the stream's failbit/badbit rather than throwing.
+    class Buffer : public std::streambuf {
+        BlobStream& blob_;
+        std::vector<char> buf_;
+        int64_t base_ = 0;     // blob offset of buf_[0] while reading
+
+        bool flush() {
+            size_t n = static_cast<size_t>(pptr() - pbase());
+            if (!n) return true;
+            if (!blob_.tryWriteAt(blob_.tell(), pbase(), n)) return false;
+            blob_.seek(blob_.tell() + static_cast<int64_t>(n));
+            setp(buf_.data(), buf_.data() + buf_.size());
+            return true;
+        }
+
+    protected:
+        int_type underflow() override {
+            if (pptr() != pbase()) {
+                if (!flush()) return traits_type::eof();
+                setp(nullptr, nullptr);
+            }
+            base_ = blob_.tell();
+            size_t n = static_cast<size_t>(std::min<int64_t>(static_cast<int64_t>(buf_.size()), blob_.size() - base_));
+            if (!n || !blob_.tryReadAt(base_, buf_.data(), n)) return traits_type::eof();
+            blob_.seek(base_ + static_cast<int64_t>(n));
+            setg(buf_.data(), buf_.data(), buf_.data() + n);
+            return traits_type::to_int_type(buf_[0]);
+        }
+        int_type overflow(int_type ch) override {
+            if (gptr()) {   // switching from reading: resume at the logical position
+                blob_.seek(base_ + (gptr() - eback()));
+                setg(nullptr, nullptr, nullptr);
+            }
+            if (!pbase()) setp(buf_.data(), buf_.data() + buf_.size());
+            else if (pptr() == epptr() && !flush()) return traits_type::eof();
+            if (traits_type::eq_int_type(ch, traits_type::eof())) return traits_type::not_eof(ch);
+            if (blob_.tell() + (pptr() - pbase()) >= blob_.size()) return traits_type::eof();
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+            return ch;
+        }
+        int sync() override { return flush() ? 0 : -1; }
+        pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode) override {
+            if (sync() != 0) return pos_type(off_type(-1));
+            int64_t cur = gptr() ? base_ + (gptr() - eback()) : blob_.tell();
+            int64_t target = dir == std::ios_base::beg ? off : dir == std::ios_base::cur ? cur + off : blob_.size() + off;
+            if (target < 0 || target > blob_.size()) return pos_type(off_type(-1));
+            setg(nullptr, nullptr, nullptr);
+            setp(nullptr, nullptr);
+            blob_.seek(target);
+            return pos_type(target);
+        }
+        pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+            return seekoff(off_type(pos), std::ios_base::beg, which);
+        }
+
+    public:
+        explicit Buffer(BlobStream& blob, size_t bufferSize = 64 * 1024)
+            : blob_(blob), buf_(bufferSize) {}
+        ~Buffer() override { sync(); }
+    };
+};
+
+// ---------------------------------
+// Container virtual tables
+// ---------------------------------
+
+// One column of a container-backed virtual table. Columns flagged as
+// sorted form the container's sort key, in declaration order.
+template<typename Row>
+struct VirtualColumn {
+    std::string name;
+    std::string type;
+    bool sorted = false;
+    std::function<void(sqlite3_context*, const Row&)> result;
+    // Three-way compare of a row's value against a constraint value;
+    // nullopt when the value's type can't be ordered against the column
+    std::function<std::optional<int>(const Row&, sqlite3_value*)> compare;
+};
+
+namespace detail {
+
+inline std::string quoteIdentifier(const std::string& name) {
+    std::string q = "\"";
+    for (char c : name) q += c == '"' ? std::string("\"\"") : std::string(1, c);
+    return q + "\"";
+}
+
+template<typename T>
+const char* sqlTypeName() {
+    if constexpr (std::is_integral_v<T>) return "INTEGER";
+    else if constexpr (std::is_floating_point_v<T>) return "REAL";
+    else if constexpr (std::is_same_v<T, std::vector<unsigned char>>) return "BLOB";
+    else return "TEXT";
+}
+
+template<typename A, typename B>
+int threeWay(const A& a, const B& b) { return a < b ? -1 : (b < a ? 1 : 0); }
+
+template<typename T>
+std::optional<int> compareValue(const T& field, sqlite3_value* v) {
+    int type = sqlite3_value_type(v);
+    if constexpr (std::is_arithmetic_v<T>) {
+        if (type == SQLITE_INTEGER && std::is_integral_v<T>)
+            return threeWay(static_cast<sqlite3_int64>(field), sqlite3_value_int64(v));
+        if (type == SQLITE_INTEGER || type == SQLITE_FLOAT)
+            return threeWay(static_cast<double>(field), sqlite3_value_double(v));
+    } else if constexpr (std::is_convertible_v<const T&, std::string_view>) {
+        if (type == SQLITE_TEXT) {
+            int c = std::string_view(field).compare(fromValue<std::string_view>(v));
+            return c < 0 ? -1 : (c > 0 ? 1 : 0);
+        }
+    }
+    return std::nullopt;
+}
+
+template<typename Row>
+struct ContainerModule {
+    std::function<std::pair<const Row*, size_t>()> view;
+    std::vector<VirtualColumn<Row>> columns;
+    std::vector<int> keys;  // sort key column indexes
+    sqlite3_module module{};
+};
+
+struct ContainerVTab {
+    sqlite3_vtab base;
+    void* module;
+};
+
+template<typename Row>
+struct ContainerCursor {
+    sqlite3_vtab_cursor base;
+    const Row* rows = nullptr;
+    size_t pos = 0;
+    size_t end = 0;
+};
+
+// idxNum packs one 3-bit operator per argv slot; equality constraints on the
+// sort key prefix come first, followed by at most two range bounds. Ten
+// slots fill 30 bits; constraints past them are left for SQLite to check.
+enum : int { kOpEq = 1, kOpGt = 2, kOpGe = 3, kOpLt = 4, kOpLe = 5 };
+constexpr int kMaxContainerArgs = 10;
+
+template<typename Row>
+int containerBestIndex(sqlite3_vtab* vtab, sqlite3_index_info* info) {
+    auto mod = static_cast<ContainerModule<Row>*>(reinterpret_cast<ContainerVTab*>(vtab)->module);
+    double rows = static_cast<double>(mod->view().second) + 1;
+
+    auto findConstraint = [&](int column, auto accept) {
+        for (int i = 0; i < info->nConstraint; ++i) {
+            const auto& c = info->aConstraint[i];
+            if (c.usable && c.iColumn == column && info->aConstraintUsage[i].argvIndex == 0 && accept(c.op))
+                return i;
+        }
+        return -1;
+    };
+
+    int argc = 0, idxNum = 0;
+    auto use = [&](int i, int op) {
+        info->aConstraintUsage[i].argvIndex = ++argc;
+        idxNum |= op << (3 * (argc - 1));
+    };
+
+    size_t k = 0;
+    for (; k < mod->keys.size() && argc < kMaxContainerArgs - 2; ++k) {
+        int i = findConstraint(mod->keys[k], [](int op) { return op == SQLITE_INDEX_CONSTRAINT_EQ; });
+        if (i < 0) break;
+        use(i, kOpEq);
+        rows = rows / 10 + 1;
+    }
+    if (k < mod->keys.size()) {
+        int lo = findConstraint(mod->keys[k], [](int op) {
+            return op == SQLITE_INDEX_CONSTRAINT_GT || op == SQLITE_INDEX_CONSTRAINT_GE; });
+        if (lo >= 0) {
+            use(lo, info->aConstraint[lo].op == SQLITE_INDEX_CONSTRAINT_GT ? kOpGt : kOpGe);
+            rows = rows / 3 + 1;
+        }
+        int hi = findConstraint(mod->keys[k], [](int op) {
+            return op == SQLITE_INDEX_CONSTRAINT_LT || op == SQLITE_INDEX_CONSTRAINT_LE; });
+        if (hi >= 0) {
+            use(hi, info->aConstraint[hi].op == SQLITE_INDEX_CONSTRAINT_LT ? kOpLt : kOpLe);
+            rows = rows / 3 + 1;
+        }
+    }
+
+    // Rows come out in container order, so an ascending ORDER BY on a
+    // prefix of the sort key needs no sorter
+    bool ordered = info->nOrderBy > 0 && static_cast<size_t>(info->nOrderBy) <= mod->keys.size();
+    for (int i = 0; ordered && i < info->nOrderBy; ++i)
+        ordered = !info->aOrderBy[i].desc && info->aOrderBy[i].iColumn == mod->keys[i];
+    info->orderByConsumed = ordered;
+
+    info->idxNum = idxNum;
+    info->estimatedRows = static_cast<sqlite3_int64>(rows);
+    info->estimatedCost = argc ? rows + 20 : rows;
+    return SQLITE_OK;
+}
+
+template<typename Row>
+int containerFilter(sqlite3_vtab_cursor* base, int idxNum, const char*, int argc, sqlite3_value** argv) {
+    auto cur = reinterpret_cast<ContainerCursor<Row>*>(base);
+    auto mod = static_cast<ContainerModule<Row>*>(reinterpret_cast<ContainerVTab*>(base->pVtab)->module);
+    auto view = mod->view();
+    cur->rows = view.first;
+    const Row* first = view.first;
+    const Row* last = view.first + view.second;
+
+    size_t eq = 0;
+    sqlite3_value* lo = nullptr; sqlite3_value* hi = nullptr;
+    bool loStrict = false, hiStrict = false;
+    for (int i = 0; i < argc; ++i) {
+        int op = (idxNum >> (3 * i)) & 7;
+        if (op == kOpEq) ++eq;
+        else if (op == kOpGt || op == kOpGe) { lo = argv[i]; loStrict = op == kOpGt; }
+        else { hi = argv[i]; hiStrict = op == kOpLt; }
+    }
+
+    // Compare the equality prefix; constraint values of a type the column
+    // can't order against are skipped and left for SQLite to evaluate
+    bool usable = true;
+    auto prefix = [&](const Row& r) {
+        for (size_t k = 0; k < eq; ++k) {
+            auto c = mod->columns[mod->keys[k]].compare(r, argv[k]);
+            if (!c) { usable = false; return 0; }
+            if (*c) return *c;
+        }
+        return 0;
+    };
+    const auto* rangeCol = eq < mod->keys.size() ? &mod->columns[mod->keys[eq]] : nullptr;
+
+    auto before = [&](const Row& r) {
+        int p = prefix(r);
+        if (p) return p < 0;
+        if (!lo) return false;
+        auto c = rangeCol->compare(r, lo);
+        if (!c) { usable = false; return false; }
+        return *c < 0 || (loStrict && *c == 0);
+    };
+    auto notAfter = [&](const Row& r) {
+        int p = prefix(r);
+        if (p) return p < 0;
+        if (!hi) return true;
+        auto c = rangeCol->compare(r, hi);
+        if (!c) { usable = false; return true; }
+        return *c < 0 || (!hiStrict && *c == 0);
+    };
+
+    const Row* b = std::partition_point(first, last, before);
+    const Row* e = std::partition_point(b, last, notAfter);
+    if (!usable) { b = first; e = last; }
+    cur->pos = static_cast<size_t>(b - first);
+    cur->end = static_cast<size_t>(e - first);
+    return SQLITE_OK;
+}
+
+template<typename Row>
+ContainerModule<Row>* makeContainerModule() {
+    auto created = new ContainerModule<Row>();
+    sqlite3_module& m = created->module;
+    m.iVersion = 1;
+    m.xCreate = nullptr;  // eponymous-only: usable without CREATE VIRTUAL TABLE
+    m.xConnect = [](sqlite3* db, void* aux, int, const char* const*, sqlite3_vtab** out, char**) {
+        auto mod = static_cast<ContainerModule<Row>*>(aux);
+        std::string ddl = "CREATE TABLE x(";
+        for (size_t i = 0; i < mod->columns.size(); ++i) {
+            if (i) ddl += ", ";
+            ddl += quoteIdentifier(mod->columns[i].name) + " " + mod->columns[i].type;
+        }
+        ddl += ")";
+        int rc = sqlite3_declare_vtab(db, ddl.c_str());
+        if (rc != SQLITE_OK) return rc;
+        auto vtab = static_cast<ContainerVTab*>(sqlite3_malloc(sizeof(ContainerVTab)));
+        if (!vtab) return SQLITE_NOMEM;
+        *vtab = ContainerVTab{};
+        vtab->module = mod;
+        *out = &vtab->base;
+        return SQLITE_OK;
+    };
+    m.xBestIndex = &containerBestIndex<Row>;
+    m.xDisconnect = [](sqlite3_vtab* vtab) { sqlite3_free(vtab); return SQLITE_OK; };
+    m.xOpen = [](sqlite3_vtab*, sqlite3_vtab_cursor** out) {
+        auto cur = new (std::nothrow) ContainerCursor<Row>();
+        if (!cur) return SQLITE_NOMEM;
+        *out = &cur->base;
+        return SQLITE_OK;
+    };
+    m.xClose = [](sqlite3_vtab_cursor* cur) {
+        delete reinterpret_cast<ContainerCursor<Row>*>(cur);
+        return SQLITE_OK;
+    };
+    m.xFilter = &containerFilter<Row>;
+    m.xNext = [](sqlite3_vtab_cursor* cur) {
+        ++reinterpret_cast<ContainerCursor<Row>*>(cur)->pos;
+        return SQLITE_OK;
+    };
+    m.xEof = [](sqlite3_vtab_cursor* base) {
+        auto cur = reinterpret_cast<ContainerCursor<Row>*>(base);
+        return cur->pos >= cur->end ? 1 : 0;
+    };
+    m.xColumn = [](sqlite3_vtab_cursor* base, sqlite3_context* ctx, int col) {
+        auto cur = reinterpret_cast<ContainerCursor<Row>*>(base);
+        auto mod = static_cast<ContainerModule<Row>*>(reinterpret_cast<ContainerVTab*>(base->pVtab)->module);
+        mod->columns[col].result(ctx, cur->rows[cur->pos]);
+        return SQLITE_OK;
+    };
+    m.xRowid = [](sqlite3_vtab_cursor* cur, sqlite3_int64* rowid) {
+        *rowid = static_cast<sqlite3_int64>(reinterpret_cast<ContainerCursor<Row>*>(cur)->pos);
+        return SQLITE_OK;
+    };
+    return created;
+}
+
+} // namespace detail
+
+// Column backed by a data member, e.g. virtualColumn("id", &Point::id, true)
+template<typename Row, typename M>
+VirtualColumn<Row> virtualColumn(const std::string& name, M Row::* member, bool sorted = false) {
+    VirtualColumn<Row> col;
+    col.name = name;
+    col.type = detail::sqlTypeName<M>();
+    col.sorted = sorted;
+    col.result = [member](sqlite3_context* ctx, const Row& r) {
+        const M& v = r.*member;
+        // Text points straight into the container; it is stable for the query
+        if constexpr (std::is_same_v<M, std::string> || std::is_same_v<M, std::string_view>)
+            sqlite3_result_text(ctx, v.data(), static_cast<int>(v.size()), SQLITE_STATIC);
+        else
+            detail::setResult(ctx, v);
+    };
+    col.compare = [member](const Row& r, sqlite3_value* v) { return detail::compareValue(r.*member, v); };
+    return col;
+}
+
+// Computed column, e.g. virtualColumn<Point>("norm", [](const Point& p) { return std::hypot(p.x, p.y); })
+template<typename Row, typename F>
+VirtualColumn<Row> virtualColumn(const std::string& name, F getter, bool sorted = false) {
+    using T = std::decay_t<decltype(getter(std::declval<const Row&>()))>;
+    VirtualColumn<Row> col;
+    col.name = name;
+    col.type = detail::sqlTypeName<T>();
+    col.sorted = sorted;
+    col.result = [getter](sqlite3_context* ctx, const Row& r) { detail::setResult(ctx, getter(r)); };
+    col.compare = [getter](const Row& r, sqlite3_value* v) { return detail::compareValue(getter(r), v); };
+    return col;
+}
+
+// ---------------------------------
+// Database::createVirtualTable
+// ---------------------------------
+template<typename Container, typename Row>
+void Database::createVirtualTable(const std::string& name, const Container& rows,
+                                  std::vector<VirtualColumn<Row>> columns) {
+    auto mod = detail::makeContainerModule<Row>();
+    const Container* source = &rows;
+    mod->view = [source]() {
+        return std::pair<const Row*, size_t>(std::data(*source), std::size(*source));
+    };
+    mod->columns = std::move(columns);
+    for (size_t i = 0; i < mod->columns.size(); ++i)
+        if (mod->columns[i].sorted) mod->keys.push_back(static_cast<int>(i));
+    int rc = sqlite3_create_module_v2(db_, name.c_str(), &mod->module, mod,
+        [](void* p) { delete static_cast<detail::ContainerModule<Row>*>(p); });
+    if (rc != SQLITE_OK) RDB_THROW(SQLiteException(sqlite3_errmsg(db_)));
+}
+
+// ---------------------------------
+// Vector similarity search
+// ---------------------------------
+enum class VectorType { Float32, Int8 };
+enum class VectorMetric { L2, Cosine, Dot };
+
+namespace detail {
+
+// Per-ISA float lanes for the distance kernels. AVX2/FMA is picked up when
+// the including translation unit is built with it (e.g. -march=native).
+#if defined(__AVX2__) && defined(__FMA__)
+struct F32Lanes {
+    using V = __m256;
+    static constexpr size_t width = 8;
+    static V zero() { return _mm256_setzero_ps(); }
+    static V load(const float* p) { return _mm256_loadu_ps(p); }
+    static V add(V a, V b) { return _mm256_add_ps(a, b); }
+    static V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+    static V fma(V a, V b, V c) { return _mm256_fmadd_ps(a, b, c); }
+    static float sum(V v) {
+        __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 1)));
+    }
+};
+#elif defined(__SSE2__)
+struct F32Lanes {
+    using V = __m128;
+    static constexpr size_t width = 4;
+    static V zero() { return _mm_setzero_ps(); }
+    static V load(const float* p) { return _mm_loadu_ps(p); }
+    static V add(V a, V b) { return _mm_add_ps(a, b); }
+    static V sub(V a, V b) { return _mm_sub_ps(a, b); }
+    static V fma(V a, V b, V c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+    static float sum(V v) {
+        v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+        return _mm_cvtss_f32(_mm_add_ss(v, _mm_shuffle_ps(v, v, 1)));
+    }
+};
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+struct F32Lanes {
+    using V = float32x4_t;
+    static constexpr size_t width = 4;
+    static V zero() { return vdupq_n_f32(0); }
+    static V load(const float* p) { return vld1q_f32(p); }
+    static V add(V a, V b) { return vaddq_f32(a, b); }
+    static V sub(V a, V b) { return vsubq_f32(a, b); }
+    static V fma(V a, V b, V c) { return vfmaq_f32(c, a, b); }
+    static float sum(V v) { return vaddvq_f32(v); }
+};
+#else
+struct F32Lanes {
+    using V = float;
+    static constexpr size_t width = 1;
+    static V zero() { return 0; }
+    static V load(const float* p) { return *p; }
+    static V add(V a, V b) { return a + b; }
+    static V sub(V a, V b) { return a - b; }
+    static V fma(V a, V b, V c) { return a * b + c; }
+    static float sum(V v) { return v; }
+};
+#endif
+
+struct VectorSums { float dot = 0, aa = 0, bb = 0, l2 = 0; };
+
+// Only the sums the metric needs are accumulated; two independent
+// accumulators per sum keep the FMA pipeline busy.
+template<VectorMetric M>
+VectorSums vectorSums(const float* a, const float* b, size_t n) {
+    using S = F32Lanes;
+    typename S::V d0 = S::zero(), d1 = S::zero(), aa = S::zero(), bb = S::zero();
+    size_t i = 0;
+    for (; i + 2 * S::width <= n; i += 2 * S::width) {
+        auto x0 = S::load(a + i), x1 = S::load(a + i + S::width);
+        auto y0 = S::load(b + i), y1 = S::load(b + i + S::width);
+        if constexpr (M == VectorMetric::L2) {
+            auto e0 = S::sub(x0, y0), e1 = S::sub(x1, y1);
+            d0 = S::fma(e0, e0, d0);
+            d1 = S::fma(e1, e1, d1);
+        } else {
+            d0 = S::fma(x0, y0, d0);
+            d1 = S::fma(x1, y1, d1);
+            if constexpr (M == VectorMetric::Cosine) {
+                aa = S::fma(x1, x1, S::fma(x0, x0, aa));
+                bb = S::fma(y1, y1, S::fma(y0, y0, bb));
+            }
+        }
+    }
+    VectorSums r;
+    float acc = S::sum(S::add(d0, d1));
+    if constexpr (M == VectorMetric::Cosine) { r.aa = S::sum(aa); r.bb = S::sum(bb); }
+    for (; i < n; ++i) {
+        if constexpr (M == VectorMetric::L2) { float e = a[i] - b[i]; acc += e * e; }
+        else {
+            acc += a[i] * b[i];
+            if constexpr (M == VectorMetric::Cosine) { r.aa += a[i] * a[i]; r.bb += b[i] * b[i]; }
+        }
+    }
+    (M == VectorMetric::L2 ? r.l2 : r.dot) = acc;
+    return r;
+}
+
+template<VectorMetric M>
+VectorSums vectorSums(const int8_t* a, const int8_t* b, size_t n) {
+    int32_t acc = 0, aa = 0, bb = 0;
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256i vacc = _mm256_setzero_si256(), vaa = _mm256_setzero_si256(), vbb = _mm256_setzero_si256();
+    for (; i + 16 <= n; i += 16) {
+        __m256i x = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+        __m256i y = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+        if constexpr (M == VectorMetric::L2) {
+            __m256i e = _mm256_sub_epi16(x, y);
+            vacc = _mm256_add_epi32(vacc, _mm256_madd_epi16(e, e));
+        } else {
+            vacc = _mm256_add_epi32(vacc, _mm256_madd_epi16(x, y));
+            if constexpr (M == VectorMetric::Cosine) {
+                vaa = _mm256_add_epi32(vaa, _mm256_madd_epi16(x, x));
+                vbb = _mm256_add_epi32(vbb, _mm256_madd_epi16(y, y));
+            }
+        }
+    }
+    alignas(32) int32_t lanes[3][8];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes[0]), vacc);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes[1]), vaa);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes[2]), vbb);
+    for (int l = 0; l < 8; ++l) { acc += lanes[0][l]; aa += lanes[1][l]; bb += lanes[2][l]; }
+#endif
+    // Integer loop; compilers vectorize this one without fast-math
+    for (; i < n; ++i) {
+        int32_t x = a[i], y = b[i];
+        if constexpr (M == VectorMetric::L2) acc += (x - y) * (x - y);
+        else {
+            acc += x * y;
+            if constexpr (M == VectorMetric::Cosine) { aa += x * x; bb += y * y; }
+        }
+    }
+    VectorSums r;
+    (M == VectorMetric::L2 ? r.l2 : r.dot) = static_cast<float>(acc);
+    r.aa = static_cast<float>(aa);
+    r.bb = static_cast<float>(bb);
+    return r;
+}
+
+// Ranking distance: smaller is closer. L2 stays squared until results are
+// returned, Dot is the negated dot product.
+template<VectorMetric M, typename T>
+float vectorDistance(const T* a, const T* b, size_t n) {
+    VectorSums s = vectorSums<M>(a, b, n);
+    if constexpr (M == VectorMetric::L2) return s.l2;
+    else if constexpr (M == VectorMetric::Dot) return -s.dot;
+    else {
+        float denom = std::sqrt(s.aa) * std::sqrt(s.bb);
+        return denom > 0 ? 1.0f - s.dot / denom : 1.0f;
+    }
+}
+
+template<typename T>
+float vectorDistance(VectorMetric metric, const T* a, const T* b, size_t n) {
+    switch (metric) {
+    case VectorMetric::L2: return vectorDistance<VectorMetric::L2>(a, b, n);
+    case VectorMetric::Cosine: return vectorDistance<VectorMetric::Cosine>(a, b, n);
+    default: return vectorDistance<VectorMetric::Dot>(a, b, n);
+    }
+}
+
+// SQLite makes no alignment promise for blob memory: a vector that is not
+// aligned for T is read through a copy in scratch
+template<typename T>
+const T* alignedVector(const void* data, size_t n, std::vector<T>& scratch) {
+    if (reinterpret_cast<uintptr_t>(data) % alignof(T) == 0) return static_cast<const T*>(data);
+    scratch.resize(n);
+    std::memcpy(scratch.data(), data, n * sizeof(T));
+    return scratch.data();
+}
+
+template<VectorMetric M, typename T>
+void vectorFunction(sqlite3_context* ctx, int, sqlite3_value** argv) {
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL || sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+    const void* a = sqlite3_value_blob(argv[0]);
+    int na = sqlite3_value_bytes(argv[0]);
+    const void* b = sqlite3_value_blob(argv[1]);
+    int nb = sqlite3_value_bytes(argv[1]);
+    if (na != nb || na % sizeof(T)) {
+        sqlite3_result_error(ctx, "vector size mismatch", -1);
+        return;
+    }
+    size_t n = static_cast<size_t>(na) / sizeof(T);
+    std::vector<T> sa, sb;
+    float d = vectorDistance<M>(alignedVector<T>(a, n, sa), alignedVector<T>(b, n, sb), n);
+    if constexpr (M == VectorMetric::L2) d = std::sqrt(d);
+    else if constexpr (M == VectorMetric::Dot) d = -d;
+    sqlite3_result_double(ctx, d);
+}
+
+} // namespace detail
+
+// Register vec_l2, vec_cosine (cosine distance) and vec_dot over float32
+// blobs, plus the _i8 variants over int8 blobs:
+//   SELECT id FROM docs ORDER BY vec_cosine(embedding, ?1) LIMIT 10;
+inline void registerVectorFunctions(Database& db) {
+    struct Fn { const char* name; void (*fn)(sqlite3_context*, int, sqlite3_value**); };
+    const Fn fns[] = {
+        {"vec_l2", &detail::vectorFunction<VectorMetric::L2, float>},
+        {"vec_cosine", &detail::vectorFunction<VectorMetric::Cosine, float>},
+        {"vec_dot", &detail::vectorFunction<VectorMetric::Dot, float>},
+        {"vec_l2_i8", &detail::vectorFunction<VectorMetric::L2, int8_t>},
+        {"vec_cosine_i8", &detail::vectorFunction<VectorMetric::Cosine, int8_t>},
+        {"vec_dot_i8", &detail::vectorFunction<VectorMetric::Dot, int8_t>},
+    };
+    for (const Fn& f : fns) {
+        if (sqlite3_create_function_v2(db.get(), f.name, 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                                       nullptr, f.fn, nullptr, nullptr, nullptr) != SQLITE_OK)
+            RDB_THROW(SQLiteException(sqlite3_errmsg(db.get())));
+    }
+}
+
+// Nearest-neighbour search over a blob column holding fixed-size float32 or
+// int8 vectors. search() is an exact scan; buildIvf() adds an optional
+// inverted-file index (k-means centroids plus list assignments, kept in the
+// tables <table>_ivf_centroids and <table>_ivf_lists) for approximate
+// search that only scans the `probes` closest lists.
+class VectorIndex {
+public:
+    struct Match {
+        int64_t rowid;
+        float distance;  // smaller is closer; for Dot it is the negated dot product
+    };
+
+    VectorIndex(Database& db, const std::string& table, const std::string& column, size_t dims,
+                VectorMetric metric = VectorMetric::L2, VectorType type = VectorType::Float32)
+        : db_(db), table_(table), column_(column), dims_(dims), metric_(metric), type_(type) {}
+
+    std::vector<Match> search(const float* query, size_t k) { return scan(query, k, nullptr); }
+    std::vector<Match> search(const int8_t* query, size_t k) { return scan(query, k, nullptr); }
+
+    std::vector<Match> searchIvf(const float* query, size_t k, size_t probes) {
+        return scan(query, k, &probeLists(query, probes));
+    }
+    std::vector<Match> searchIvf(const int8_t* query, size_t k, size_t probes) {
+        std::vector<float> q(query, query + dims_);
+        return scan(query, k, &probeLists(q.data(), probes));
+    }
+
+    // Cluster a random sample into `lists` centroids and assign every row
+    void buildIvf(size_t lists, int iterations = 10) {
+        std::vector<float> sample;
+        {
+            auto stmt = db_.prepare("SELECT " + detail::quoteIdentifier(column_) + " FROM " +
+                                    detail::quoteIdentifier(table_) + " ORDER BY random() LIMIT ?;");
+            stmt->bind(1, static_cast<int>(lists * 64));
+            std::vector<float> v(dims_);
+            while (stmt->step())
+                if (readVector(*stmt, 0, v.data())) sample.insert(sample.end(), v.begin(), v.end());
+        }
+        size_t n = sample.size() / dims_;
+        if (n < lists) RDB_THROW(SQLiteException("not enough vectors to build " + std::to_string(lists) + " lists"));
+
+        centroids_.assign(sample.begin(), sample.begin() + lists * dims_);
+        std::vector<size_t> assign(n);
+        std::vector<size_t> counts(lists);
+        for (int it = 0; it < iterations; ++it) {
+            for (size_t i = 0; i < n; ++i) assign[i] = nearestCentroid(&sample[i * dims_]);
+            std::fill(centroids_.begin(), centroids_.end(), 0.0f);
+            std::fill(counts.begin(), counts.end(), 0);
+            for (size_t i = 0; i < n; ++i) {
+                float* c = &centroids_[assign[i] * dims_];
+                for (size_t d = 0; d < dims_; ++d) c[d] += sample[i * dims_ + d];
+                ++counts[assign[i]];
+            }
+            for (size_t c = 0; c < lists; ++c) {
+                // Reseed empty lists from a sample point
+                if (!counts[c]) { std::copy_n(&sample[(c * 7919 % n) * dims_], dims_, &centroids_[c * dims_]); continue; }
+                for (size_t d = 0; d < dims_; ++d) centroids_[c * dims_ + d] /= static_cast<float>(counts[c]);
+            }
+        }
+
+        Database::Transaction txn(db_);
+        db_.execute("DROP TABLE IF EXISTS " + centroidsTable() + ";");
+        db_.execute("DROP TABLE IF EXISTS " + listsTable() + ";");
+        db_.execute("CREATE TABLE " + centroidsTable() + "(id INTEGER PRIMARY KEY, vec BLOB);");
+        db_.execute("CREATE TABLE " + listsTable() + "(rid INTEGER PRIMARY KEY, list INTEGER);");
+        db_.execute("CREATE INDEX " + detail::quoteIdentifier(table_ + "_ivf_lists_by_list") + " ON " +
+                    listsTable() + "(list, rid);");
+        auto ins = db_.prepare("INSERT INTO " + centroidsTable() + "(id, vec) VALUES(?, ?);");
+        for (size_t c = 0; c < lists; ++c) {
+            ins->bind(1, static_cast<int>(c));
+            ins->bindBlob(2, &centroids_[c * dims_], static_cast<int>(dims_ * sizeof(float)));
+            ins->step();
+            ins->reset();
+        }
+        assignRows("");
+        txn.commit();
+    }
+
+    // Assign rows added since the last build; returns the number assigned.
+    // Rows whose vectors changed keep their old list until the next buildIvf().
+    size_t addToIvf() {
+        loadCentroids();
+        Database::Transaction txn(db_);
+        size_t n = assignRows(" WHERE rowid NOT IN (SELECT rid FROM " + listsTable() + ")");
+        txn.commit();
+        return n;
+    }
+
+    size_t dims() const { return dims_; }
+
+private:
+    Database& db_;
+    std::string table_, column_;
+    size_t dims_;
+    VectorMetric metric_;
+    VectorType type_;
+    std::vector<float> centroids_;
+    std::vector<int64_t> probes_;
+    std::unique_ptr<Statement> scanStmt_, ivfStmt_;
+
+    std::string centroidsTable() const { return detail::quoteIdentifier(table_ + "_ivf_centroids"); }
+    std::string listsTable() const { return detail::quoteIdentifier(table_ + "_ivf_lists"); }
+
+    size_t elementSize() const { return type_ == VectorType::Float32 ? sizeof(float) : sizeof(int8_t); }
+
+    // Reads a row's vector as floats; false for NULL or wrongly sized blobs
+    bool readVector(Statement& stmt, int col, float* out) {
+        const void* data = stmt.getBlobData(col);
+        if (!data || static_cast<size_t>(stmt.getBytes(col)) != dims_ * elementSize()) return false;
+        if (type_ == VectorType::Float32) std::memcpy(out, data, dims_ * sizeof(float));
+        else std::copy_n(static_cast<const int8_t*>(data), dims_, out);
+        if (metric_ == VectorMetric::Cosine) {
+            float norm = std::sqrt(detail::vectorSums<VectorMetric::Dot>(out, out, dims_).dot);
+            if (norm > 0) for (size_t d = 0; d < dims_; ++d) out[d] /= norm;
+        }
+        return true;
+    }
+
+    size_t nearestCentroid(const float* v) const {
+        size_t best = 0;
+        float bestDist = std::numeric_limits<float>::max();
+        for (size_t c = 0; c * dims_ < centroids_.size(); ++c) {
+            float d = detail::vectorDistance<VectorMetric::L2>(v, &centroids_[c * dims_], dims_);
+            if (d < bestDist) { bestDist = d; best = c; }
+        }
+        return best;
+    }
+
+    void loadCentroids() {
+        if (!centroids_.empty()) return;
+        auto stmt = db_.prepare("SELECT vec FROM " + centroidsTable() + " ORDER BY id;");
+        while (stmt->step()) {
+            const void* data = stmt->getBlobData(0);
+            if (data && static_cast<size_t>(stmt->getBytes(0)) == dims_ * sizeof(float)) {
+                centroids_.resize(centroids_.size() + dims_);
+                std::memcpy(&centroids_[centroids_.size() - dims_], data, dims_ * sizeof(float));
+            }
+        }
+        if (centroids_.empty()) RDB_THROW(SQLiteException("no IVF index on " + table_));
+    }
+
+    size_t assignRows(const std::string& where) {
+        auto rows = db_.prepare("SELECT rowid, " + detail::quoteIdentifier(column_) + " FROM " +
+                                detail::quoteIdentifier(table_) + where + ";");
+        auto ins = db_.prepare("INSERT OR REPLACE INTO " + listsTable() + "(rid, list) VALUES(?, ?);");
+        std::vector<float> v(dims_);
+        size_t n = 0;
+        while (rows->step()) {
+            if (!readVector(*rows, 1, v.data())) continue;
+            ins->bindInt64(1, rows->getInt64(0));
+            ins->bind(2, static_cast<int>(nearestCentroid(v.data())));
+            ins->step();
+            ins->reset();
+            ++n;
+        }
+        return n;
+    }
+
+    const std::vector<int64_t>& probeLists(const float* query, size_t probes) {
+        loadCentroids();
+        std::vector<float> q(query, query + dims_);
+        if (metric_ == VectorMetric::Cosine) {
+            float norm = std::sqrt(detail::vectorSums<VectorMetric::Dot>(q.data(), q.data(), dims_).dot);
+            if (norm > 0) for (float& x : q) x /= norm;
+        }
+        size_t lists = centroids_.size() / dims_;
+        std::vector<std::pair<float, int64_t>> order(lists);
+        for (size_t c = 0; c < lists; ++c)
+            order[c] = { detail::vectorDistance<VectorMetric::L2>(q.data(), &centroids_[c * dims_], dims_),
+                         static_cast<int64_t>(c) };
+        probes = std::min(probes, lists);
+        std::partial_sort(order.begin(), order.begin() + probes, order.end());
+        probes_.clear();
+        for (size_t i = 0; i < probes; ++i) probes_.push_back(order[i].second);
+        return probes_;
+    }
+
+    // Exact scan over the whole table, or over the given IVF lists, keeping
+    // the k best rows in a max-heap
+    template<typename T>
+    std::vector<Match> scan(const T* query, size_t k, const std::vector<int64_t>* lists) {
+        if ((type_ == VectorType::Float32) != std::is_same_v<T, float>)
+            RDB_THROW(SQLiteException("query element type does not match the vector column"));
+        Statement* stmt;
+        if (lists) {
+            if (!ivfStmt_)
+                ivfStmt_ = db_.prepare("SELECT t.rowid, t." + detail::quoteIdentifier(column_) + " FROM " +
+                                       listsTable() + " l JOIN " + detail::quoteIdentifier(table_) +
+                                       " t ON t.rowid = l.rid WHERE l.list IN rdb_array(?1);");
+            stmt = ivfStmt_.get();
+        } else {
+            if (!scanStmt_)
+                scanStmt_ = db_.prepare("SELECT rowid, " + detail::quoteIdentifier(column_) + " FROM " +
+                                        detail::quoteIdentifier(table_) + ";");
+            stmt = scanStmt_.get();
+        }
+        detail::ResetOnExit reset(*stmt);
+        if (lists) stmt->bindArray(1, *lists);
+
+        auto closer = [](const Match& a, const Match& b) { return a.distance < b.distance; };
+        std::vector<Match> heap;
+        heap.reserve(k + 1);
+        if (k == 0) return heap;
+        size_t bytes = dims_ * sizeof(T);
+        std::vector<T> scratch;
+        while (stmt->step()) {
+            const void* data = stmt->getBlobData(1);
+            if (!data || static_cast<size_t>(stmt->getBytes(1)) != bytes) continue;
+            float d = detail::vectorDistance(metric_, query, detail::alignedVector<T>(data, dims_, scratch), dims_);
+            if (heap.size() < k) {
+                heap.push_back({stmt->getInt64(0), d});
+                std::push_heap(heap.begin(), heap.end(), closer);
+            } else if (d < heap.front().distance) {
+                std::pop_heap(heap.begin(), heap.end(), closer);
+                heap.back() = {stmt->getInt64(0), d};
+                std::push_heap(heap.begin(), heap.end(), closer);
+            }
+        }
+        std::sort_heap(heap.begin(), heap.end(), closer);
+        if (metric_ == VectorMetric::L2)
+            for (Match& m : heap) m.distance = std::sqrt(m.distance);
+        return heap;
+    }
+};
+
+// ---------------------------------
+// Bloom filters
+// ---------------------------------
+namespace detail {
+
+inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+inline uint64_t hashKey(int64_t key) { return mix64(static_cast<uint64_t>(key) + 0x9e3779b97f4a7c15ULL); }
+
+inline uint64_t hashKey(std::string_view key) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ key.size();
+    const char* p = key.data();
+    size_t n = key.size();
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t w;
+        std::memcpy(&w, p, 8);
+        h = mix64(h ^ w);
+    }
+    uint64_t tail = 0;
+    if (n) std::memcpy(&tail, p, n);
+    return mix64(h ^ tail ^ (static_cast<uint64_t>(n) << 59));
+}
+
+inline int popcount64(uint64_t x) {
+    int n = 0;
+    for (; x; x &= x - 1) ++n;
+    return n;
+}
+
+// x must be non-zero
+inline int countLeadingZeros64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_clzll(x);
+#else
+    int n = 0;
+    for (uint64_t bit = uint64_t(1) << 63; !(x & bit); bit >>= 1) ++n;
+    return n;
+#endif
+}
+
+template<typename T>
+void writePod(std::ostream& out, const T& v) { out.write(reinterpret_cast<const char*>(&v), sizeof(T)); }
+template<typename T>
+bool readPod(std::istream& in, T& v) { return static_cast<bool>(in.read(reinterpret_cast<char*>(&v), sizeof(T))); }
+
+} // namespace detail
+
+// Cache-blocked Bloom filter: all probes for a key land in one 64-byte
+// block, so a lookup costs a single cache miss.
+class BloomFilter {
+public:
+    BloomFilter() = default;
+    BloomFilter(size_t expectedKeys, double fpRate) { reset(expectedKeys, fpRate); }
+
+    void reset(size_t expectedKeys, double fpRate) {
+        // Blocking costs some accuracy, so size ~10% above the classic formula
+        double bitsPerKey = -std::log(fpRate) / (std::log(2.0) * std::log(2.0)) * 1.1;
+        size_t bits = static_cast<size_t>(std::max<double>(1, static_cast<double>(expectedKeys)) * bitsPerKey);
+        blocks_ = std::max<size_t>(1, (bits + kBlockBits - 1) / kBlockBits);
+        k_ = std::min(16, std::max(1, static_cast<int>(std::lround(bitsPerKey / 1.1 * std::log(2.0)))));
+        words_.assign(blocks_ * kBlockWords, 0);
+        count_ = 0;
+    }
+
+    // A default-constructed filter has no bits until reset(); add() does
+    // nothing and mightContain() says no
+    void add(uint64_t hash) {
+        if (words_.empty()) return;
+        uint64_t* block = blockFor(hash);
+        uint64_t bits = detail::mix64(hash);
+        for (int i = 0; i < k_; ++i) {
+            size_t pos = probeBit(hash, bits, i);
+            block[pos >> 6] |= 1ULL << (pos & 63);
+        }
+        ++count_;
+    }
+
+    bool mightContain(uint64_t hash) const {
+        if (words_.empty()) return false;
+        const uint64_t* block = blockFor(hash);
+        uint64_t bits = detail::mix64(hash);
+        for (int i = 0; i < k_; ++i) {
+            size_t pos = probeBit(hash, bits, i);
+            if (!(block[pos >> 6] & (1ULL << (pos & 63)))) return false;
+        }
+        return true;
+    }
+
+    size_t size() const { return count_; }
+    int hashCount() const { return k_; }
+    size_t bitCount() const { return words_.size() * 64; }
+    size_t memoryBytes() const { return words_.size() * sizeof(uint64_t); }
+
+    // Mean over blocks of (fill ratio)^k; O(size) so meant for reporting
+    double estimatedFalsePositiveRate() const {
+        if (words_.empty()) return 0;
+        double sum = 0;
+        for (size_t b = 0; b < blocks_; ++b) {
+            int set = 0;
+            for (size_t w = 0; w < kBlockWords; ++w) set += detail::popcount64(words_[b * kBlockWords + w]);
+            sum += std::pow(static_cast<double>(set) / kBlockBits, k_);
+        }
+        return sum / static_cast<double>(blocks_);
+    }
+
+    void save(std::ostream& out) const {
+        out.write("RDBBLOOM", 8);
+        detail::writePod(out, static_cast<uint64_t>(blocks_));
+        detail::writePod(out, static_cast<uint32_t>(k_));
+        detail::writePod(out, static_cast<uint64_t>(count_));
+        out.write(reinterpret_cast<const char*>(words_.data()), static_cast<std::streamsize>(memoryBytes()));
+    }
+
+    bool load(std::istream& in) {
+        char magic[8];
+        uint64_t blocks, count;
+        uint32_t k;
+        if (!in.read(magic, 8) || std::memcmp(magic, "RDBBLOOM", 8) != 0) return false;
+        if (!detail::readPod(in, blocks) || !detail::readPod(in, k) || !detail::readPod(in, count)) return false;
+        if (!blocks || !k || k > 16) return false;
+        std::vector<uint64_t> words(blocks * kBlockWords);
+        if (!in.read(reinterpret_cast<char*>(words.data()), static_cast<std::streamsize>(words.size() * sizeof(uint64_t))))
+            return false;
+        words_ = std::move(words);
+        blocks_ = blocks;
+        k_ = static_cast<int>(k);
+        count_ = count;
+        return true;
+    }
+
+private:
+    static constexpr size_t kBlockBits = 512;
+    static constexpr size_t kBlockWords = kBlockBits / 64;
+    std::vector<uint64_t> words_;
+    size_t blocks_ = 0;
+    int k_ = 0;
+    size_t count_ = 0;
+
+    // Bit positions are independent 9-bit slices of a remixed hash (seven per
+    // 64-bit word); double hashing within a 512-bit block correlates probes.
+    static size_t probeBit(uint64_t hash, uint64_t& bits, int i) {
+        if (i && i % 7 == 0) bits = detail::mix64(hash + static_cast<uint64_t>(i));
+        size_t pos = static_cast<size_t>(bits & (kBlockBits - 1));
+        bits >>= 9;
+        return pos;
+    }
+
+    const uint64_t* blockFor(uint64_t hash) const {
+        return &words_[((hash >> 32) * blocks_ >> 32) * kBlockWords];
+    }
+    uint64_t* blockFor(uint64_t hash) {
+        return &words_[((hash >> 32) * blocks_ >> 32) * kBlockWords];
+    }
+};
+
+// Negative-lookup accelerator for one key column of a rowid table.
+// mightContain() answers "definitely absent" without touching SQLite;
+// contains() confirms possible hits with a cached point query. Inserts and
+// updates made through the same connection are picked up via the update
+// hook; keys written by other connections need build() or a reload. Until
+// build() or load() has filled it, every key is a "maybe" and contains()
+// asks SQLite.
+class KeyFilter {
+public:
+    struct Stats {
+        uint64_t queries = 0;          // mightContain()/contains() calls
+        uint64_t definiteMisses = 0;   // answered without SQLite
+        uint64_t falsePositives = 0;   // filter said maybe, contains() found nothing
+        size_t keys = 0;
+        size_t memoryBytes = 0;
+        double estimatedFalsePositiveRate = 0;
+        double observedFalsePositiveRate = 0;  // falsePositives / (falsePositives + definiteMisses)
+    };
+
+    KeyFilter(Database& db, const std::string& table, const std::string& column, double fpRate = 0.01)
+        : db_(db), table_(table), column_(column), fpRate_(fpRate) {
+        listener_ = db_.addUpdateListener([this](int op, const char* dbName, const char* tbl, int64_t rowid) {
+            if (built() && op != SQLITE_DELETE && std::strcmp(dbName, "main") == 0 && sameName(tbl, table_))
+                pending_.push_back(rowid);
+        });
+    }
+
+    ~KeyFilter() { db_.removeListener(listener_); }
+
+    KeyFilter(const KeyFilter&) = delete;
+    KeyFilter& operator=(const KeyFilter&) = delete;
+
+    // Rebuild from the table, sized for expectedKeys (0: twice the current row count)
+    void build(size_t expectedKeys = 0) {
+        if (!expectedKeys) {
+            auto count = db_.prepare("SELECT count(*) FROM " + detail::quoteIdentifier(table_) + ";");
+            count->step();
+            expectedKeys = std::max<size_t>(1024, static_cast<size_t>(count->getInt64(0)) * 2);
+        }
+        filter_.reset(expectedKeys, fpRate_);
+        capacity_ = expectedKeys;
+        maxRowid_ = 0;
+        pending_.clear();
+        addRows("", 0);
+    }
+
+    bool mightContain(int64_t key) { return probe(detail::hashKey(key)); }
+    bool mightContain(std::string_view key) { return probe(detail::hashKey(key)); }
+
+    bool contains(int64_t key) {
+        if (!mightContain(key)) return false;
+        Statement& q = lookup();
+        detail::ResetOnExit reset(q);
+        q.bindInt64(1, key);
+        return confirm(q);
+    }
+    bool contains(std::string_view key) {
+        if (!mightContain(key)) return false;
+        Statement& q = lookup();
+        detail::ResetOnExit reset(q);
+        q.bindText(1, key);
+        return confirm(q);
+    }
+
+    Stats stats() const {
+        Stats s = stats_;
+        s.keys = filter_.size();
+        s.memoryBytes = filter_.memoryBytes();
+        s.estimatedFalsePositiveRate = filter_.estimatedFalsePositiveRate();
+        uint64_t negatives = s.falsePositives + s.definiteMisses;
+        s.observedFalsePositiveRate = negatives ? static_cast<double>(s.falsePositives) / negatives : 0;
+        return s;
+    }
+
+    // Sidecar file for fast startup. load() restores the filter and then
+    // adds rows with a higher rowid than when it was saved; it returns false
+    // (leaving the filter untouched) if the file is missing or doesn't
+    // match, and the caller should build(). The file records the schema
+    // version and the number of rows up to the highest rowid it covers, so
+    // a VACUUM, a schema change or a deleted row makes it stale. It cannot
+    // see an update to an existing row, or a deleted highest rowid reused
+    // by an insert: load() is only sound for a table that has been
+    // append-only since save().
+    void save(const std::string& path) {
+        flush();
+        int64_t rows = rowsUpTo(maxRowid_), schema = schemaVersion();
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write("RDBKEYF2", 8);
+        writeString(out, table_);
+        writeString(out, column_);
+        detail::writePod(out, maxRowid_);
+        detail::writePod(out, rows);
+        detail::writePod(out, schema);
+        detail::writePod(out, static_cast<uint64_t>(capacity_));
+        filter_.save(out);
+        if (!out) RDB_THROW(SQLiteException("failed to write " + path));
+    }
+
+    bool load(const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        char magic[8];
+        std::string table, column;
+        int64_t maxRowid, rows, schema;
+        uint64_t capacity;
+        BloomFilter filter;
+        if (!in.read(magic, 8) || std::memcmp(magic, "RDBKEYF2", 8) != 0) return false;
+        if (!readString(in, table) || !readString(in, column) || !sameName(table.c_str(), table_) ||
+            !sameName(column.c_str(), column_))
+            return false;
+        if (!detail::readPod(in, maxRowid) || !detail::readPod(in, rows) || !detail::readPod(in, schema) ||
+            !detail::readPod(in, capacity) || !filter.load(in))
+            return false;
+        if (schema != schemaVersion() || rows != rowsUpTo(maxRowid)) return false;
+        filter_ = std::move(filter);
+        capacity_ = capacity;
+        maxRowid_ = maxRowid;
+        pending_.clear();
+        addRows(" WHERE rowid > ?", maxRowid);
+        return true;
+    }
+
+private:
+    Database& db_;
+    std::string table_, column_;
+    double fpRate_;
+    int listener_ = 0;
+    BloomFilter filter_;
+    size_t capacity_ = 0;
+    int64_t maxRowid_ = 0;
+    std::vector<int64_t> pending_;  // rowids changed since the last probe
+    Stats stats_;
+    std::unique_ptr<Statement> lookup_, fetch_;
+
+    static bool sameName(const char* a, const std::string& b) {
+        size_t i = 0;
+        for (; a[i] && i < b.size(); ++i)
+            if (std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i])))
+                return false;
+        return !a[i] && i == b.size();
+    }
+
+    static void writeString(std::ostream& out, const std::string& s) {
+        detail::writePod(out, static_cast<uint32_t>(s.size()));
+        out.write(s.data(), static_cast<std::streamsize>(s.size()));
+    }
+    static bool readString(std::istream& in, std::string& s) {
+        uint32_t n;
+        if (!detail::readPod(in, n) || n > 4096) return false;
+        s.resize(n);
+        return static_cast<bool>(in.read(&s[0], n));
+    }
+
+    void addValue(Statement& stmt, int col) {
+        switch (sqlite3_column_type(stmt.get(), col)) {
+        case SQLITE_NULL: return;
+        case SQLITE_INTEGER: filter_.add(detail::hashKey(stmt.getInt64(col))); return;
+        default: {
+            auto data = static_cast<const char*>(stmt.getBlobData(col));
+            filter_.add(detail::hashKey(std::string_view(data ? data : "", stmt.getBytes(col))));
+        }
+        }
+    }
+
+    // Taken as all rows less those above rowid: a bare count(*) walks the
+    // smallest index's pages without decoding rows, and the rows above are
+    // only the few appended since save()
+    int64_t rowsUpTo(int64_t rowid) {
+        std::string table = detail::quoteIdentifier(table_);
+        auto count = db_.prepare("SELECT (SELECT count(*) FROM " + table + ") - (SELECT count(*) FROM " + table +
+                                 " WHERE rowid > ?);");
+        count->bindInt64(1, rowid);
+        count->step();
+        return count->getInt64(0);
+    }
+
+    int64_t schemaVersion() {
+        auto version = db_.prepare("PRAGMA schema_version;");
+        version->step();
+        return version->getInt64(0);
+    }
+
+    void addRows(const std::string& where, int64_t after) {
+        auto rows = db_.prepare("SELECT rowid, " + detail::quoteIdentifier(column_) + " FROM " +
+                                detail::quoteIdentifier(table_) + where + ";");
+        if (!where.empty()) rows->bindInt64(1, after);
+        while (rows->step()) {
+            maxRowid_ = std::max(maxRowid_, rows->getInt64(0));
+            addValue(*rows, 1);
+        }
+    }
+
+    // Pull keys of rows inserted/updated since the last probe. Runs outside
+    // the update hook, where querying the connection is not allowed.
+    void flush() {
+        if (!fetch_)
+            fetch_ = db_.prepare("SELECT " + detail::quoteIdentifier(column_) + " FROM " +
+                                 detail::quoteIdentifier(table_) + " WHERE rowid = ?;");
+        // A rowid leaves pending_ only once read, so a step that throws
+        // (SQLITE_BUSY, say) leaves the rest for the next probe
+        while (!pending_.empty()) {
+            int64_t rowid = pending_.back();
+            {
+                detail::ResetOnExit reset(*fetch_);
+                fetch_->bindInt64(1, rowid);
+                if (fetch_->step()) addValue(*fetch_, 0);
+            }
+            pending_.pop_back();
+            maxRowid_ = std::max(maxRowid_, rowid);
+        }
+        if (filter_.size() > capacity_) build(filter_.size() * 2);
+    }
+
+    // The filter has bits once build() or load() has run; build() scans
+    // every row, so changes made before then need not be queued
+    bool built() const { return filter_.bitCount() != 0; }
+
+    bool probe(uint64_t hash) {
+        if (!pending_.empty()) flush();
+        ++stats_.queries;
+        if (!built()) return true;
+        if (filter_.mightContain(hash)) return true;
+        ++stats_.definiteMisses;
+        return false;
+    }
+
+    Statement& lookup() {
+        if (!lookup_)
+            lookup_ = db_.prepare("SELECT 1 FROM " + detail::quoteIdentifier(table_) + " WHERE " +
+                                  detail::quoteIdentifier(column_) + " = ? LIMIT 1;");
+        return *lookup_;
+    }
+
+    bool confirm(Statement& q) {
+        bool found = q.step();
+        if (!found) ++stats_.falsePositives;
+        return found;
+    }
+};
+
+// ---------------------------------
+// In-memory table mirrors
+// ---------------------------------
+
+// Read-mostly copy of a rowid table in an open-addressing hash map (flat
+// key array plus packed rows) for point lookups without a statement
+// round trip. `columns` must start with the table's INTEGER PRIMARY KEY;
+// `loader` maps one row of "SELECT <columns> FROM <table>" to a Row.
+//
+// Writes through the same connection mark the touched keys stale via the
+// update hook and they are re-read on their next get(); keys touched by a
+// rolled-back transaction are marked stale again. Writes from other
+// connections, primary key changes, REPLACE conflicts on other unique
+// columns and truncating DELETEs are not observed: call invalidate() (SQL
+// fallback for every key until reload()) or refreshIfChanged().
+template<typename Row>
+class TableMirror {
+public:
+    using Loader = std::function<Row(Statement&)>;
+
+    struct Stats {
+        uint64_t hits = 0;          // served from memory
+        uint64_t absent = 0;        // known missing, answered from memory
+        uint64_t sqlLookups = 0;    // stale, new or invalidated keys read through SQL
+        uint64_t reloads = 0;
+        size_t rows = 0;
+        size_t memoryBytes = 0;
+    };
+
+    TableMirror(Database& db, const std::string& table, const std::string& columns, Loader loader)
+        : db_(db), table_(table), select_("SELECT " + columns + " FROM " + detail::quoteIdentifier(table)),
+          loader_(std::move(loader)) {
+        listeners_[0] = db_.addUpdateListener([this](int, const char* dbName, const char* tbl, int64_t rowid) {
+            if (std::strcmp(dbName, "main") != 0 || !sameTable(tbl)) return;
+            markStale(rowid);
+            touched_.push_back(rowid);
+        });
+        listeners_[1] = db_.addCommitListener([this] { touched_.clear(); });
+        listeners_[2] = db_.addRollbackListener([this] {
+            for (int64_t rowid : touched_) markStale(rowid);
+            touched_.clear();
+        });
+        reload();
+    }
+
+    ~TableMirror() { for (int id : listeners_) db_.removeListener(id); }
+
+    TableMirror(const TableMirror&) = delete;
+    TableMirror& operator=(const TableMirror&) = delete;
+
+    // Row for `key`, or nullptr if there is none. The pointer is valid until
+    // the next get(), reload() or write to the table.
+    const Row* get(int64_t key) {
+        if (invalid_) return fetchDetached(key);
+        size_t slot = find(key);
+        if (slots_[slot] != kEmpty) {
+            uint32_t idx = slots_[slot];
+            if (state_[idx] == Fresh) { ++stats_.hits; return &rows_[idx]; }
+            if (state_[idx] == Gone) { ++stats_.absent; return nullptr; }
+            return refresh(slot, key);
+        }
+        if (!pendingNew_.count(key)) { ++stats_.absent; return nullptr; }
+        // Still pending if the read throws
+        const Row* row = refresh(slot, key);
+        pendingNew_.erase(key);
+        return row;
+    }
+
+    void reload() {
+        keys_.clear(); slots_.clear(); rows_.clear(); state_.clear(); pendingNew_.clear();
+        auto count = db_.prepare("SELECT count(*) FROM " + detail::quoteIdentifier(table_) + ";");
+        count->step();
+        rehash(static_cast<size_t>(count->getInt64(0)));
+        auto all = db_.prepare(select_ + ";");
+        while (all->step()) {
+            int64_t key = all->getInt64(0);
+            size_t slot = find(key);
+            if (slots_[slot] == kEmpty) insert(slot, key, loader_(*all));
+        }
+        invalid_ = false;
+        ++stats_.reloads;
+        dataVersion_ = currentDataVersion();
+    }
+
+    // Serve every key through SQL until the next reload()
+    void invalidate() { invalid_ = true; }
+
+    // Reload if another connection has committed since the last load
+    bool refreshIfChanged() {
+        if (currentDataVersion() == dataVersion_ && !invalid_) return false;
+        reload();
+        return true;
+    }
+
+    Stats stats() const {
+        Stats s = stats_;
+        s.rows = rows_.size();
+        s.memoryBytes = keys_.size() * (sizeof(int64_t) + sizeof(uint32_t)) + rows_.size() * (sizeof(Row) + 1);
+        return s;
+    }
+
+private:
+    enum State : uint8_t { Fresh, Stale, Gone };
+    static constexpr uint32_t kEmpty = 0xffffffffu;
+
+    Database& db_;
+    std::string table_, select_;
+    Loader loader_;
+    int listeners_[3] = {0, 0, 0};
+    std::vector<int64_t> keys_;      // by slot
+    std::vector<uint32_t> slots_;    // slot -> index into rows_, or kEmpty
+    std::vector<Row> rows_;
+    std::vector<uint8_t> state_;     // by row index
+    size_t mask_ = 0;
+    std::unordered_set<int64_t> pendingNew_;  // inserted keys not yet in the map
+    std::vector<int64_t> touched_;   // rowids written in the open transaction
+    bool invalid_ = false;
+    int64_t dataVersion_ = 0;
+    std::unique_ptr<Statement> point_, dataVersionStmt_;
+    std::optional<Row> detached_;
+    Stats stats_;
+
+    bool sameTable(const char* tbl) const {
+        size_t i = 0;
+        for (; tbl[i] && i < table_.size(); ++i)
+            if (std::tolower(static_cast<unsigned char>(tbl[i])) != std::tolower(static_cast<unsigned char>(table_[i])))
+                return false;
+        return !tbl[i] && i == table_.size();
+    }
+
+    size_t find(int64_t key) const {
+        size_t slot = static_cast<size_t>(detail::hashKey(key)) & mask_;
+        while (slots_[slot] != kEmpty && keys_[slot] != key) slot = (slot + 1) & mask_;
+        return slot;
+    }
+
+    void rehash(size_t rows) {
+        size_t cap = 16;
+        while (cap < rows * 2) cap <<= 1;
+        std::vector<int64_t> oldKeys(cap);
+        std::vector<uint32_t> oldSlots(cap, kEmpty);
+        oldKeys.swap(keys_);
+        oldSlots.swap(slots_);
+        mask_ = cap - 1;
+        for (size_t s = 0; s < oldSlots.size(); ++s) {
+            if (oldSlots[s] == kEmpty) continue;
+            size_t slot = find(oldKeys[s]);
+            keys_[slot] = oldKeys[s];
+            slots_[slot] = oldSlots[s];
+        }
+    }
+
+    void insert(size_t slot, int64_t key, Row row) {
+        keys_[slot] = key;
+        slots_[slot] = static_cast<uint32_t>(rows_.size());
+        rows_.push_back(std::move(row));
+        state_.push_back(Fresh);
+        if (rows_.size() * 10 > keys_.size() * 7) rehash(rows_.size());
+    }
+
+    void markStale(int64_t key) {
+        size_t slot = find(key);
+        if (slots_[slot] != kEmpty) state_[slots_[slot]] = Stale;
+        else pendingNew_.insert(key);
+    }
+
+    Statement& point() {
+        if (!point_) point_ = db_.prepare(select_ + " WHERE rowid = ?;");
+        return *point_;
+    }
+
+    const Row* refresh(size_t slot, int64_t key) {
+        ++stats_.sqlLookups;
+        Statement& stmt = point();
+        detail::ResetOnExit reset(stmt);
+        stmt.bindInt64(1, key);
+        bool found = stmt.step();
+        const Row* result = nullptr;
+        if (slots_[slot] != kEmpty) {
+            uint32_t idx = slots_[slot];
+            if (found) { rows_[idx] = loader_(stmt); state_[idx] = Fresh; result = &rows_[idx]; }
+            else state_[idx] = Gone;
+        } else if (found) {
+            insert(slot, key, loader_(stmt));
+            result = &rows_[slots_[find(key)]];
+        }
+        return result;
+    }
+
+    const Row* fetchDetached(int64_t key) {
+        ++stats_.sqlLookups;
+        Statement& stmt = point();
+        detail::ResetOnExit reset(stmt);
+        stmt.bindInt64(1, key);
+        if (stmt.step()) detached_ = loader_(stmt);
+        else detached_.reset();
+        return detached_ ? &*detached_ : nullptr;
+    }
+
+    int64_t currentDataVersion() {
+        if (!dataVersionStmt_) dataVersionStmt_ = db_.prepare("PRAGMA data_version;");
+        detail::ResetOnExit reset(*dataVersionStmt_);
+        dataVersionStmt_->step();
+        return dataVersionStmt_->getInt64(0);
+    }
+};
+
+// ---------------------------------
+// Key-value store
+// ---------------------------------
+
+// Persistent string -> bytes map in a WITHOUT ROWID table. Keys are stored
+// as TEXT with BINARY collation, so iteration follows byte order. All
+// statements are prepared once and reused.
+class KVStore {
+public:
+    // Optional value compression. Values of at least minBytes are passed to
+    // compress() and stored with a flag so decompress() is only applied to
+    // them; stores written without a codec stay readable after adding one.
+    struct Codec {
+        std::function<std::string(std::string_view)> compress;
+        std::function<std::string(std::string_view)> decompress;
+        size_t minBytes = 256;
+    };
+
+    // Ordered cursor over a key range; borrows a cached statement from the store
+    class Iterator {
+    public:
+        Iterator(Iterator&& other) noexcept
+            : kv_(other.kv_), stmt_(std::move(other.stmt_)), bounded_(other.bounded_), valid_(other.valid_) {
+            other.kv_ = nullptr;
+        }
+        Iterator& operator=(Iterator&&) = delete;
+        ~Iterator() { if (kv_ && stmt_) kv_->release(std::move(stmt_), bounded_); }
+
+        bool valid() const { return valid_; }
+        void next() { valid_ = stmt_->step(); }
+        std::string_view key() {
+            auto data = static_cast<const char*>(stmt_->getBlobData(0));
+            return std::string_view(data ? data : "", stmt_->getBytes(0));
+        }
+        std::string value() { return kv_->decode(*stmt_, 1); }
+
+    private:
+        friend class KVStore;
+        Iterator(KVStore* kv, std::unique_ptr<Statement> stmt, bool bounded)
+            : kv_(kv), stmt_(std::move(stmt)), bounded_(bounded), valid_(stmt_->step()) {}
+        KVStore* kv_;
+        std::unique_ptr<Statement> stmt_;
+        bool bounded_;
+        bool valid_;
+    };
+
+    explicit KVStore(Database& db, const std::string& name = "kv") : KVStore(db, name, Codec()) {}
+
+    KVStore(Database& db, const std::string& name, Codec codec)
+        : db_(db), table_(detail::quoteIdentifier(name)), codec_(std::move(codec)) {
+        db_.execute("CREATE TABLE IF NOT EXISTS " + table_ +
+                    "(k TEXT PRIMARY KEY, v BLOB, z INTEGER NOT NULL DEFAULT 0) WITHOUT ROWID;");
+        get_ = db_.prepare("SELECT v, z FROM " + table_ + " WHERE k = ?;");
+        put_ = db_.prepare("INSERT OR REPLACE INTO " + table_ + "(k, v, z) VALUES(?, ?, ?);");
+        del_ = db_.prepare("DELETE FROM " + table_ + " WHERE k = ?;");
+        multiGet_ = db_.prepare("SELECT k, v, z FROM " + table_ + " WHERE k IN rdb_array(?1);");
+    }
+
+    std::optional<std::string> get(std::string_view key) {
+        detail::ResetOnExit reset(*get_);
+        get_->bindText(1, key);
+        std::optional<std::string> result;
+        if (get_->step()) result = decode(*get_, 0);
+        return result;
+    }
+
+    void put(std::string_view key, std::string_view value) {
+        detail::ResetOnExit reset(*put_);
+        bindPut(key, value);
+        put_->step();
+    }
+
+    bool remove(std::string_view key) {
+        detail::ResetOnExit reset(*del_);
+        del_->bindText(1, key);
+        del_->step();
+        return sqlite3_changes(db_.get()) > 0;
+    }
+
+    // All keys in one statement; results are in the order of `keys`
+    std::vector<std::optional<std::string>> multiGet(const std::vector<std::string_view>& keys) {
+        std::vector<std::optional<std::string>> results(keys.size());
+        std::vector<size_t> order(keys.size());
+        for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return keys[a] < keys[b]; });
+        detail::ResetOnExit reset(*multiGet_);
+        multiGet_->bindArray(1, keys);
+        while (multiGet_->step()) {
+            auto data = static_cast<const char*>(multiGet_->getBlobData(0));
+            std::string_view k(data ? data : "", multiGet_->getBytes(0));
+            auto range = std::equal_range(order.begin(), order.end(), k,
+                [&](const auto& a, const auto& b) { return lessKey(keys, a, b); });
+            if (range.first == range.second) continue;
+            std::string value = decode(*multiGet_, 1);
+            for (auto it = range.first; it != range.second; ++it) results[*it] = value;
+        }
+        return results;
+    }
+
+    std::vector<std::optional<std::string>> multiGet(const std::vector<std::string>& keys) {
+        return multiGet(std::vector<std::string_view>(keys.begin(), keys.end()));
+    }
+
+    // Writes all pairs in a single transaction
+    template<typename Pairs>
+    void putBatch(const Pairs& items) {
+        Database::Transaction txn(db_);
+        for (const auto& [key, value] : items) put(key, value);
+        txn.commit();
+    }
+
+    Iterator scanPrefix(std::string_view prefix) {
+        std::optional<std::string> end = prefixEnd(prefix);
+        return end ? scanRange(prefix, *end) : scanFrom(prefix);
+    }
+
+    // Keys in [begin, end)
+    Iterator scanRange(std::string_view begin, std::string_view end) {
+        auto stmt = acquire(true);
+        stmt->bindText(1, begin);
+        stmt->bindText(2, end);
+        return Iterator(this, std::move(stmt), true);
+    }
+
+    // Keys >= begin
+    Iterator scanFrom(std::string_view begin) {
+        auto stmt = acquire(false);
+        stmt->bindText(1, begin);
+        return Iterator(this, std::move(stmt), false);
+    }
+
+private:
+    Database& db_;
+    std::string table_;
+    Codec codec_;
+    std::unique_ptr<Statement> get_, put_, del_, multiGet_;
+    std::vector<std::unique_ptr<Statement>> freeScans_[2];  // [unbounded, bounded]
+
+    template<typename A, typename B>
+    static bool lessKey(const std::vector<std::string_view>& keys, const A& a, const B& b) {
+        if constexpr (std::is_same_v<A, size_t>) return keys[a] < b;
+        else return a < keys[b];
+    }
+
+    // Smallest string greater than every string starting with prefix
+    static std::optional<std::string> prefixEnd(std::string_view prefix) {
+        std::string end(prefix);
+        while (!end.empty() && static_cast<unsigned char>(end.back()) == 0xff) end.pop_back();
+        if (end.empty()) return std::nullopt;
+        end.back() = static_cast<char>(static_cast<unsigned char>(end.back()) + 1);
+        return end;
+    }
+
+    std::unique_ptr<Statement> acquire(bool bounded) {
+        auto& pool = freeScans_[bounded];
+        if (!pool.empty()) {
+            auto stmt = std::move(pool.back());
+            pool.pop_back();
+            return stmt;
+        }
+        return db_.prepare("SELECT k, v, z FROM " + table_ + " WHERE k >= ?1" +
+                           (bounded ? " AND k < ?2" : "") + " ORDER BY k;");
+    }
+
+    void release(std::unique_ptr<Statement> stmt, bool bounded) {
+        stmt->reset();
+        sqlite3_clear_bindings(stmt->get());
+        freeScans_[bounded].push_back(std::move(stmt));
+    }
+
+    void bindPut(std::string_view key, std::string_view value) {
+        put_->bindText(1, key);
+        if (codec_.compress && value.size() >= codec_.minBytes) {
+            std::string packed = codec_.compress(value);
+            put_->bindBlob(2, packed.data(), static_cast<int>(packed.size()));
+            put_->bind(3, 1);
+        } else {
+            put_->bindBlob(2, value.data(), static_cast<int>(value.size()));
+            put_->bind(3, 0);
+        }
+    }
+
+    std::string decode(Statement& stmt, int col) {
+        auto data = static_cast<const char*>(stmt.getBlobData(col));
+        std::string_view raw(data ? data : "", stmt.getBytes(col));
+        if (!stmt.getInt(col + 1)) return std::string(raw);
+        if (!codec_.decompress) RDB_THROW(SQLiteException("compressed value but no codec configured"));
+        return codec_.decompress(raw);
+    }
+};
+
+// ---------------------------------
+// Job queue
+// ---------------------------------
+
+// Durable work queue in a table. Jobs are claimed in lane order (lane 0
+// first) and then FIFO; a claimed job becomes invisible to other consumers
+// until it is acked, nacked or its visibility timeout expires. Each consumer
+// thread should use its own Database connection (WAL mode recommended).
+class Queue {
+public:
+    struct Job {
+        int64_t id;
+        int lane;
+        int attempts;   // claims so far, including this one; also the claim token
+        std::string payload;
+    };
+
+    Queue(Database& db, const std::string& name = "jobs",
+          std::chrono::milliseconds visibilityTimeout = std::chrono::seconds(30))
+        : db_(db), table_(detail::quoteIdentifier(name)), timeout_(visibilityTimeout) {
+        db_.execute("CREATE TABLE IF NOT EXISTS " + table_ +
+                    "(id INTEGER PRIMARY KEY, lane INTEGER NOT NULL, visible_at INTEGER NOT NULL,"
+                    " attempts INTEGER NOT NULL DEFAULT 0, payload BLOB);");
+        // Matches the claim query: seek per lane, oldest visible jobs first
+        db_.execute("CREATE INDEX IF NOT EXISTS " + detail::quoteIdentifier(name + "_dequeue") + " ON " +
+                    table_ + "(lane, visible_at);");
+        insert_ = db_.prepare("INSERT INTO " + table_ + "(lane, visible_at, payload) VALUES(?, ?, ?);");
+        nextLane_ = db_.prepare("SELECT lane FROM " + table_ + " WHERE lane >= ? ORDER BY lane LIMIT 1;");
+        claim_ = db_.prepare("UPDATE " + table_ + " SET visible_at = ?1, attempts = attempts + 1"
+                             " WHERE id IN (SELECT id FROM " + table_ +
+                             " WHERE lane = ?4 AND visible_at <= ?2 ORDER BY visible_at LIMIT ?3)"
+                             " RETURNING id, lane, attempts, payload;");
+        ack_ = db_.prepare("DELETE FROM " + table_ + " WHERE id = ? AND attempts = ?;");
+        nack_ = db_.prepare("UPDATE " + table_ + " SET visible_at = ? WHERE id = ? AND attempts = ?;");
+        pending_ = db_.prepare("SELECT count(*) FROM " + table_ + ";");
+    }
+
+    int64_t enqueue(std::string_view payload, int lane = 0,
+                    std::chrono::milliseconds delay = std::chrono::milliseconds(0)) {
+        detail::ResetOnExit reset(*insert_);
+        bindInsert(payload, lane, now() + delay.count());
+        insert_->step();
+        return sqlite3_last_insert_rowid(db_.get());
+    }
+
+    template<typename Payloads>
+    void enqueueBatch(const Payloads& payloads, int lane = 0) {
+        Database::Transaction txn(db_, Database::Transaction::Immediate);
+        int64_t at = now();
+        for (const auto& p : payloads) {
+            detail::ResetOnExit reset(*insert_);
+            bindInsert(p, lane, at);
+            insert_->step();
+        }
+        txn.commit();
+    }
+
+    // Atomically claim up to n visible jobs. Lanes are visited in order,
+    // each with its own index seek to its visible jobs, so jobs delayed or
+    // claimed by others in earlier lanes are never walked.
+    std::vector<Job> claim(size_t n) {
+        std::vector<Job> jobs;
+        Database::Transaction txn(db_, Database::Transaction::Immediate);
+        int64_t t = now();
+        int64_t lane = std::numeric_limits<int>::min();
+        while (jobs.size() < n) {
+            {
+                detail::ResetOnExit reset(*nextLane_);
+                nextLane_->bindInt64(1, lane);
+                if (!nextLane_->step()) break;
+                lane = nextLane_->getInt64(0);
+            }
+            detail::ResetOnExit reset(*claim_);
+            claim_->bindInt64(1, t + timeout_.count());
+            claim_->bindInt64(2, t);
+            claim_->bindInt64(3, static_cast<int64_t>(n - jobs.size()));
+            claim_->bindInt64(4, lane);
+            while (claim_->step()) {
+                auto data = static_cast<const char*>(claim_->getBlobData(3));
+                jobs.push_back({claim_->getInt64(0), claim_->getInt(1), claim_->getInt(2),
+                                std::string(data ? data : "", claim_->getBytes(3))});
+            }
+            ++lane;
+        }
+        txn.commit();
+        // RETURNING yields rows in update order, not claim order
+        std::sort(jobs.begin(), jobs.end(), [](const Job& a, const Job& b) {
+            return a.lane != b.lane ? a.lane < b.lane : a.id < b.id;
+        });
+        return jobs;
+    }
+
+    // Remove a finished job. Returns false if its visibility timeout expired
+    // and it has been claimed again since (that claim is left alone).
+    bool ack(const Job& job) {
+        detail::ResetOnExit reset(*ack_);
+        ack_->bindInt64(1, job.id);
+        ack_->bind(2, job.attempts);
+        ack_->step();
+        return sqlite3_changes(db_.get()) > 0;
+    }
+
+    // Batch ack in one transaction; returns the number removed
+    size_t ack(const std::vector<Job>& jobs) {
+        size_t n = 0;
+        Database::Transaction txn(db_, Database::Transaction::Immediate);
+        for (const Job& job : jobs) n += ack(job);
+        txn.commit();
+        return n;
+    }
+
+    // Make a claimed job visible again, optionally after a delay
+    bool nack(const Job& job, std::chrono::milliseconds delay = std::chrono::milliseconds(0)) {
+        detail::ResetOnExit reset(*nack_);
+        nack_->bindInt64(1, now() + delay.count());
+        nack_->bindInt64(2, job.id);
+        nack_->bind(3, job.attempts);
+        nack_->step();
+        return sqlite3_changes(db_.get()) > 0;
+    }
+
+    // Jobs not yet acked, claimed or not
+    size_t size() {
+        detail::ResetOnExit reset(*pending_);
+        pending_->step();
+        return static_cast<size_t>(pending_->getInt64(0));
+    }
+
+private:
+    Database& db_;
+    std::string table_;
+    std::chrono::milliseconds timeout_;
+    std::unique_ptr<Statement> insert_, nextLane_, claim_, ack_, nack_, pending_;
+
+    static int64_t now() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    void bindInsert(std::string_view payload, int lane, int64_t visibleAt) {
+        insert_->bind(1, lane);
+        insert_->bindInt64(2, visibleAt);
+        insert_->bindBlob(3, payload.data(), static_cast<int>(payload.size()));
+    }
+};
+
+// ---------------------------------
+// Keyset pagination
+// ---------------------------------
+
+// Pages through a query by seeking past the last row of the previous page
+// instead of using OFFSET, so every page costs the same: one index seek,
+// plus one more for each leading key whose value the page runs past. The ORDER BY keys
+// must be output columns of `select`, NOT NULL, and unique together (end
+// with the primary key). Continuation tokens are opaque URL-safe strings.
+//
+//   KeysetPager pager(db, "SELECT id, name, created FROM users WHERE active = 1",
+//                     {{"created", true}, {"id", true}}, 50);
+//   std::string token = pager.fetch("", [](Statement& row) { ... });   // first page
+//   token = pager.fetch(token, ...);                                    // "" when done
+class KeysetPager {
+public:
+    struct Key {
+        std::string column;
+        bool descending = false;
+    };
+
+    KeysetPager(Database& db, const std::string& select, std::vector<Key> keys, int pageSize)
+        : keys_(std::move(keys)), pageSize_(pageSize) {
+        if (keys_.empty()) RDB_THROW(SQLiteException("keyset pagination needs at least one ORDER BY key"));
+        if (pageSize_ <= 0) RDB_THROW(SQLiteException("keyset pagination needs a positive page size"));
+        std::string from = "SELECT * FROM (" + select + ")";
+        std::string orderBy = " ORDER BY ";
+        for (size_t i = 0; i < keys_.size(); ++i)
+            orderBy += (i ? ", " : "") + detail::quoteIdentifier(keys_[i].column) + (keys_[i].descending ? " DESC" : "");
+        std::string limit = " LIMIT ?" + std::to_string(keys_.size() + 1) + ";";
+        first_ = db.prepare(from + orderBy + limit);
+        for (size_t level = keys_.size(); level-- > 0;)
+            next_.push_back(db.prepare(from + " WHERE " + seekCondition(level) + orderBy + limit));
+
+        int columns = sqlite3_column_count(first_->get());
+        for (const Key& key : keys_) {
+            int found = -1;
+            for (int c = 0; c < columns && found < 0; ++c) {
+                const char* name = sqlite3_column_name(first_->get(), c);
+                if (name && sqlite3_stricmp(name, key.column.c_str()) == 0) found = c;
+            }
+            if (found < 0) RDB_THROW(SQLiteException("ORDER BY key '" + key.column + "' is not a selected column"));
+            keyColumns_.push_back(found);
+        }
+        // Tokens are only valid for the same query, key columns and directions
+        std::string signature = select;
+        for (const Key& key : keys_) {
+            signature += '\0';
+            signature += key.column;
+            signature += '\0';
+            signature += key.descending ? 'D' : 'A';
+        }
+        signature_ = static_cast<uint32_t>(detail::hashKey(std::string_view(signature)));
+    }
+
+    // Run fn for each row of the page after `token` ("" for the first page)
+    // and return the token for the following page, or "" after the last one.
+    std::string fetch(const std::string& token, const std::function<void(Statement&)>& fn) {
+        int rows = 0;
+        if (token.empty()) {
+            read(*first_, rows, fn);
+        } else {
+            for (auto& stmt : next_) {
+                if (rows > pageSize_) break;
+                bindToken(*stmt, token);
+                read(*stmt, rows, fn);
+            }
+        }
+        return rows > pageSize_ ? pending_ : std::string();
+    }
+
+    int pageSize() const { return pageSize_; }
+
+private:
+    std::vector<Key> keys_;
+    int pageSize_;
+    std::vector<int> keyColumns_;
+    uint32_t signature_ = 0;
+    std::unique_ptr<Statement> first_;
+    std::vector<std::unique_ptr<Statement>> next_;   // deepest level first
+    std::string pending_;
+
+    // Steps stmt (reset by the caller) for the rows the page still needs;
+    // rows reaches pageSize_ + 1 when another page exists
+    void read(Statement& stmt, int& rows, const std::function<void(Statement&)>& fn) {
+        detail::ResetOnExit reset(stmt);
+        stmt.bind(static_cast<int>(keys_.size() + 1), pageSize_ + 1 - rows);
+        while (stmt.step()) {
+            // The extra row only tells us whether another page exists
+            if (++rows > pageSize_) return;
+            fn(stmt);
+            if (rows == pageSize_) pending_ = makeToken(stmt);
+        }
+    }
+
+    // The rows after the token whose first `level` keys equal the token's
+    // and whose next key is past it: k1 = ?1 AND k2 > ?2 for level 1.
+    // Read deepest level first, the levels cover everything after the
+    // token in order, and each is an equality-plus-range seek on an index
+    // over the keys. A single row-value or OR condition is not: SQLite
+    // seeks on its first column only and filters the rest.
+    std::string seekCondition(size_t level) const {
+        std::string cond;
+        for (size_t i = 0; i < level; ++i)
+            cond += detail::quoteIdentifier(keys_[i].column) + " = ?" + std::to_string(i + 1) + " AND ";
+        return cond + detail::quoteIdentifier(keys_[level].column) + (keys_[level].descending ? " < ?" : " > ?") +
+               std::to_string(level + 1);
+    }
+
+    // Token: signature, then per key a type byte and its value, base64url-encoded
+    std::string makeToken(Statement& stmt) const {
+        std::string raw;
+        auto put = [&raw](const void* p, size_t n) { raw.append(static_cast<const char*>(p), n); };
+        put(&signature_, sizeof(signature_));
+        for (int col : keyColumns_) {
+            char type = static_cast<char>(sqlite3_column_type(stmt.get(), col));
+            raw += type;
+            if (type == SQLITE_INTEGER) { int64_t v = stmt.getInt64(col); put(&v, sizeof(v)); }
+            else if (type == SQLITE_FLOAT) { double v = stmt.getDouble(col); put(&v, sizeof(v)); }
+            else if (type != SQLITE_NULL) {
+                const void* data = stmt.getBlobData(col);
+                uint32_t n = static_cast<uint32_t>(stmt.getBytes(col));
+                put(&n, sizeof(n));
+                put(data, n);
+            }
+        }
+        return base64url(raw);
+    }
+
+    void bindToken(Statement& stmt, const std::string& token) const {
+        std::string raw;
+        uint32_t sig = 0;
+        size_t pos = sizeof(sig);
+        auto take = [&](void* out, size_t n) {
+            if (pos + n > raw.size()) RDB_THROW(SQLiteException("invalid page token"));
+            std::memcpy(out, raw.data() + pos, n);
+            pos += n;
+        };
+        if (!unbase64url(token, raw) || raw.size() < sizeof(sig)) RDB_THROW(SQLiteException("invalid page token"));
+        std::memcpy(&sig, raw.data(), sizeof(sig));
+        if (sig != signature_) RDB_THROW(SQLiteException("page token belongs to a different query"));
+        for (size_t i = 0; i < keys_.size(); ++i) {
+            int index = static_cast<int>(i + 1);
+            char type;
+            take(&type, 1);
+            if (type == SQLITE_INTEGER) { int64_t v; take(&v, sizeof(v)); stmt.bindInt64(index, v); }
+            else if (type == SQLITE_FLOAT) { double v; take(&v, sizeof(v)); stmt.bind(index, v); }
+            else if (type == SQLITE_NULL) sqlite3_bind_null(stmt.get(), index);
+            else {
+                uint32_t n;
+                take(&n, sizeof(n));
+                if (pos + n > raw.size()) RDB_THROW(SQLiteException("invalid page token"));
+                if (type == SQLITE_TEXT) stmt.bindText(index, std::string_view(raw.data() + pos, n));
+                else stmt.bindBlob(index, raw.data() + pos, static_cast<int>(n));
+                pos += n;
+            }
+        }
+    }
+
+    static const char* base64Alphabet() {
+        return "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    }
+
+    static std::string base64url(const std::string& in) {
+        std::string out;
+        uint32_t acc = 0;
+        int bits = 0;
+        for (unsigned char c : in) {
+            acc = (acc << 8) | c;
+            bits += 8;
+            while (bits >= 6) { bits -= 6; out += base64Alphabet()[(acc >> bits) & 63]; }
+        }
+        if (bits) out += base64Alphabet()[(acc << (6 - bits)) & 63];
+        return out;
+    }
+
+    static bool unbase64url(const std::string& in, std::string& out) {
+        uint32_t acc = 0;
+        int bits = 0;
+        for (char c : in) {
+            const char* p = std::strchr(base64Alphabet(), c);
+            if (!c || !p) return false;
+            acc = (acc << 6) | static_cast<uint32_t>(p - base64Alphabet());
+            bits += 6;
+            if (bits >= 8) { bits -= 8; out += static_cast<char>((acc >> bits) & 0xff); }
+        }
+        return true;
+    }
+};
+
+// ---------------------------------
+// Statement manifests and connection pools
+// ---------------------------------
+
+// Named queries declared up front, so they can be prepared (and their
+// b-tree paths paged in) before the first request rather than during it.
+//
+//   StatementManifest manifest;
+//   auto byEmail = manifest.add("user_by_email", "SELECT * FROM users WHERE email = ?", true);
+class StatementManifest {
+public:
+    struct Entry {
+        std::string name;
+        std::string sql;
+        bool touch = false;   // page in the tables and indexes it reads at warm-up
+    };
+
+    // Returns the entry's id for O(1) lookup in PreparedStatements
+    size_t add(const std::string& name, const std::string& sql, bool touch = false) {
+        entries_.push_back({name, sql, touch});
+        return entries_.size() - 1;
+    }
+
+    const std::vector<Entry>& entries() const { return entries_; }
+
+private:
+    std::vector<Entry> entries_;
+};
+
+// How long a warm-up took and how much it did
+struct WarmupReport {
+    std::chrono::microseconds elapsed{0};
+    size_t connections = 0;
+    size_t statements = 0;    // prepared, summed over connections
+    size_t pages = 0;         // b-tree pages read while touching, summed over connections
+};
+
+// Every statement of a manifest prepared on one connection. Statements are
+// prepared with SQLITE_PREPARE_PERSISTENT since they live as long as the
+// connection. Touching reads the pages of the tables and indexes the
+// flagged read-only statements use into the connection's cache.
+class PreparedStatements {
+public:
+    PreparedStatements(Database& db, const StatementManifest& manifest) {
+        Status st = tryPrepareAll(db, manifest);
+        if (!st) RDB_THROW(SQLiteException(db.errorMessage()));
+    }
+
+    // Non-throwing form used by ConnectionPool's warm-up threads
+    PreparedStatements() = default;
+    Status tryPrepareAll(Database& db, const StatementManifest& manifest) {
+        statements_.clear();
+        ids_.clear();
+        for (const auto& entry : manifest.entries()) {
+            auto prepared = db.tryPrepare(entry.sql, SQLITE_PREPARE_PERSISTENT);
+            if (!prepared) return prepared.status();
+            ids_[entry.name] = statements_.size();
+            statements_.push_back(std::move(*prepared));
+        }
+        return Status();
+    }
+
+    // Pages in the b-trees the touch-flagged read-only statements open. The
+    // root pages of their bytecode's OpenRead ops are matched against
+    // sqlite_schema, and each table or index found is scanned in key order
+    // with an equal share of the connection's page cache: a tree that fits
+    // is read whole, a larger one from its low end. *pages is incremented
+    // by the pages the scans read (SQLITE_DBSTATUS_CACHE_MISS).
+    Status touch(Database& db, const StatementManifest& manifest, size_t* pages = nullptr) {
+        std::vector<int> roots;
+        const auto& entries = manifest.entries();
+        for (size_t i = 0; i < entries.size() && i < statements_.size(); ++i) {
+            if (!entries[i].touch || !sqlite3_stmt_readonly(statements_[i]->get())) continue;
+            auto program = db.tryPrepare("EXPLAIN " + entries[i].sql);
+            if (!program) return program.status();
+            // Columns: addr, opcode, p1, p2 (root page), p3 (schema), ...
+            while ((*program)->tryStep().row())
+                if ((*program)->getText(1) == "OpenRead" && (*program)->getInt(4) == 0)
+                    roots.push_back((*program)->getInt(3));
+        }
+        std::sort(roots.begin(), roots.end());
+        roots.erase(std::unique(roots.begin(), roots.end()), roots.end());
+
+        std::vector<std::string> scans;
+        if (!roots.empty()) {
+            auto schema = db.tryPrepare("SELECT type, name, tbl_name FROM sqlite_schema WHERE rootpage = ?;");
+            if (!schema) return schema.status();
+            for (int root : roots) {
+                (*schema)->reset();
+                (*schema)->bind(1, root);
+                if (!(*schema)->tryStep().row()) continue;
+                if ((*schema)->getText(0) == "index")
+                    scans.push_back("SELECT 1 FROM " + detail::quoteIdentifier((*schema)->getText(2)) +
+                                    " INDEXED BY " + detail::quoteIdentifier((*schema)->getText(1)) + ";");
+                else if ((*schema)->getText(0) == "table")
+                    scans.push_back("SELECT 1 FROM " + detail::quoteIdentifier((*schema)->getText(1)) + " NOT INDEXED;");
+            }
+        }
+        if (scans.empty()) return Status();
+
+        int64_t cachePages = pragmaInt(db, "cache_size");
+        if (cachePages < 0) cachePages = -cachePages * 1024 / std::max<int64_t>(pragmaInt(db, "page_size"), 512);
+        const size_t share = std::max<size_t>(static_cast<size_t>(cachePages) / scans.size(), 1);
+
+        const size_t before = cacheMisses(db);
+        for (const auto& sql : scans) {
+            // A partial index can't be scanned whole; it is skipped
+            auto scan = db.tryPrepare(sql);
+            if (!scan) continue;
+            const size_t start = cacheMisses(db);
+            size_t rows = 0;
+            Status st;
+            while ((st = (*scan)->tryStep()).row())
+                if (++rows % 64 == 0 && cacheMisses(db) - start >= share) break;
+            if (!st) return st;
+        }
+        if (pages) *pages += cacheMisses(db) - before;
+        return Status();
+    }
+
+    // Statements come back reset, with any previous bindings still in place
+    Statement& operator[](size_t id) {
+        Statement& stmt = *statements_.at(id);
+        stmt.reset();
+        return stmt;
+    }
+    Statement& operator[](const std::string& name) {
+        auto it = ids_.find(name);
+        if (it == ids_.end()) RDB_THROW(SQLiteException("no statement named '" + name + "' in the manifest"));
+        return (*this)[it->second];
+    }
+
+    size_t size() const { return statements_.size(); }
+
+private:
+    static size_t cacheMisses(Database& db) {
+        int current = 0, highwater = 0;
+        sqlite3_db_status(db.get(), SQLITE_DBSTATUS_CACHE_MISS, &current, &highwater, 0);
+        return static_cast<size_t>(current);
+    }
+
+    static int64_t pragmaInt(Database& db, const std::string& pragma) {
+        auto q = db.tryPrepare("PRAGMA " + pragma + ";");
+        return q && (*q)->tryStep().row() ? (*q)->getInt64(0) : 0;
+    }
+
+    std::vector<std::unique_ptr<Statement>> statements_;
+    std::unordered_map<std::string, size_t> ids_;
+};
+
+// A fixed set of connections to one database file, each with the
+// manifest's statements prepared. The connections are opened, prepared
+// and touched in parallel in the constructor, so warm-up cost is paid
+// once at startup; warmup() reports what it took. Threads acquire a
+// connection for the duration of a Lease.
+//
+//   ConnectionPool pool("app.db", 4, manifest, [](Database& db) {
+//       db.setBusyTimeout(5000);
+//       return db.tryExecute("PRAGMA journal_mode=WAL;");
+//   });
+//   auto lease = pool.acquire();
+//   Statement& q = lease.statement(byEmail);
+class ConnectionPool {
+    struct Connection {
+        std::optional<Database> db;
+        PreparedStatements statements;
+    };
+
+public:
+    // Per-connection setup (pragmas, functions); runs on the warm-up
+    // threads, so it reports failure through its Status instead of throwing
+    using Setup = std::function<Status(Database&)>;
+
+    ConnectionPool(const std::string& filename, size_t size,
+                   const StatementManifest& manifest = StatementManifest(), Setup setup = nullptr) {
+        auto start = std::chrono::steady_clock::now();
+        connections_.resize(std::max<size_t>(size, 1));
+        std::vector<std::string> errors(connections_.size());
+        std::vector<size_t> pages(connections_.size(), 0);
+
+        auto warm = [&](size_t i) {
+            auto opened = Database::tryOpen(filename);
+            if (!opened) { errors[i] = opened.status().message(); return; }
+            connections_[i] = std::make_unique<Connection>();
+            Connection& c = *connections_[i];
+            c.db.emplace(std::move(*opened));
+            Status st = setup ? setup(*c.db) : Status();
+            if (st) st = c.statements.tryPrepareAll(*c.db, manifest);
+            if (st) st = c.statements.touch(*c.db, manifest, &pages[i]);
+            if (!st) errors[i] = c.db->errorMessage();
+        };
+        // The first connection runs on this thread: it may create the
+        // schema or switch journal modes in setup before the others open
+        warm(0);
+        std::vector<std::thread> threads;
+        if (errors[0].empty())
+            for (size_t i = 1; i < connections_.size(); ++i) threads.emplace_back(warm, i);
+        for (auto& t : threads) t.join();
+
+        for (const auto& e : errors)
+            if (!e.empty()) RDB_THROW(SQLiteException("connection pool warm-up failed: " + e));
+        for (size_t i = 0; i < connections_.size(); ++i) {
+            free_.push_back(connections_[i].get());
+            report_.statements += connections_[i]->statements.size();
+            report_.pages += pages[i];
+        }
+        report_.connections = connections_.size();
+        report_.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start);
+    }
+
+    ConnectionPool(const ConnectionPool&) = delete;
+    ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+    // Exclusive use of one connection; returned to the pool on destruction
+    class Lease {
+        ConnectionPool* pool_;
+        Connection* conn_;
+        friend class ConnectionPool;
+        Lease(ConnectionPool* pool, Connection* conn) : pool_(pool), conn_(conn) {}
+
+    public:
+        Lease(Lease&& other) noexcept : pool_(other.pool_), conn_(other.conn_) { other.conn_ = nullptr; }
+        Lease& operator=(Lease&&) = delete;
+        ~Lease() { if (conn_) pool_->release(conn_); }
+
+        Database& db() { return *conn_->db; }
+        Statement& statement(size_t id) { return conn_->statements[id]; }
+        Statement& statement(const std::string& name) { return conn_->statements[name]; }
+    };
+
+    // Blocks until a connection is free
+    Lease acquire() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ++stats_.acquires;
+        if (free_.empty()) {
+            ++stats_.waits;
+            auto start = std::chrono::steady_clock::now();
+            available_.wait(lock, [this] { return !free_.empty(); });
+            stats_.waitTime += std::chrono::steady_clock::now() - start;
+        }
+        Connection* conn = free_.back();
+        free_.pop_back();
+        return Lease(this, conn);
+    }
+
+    // Counters since construction; waits are acquires that found no free
+    // connection
+    struct Stats {
+        size_t size = 0;
+        size_t inUse = 0;
+        uint64_t acquires = 0;
+        uint64_t waits = 0;
+        std::chrono::nanoseconds waitTime{0};
+    };
+    Stats stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Stats s = stats_;
+        s.size = connections_.size();
+        s.inUse = connections_.size() - free_.size();
+        return s;
+    }
+
+    size_t size() const { return connections_.size(); }
+    const WarmupReport& warmup() const { return report_; }
+
+private:
+    std::vector<std::unique_ptr<Connection>> connections_;
+    std::vector<Connection*> free_;
+    mutable std::mutex mutex_;
+    std::condition_variable available_;
+    WarmupReport report_;
+    Stats stats_;
+
+    void release(Connection* conn) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            free_.push_back(conn);
+        }
+        available_.notify_one();
+    }
+};
+
+// ---------------------------------
+// Page cache warming
+// ---------------------------------
+
+// Reads a database file (or just the pages of some tables and indexes)
+// into the operating system's page cache on a background thread, so
+// queries after a restart hit memory instead of disk. Reads are large and
+// in file order, optionally capped at bytesPerSecond so a warming service
+// does not starve its own foreground I/O.
+//
+// With no objects listed the whole file is read sequentially. Otherwise
+// the pages of each table (and its indexes) are found through the dbstat
+// virtual table on a private read-only connection; note that dbstat
+// itself walks those b-trees, so on slow storage warming a whole file
+// that fits in memory can finish sooner.
+//
+//   PageCacheWarmer warmer(db, {{"orders", "customers"}, 200 << 20});
+//   ... serve traffic ...
+//   auto p = warmer.progress();   // bytesDone / bytesTotal, elapsed, finished
+class PageCacheWarmer {
+public:
+    struct Options {
+        std::vector<std::string> objects;   // tables or indexes; empty = whole file
+        uint64_t bytesPerSecond = 0;        // 0 = unthrottled
+        size_t chunkBytes = 1 << 20;
+        std::string schema = "main";
+    };
+
+    struct Progress {
+        uint64_t bytesDone = 0;
+        uint64_t bytesTotal = 0;            // 0 until the plan is made
+        std::chrono::milliseconds elapsed{0};
+        bool finished = false;
+    };
+
+    PageCacheWarmer(Database& db, Options options) : options_(std::move(options)) {
+        const char* file = sqlite3_db_filename(db.get(), options_.schema.c_str());
+        path_ = file ? file : "";
+        auto q = db.prepare("PRAGMA " + detail::quoteIdentifier(options_.schema) + ".page_size");
+        pageSize_ = q->step() ? q->getInt64(0) : 4096;
+        start_ = std::chrono::steady_clock::now();
+        thread_ = std::thread([this] { run(); });
+    }
+
+    ~PageCacheWarmer() {
+        cancel();
+        if (thread_.joinable()) thread_.join();
+    }
+
+    PageCacheWarmer(const PageCacheWarmer&) = delete;
+    PageCacheWarmer& operator=(const PageCacheWarmer&) = delete;
+
+    Progress progress() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return progress_;
+    }
+
+    // Empty unless warming stopped on an error
+    std::string error() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return error_;
+    }
+
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [this] { return progress_.finished; });
+    }
+
+    void cancel() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cancelled_ = true;
+        changed_.notify_all();
+    }
+
+private:
+    struct Range { int64_t offset; int64_t bytes; };
+
+    Options options_;
+    std::string path_;
+    int64_t pageSize_ = 4096;
+    std::chrono::steady_clock::time_point start_;
+    mutable std::mutex mutex_;
+    std::condition_variable changed_;
+    Progress progress_;
+    std::string error_;
+    bool cancelled_ = false;
+    std::thread thread_;
+
+    void run() {
+        std::vector<Range> ranges = plan();
+        uint64_t total = 0;
+        for (const Range& r : ranges) total += r.bytes;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            progress_.bytesTotal = total;
+        }
+        std::ifstream in;
+        if (total) in.open(path_, std::ios::binary);
+        if (total && !in) fail("cannot open " + path_);
+
+        std::vector<char> buffer(std::max<size_t>(options_.chunkBytes, static_cast<size_t>(pageSize_)));
+        uint64_t done = 0;
+        for (const Range& r : ranges) {
+            if (!in) break;
+            in.seekg(r.offset);
+            for (int64_t off = 0; off < r.bytes && in; ) {
+                auto n = static_cast<std::streamsize>(std::min<int64_t>(r.bytes - off, static_cast<int64_t>(buffer.size())));
+                in.read(buffer.data(), n);
+                off += n;
+                done += static_cast<uint64_t>(n);
+                if (!update(done)) return finish();
+                throttle(done);
+            }
+        }
+        finish();
+    }
+
+    // Byte ranges to read, in file order with adjacent pages coalesced
+    std::vector<Range> plan() {
+        std::vector<Range> ranges;
+        if (path_.empty()) return ranges;   // in-memory or temporary database
+        if (options_.objects.empty()) {
+            std::ifstream f(path_, std::ios::binary | std::ios::ate);
+            if (f) ranges.push_back({0, static_cast<int64_t>(f.tellg())});
+            return ranges;
+        }
+
+        sqlite3* db = nullptr;
+        int rc = sqlite3_open_v2(path_.c_str(), &db, SQLITE_OPEN_READONLY, nullptr);
+        sqlite3_stmt* btrees = nullptr;
+        sqlite3_stmt* pages = nullptr;
+        if (rc == SQLITE_OK)
+            rc = sqlite3_prepare_v2(db, "SELECT name FROM sqlite_schema WHERE (name = ?1 OR tbl_name = ?1) AND rootpage > 0",
+                                    -1, &btrees, nullptr);
+        if (rc == SQLITE_OK)
+            rc = sqlite3_prepare_v2(db, "SELECT pageno FROM dbstat WHERE name = ?1", -1, &pages, nullptr);
+
+        std::vector<int64_t> pagenos;
+        for (size_t i = 0; rc == SQLITE_OK && i < options_.objects.size(); ++i) {
+            sqlite3_bind_text(btrees, 1, options_.objects[i].c_str(), -1, SQLITE_TRANSIENT);
+            while ((rc = sqlite3_step(btrees)) == SQLITE_ROW) {
+                sqlite3_bind_value(pages, 1, sqlite3_column_value(btrees, 0));
+                while ((rc = sqlite3_step(pages)) == SQLITE_ROW) pagenos.push_back(sqlite3_column_int64(pages, 0));
+                sqlite3_reset(pages);
+                if (rc != SQLITE_DONE || isCancelled()) break;
+            }
+            sqlite3_reset(btrees);
+            if (rc == SQLITE_DONE) rc = SQLITE_OK;
+        }
+        if (rc != SQLITE_OK) fail(db ? sqlite3_errmsg(db) : "cannot open " + path_);
+        sqlite3_finalize(pages);
+        sqlite3_finalize(btrees);
+        sqlite3_close(db);
+        if (rc != SQLITE_OK) return ranges;
+
+        std::sort(pagenos.begin(), pagenos.end());
+        pagenos.erase(std::unique(pagenos.begin(), pagenos.end()), pagenos.end());
+        for (int64_t pgno : pagenos) {
+            int64_t offset = (pgno - 1) * pageSize_;
+            if (!ranges.empty() && ranges.back().offset + ranges.back().bytes == offset) ranges.back().bytes += pageSize_;
+            else ranges.push_back({offset, pageSize_});
+        }
+        return ranges;
+    }
+
+    bool isCancelled() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return cancelled_;
+    }
+
+    bool update(uint64_t done) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        progress_.bytesDone = done;
+        progress_.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_);
+        return !cancelled_;
+    }
+
+    // Sleep until `done` bytes are within the configured rate; wakes early on cancel
+    void throttle(uint64_t done) {
+        if (!options_.bytesPerSecond) return;
+        auto due = start_ + std::chrono::microseconds(done * 1000000 / options_.bytesPerSecond);
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait_until(lock, due, [this] { return cancelled_; });
+    }
+
+    void fail(const std::string& message) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        error_ = message;
+    }
+
+    void finish() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        progress_.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_);
+        progress_.finished = true;
+        changed_.notify_all();
+    }
+};
+
+// ---------------------------------
+// Schema catalog
+// ---------------------------------
+namespace detail {
+
+// ASCII case-insensitive hashing for SQL identifiers, so lookups by any
+// spelling neither allocate nor fold case into a temporary
+struct NoCaseHash {
+    size_t operator()(const std::string& s) const {
+        uint64_t h = 1469598103934665603ull;
+        for (unsigned char c : s) h = (h ^ static_cast<unsigned char>(std::tolower(c))) * 1099511628211ull;
+        return static_cast<size_t>(h);
+    }
+};
+struct NoCaseEqual {
+    bool operator()(const std::string& a, const std::string& b) const {
+        return a.size() == b.size() && sqlite3_strnicmp(a.c_str(), b.c_str(), static_cast<int>(a.size())) == 0;
+    }
+};
+
+} // namespace detail
+
+// In-memory copy of a schema's tables, views, columns and indexes. It is
+// loaded once; lookups are hash probes that never touch SQLite. Call
+// refreshIfChanged() where a schema change must be noticed: it steps a
+// prepared PRAGMA schema_version and reloads only if the version moved.
+// The pragma opens a read transaction of its own when none is open, so
+// changes committed by other connections are seen; the pager's data
+// version counter (SQLITE_FCNTL_DATA_VERSION) is not enough, since it
+// only advances when this connection starts a read transaction.
+class SchemaCatalog {
+public:
+    struct Column {
+        std::string name;
+        std::string type;            // declared type, as written
+        bool notNull = false;
+        int primaryKey = 0;          // 1-based position in the primary key, 0 if not part of it
+        std::optional<std::string> defaultValue;
+    };
+
+    struct Index {
+        std::string name;
+        std::string table;
+        bool unique = false;
+        bool partial = false;
+        std::string origin;          // "c" CREATE INDEX, "u" UNIQUE constraint, "pk" PRIMARY KEY
+        std::vector<std::string> columns;   // "" for expression terms
+    };
+
+    struct Table {
+        std::string name;
+        bool view = false;
+        std::vector<Column> columns;
+        std::vector<std::string> indexes;
+
+        const Column* column(const std::string& columnName) const {
+            auto it = byName.find(columnName);
+            return it == byName.end() ? nullptr : &columns[it->second];
+        }
+
+    private:
+        friend class SchemaCatalog;
+        std::unordered_map<std::string, size_t, detail::NoCaseHash, detail::NoCaseEqual> byName;
+    };
+
+    explicit SchemaCatalog(Database& db, const std::string& schema = "main")
+        : db_(db), schema_(schema) {
+        reload();
+    }
+
+    const Table* table(const std::string& name) const {
+        auto it = tables_.find(name);
+        return it == tables_.end() ? nullptr : &it->second;
+    }
+    const Index* index(const std::string& name) const {
+        auto it = indexes_.find(name);
+        return it == indexes_.end() ? nullptr : &it->second;
+    }
+    const Column* column(const std::string& table, const std::string& column) const {
+        const Table* t = this->table(table);
+        return t ? t->column(column) : nullptr;
+    }
+
+    bool hasTable(const std::string& name) const {
+        const Table* t = table(name);
+        return t && !t->view;
+    }
+    bool hasView(const std::string& name) const {
+        const Table* t = table(name);
+        return t && t->view;
+    }
+    bool hasIndex(const std::string& name) const { return index(name) != nullptr; }
+    bool hasColumn(const std::string& table, const std::string& column) const {
+        return this->column(table, column) != nullptr;
+    }
+
+    // Tables and views by name
+    const std::unordered_map<std::string, Table, detail::NoCaseHash, detail::NoCaseEqual>& tables() const {
+        return tables_;
+    }
+
+    int64_t schemaVersion() const { return version_; }
+
+    // Returns true if the schema had changed and the catalog was reloaded
+    bool refreshIfChanged() {
+        if (currentVersion() == version_) return false;
+        reload();
+        return true;
+    }
+
+    void reload() {
+        tables_.clear();
+        indexes_.clear();
+        // Read the version first: a change racing the load is then seen by
+        // the next refreshIfChanged() instead of being missed
+        version_ = currentVersion();
+
+        std::string schema = detail::quoteIdentifier(schema_);
+        auto objects = db_.prepare("SELECT type, name FROM " + schema +
+                                   ".sqlite_schema WHERE type IN ('table', 'view') ORDER BY name");
+        while (objects->step()) {
+            Table t;
+            t.view = objects->getText(0) == "view";
+            t.name = objects->getText(1);
+            std::string name = t.name;
+            tables_.emplace(name, std::move(t));
+        }
+
+        auto columns = db_.prepare("SELECT name, type, \"notnull\", dflt_value, pk FROM pragma_table_info(?1, ?2)");
+        auto indexList = db_.prepare("SELECT name, \"unique\", origin, partial FROM pragma_index_list(?1, ?2)");
+        auto indexInfo = db_.prepare("SELECT name FROM pragma_index_info(?1, ?2) ORDER BY seqno");
+        for (auto& [name, t] : tables_) {
+            columns->bindText(1, name);
+            columns->bindText(2, schema_);
+            // A virtual table whose module is not loaded cannot report its
+            // columns; keep it in the catalog without them
+            while (columns->tryStep().row()) {
+                Column c;
+                c.name = columns->getText(0);
+                c.type = columns->getText(1);
+                c.notNull = columns->getInt(2) != 0;
+                if (sqlite3_column_type(columns->get(), 3) != SQLITE_NULL) c.defaultValue = columns->getText(3);
+                c.primaryKey = columns->getInt(4);
+                t.byName.emplace(c.name, t.columns.size());
+                t.columns.push_back(std::move(c));
+            }
+            columns->reset();
+            if (t.view) continue;
+
+            indexList->bindText(1, name);
+            indexList->bindText(2, schema_);
+            while (indexList->tryStep().row()) {
+                Index ix;
+                ix.name = indexList->getText(0);
+                ix.table = name;
+                ix.unique = indexList->getInt(1) != 0;
+                ix.origin = indexList->getText(2);
+                ix.partial = indexList->getInt(3) != 0;
+                t.indexes.push_back(ix.name);
+                std::string ixName = ix.name;
+                indexes_.emplace(ixName, std::move(ix));
+            }
+            indexList->reset();
+        }
+        for (auto& [name, ix] : indexes_) {
+            indexInfo->bindText(1, name);
+            indexInfo->bindText(2, schema_);
+            while (indexInfo->tryStep().row()) ix.columns.push_back(indexInfo->getText(0));
+            indexInfo->reset();
+        }
+    }
+
+private:
+    Database& db_;
+    std::string schema_;
+    int64_t version_ = -1;
+    std::unordered_map<std::string, Table, detail::NoCaseHash, detail::NoCaseEqual> tables_;
+    std::unordered_map<std::string, Index, detail::NoCaseHash, detail::NoCaseEqual> indexes_;
+    std::unique_ptr<Statement> versionStmt_;
+
+    int64_t currentVersion() {
+        if (!versionStmt_) versionStmt_ = db_.prepare("PRAGMA " + detail::quoteIdentifier(schema_) + ".schema_version;");
+        versionStmt_->step();
+        int64_t v = versionStmt_->getInt64(0);
+        versionStmt_->reset();
+        return v;
+    }
+};
+
+// ---------------------------------
+// Statistics maintenance
+// ---------------------------------
+
+// Keeps planner statistics fresh on a long-lived connection by running
+// PRAGMA optimize (bounded by analysis_limit and a wall-clock budget):
+//   - from maybeRun(), once changesThreshold rows have been written since
+//     the last pass, or after idleAfter without writes;
+//   - from the destructor, as SQLite recommends before closing.
+// maybeRun() is cheap and is meant to be called from the application's
+// own idle points or timers; it never runs inside an open transaction.
+// Each pass is reported to the log callback with the ANALYZE statements
+// executed and any change in the plans of the watched queries.
+//
+// While a pass runs, a progress listener (Database::addProgressListener)
+// enforces the time budget alongside any the application registered.
+class OptimizeScheduler {
+public:
+    struct PlanChange {
+        std::string sql;
+        std::string before;
+        std::string after;
+    };
+
+    struct Report {
+        std::string trigger;                // "writes", "idle", "close" or "manual"
+        int64_t changes = 0;                // rows written since the previous pass
+        std::vector<std::string> analyzed;  // ANALYZE statements run
+        std::vector<PlanChange> planChanges;
+        std::chrono::milliseconds elapsed{0};
+        bool budgetExhausted = false;
+        std::string error;
+    };
+
+    struct Options {
+        int analysisLimit = 400;            // rows sampled per index; 0 = no limit
+        int64_t changesThreshold = 10000;
+        std::chrono::milliseconds idleAfter{std::chrono::seconds(60)};
+        std::chrono::milliseconds budget{500};
+        bool onClose = true;
+        std::vector<std::string> watch;     // queries whose EXPLAIN QUERY PLAN is compared
+        std::function<void(const Report&)> log;
+    };
+
+    OptimizeScheduler(Database& db, Options options)
+        : db_(db), options_(std::move(options)) {
+        lastSeenChanges_ = lastRunChanges_ = sqlite3_total_changes64(db_.get());
+        lastActivity_ = std::chrono::steady_clock::now();
+    }
+
+    ~OptimizeScheduler() {
+        if (options_.onClose) run("close");
+    }
+
+    OptimizeScheduler(const OptimizeScheduler&) = delete;
+    OptimizeScheduler& operator=(const OptimizeScheduler&) = delete;
+
+    // Run a pass if one is due; returns true if it ran
+    bool maybeRun() {
+        auto now = std::chrono::steady_clock::now();
+        int64_t changes = sqlite3_total_changes64(db_.get());
+        if (changes != lastSeenChanges_) {
+            lastSeenChanges_ = changes;
+            lastActivity_ = now;
+        }
+        if (!sqlite3_get_autocommit(db_.get())) return false;
+        int64_t pending = changes - lastRunChanges_;
+        if (pending >= options_.changesThreshold) { run("writes"); return true; }
+        if ((pending > 0 || !ranOnce_) && now - lastActivity_ >= options_.idleAfter) { run("idle"); return true; }
+        return false;
+    }
+
+    // Run a pass now
+    Report run(const std::string& trigger = "manual") {
+        Report report;
+        report.trigger = trigger;
+        auto start = std::chrono::steady_clock::now();
+        int64_t changes = sqlite3_total_changes64(db_.get());
+        report.changes = changes - lastRunChanges_;
+
+        std::vector<std::string> before;
+        for (const auto& sql : options_.watch) before.push_back(plan(sql));
+
+        // PRAGMA optimize with the debug bit lists the ANALYZE statements it
+        // would run; running them one by one lets each be logged and timed
+        std::vector<std::string> statements;
+        if (auto q = db_.tryPrepare("PRAGMA optimize(0xffff);")) {
+            while ((*q)->tryStep().row()) statements.push_back((*q)->getText(0));
+        }
+
+        int64_t previousLimit = pragmaValue("PRAGMA analysis_limit;");
+        db_.tryExecute("PRAGMA analysis_limit=" + std::to_string(options_.analysisLimit) + ";");
+        deadline_ = start + options_.budget;
+        // An interrupt from another listener is reported as an error
+        bool over = false;
+        int budget = db_.addProgressListener(1000, [&] { return over = std::chrono::steady_clock::now() > deadline_; });
+        for (const auto& sql : statements) {
+            Status st = db_.tryExecute(sql);
+            if (st.code == SQLITE_INTERRUPT && over) { report.budgetExhausted = true; break; }
+            if (!st) { report.error = db_.errorMessage(); break; }
+            report.analyzed.push_back(sql);
+        }
+        db_.removeListener(budget);
+        db_.tryExecute("PRAGMA analysis_limit=" + std::to_string(previousLimit) + ";");
+
+        for (size_t i = 0; i < options_.watch.size(); ++i) {
+            std::string after = plan(options_.watch[i]);
+            if (after != before[i]) report.planChanges.push_back({options_.watch[i], before[i], after});
+        }
+
+        // Changes made by the pass itself (sqlite_stat1 rows) are not
+        // application writes and must not trigger the next one
+        lastRunChanges_ = lastSeenChanges_ = sqlite3_total_changes64(db_.get());
+        ranOnce_ = true;
+        report.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        if (options_.log) options_.log(report);
+        return report;
+    }
+
+private:
+    Database& db_;
+    Options options_;
+    int64_t lastSeenChanges_ = 0;
+    int64_t lastRunChanges_ = 0;
+    bool ranOnce_ = false;
+    std::chrono::steady_clock::time_point lastActivity_;
+    std::chrono::steady_clock::time_point deadline_;
+
+    int64_t pragmaValue(const std::string& sql) {
+        auto q = db_.tryPrepare(sql);
+        return q && (*q)->tryStep().row() ? (*q)->getInt64(0) : 0;
+    }
+
+    // EXPLAIN QUERY PLAN detail lines, one per step
+    std::string plan(const std::string& sql) {
+        auto q = db_.tryPrepare("EXPLAIN QUERY PLAN " + sql);
+        if (!q) return std::string("error: ") + db_.errorMessage();
+        std::string out;
+        while ((*q)->tryStep().row()) out += (*q)->getText(3) + "\n";
+        return out;
+    }
+};
+
+// ---------------------------------
+// Query profiling
+// ---------------------------------
+namespace detail {
+
+struct SqlToken {
+    enum Kind { Word, Quoted, Number, String, Blob, Param, Op } kind;
+    std::string_view text;
+};
+
+// Lexes SQL well enough to normalise it and find table and column names;
+// comments are dropped
+inline std::vector<SqlToken> tokenizeSql(std::string_view sql) {
+    std::vector<SqlToken> out;
+    auto isWord = [](unsigned char c) { return std::isalnum(c) || c == '_' || c == '$' || c >= 0x80; };
+    size_t i = 0, n = sql.size();
+    while (i < n) {
+        unsigned char c = static_cast<unsigned char>(sql[i]);
+        size_t start = i;
+        if (std::isspace(c)) { ++i; continue; }
+        if (c == '-' && i + 1 < n && sql[i + 1] == '-') {
+            while (i < n && sql[i] != '\n') ++i;
+            continue;
+        }
+        if (c == '/' && i + 1 < n && sql[i + 1] == '*') {
+            size_t end = sql.find("*/", i + 2);
+            i = end == std::string_view::npos ? n : end + 2;
+            continue;
+        }
+        SqlToken::Kind kind;
+        if (c == '\'' || ((c == 'x' || c == 'X') && i + 1 < n && sql[i + 1] == '\'')) {
+            kind = c == '\'' ? SqlToken::String : SqlToken::Blob;
+            i += c == '\'' ? 1 : 2;
+            while (i < n) {
+                if (sql[i] == '\'') {
+                    if (i + 1 < n && sql[i + 1] == '\'') { i += 2; continue; }
+                    ++i;
+                    break;
+                }
+                ++i;
+            }
+        } else if (c == '"' || c == '`' || c == '[') {
+            char close = c == '[' ? ']' : static_cast<char>(c);
+            kind = SqlToken::Quoted;
+            ++i;
+            while (i < n) {
+                if (sql[i] == close) {
+                    if (close != ']' && i + 1 < n && sql[i + 1] == close) { i += 2; continue; }
+                    ++i;
+                    break;
+                }
+                ++i;
+            }
+        } else if (std::isdigit(c) || (c == '.' && i + 1 < n && std::isdigit(static_cast<unsigned char>(sql[i + 1])))) {
+            kind = SqlToken::Number;
+            while (i < n && (isWord(static_cast<unsigned char>(sql[i])) || sql[i] == '.' ||
+                             ((sql[i] == '+' || sql[i] == '-') && (sql[i - 1] == 'e' || sql[i - 1] == 'E'))))
+                ++i;
+        } else if (c == '?' || c == ':' || c == '@' || (c == '$' && i + 1 < n && isWord(static_cast<unsigned char>(sql[i + 1])))) {
+            kind = SqlToken::Param;
+            ++i;
+            while (i < n && isWord(static_cast<unsigned char>(sql[i]))) ++i;
+        } else if (isWord(c)) {
+            kind = SqlToken::Word;
+            while (i < n && isWord(static_cast<unsigned char>(sql[i]))) ++i;
+        } else {
+            kind = SqlToken::Op;
+            static const char* const twoChar[] = {"<=", ">=", "<>", "!=", "==", "||", "<<", ">>", "->"};
+            ++i;
+            for (const char* op : twoChar)
+                if (i < n && sql[start] == op[0] && sql[i] == op[1]) { ++i; break; }
+            if (i < n && sql.substr(start, i - start) == "->" && sql[i] == '>') ++i;
+        }
+        out.push_back({kind, sql.substr(start, i - start)});
+    }
+    return out;
+}
+
+inline bool sqlKeyword(const SqlToken& t, const char* word) {
+    return t.kind == SqlToken::Word && t.text.size() == std::strlen(word) &&
+           sqlite3_strnicmp(t.text.data(), word, static_cast<int>(t.text.size())) == 0;
+}
+
+// Identifier text without its quotes
+inline std::string sqlIdentifier(const SqlToken& t) {
+    if (t.kind != SqlToken::Quoted) return std::string(t.text);
+    std::string out;
+    char close = t.text[0] == '[' ? ']' : t.text[0];
+    for (size_t i = 1; i + 1 < t.text.size(); ++i) {
+        out += t.text[i];
+        if (t.text[i] == close && close != ']') ++i;
+    }
+    return out;
+}
+
+// Whether an operator at tokens[i] is a prefix sign rather than a binary operator
+inline bool unaryPosition(const std::vector<SqlToken>& tokens, size_t i) {
+    if (i == 0) return true;
+    const SqlToken& prev = tokens[i - 1];
+    if (prev.kind == SqlToken::Op) return prev.text != ")";
+    static const char* const keywords[] = {"SELECT", "WHERE", "AND", "OR", "NOT", "BETWEEN", "IN", "IS", "LIKE",
+                                           "LIMIT", "OFFSET", "WHEN", "THEN", "ELSE", "VALUES", "SET", "BY", "ON"};
+    for (const char* k : keywords)
+        if (sqlKeyword(prev, k)) return true;
+    return false;
+}
+
+// Canonical text for a statement: literals become ?, IN lists of
+// parameters collapse to IN (?), comments and layout are dropped, so the
+// same query with different constants shares one entry
+inline std::string normalizeSql(std::string_view sql) {
+    auto tokens = tokenizeSql(sql);
+    std::vector<std::string_view> parts;
+    auto isLiteral = [](const SqlToken& t) {
+        return t.kind == SqlToken::Number || t.kind == SqlToken::String || t.kind == SqlToken::Blob;
+    };
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        const SqlToken& t = tokens[i];
+        if (t.kind == SqlToken::Op && (t.text == "-" || t.text == "+") && i + 1 < tokens.size() &&
+            tokens[i + 1].kind == SqlToken::Number && unaryPosition(tokens, i)) {
+            continue;   // sign of a literal
+        }
+        if (isLiteral(t) || t.kind == SqlToken::Param) parts.push_back("?");
+        else parts.push_back(t.text);
+        // IN (?, ?, ...) -> IN (?)
+        if (parts.size() >= 4 && parts.back() == ")" ) {
+            size_t j = parts.size() - 2;
+            bool onlyParams = true;
+            while (j > 0 && parts[j] != "(") {
+                if (parts[j] != "?" && parts[j] != ",") { onlyParams = false; break; }
+                --j;
+            }
+            if (onlyParams && j > 0 && parts[j] == "(" && parts.size() - j > 3 &&
+                parts[j - 1].size() == 2 && sqlite3_strnicmp(parts[j - 1].data(), "IN", 2) == 0) {
+                parts.resize(j);
+                parts.insert(parts.end(), {"(", "?", ")"});
+            }
+        }
+    }
+    std::string out;
+    for (size_t i = 0; i < parts.size(); ++i) {
+        std::string_view p = parts[i];
+        bool tight = i == 0 || p == ")" || p == "," || p == "." || p == ";" || parts[i - 1] == "(" || parts[i - 1] == "." ||
+                     (p == "(" && i > 0 && std::isalnum(static_cast<unsigned char>(parts[i - 1].back())) &&
+                      !(parts[i - 1].size() == 2 && sqlite3_strnicmp(parts[i - 1].data(), "IN", 2) == 0));
+        if (!tight) out += ' ';
+        out += p;
+    }
+    while (!out.empty() && out.back() == ';') out.pop_back();
+    return out;
+}
+
+// Size at which the trackers' caches of raw statement text are emptied.
+// Text with embedded literals is new for every statement, so without a
+// bound the caches grow with the workload rather than with its shapes.
+constexpr size_t kSqlTextCacheLimit = 1024;
+
+} // namespace detail
+
+// Per-statement profile of everything a connection runs, gathered from the
+// statement trace events: statements are grouped by normalised SQL
+// (constants replaced by ?), with call counts, wall time and SQLite's own
+// per-statement counters (full-scan steps, sorts, automatic indexes, VM
+// steps). Time is measured from the first step to the reset with
+// steady_clock, since SQLite's own profile figure has only the VFS
+// clock's millisecond resolution.
+//
+//   QueryProfiler profiler(db);
+//   ... run the workload ...
+//   for (auto& e : profiler.entries()) std::cout << e.calls << " " << e.sql << "\n";
+class QueryProfiler {
+public:
+    struct Entry {
+        std::string sql;              // normalised
+        uint64_t fingerprint = 0;     // hash of sql
+        uint64_t calls = 0;
+        uint64_t totalNs = 0;
+        uint64_t maxNs = 0;
+        uint64_t fullScanSteps = 0;   // rows stepped over by full table scans
+        uint64_t sorts = 0;
+        uint64_t autoIndexes = 0;     // rows inserted into automatic indexes
+        uint64_t vmSteps = 0;
+    };
+
+    explicit QueryProfiler(Database& db) : db_(db) {
+        listener_ = db_.addTraceListener(SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE, [this](unsigned type, void* p, void*) {
+            auto stmt = static_cast<sqlite3_stmt*>(p);
+            if (type == SQLITE_TRACE_STMT) running_.emplace(stmt, std::chrono::steady_clock::now());
+            else record(stmt);
+        });
+    }
+
+    ~QueryProfiler() { db_.removeListener(listener_); }
+
+    QueryProfiler(const QueryProfiler&) = delete;
+    QueryProfiler& operator=(const QueryProfiler&) = delete;
+
+    // Most expensive (total time) first
+    std::vector<Entry> entries() const {
+        std::vector<Entry> out = entries_;
+        std::sort(out.begin(), out.end(), [](const Entry& a, const Entry& b) { return a.totalNs > b.totalNs; });
+        return out;
+    }
+
+    const Entry* find(uint64_t fingerprint) const {
+        auto it = byFingerprint_.find(fingerprint);
+        return it == byFingerprint_.end() ? nullptr : &entries_[it->second];
+    }
+
+    void reset() {
+        entries_.clear();
+        byFingerprint_.clear();
+        byText_.clear();
+        running_.clear();
+    }
+
+private:
+    struct Cached {
+        std::string raw;
+        size_t entry;
+    };
+
+    Database& db_;
+    int listener_ = 0;
+    std::vector<Entry> entries_;
+    std::unordered_map<uint64_t, size_t> byFingerprint_;
+    // Normalising is the expensive part; statements are recognised by the
+    // address of their SQL text, confirmed against a copy of it since a
+    // finalised statement's memory can be reused. Emptied when it reaches
+    // detail::kSqlTextCacheLimit entries.
+    std::unordered_map<const char*, Cached> byText_;
+    std::unordered_map<sqlite3_stmt*, std::chrono::steady_clock::time_point> running_;
+
+    void record(sqlite3_stmt* stmt) {
+        int64_t ns = 0;
+        auto started = running_.find(stmt);
+        if (started != running_.end()) {
+            ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started->second).count();
+            running_.erase(started);
+        }
+        const char* text = sqlite3_sql(stmt);
+        if (!text) return;
+        auto cached = byText_.find(text);
+        if (cached == byText_.end() || cached->second.raw != text) {
+            std::string sql = detail::normalizeSql(text);
+            uint64_t fp = detail::hashKey(std::string_view(sql));
+            auto [it, added] = byFingerprint_.emplace(fp, entries_.size());
+            if (added) {
+                Entry e;
+                e.sql = std::move(sql);
+                e.fingerprint = fp;
+                entries_.push_back(std::move(e));
+            }
+            if (byText_.size() >= detail::kSqlTextCacheLimit) byText_.clear();
+            cached = byText_.insert_or_assign(text, Cached{text, it->second}).first;
+        }
+        Entry& e = entries_[cached->second.entry];
+        ++e.calls;
+        e.totalNs += static_cast<uint64_t>(ns);
+        e.maxNs = std::max(e.maxNs, static_cast<uint64_t>(ns));
+        e.fullScanSteps += static_cast<uint64_t>(sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1));
+        e.sorts += static_cast<uint64_t>(sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 1));
+        e.autoIndexes += static_cast<uint64_t>(sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 1));
+        e.vmSteps += static_cast<uint64_t>(sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1));
+    }
+};
+
+// ---------------------------------
+// Index advisor
+// ---------------------------------
+
+// Recommends indexes for a profiled workload, in the manner of SQLite's
+// sqlite3_expert extension: the schema is copied into a scratch in-memory
+// database with sqlite_stat1 rows sampled from the real data, candidate
+// indexes are built from the columns each statement filters, joins and
+// sorts on, and each candidate is created there and judged by the plan
+// EXPLAIN QUERY PLAN then reports. Costs are estimated rows visited per
+// plan step (nested loops multiply), weighted by how often the statement
+// ran. Each suggestion also counts the index entries the workload's
+// INSERT/UPDATE/DELETE statements would write, and suggestions are ranked
+// by benefit - writeCost * writeWeight.
+//
+//   QueryProfiler profiler(db);
+//   ... run the workload ...
+//   for (auto& s : IndexAdvisor(db).advise(profiler.entries()))
+//       std::cout << s.sql << "  -- score " << s.score << "\n";
+class IndexAdvisor {
+public:
+    struct Suggestion {
+        std::string table;
+        std::vector<std::string> columns;
+        std::string sql;                    // CREATE INDEX statement
+        double benefit = 0;                 // estimated rows visited saved over the workload
+        double writeCost = 0;               // index entries written by the workload's writes
+        double score = 0;
+        std::vector<std::string> queries;   // statements whose plans would use the index
+    };
+
+    struct Options {
+        int64_t sampleRows = 100000;        // rows read per column set to estimate selectivity
+        double writeWeight = 4.0;           // rows-visited equivalent of one index entry write
+        size_t maxColumns = 3;
+    };
+
+    explicit IndexAdvisor(Database& db) : IndexAdvisor(db, Options()) {}
+    IndexAdvisor(Database& db, Options options) : db_(db), options_(options) {}
+
+    std::vector<Suggestion> advise(const std::vector<QueryProfiler::Entry>& workload) {
+        SchemaCatalog catalog(db_);
+        catalog_ = &catalog;
+        Database scratch(":memory:");
+        scratch_ = &scratch;
+        rows_.clear();
+        stats_.clear();
+        buildScratch();
+
+        std::vector<Suggestion> found;
+        std::vector<Write> writes;
+        for (const auto& entry : workload) {
+            auto tokens = detail::tokenizeSql(entry.sql);
+            if (tokens.empty()) continue;
+            if (classifyWrite(tokens, entry.calls, writes)) continue;
+            adviseStatement(entry, tokens, found);
+        }
+        catalog_ = nullptr;
+        scratch_ = nullptr;
+
+        // An index whose columns start with a smaller suggestion serves its queries too
+        std::sort(found.begin(), found.end(), [](const Suggestion& a, const Suggestion& b) {
+            return a.columns.size() > b.columns.size();
+        });
+        std::vector<Suggestion> merged;
+        for (auto& s : found) {
+            Suggestion* into = nullptr;
+            for (auto& m : merged)
+                if (sameName(m.table, s.table) && m.columns.size() >= s.columns.size() &&
+                    std::equal(s.columns.begin(), s.columns.end(), m.columns.begin(), sameName))
+                    into = &m;
+            if (!into) { merged.push_back(std::move(s)); continue; }
+            into->benefit += s.benefit;
+            for (auto& q : s.queries)
+                if (std::find(into->queries.begin(), into->queries.end(), q) == into->queries.end())
+                    into->queries.push_back(q);
+        }
+
+        for (auto& s : merged) {
+            for (const Write& w : writes) {
+                if (!sameName(w.table, s.table)) continue;
+                if (!w.update) { s.writeCost += w.calls; continue; }
+                bool touches = false;
+                for (const auto& c : w.columns)
+                    for (const auto& ic : s.columns) touches = touches || sameName(c, ic);
+                if (touches) s.writeCost += 2 * w.calls;   // delete + insert of the entry
+            }
+            s.score = s.benefit - s.writeCost * options_.writeWeight;
+            std::string name = "idx_" + s.table;
+            std::string list;
+            for (const auto& c : s.columns) {
+                name += "_" + c;
+                list += (list.empty() ? "" : ", ") + detail::quoteIdentifier(c);
+            }
+            s.sql = "CREATE INDEX " + detail::quoteIdentifier(name) + " ON " + detail::quoteIdentifier(s.table) + "(" + list + ");";
+        }
+        std::sort(merged.begin(), merged.end(), [](const Suggestion& a, const Suggestion& b) { return a.score > b.score; });
+        return merged;
+    }
+
+private:
+    struct Write {
+        std::string table;
+        bool update = false;
+        std::vector<std::string> columns;   // SET columns of an UPDATE
+        double calls = 0;
+    };
+
+    struct Usage {
+        std::vector<std::string> eq, range, order;
+    };
+
+    Database& db_;
+    Options options_;
+    SchemaCatalog* catalog_ = nullptr;
+    Database* scratch_ = nullptr;
+    std::unordered_map<std::string, double, detail::NoCaseHash, detail::NoCaseEqual> rows_;
+    // sqlite_stat1 figures per index: rows, then rows per distinct prefix of 1..n columns
+    std::unordered_map<std::string, std::vector<double>, detail::NoCaseHash, detail::NoCaseEqual> stats_;
+    std::unordered_map<std::string, double> distinct_;
+    int hypothetical_ = 0;
+
+    static bool sameName(const std::string& a, const std::string& b) { return detail::NoCaseEqual()(a, b); }
+
+    double rowCount(const std::string& table) {
+        auto it = rows_.find(table);
+        if (it != rows_.end()) return it->second;
+        double n = 0;
+        if (auto q = db_.tryPrepare("SELECT count(*) FROM " + detail::quoteIdentifier(table)))
+            if ((*q)->tryStep().row()) n = static_cast<double>((*q)->getInt64(0));
+        return rows_[table] = n;
+    }
+
+    // Average rows sharing each prefix of `columns`, estimated from a sample:
+    // repeated values are assumed fully seen, near-unique ones to scale
+    std::vector<double> sampleStat(const std::string& table, const std::vector<std::string>& columns) {
+        double n = rowCount(table);
+        double sample = std::min<double>(n, static_cast<double>(options_.sampleRows));
+        std::vector<double> stat{n};
+        std::string list, key = table;
+        for (const auto& c : columns) {
+            list += (list.empty() ? "" : ", ") + detail::quoteIdentifier(c);
+            key += '\x1f' + c;
+            auto cached = distinct_.find(key);
+            double distinct = 0;
+            if (cached != distinct_.end()) {
+                distinct = cached->second;
+            } else {
+                auto q = db_.tryPrepare("SELECT count(*) FROM (SELECT DISTINCT " + list + " FROM (SELECT " + list +
+                                        " FROM " + detail::quoteIdentifier(table) + " LIMIT " +
+                                        std::to_string(options_.sampleRows) + "))");
+                if (q && (*q)->tryStep().row()) distinct = static_cast<double>((*q)->getInt64(0));
+                distinct_[key] = distinct;
+            }
+            double perValue = distinct <= 0 ? 1 : distinct * 10 < sample ? n / distinct : sample / distinct;
+            stat.push_back(std::max(1.0, std::ceil(perValue)));
+        }
+        return stat;
+    }
+
+    void setStat(const std::string& table, const std::string& index, const std::vector<double>& stat) {
+        std::string text;
+        for (double v : stat) text += (text.empty() ? "" : " ") + std::to_string(static_cast<int64_t>(v));
+        auto ins = scratch_->prepare("INSERT INTO sqlite_stat1(tbl, idx, stat) VALUES (?, ?, ?)");
+        ins->bindText(1, table);
+        if (index.empty()) sqlite3_bind_null(ins->get(), 2);
+        else ins->bindText(2, index);
+        ins->bindText(3, text);
+        ins->tryStep();
+        if (!index.empty()) stats_[index] = stat;
+    }
+
+    // Copy of the schema (no data) with statistics describing the real data
+    void buildScratch() {
+        auto schema = db_.prepare("SELECT type, sql FROM sqlite_schema WHERE sql IS NOT NULL "
+                                  "AND name NOT LIKE 'sqlite\\_%' ESCAPE '\\' ORDER BY rowid");
+        while (schema->step())
+            if (schema->getText(0) != "trigger") scratch_->tryExecute(schema->getText(1));
+        scratch_->tryExecute("ANALYZE; DELETE FROM sqlite_stat1;");
+
+        std::unordered_map<std::string, std::string, detail::NoCaseHash, detail::NoCaseEqual> real;
+        if (catalog_->hasTable("sqlite_stat1")) {
+            auto q = db_.prepare("SELECT idx, stat FROM sqlite_stat1 WHERE idx IS NOT NULL");
+            while (q->step()) real[q->getText(0)] = q->getText(1);
+        }
+        for (const auto& [name, table] : catalog_->tables()) {
+            if (table.view || name.compare(0, 7, "sqlite_") == 0) continue;
+            if (table.indexes.empty()) setStat(name, "", {rowCount(name)});
+            for (const auto& ixName : table.indexes) {
+                const SchemaCatalog::Index* ix = catalog_->index(ixName);
+                auto it = real.find(ixName);
+                std::vector<double> stat;
+                if (it != real.end()) {
+                    const char* p = it->second.c_str();
+                    char* end = nullptr;
+                    for (double v = std::strtod(p, &end); end != p; v = std::strtod(p, &end)) {
+                        stat.push_back(v);
+                        p = end;
+                    }
+                    rows_[name] = stat.empty() ? rowCount(name) : stat[0];
+                } else if (std::find(ix->columns.begin(), ix->columns.end(), "") == ix->columns.end()) {
+                    stat = sampleStat(name, ix->columns);
+                }
+                if (!stat.empty()) setStat(name, ixName, stat);
+            }
+        }
+        scratch_->tryExecute("ANALYZE sqlite_schema;");
+    }
+
+    // Aliases and table names of the FROM/JOIN/UPDATE/DELETE targets
+    std::unordered_map<std::string, std::string, detail::NoCaseHash, detail::NoCaseEqual>
+    tablesOf(const std::vector<detail::SqlToken>& t) {
+        using detail::sqlKeyword;
+        static const char* const notAlias[] = {"WHERE", "JOIN", "INNER", "LEFT", "RIGHT", "FULL", "OUTER", "CROSS",
+                                               "NATURAL", "ON", "USING", "ORDER", "GROUP", "HAVING", "LIMIT", "WINDOW",
+                                               "UNION", "EXCEPT", "INTERSECT", "SET", "INDEXED", "NOT", "RETURNING", "VALUES"};
+        auto isName = [&](size_t i) {
+            if (i >= t.size() || (t[i].kind != detail::SqlToken::Word && t[i].kind != detail::SqlToken::Quoted)) return false;
+            for (const char* k : notAlias)
+                if (sqlKeyword(t[i], k)) return false;
+            return true;
+        };
+        std::unordered_map<std::string, std::string, detail::NoCaseHash, detail::NoCaseEqual> out;
+        for (size_t i = 0; i < t.size(); ++i) {
+            bool target = sqlKeyword(t[i], "FROM") || sqlKeyword(t[i], "JOIN") || sqlKeyword(t[i], "UPDATE") ||
+                          sqlKeyword(t[i], "INTO");
+            while (target) {
+                size_t j = i + 1;
+                if (sqlKeyword(t[i], "UPDATE") && j + 1 < t.size() && sqlKeyword(t[j], "OR")) j += 2;
+                if (!isName(j)) break;
+                if (j + 2 < t.size() && t[j + 1].text == "." && isName(j + 2)) j += 2;   // schema.table
+                std::string table = detail::sqlIdentifier(t[j]);
+                if (!catalog_->table(table)) break;
+                out[table] = table;
+                size_t k = j + 1;
+                if (k < t.size() && sqlKeyword(t[k], "AS")) ++k;
+                if (isName(k) && !catalog_->table(detail::sqlIdentifier(t[k]))) { out[detail::sqlIdentifier(t[k])] = table; ++k; }
+                i = k - 1;
+                target = k < t.size() && t[k].text == ",";
+                if (target) i = k;
+            }
+        }
+        return out;
+    }
+
+    bool classifyWrite(const std::vector<detail::SqlToken>& t, uint64_t calls, std::vector<Write>& writes) {
+        using detail::sqlKeyword;
+        bool insert = sqlKeyword(t[0], "INSERT") || sqlKeyword(t[0], "REPLACE");
+        bool update = sqlKeyword(t[0], "UPDATE");
+        bool remove = sqlKeyword(t[0], "DELETE");
+        if (!insert && !update && !remove) return false;
+        auto tables = tablesOf(t);
+        for (size_t i = 0; i < t.size(); ++i) {
+            if (!(insert ? sqlKeyword(t[i], "INTO") : update ? sqlKeyword(t[i], "UPDATE") : sqlKeyword(t[i], "FROM"))) continue;
+            size_t j = i + 1;
+            if (update && j + 1 < t.size() && sqlKeyword(t[j], "OR")) j += 2;
+            if (j + 2 < t.size() && t[j + 1].text == ".") j += 2;
+            if (j >= t.size()) break;
+            Write w;
+            w.table = detail::sqlIdentifier(t[j]);
+            w.update = update;
+            w.calls = static_cast<double>(calls);
+            if (update) {
+                bool inSet = false;
+                for (size_t k = j; k < t.size() && !sqlKeyword(t[k], "WHERE") && !sqlKeyword(t[k], "FROM"); ++k) {
+                    if (sqlKeyword(t[k], "SET")) inSet = true;
+                    else if (inSet && k + 1 < t.size() && t[k + 1].text == "=" && catalog_->column(w.table, detail::sqlIdentifier(t[k])))
+                        w.columns.push_back(detail::sqlIdentifier(t[k]));
+                }
+            }
+            writes.push_back(std::move(w));
+            break;
+        }
+        // UPDATE and DELETE also read: their WHERE clauses may want an index
+        return insert;
+    }
+
+    // Columns each table is filtered (equality / range), joined or sorted on
+    std::unordered_map<std::string, Usage, detail::NoCaseHash, detail::NoCaseEqual>
+    usageOf(const std::vector<detail::SqlToken>& t,
+            const std::unordered_map<std::string, std::string, detail::NoCaseHash, detail::NoCaseEqual>& tables) {
+        using detail::sqlKeyword;
+        std::unordered_map<std::string, Usage, detail::NoCaseHash, detail::NoCaseEqual> out;
+        auto add = [](std::vector<std::string>& v, const std::string& c) {
+            for (const auto& x : v) if (detail::NoCaseEqual()(x, c)) return;
+            v.push_back(c);
+        };
+        auto isOp = [&](size_t i, std::initializer_list<const char*> ops) {
+            if (i >= t.size()) return false;
+            for (const char* op : ops)
+                if (t[i].text == op || sqlKeyword(t[i], op)) return true;
+            return false;
+        };
+        bool inSet = false, inOrder = false;
+        for (size_t i = 0; i < t.size(); ++i) {
+            if (sqlKeyword(t[i], "SET")) inSet = true;
+            if (sqlKeyword(t[i], "WHERE")) inSet = false;
+            if ((sqlKeyword(t[i], "ORDER") || sqlKeyword(t[i], "GROUP")) && i + 1 < t.size() && sqlKeyword(t[i + 1], "BY")) inOrder = true;
+            if (sqlKeyword(t[i], "LIMIT") || sqlKeyword(t[i], "HAVING") || t[i].text == ")") inOrder = false;
+            if (inSet || (t[i].kind != detail::SqlToken::Word && t[i].kind != detail::SqlToken::Quoted)) continue;
+            if (i + 1 < t.size() && (t[i + 1].text == "." || t[i + 1].text == "(")) continue;
+            std::string column = detail::sqlIdentifier(t[i]);
+            std::string qualifier;
+            size_t before = i;
+            if (i >= 2 && t[i - 1].text == ".") {
+                qualifier = detail::sqlIdentifier(t[i - 2]);
+                before = i - 2;
+            }
+            bool eq = isOp(i + 1, {"=", "==", "IN"}) || (isOp(i + 1, {"IS"}) && !isOp(i + 2, {"NOT"})) ||
+                      (before > 0 && isOp(before - 1, {"=", "=="}));
+            bool range = isOp(i + 1, {"<", ">", "<=", ">=", "BETWEEN", "LIKE", "GLOB"}) ||
+                         (before > 0 && isOp(before - 1, {"<", ">", "<=", ">="}));
+            if (!eq && !range && !inOrder) continue;
+            for (const auto& [alias, table] : tables) {
+                if (!qualifier.empty() ? !sameName(alias, qualifier) : !sameName(alias, table)) continue;
+                if (!catalog_->column(table, column)) continue;
+                Usage& u = out[table];
+                if (eq) add(u.eq, column);
+                else if (range) add(u.range, column);
+                else add(u.order, column);
+            }
+        }
+        return out;
+    }
+
+    // Estimated rows visited by the plan; indexes it uses are appended to `used`
+    double planCost(const std::string& sql,
+                    const std::unordered_map<std::string, std::string, detail::NoCaseHash, detail::NoCaseEqual>& tables,
+                    std::vector<std::string>& used, bool& ok) {
+        auto q = scratch_->tryPrepare("EXPLAIN QUERY PLAN " + sql);
+        ok = q.ok();
+        if (!ok) return 0;
+        std::unordered_map<int, double> loops;   // parent id -> rows produced by the enclosing loops
+        double cost = 0;
+        while ((*q)->tryStep().row()) {
+            int parent = (*q)->getInt(1);
+            std::string detail = (*q)->getText(3);
+            double& outer = loops.emplace(parent, 1.0).first->second;
+            if (detail.compare(0, 15, "USE TEMP B-TREE") == 0) {
+                cost += outer * std::log2(outer + 1);
+                continue;
+            }
+            bool search = detail.compare(0, 7, "SEARCH ") == 0;
+            if (!search && detail.compare(0, 5, "SCAN ") != 0) continue;
+            size_t nameStart = search ? 7 : 5;
+            std::string name = detail.substr(nameStart, detail.find(' ', nameStart) - nameStart);
+            auto t = tables.find(name);
+            double n = t != tables.end() ? rowCount(t->second) : catalog_->table(name) ? rowCount(name) : 1;
+            double rows = n;
+            size_t paren = detail.find(" (");
+            std::string terms = paren == std::string::npos ? "" : detail.substr(paren);
+            size_t at = detail.find("INDEX ");
+            if (detail.find("INTEGER PRIMARY KEY") != std::string::npos) {
+                rows = terms.find("=?") != std::string::npos ? 1 : n / 4;
+            } else if (at != std::string::npos) {
+                size_t idxStart = at + 6;
+                std::string index = detail.substr(idxStart, detail.find(' ', idxStart) - idxStart);
+                if (detail.find("AUTOMATIC") != std::string::npos) {
+                    cost += n;   // built for this statement
+                    rows = 10;
+                } else if (search) {
+                    size_t eqTerms = 0;
+                    for (size_t p = terms.find("=?"); p != std::string::npos; p = terms.find("=?", p + 2)) ++eqTerms;
+                    bool hasRange = terms.find('>') != std::string::npos || terms.find('<') != std::string::npos;
+                    auto st = stats_.find(index);
+                    if (eqTerms == 0) rows = n;
+                    else if (st != stats_.end() && st->second.size() > 1) rows = st->second[std::min(eqTerms, st->second.size() - 1)];
+                    else rows = 10;
+                    if (hasRange) rows = std::max(1.0, rows / 4);
+                }
+                used.push_back(index);
+            }
+            cost += outer * rows;
+            outer *= std::max(1.0, rows);
+        }
+        return cost;
+    }
+
+    void adviseStatement(const QueryProfiler::Entry& entry, const std::vector<detail::SqlToken>& tokens,
+                         std::vector<Suggestion>& found) {
+        auto tables = tablesOf(tokens);
+        if (tables.empty()) return;
+        std::vector<std::string> used;
+        bool ok = false;
+        double base = planCost(entry.sql, tables, used, ok);
+        if (!ok || base <= 1) return;
+
+        Suggestion best;
+        for (auto& [table, usage] : usageOf(tokens, tables)) {
+            // Most selective equality columns first
+            std::vector<std::pair<double, std::string>> ranked;
+            for (const auto& c : usage.eq) ranked.push_back({sampleStat(table, {c}).back(), c});
+            std::sort(ranked.begin(), ranked.end());
+            std::vector<std::string> eq;
+            for (size_t i = 0; i < ranked.size() && i < options_.maxColumns; ++i) eq.push_back(ranked[i].second);
+
+            std::vector<std::vector<std::string>> candidates;
+            auto with = [&](std::vector<std::string> cols, const std::vector<std::string>& tail) {
+                for (const auto& c : tail)
+                    if (cols.size() < options_.maxColumns && std::find(cols.begin(), cols.end(), c) == cols.end()) cols.push_back(c);
+                if (!cols.empty() && std::find(candidates.begin(), candidates.end(), cols) == candidates.end()) candidates.push_back(cols);
+            };
+            with(eq, {});
+            if (!usage.range.empty()) with(eq, {usage.range[0]});
+            with(eq, usage.order);
+            for (const auto& c : eq) with({c}, {});
+            for (const auto& c : usage.range) with({c}, {});
+            with({}, usage.order);
+
+            for (const auto& cols : candidates) {
+                if (coveredByExisting(table, cols)) continue;
+                double cost = tryIndex(entry.sql, tables, table, cols);
+                double benefit = (base - cost) * static_cast<double>(entry.calls);
+                if (benefit > best.benefit) {
+                    best.table = table;
+                    best.columns = cols;
+                    best.benefit = benefit;
+                }
+            }
+        }
+        if (best.benefit <= 0) return;
+        best.queries.push_back(entry.sql);
+        for (auto& s : found) {
+            if (sameName(s.table, best.table) && s.columns == best.columns) {
+                s.benefit += best.benefit;
+                s.queries.push_back(entry.sql);
+                return;
+            }
+        }
+        found.push_back(std::move(best));
+    }
+
+    bool coveredByExisting(const std::string& table, const std::vector<std::string>& cols) {
+        const SchemaCatalog::Table* t = catalog_->table(table);
+        for (const auto& name : t->indexes) {
+            const SchemaCatalog::Index* ix = catalog_->index(name);
+            if (ix->partial || ix->columns.size() < cols.size()) continue;
+            if (std::equal(cols.begin(), cols.end(), ix->columns.begin(), sameName)) return true;
+        }
+        return false;
+    }
+
+    // Plan cost with a hypothetical index in place, or infinity if the plan ignores it
+    double tryIndex(const std::string& sql,
+                    const std::unordered_map<std::string, std::string, detail::NoCaseHash, detail::NoCaseEqual>& tables,
+                    const std::string& table, const std::vector<std::string>& cols) {
+        std::string name = "rdb_advisor_" + std::to_string(++hypothetical_);
+        std::string list;
+        for (const auto& c : cols) list += (list.empty() ? "" : ", ") + detail::quoteIdentifier(c);
+        if (!scratch_->tryExecute("CREATE INDEX " + name + " ON " + detail::quoteIdentifier(table) + "(" + list + ");"))
+            return std::numeric_limits<double>::infinity();
+        setStat(table, name, sampleStat(table, cols));
+        scratch_->tryExecute("ANALYZE sqlite_schema;");
+
+        std::vector<std::string> used;
+        bool ok = false;
+        double cost = planCost(sql, tables, used, ok);
+        bool usesIt = std::find(used.begin(), used.end(), name) != used.end();
+
+        scratch_->tryExecute("DROP INDEX " + name + "; DELETE FROM sqlite_stat1 WHERE idx = '" + name + "'; ANALYZE sqlite_schema;");
+        stats_.erase(name);
+        return ok && usesIt ? cost : std::numeric_limits<double>::infinity();
+    }
+};
+
+// ---------------------------------
+// Incremental vacuum
+// ---------------------------------
+
+// Returns free pages to the filesystem a slice at a time, from a
+// background thread with its own connection, instead of a full VACUUM
+// that rewrites the file under an exclusive lock. The database must use
+// auto_vacuum=INCREMENTAL (see enable()).
+//
+// Slices only run once no other connection has committed for idleAfter
+// (tracked through PRAGMA data_version), each is one short write
+// transaction of PRAGMA incremental_vacuum(N), and N adapts so a slice
+// stays within sliceBudget; a writer that arrives meanwhile waits at most
+// about that long. In WAL mode the file shrinks when the WAL is next
+// checkpointed.
+//
+//   IncrementalVacuum::enable(db);          // once; may run a full VACUUM
+//   IncrementalVacuum vacuum("app.db");
+//   auto s = vacuum.stats();                // freelistPages, reclaimedPages, ...
+class IncrementalVacuum {
+public:
+    struct Options {
+        std::chrono::milliseconds sliceBudget{10};
+        std::chrono::milliseconds idleAfter{1000};
+        std::chrono::milliseconds interval{250};   // how often to look for work
+        int64_t minFreePages = 64;                 // leave smaller freelists alone
+        int initialPages = 256;
+    };
+
+    struct Stats {
+        bool incremental = false;                  // auto_vacuum is INCREMENTAL
+        int64_t pageCount = 0;
+        int64_t freelistPages = 0;
+        int64_t reclaimedPages = 0;
+        int64_t slices = 0;
+        int pagesPerSlice = 0;
+        std::chrono::microseconds longestSlice{0};
+        std::string error;
+    };
+
+    // Switch a database to auto_vacuum=INCREMENTAL. A database that already
+    // has tables and used auto_vacuum=NONE needs one full VACUUM for the
+    // change to take effect; returns true if that was run.
+    static bool enable(Database& db) {
+        auto mode = db.prepare("PRAGMA auto_vacuum;");
+        int current = mode->step() ? mode->getInt(0) : 0;
+        mode.reset();
+        if (current == 2) return false;
+        db.execute("PRAGMA auto_vacuum=INCREMENTAL;");
+        auto pages = db.prepare("PRAGMA page_count;");
+        bool populated = pages->step() && pages->getInt64(0) > 1;
+        pages.reset();
+        if (current == 0 && populated) {
+            db.execute("VACUUM;");
+            return true;
+        }
+        return false;
+    }
+
+    explicit IncrementalVacuum(const std::string& filename) : IncrementalVacuum(filename, Options()) {}
+    IncrementalVacuum(const std::string& filename, Options options)
+        : filename_(filename), options_(options) {
+        thread_ = std::thread([this] { run(); });
+    }
+
+    ~IncrementalVacuum() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        thread_.join();
+    }
+
+    IncrementalVacuum(const IncrementalVacuum&) = delete;
+    IncrementalVacuum& operator=(const IncrementalVacuum&) = delete;
+
+    Stats stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+private:
+    std::string filename_;
+    Options options_;
+    mutable std::mutex mutex_;
+    std::condition_variable wake_;
+    bool stopping_ = false;
+    Stats stats_;
+    std::thread thread_;
+
+    // Sleep for d; false if stopping
+    bool pause(std::chrono::steady_clock::duration d) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return !wake_.wait_for(lock, d, [this] { return stopping_; });
+    }
+
+    void fail(const std::string& message) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.error = message;
+    }
+
+    static int64_t pragma(Statement& stmt) {
+        int64_t v = stmt.tryStep().row() ? stmt.getInt64(0) : 0;
+        stmt.reset();
+        return v;
+    }
+
+    void run() {
+        auto opened = Database::tryOpen(filename_);
+        if (!opened) return fail(opened.status().message());
+        Database& db = *opened;
+        // Give way quickly to writers rather than queueing behind them
+        db.setBusyTimeout(static_cast<int>(options_.sliceBudget.count()));
+        auto mode = db.tryPrepare("PRAGMA auto_vacuum;");
+        auto version = db.tryPrepare("PRAGMA data_version;");
+        auto freelist = db.tryPrepare("PRAGMA freelist_count;");
+        auto pages = db.tryPrepare("PRAGMA page_count;");
+        if (!mode || !version || !freelist || !pages) return fail(db.errorMessage());
+
+        int perSlice = std::max(1, options_.initialPages);
+        int64_t lastVersion = pragma(**version);
+        auto lastActivity = std::chrono::steady_clock::now();
+        auto interval = options_.interval;
+
+        while (pause(interval)) {
+            interval = options_.interval;
+            auto now = std::chrono::steady_clock::now();
+            int64_t v = pragma(**version);
+            if (v != lastVersion) {
+                lastVersion = v;
+                lastActivity = now;
+            }
+            bool incremental = pragma(**mode) == 2;
+            int64_t free = pragma(**freelist);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stats_.incremental = incremental;
+                stats_.freelistPages = free;
+                stats_.pageCount = pragma(**pages);
+                stats_.pagesPerSlice = perSlice;
+            }
+            if (!incremental || free < options_.minFreePages || now - lastActivity < options_.idleAfter) continue;
+
+            auto start = std::chrono::steady_clock::now();
+            Status st = db.tryExecute("PRAGMA incremental_vacuum(" + std::to_string(perSlice) + ");");
+            auto took = std::chrono::steady_clock::now() - start;
+            if (st.busy()) continue;   // someone is writing: not idle after all
+            if (!st) return fail(db.errorMessage());
+
+            int64_t after = pragma(**freelist);
+            // Keep slices inside the budget: halve when over, grow when well under
+            if (took > options_.sliceBudget) perSlice = std::max(1, perSlice / 2);
+            else if (took < options_.sliceBudget / 2) perSlice = std::min(perSlice * 2, 1 << 20);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stats_.reclaimedPages += free - after;
+                stats_.freelistPages = after;
+                stats_.pageCount = pragma(**pages);
+                stats_.slices++;
+                stats_.pagesPerSlice = perSlice;
+                stats_.longestSlice = std::max(stats_.longestSlice,
+                                               std::chrono::duration_cast<std::chrono::microseconds>(took));
+            }
+            // More to do: come back after a gap as long as the slice, so the
+            // vacuum holds the write lock at most half the time
+            if (after >= options_.minFreePages) interval = std::chrono::duration_cast<std::chrono::milliseconds>(took) + std::chrono::milliseconds(1);
+            lastVersion = pragma(**version);
+        }
+    }
+};
+
+// ---------------------------------
+// Workload capture
+// ---------------------------------
+
+// A bound parameter value as captured
+struct WorkloadValue {
+    enum Type : uint8_t { Null, Integer, Real, Text, Blob } type = Null;
+    int64_t i = 0;
+    double d = 0;
+    std::string bytes;   // Text and Blob
+
+    void bind(Statement& stmt, int index) const {
+        sqlite3_stmt* s = stmt.get();
+        switch (type) {
+        case Integer: sqlite3_bind_int64(s, index, i); break;
+        case Real: sqlite3_bind_double(s, index, d); break;
+        case Text: sqlite3_bind_text(s, index, bytes.data(), static_cast<int>(bytes.size()), SQLITE_TRANSIENT); break;
+        case Blob: sqlite3_bind_blob(s, index, bytes.data(), static_cast<int>(bytes.size()), SQLITE_TRANSIENT); break;
+        default: sqlite3_bind_null(s, index); break;
+        }
+    }
+};
+
+// One statement execution: SQL is interned, times are nanoseconds from
+// when the log was opened
+struct WorkloadEvent {
+    uint32_t statement = 0;    // index into Workload::statements
+    uint32_t connection = 0;
+    uint32_t thread = 0;
+    uint64_t startNs = 0;
+    uint64_t durationNs = 0;
+    std::vector<WorkloadValue> params;   // by parameter index - 1
+};
+
+// A capture file read back, e.g. for replay
+struct Workload {
+    std::vector<std::string> statements;
+    std::vector<WorkloadEvent> events;   // in completion order
+    uint32_t connections = 0;
+    uint32_t threads = 0;
+
+    // False if this is not a workload log; a truncated last record (the
+    // writer died) is dropped
+    bool load(std::istream& in) {
+        char magic[8];
+        if (!in.read(magic, 8) || std::memcmp(magic, "RDBWLOG1", 8) != 0) return false;
+        statements.clear();
+        events.clear();
+        connections = threads = 0;
+        char tag;
+        while (in.get(tag)) {
+            if (tag == 'S') {
+                uint32_t id, len;
+                if (!detail::readPod(in, id) || !detail::readPod(in, len) || id != statements.size()) break;
+                std::string sql(len, '\0');
+                if (!in.read(&sql[0], len)) break;
+                statements.push_back(std::move(sql));
+            } else if (tag == 'E') {
+                WorkloadEvent e;
+                uint16_t count;
+                if (!detail::readPod(in, e.statement) || !detail::readPod(in, e.connection) ||
+                    !detail::readPod(in, e.thread) || !detail::readPod(in, e.startNs) ||
+                    !detail::readPod(in, e.durationNs) || !detail::readPod(in, count) ||
+                    e.statement >= statements.size())
+                    break;
+                e.params.resize(count);
+                bool ok = true;
+                for (auto& v : e.params) {
+                    uint8_t type;
+                    if (!(ok = detail::readPod(in, type) && type <= WorkloadValue::Blob)) break;
+                    v.type = static_cast<WorkloadValue::Type>(type);
+                    if (v.type == WorkloadValue::Integer) ok = detail::readPod(in, v.i);
+                    else if (v.type == WorkloadValue::Real) ok = detail::readPod(in, v.d);
+                    else if (v.type != WorkloadValue::Null) {
+                        uint32_t len;
+                        ok = detail::readPod(in, len);
+                        if (ok) {
+                            v.bytes.resize(len);
+                            ok = len == 0 || static_cast<bool>(in.read(&v.bytes[0], len));
+                        }
+                    }
+                    if (!ok) break;
+                }
+                if (!ok) break;
+                connections = std::max(connections, e.connection + 1);
+                threads = std::max(threads, e.thread + 1);
+                events.push_back(std::move(e));
+            } else {
+                break;
+            }
+        }
+        return true;
+    }
+};
+
+// Append-only capture file shared by any number of connections and
+// threads. Records are
+//   'S' id:u32 length:u32 sql            first sighting of a statement
+//   'E' statement:u32 connection:u32 thread:u32 startNs:u64 durationNs:u64
+//       count:u16 { type:u8 value }      one execution
+// in native byte order, after an 8-byte "RDBWLOG1" header; integers and
+// reals are stored raw, text and blobs with a u32 length.
+class WorkloadLog {
+public:
+    explicit WorkloadLog(const std::string& path)
+        : out_(path, std::ios::binary | std::ios::trunc), epoch_(std::chrono::steady_clock::now()) {
+        if (!out_) RDB_THROW(SQLiteException("Cannot open workload log: " + path));
+        out_.write("RDBWLOG1", 8);
+    }
+
+    ~WorkloadLog() { flush(); }
+
+    WorkloadLog(const WorkloadLog&) = delete;
+    WorkloadLog& operator=(const WorkloadLog&) = delete;
+
+    void flush() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        out_.flush();
+    }
+
+    uint64_t events() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return events_;
+    }
+
+    uint64_t nowNs() const {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - epoch_).count());
+    }
+
+    uint32_t newConnection() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return connections_++;
+    }
+
+    // Id for a statement's SQL, writing it out the first time
+    uint32_t intern(const std::string& sql) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto [it, added] = statements_.emplace(sql, static_cast<uint32_t>(statements_.size()));
+        if (added) {
+            out_.put('S');
+            detail::writePod(out_, it->second);
+            detail::writePod(out_, static_cast<uint32_t>(sql.size()));
+            out_.write(sql.data(), static_cast<std::streamsize>(sql.size()));
+        }
+        return it->second;
+    }
+
+    // e.thread is filled in from the calling thread
+    void append(WorkloadEvent& e) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        e.thread = threads_.emplace(std::this_thread::get_id(), static_cast<uint32_t>(threads_.size())).first->second;
+        out_.put('E');
+        detail::writePod(out_, e.statement);
+        detail::writePod(out_, e.connection);
+        detail::writePod(out_, e.thread);
+        detail::writePod(out_, e.startNs);
+        detail::writePod(out_, e.durationNs);
+        detail::writePod(out_, static_cast<uint16_t>(e.params.size()));
+        for (const auto& v : e.params) {
+            detail::writePod(out_, static_cast<uint8_t>(v.type));
+            if (v.type == WorkloadValue::Integer) detail::writePod(out_, v.i);
+            else if (v.type == WorkloadValue::Real) detail::writePod(out_, v.d);
+            else if (v.type != WorkloadValue::Null) {
+                detail::writePod(out_, static_cast<uint32_t>(v.bytes.size()));
+                out_.write(v.bytes.data(), static_cast<std::streamsize>(v.bytes.size()));
+            }
+        }
+        ++events_;
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::ofstream out_;
+    std::chrono::steady_clock::time_point epoch_;
+    std::unordered_map<std::string, uint32_t> statements_;
+    std::unordered_map<std::thread::id, uint32_t> threads_;
+    uint32_t connections_ = 0;
+    uint64_t events_ = 0;
+};
+
+// Records every statement a connection runs into a WorkloadLog, with its
+// parameter values, start time, duration and thread, for replay by
+// tools/rdb_replay.cpp. SQLite has no call to read bound values back, so
+// they are recovered from sqlite3_expanded_sql(), lexed against the
+// statement's own text: integers, text and blobs come back exactly, reals
+// to 15 significant digits. Capture costs an expansion and a lex per
+// parameterised execution, so it is meant for test and staging runs.
+//
+//   WorkloadLog log("workload.rdbw");
+//   WorkloadCapture capture(db, log);       // or dbconnect.capture(&log)
+//   ... run the workload ...
+class WorkloadCapture {
+public:
+    WorkloadCapture(Database& db, WorkloadLog& log) : db_(db), log_(log), connection_(log.newConnection()) {
+        listener_ = db_.addTraceListener(SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE, [this](unsigned type, void* p, void* x) {
+            auto stmt = static_cast<sqlite3_stmt*>(p);
+            if (type == SQLITE_TRACE_PROFILE) return record(stmt);
+            // Trigger programs report as "-- TRIGGER name"; they belong to
+            // the statement that fired them
+            auto text = static_cast<const char*>(x);
+            if (text && text[0] == '-' && text[1] == '-') return;
+            running_[stmt] = log_.nowNs();
+        });
+    }
+
+    ~WorkloadCapture() { db_.removeListener(listener_); }
+
+    WorkloadCapture(const WorkloadCapture&) = delete;
+    WorkloadCapture& operator=(const WorkloadCapture&) = delete;
+
+private:
+    // Per distinct SQL text: for each token, the parameter index it binds
+    // (0 for anything else), so expanded text can be matched up
+    struct Cached {
+        std::string raw;
+        uint32_t id = 0;
+        int params = 0;
+        std::vector<int> slots;
+    };
+
+    Database& db_;
+    WorkloadLog& log_;
+    uint32_t connection_;
+    int listener_ = 0;
+    std::unordered_map<const char*, Cached> byText_;
+    std::unordered_map<sqlite3_stmt*, uint64_t> running_;
+
+    void record(sqlite3_stmt* stmt) {
+        uint64_t end = log_.nowNs();
+        auto started = running_.find(stmt);
+        if (started == running_.end()) return;
+        WorkloadEvent e;
+        e.connection = connection_;
+        e.startNs = started->second;
+        e.durationNs = end - started->second;
+        running_.erase(started);
+
+        const char* text = sqlite3_sql(stmt);
+        if (!text) return;
+        auto cached = byText_.find(text);
+        if (cached == byText_.end() || cached->second.raw != text) {
+            Cached c;
+            c.raw = text;
+            c.id = log_.intern(c.raw);
+            c.params = sqlite3_bind_parameter_count(stmt);
+            int highest = 0;
+            for (const auto& t : detail::tokenizeSql(c.raw)) {
+                int slot = 0;
+                if (t.kind == detail::SqlToken::Param) {
+                    // Bare ? takes the next free index; ?NNN and names are looked up
+                    slot = t.text.size() == 1 ? highest + 1 : sqlite3_bind_parameter_index(stmt, std::string(t.text).c_str());
+                    highest = std::max(highest, slot);
+                }
+                c.slots.push_back(slot);
+            }
+            if (byText_.size() >= detail::kSqlTextCacheLimit) byText_.clear();
+            cached = byText_.insert_or_assign(text, std::move(c)).first;
+        }
+        const Cached& c = cached->second;
+        e.statement = c.id;
+        if (c.params > 0) {
+            e.params.resize(static_cast<size_t>(c.params));
+            if (char* expanded = sqlite3_expanded_sql(stmt)) {
+                extract(c, expanded, e.params);
+                sqlite3_free(expanded);
+            }
+        }
+        log_.append(e);
+    }
+
+    // Walk the expanded text alongside the original: tokens match one for
+    // one except where a parameter became a literal
+    static void extract(const Cached& c, std::string_view expanded, std::vector<WorkloadValue>& out) {
+        auto tokens = detail::tokenizeSql(expanded);
+        size_t t = 0;
+        for (int slot : c.slots) {
+            if (t >= tokens.size()) return;
+            if (!slot) { ++t; continue; }
+            WorkloadValue v;
+            const detail::SqlToken* tok = &tokens[t++];
+            bool negative = false;
+            if (tok->kind == detail::SqlToken::Op && tok->text == "-" && t < tokens.size()) {
+                negative = true;
+                tok = &tokens[t++];
+            }
+            std::string s(tok->text);
+            if (tok->kind == detail::SqlToken::Number) {
+                if (s.find_first_of(".eE") == std::string::npos) {
+                    v.type = WorkloadValue::Integer;
+                    // Via unsigned so INT64_MIN's magnitude survives
+                    uint64_t u = std::strtoull(s.c_str(), nullptr, 10);
+                    v.i = static_cast<int64_t>(negative ? 0 - u : u);
+                } else {
+                    v.type = WorkloadValue::Real;
+                    v.d = std::strtod(s.c_str(), nullptr);
+                    if (negative) v.d = -v.d;
+                }
+            } else if (tok->kind == detail::SqlToken::String) {
+                v.type = WorkloadValue::Text;
+                for (size_t i = 1; i + 1 < s.size(); ++i) {
+                    v.bytes += s[i];
+                    if (s[i] == '\'') ++i;
+                }
+            } else if (tok->kind == detail::SqlToken::Blob) {
+                v.type = WorkloadValue::Blob;
+                for (size_t i = 2; i + 2 < s.size(); i += 2)
+                    v.bytes += static_cast<char>(std::strtol(s.substr(i, 2).c_str(), nullptr, 16));
+            } else if (detail::sqlKeyword(*tok, "zeroblob") && t + 2 < tokens.size()) {
+                // zeroblob(N)
+                v.type = WorkloadValue::Blob;
+                v.bytes.assign(static_cast<size_t>(std::strtoull(std::string(tokens[t + 1].text).c_str(), nullptr, 10)), '\0');
+                t += 3;
+            }
+            if (slot <= static_cast<int>(out.size())) out[static_cast<size_t>(slot - 1)] = std::move(v);
+        }
+    }
+};
+
+// ---------------------------------
+// Latency histograms
+// ---------------------------------
+
+// HDR-style histogram of nanosecond latencies: log-linear buckets, 64 per
+// power of two, so any recorded value is reported to within 1.6% from
+// 1 ns up to the 2^36 ns (about 69 s) ceiling; larger values land in the
+// last bucket. Percentiles report the top of the bucket, as HdrHistogram's
+// highest-equivalent value does, capped at the largest value seen. One
+// writer at a time: give each thread its own and merge() to report.
+//
+//   LatencyHistogram h;
+//   h.record(ns);
+//   h.percentile(99.9);
+class LatencyHistogram {
+public:
+    static constexpr int kSubBits = 6;
+    static constexpr int kMaxBits = 36;
+    static constexpr size_t kBuckets = static_cast<size_t>(kMaxBits - kSubBits + 1) << kSubBits;
+
+    static size_t bucketFor(uint64_t ns) {
+        constexpr uint64_t sub = uint64_t(1) << kSubBits;
+        if (ns < sub) return static_cast<size_t>(ns);
+        int top = 63 - detail::countLeadingZeros64(ns);
+        if (top >= kMaxBits) return kBuckets - 1;
+        int shift = top - kSubBits;
+        return (static_cast<size_t>(shift + 1) << kSubBits) + static_cast<size_t>((ns >> shift) - sub);
+    }
+
+    // Largest value that maps to bucket i
+    static uint64_t bucketHigh(size_t i) {
+        constexpr uint64_t sub = uint64_t(1) << kSubBits;
+        if (i < sub) return i;
+        int shift = static_cast<int>(i >> kSubBits) - 1;
+        uint64_t m = (i & (sub - 1)) + sub;
+        return ((m + 1) << shift) - 1;
+    }
+
+    LatencyHistogram() : counts_(kBuckets, 0) {}
+
+    void record(uint64_t ns) {
+        ++counts_[bucketFor(ns)];
+        ++count_;
+        sum_ += ns;
+        if (ns < min_) min_ = ns;
+        if (ns > max_) max_ = ns;
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < kBuckets; ++i) counts_[i] += other.counts_[i];
+        count_ += other.count_;
+        sum_ += other.sum_;
+        min_ = std::min(min_, other.min_);
+        max_ = std::max(max_, other.max_);
+    }
+
+    void reset() {
+        std::fill(counts_.begin(), counts_.end(), 0);
+        count_ = sum_ = max_ = 0;
+        min_ = UINT64_MAX;
+    }
+
+    uint64_t count() const { return count_; }
+    uint64_t min() const { return count_ ? min_ : 0; }
+    uint64_t max() const { return max_; }
+    uint64_t sum() const { return sum_; }
+    double mean() const { return count_ ? static_cast<double>(sum_) / static_cast<double>(count_) : 0; }
+
+    // p in [0, 100]
+    uint64_t percentile(double p) const {
+        if (!count_) return 0;
+        uint64_t rank = static_cast<uint64_t>(std::ceil(std::clamp(p, 0.0, 100.0) / 100.0 * static_cast<double>(count_)));
+        rank = std::max<uint64_t>(rank, 1);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; ++i) {
+            seen += counts_[i];
+            if (seen >= rank) return std::min(bucketHigh(i), max_);
+        }
+        return max_;
+    }
+
+    const std::vector<uint64_t>& counts() const { return counts_; }
+
+    // Add n values known only by their bucket (counts kept elsewhere);
+    // they count as the bucket's midpoint
+    void addBucket(size_t bucket, uint64_t n) {
+        uint64_t low = bucket ? bucketHigh(bucket - 1) + 1 : 0, high = bucketHigh(bucket);
+        counts_[bucket] += n;
+        count_ += n;
+        sum_ += n * (low + (high - low) / 2);
+        min_ = std::min(min_, low);
+        max_ = std::max(max_, high);
+    }
+
+private:
+    std::vector<uint64_t> counts_;
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t min_ = UINT64_MAX;
+    uint64_t max_ = 0;
+};
+
+// ---------------------------------
+// Statement latency
+// ---------------------------------
+namespace detail {
+
+// Single-writer histogram with the LatencyHistogram bucket layout whose
+// counts can be read from other threads. Rows of 64 buckets (one power of
+// two) are allocated the first time a value lands in them, so a histogram
+// costs ~0.5 KB per octave of latency actually seen.
+class AtomicHistogram {
+public:
+    static constexpr size_t kRowSize = size_t(1) << LatencyHistogram::kSubBits;
+    static constexpr size_t kRows = LatencyHistogram::kBuckets / kRowSize;
+
+    AtomicHistogram() {
+        for (auto& r : rows_) r.store(nullptr, std::memory_order_relaxed);
+    }
+    ~AtomicHistogram() {
+        for (auto& r : rows_) delete[] r.load(std::memory_order_relaxed);
+    }
+    AtomicHistogram(const AtomicHistogram&) = delete;
+    AtomicHistogram& operator=(const AtomicHistogram&) = delete;
+
+    // Owning thread only: a plain load and store, no read-modify-write
+    void record(uint64_t ns) {
+        size_t b = LatencyHistogram::bucketFor(ns);
+        auto& slot = rows_[b / kRowSize];
+        std::atomic<uint64_t>* row = slot.load(std::memory_order_relaxed);
+        if (!row) {
+            row = new std::atomic<uint64_t>[kRowSize];
+            for (size_t i = 0; i < kRowSize; ++i) row[i].store(0, std::memory_order_relaxed);
+            slot.store(row, std::memory_order_release);
+        }
+        auto& c = row[b % kRowSize];
+        c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    // Owning thread only
+    void clear() {
+        for (auto& r : rows_)
+            if (auto* row = r.load(std::memory_order_relaxed))
+                for (size_t i = 0; i < kRowSize; ++i) row[i].store(0, std::memory_order_relaxed);
+    }
+
+    // Any thread
+    void addTo(LatencyHistogram& h) const {
+        for (size_t r = 0; r < kRows; ++r)
+            if (auto* row = rows_[r].load(std::memory_order_acquire))
+                for (size_t i = 0; i < kRowSize; ++i)
+                    if (uint64_t n = row[i].load(std::memory_order_relaxed)) h.addBucket(r * kRowSize + i, n);
+    }
+
+private:
+    std::atomic<std::atomic<uint64_t>*> rows_[kRows];
+};
+
+} // namespace detail
+
+// Latency histograms for every statement run on the connections attached
+// to it with LatencyTracker, keyed by statement fingerprint (normalised SQL,
+// as QueryProfiler uses) and connection. Four latencies are kept, from the
+// Database timing listener:
+//   prepare   each prepare()/tryPrepare()
+//   step      each step()/tryStep()
+//   total     start of the first step to end of the last, including the
+//             caller's time between rows; for execute() scripts, the
+//             whole script
+//   commit    from the commit hook to the end of the statement or script
+//             that committed (COMMIT, or an autocommit write)
+// Recording never locks: each thread writes only its own shard (a fixed
+// open-addressed table of series, 4096 per thread), and snapshot() merges
+// the shards. reset() bumps a generation; each shard clears itself the next
+// time its thread records, and snapshots skip shards not yet cleared.
+//
+//   StatementLatency latency;
+//   LatencyTracker tracker(db, latency, "writer");
+//   ... run the workload ...
+//   for (auto& e : latency.snapshot())
+//       std::cout << e.sql << " p99 " << e.total.percentile(99) << " ns\n";
+class StatementLatency {
+public:
+    enum Metric { Prepare, Step, Total, Commit, MetricCount };
+
+    struct Entry {
+        uint64_t fingerprint = 0;
+        std::string sql;              // normalised
+        uint32_t connection = 0;      // UINT32_MAX when merged across connections
+        std::string connectionName;
+        LatencyHistogram prepare, step, total, commit;
+
+        LatencyHistogram& operator[](Metric m) {
+            return m == Prepare ? prepare : m == Step ? step : m == Total ? total : commit;
+        }
+        const LatencyHistogram& operator[](Metric m) const { return const_cast<Entry&>(*this)[m]; }
+    };
+
+    StatementLatency() : id_(nextRegistryId()) {}
+
+    StatementLatency(const StatementLatency&) = delete;
+    StatementLatency& operator=(const StatementLatency&) = delete;
+
+    uint32_t newConnection(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        connectionNames_.push_back(name);
+        return static_cast<uint32_t>(connectionNames_.size() - 1);
+    }
+
+    // Called by LatencyTracker once per distinct statement text
+    void describe(uint64_t fingerprint, std::string sql) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        statements_.emplace(fingerprint, std::move(sql));
+    }
+
+    // Hot path: record into the calling thread's shard
+    void record(uint64_t fingerprint, uint32_t connection, Metric m, uint64_t ns) {
+        Shard& s = shard();
+        uint64_t generation = generation_.load(std::memory_order_relaxed);
+        if (s.generation.load(std::memory_order_relaxed) != generation) {
+            for (auto& slot : s.slots)
+                if (Series* series = slot.series.load(std::memory_order_relaxed))
+                    for (auto& h : series->metrics) h.clear();
+            s.generation.store(generation, std::memory_order_release);
+        }
+        if (Series* series = find(s, fingerprint, connection)) series->metrics[m].record(ns);
+        else s.dropped.store(s.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    // Per statement and connection; byStatement merges connections
+    std::vector<Entry> snapshot(bool byStatement = false) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t generation = generation_.load(std::memory_order_relaxed);
+        std::vector<Entry> out;
+        std::unordered_map<uint64_t, size_t> index;   // (fingerprint, connection) hashed
+        for (const auto& s : shards_) {
+            if (s->generation.load(std::memory_order_acquire) != generation) continue;
+            for (const auto& slot : s->slots) {
+                const Series* series = slot.series.load(std::memory_order_acquire);
+                if (!series) continue;
+                uint32_t connection = byStatement ? UINT32_MAX : series->connection;
+                auto [it, added] = index.emplace(series->fingerprint ^ (uint64_t(connection) * 0x9E3779B97F4A7C15ULL), out.size());
+                if (added) {
+                    Entry e;
+                    e.fingerprint = series->fingerprint;
+                    e.connection = connection;
+                    auto sql = statements_.find(series->fingerprint);
+                    if (sql != statements_.end()) e.sql = sql->second;
+                    if (connection < connectionNames_.size()) e.connectionName = connectionNames_[connection];
+                    out.push_back(std::move(e));
+                }
+                for (int m = 0; m < MetricCount; ++m)
+                    series->metrics[m].addTo(out[it->second][static_cast<Metric>(m)]);
+            }
+        }
+        // Series cleared by a reset and not used since
+        out.erase(std::remove_if(out.begin(), out.end(), [](const Entry& e) {
+            return !e.prepare.count() && !e.step.count() && !e.total.count() && !e.commit.count();
+        }), out.end());
+        // Slowest (total time) first
+        std::sort(out.begin(), out.end(), [](const Entry& a, const Entry& b) {
+            return a.total.mean() * static_cast<double>(a.total.count()) > b.total.mean() * static_cast<double>(b.total.count());
+        });
+        return out;
+    }
+
+    // Start counting afresh; recording threads clear their shards lazily
+    void reset() { generation_.fetch_add(1, std::memory_order_relaxed); }
+
+    // Records lost because a thread's table was full
+    uint64_t dropped() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t n = 0;
+        for (const auto& s : shards_) n += s->dropped.load(std::memory_order_relaxed);
+        return n;
+    }
+
+    // One CSV row per statement, connection and metric:
+    //   fingerprint,connection,metric,count,mean_ns,p50_ns,...,max_ns,sql
+    std::string exportPercentiles(const std::vector<double>& percentiles = {50, 90, 99, 99.9},
+                                  bool byStatement = false) const {
+        static const char* const names[MetricCount] = {"prepare", "step", "total", "commit"};
+        std::string out = "fingerprint,connection,metric,count,mean_ns";
+        for (double p : percentiles) {
+            char label[32];
+            std::snprintf(label, sizeof label, ",p%g_ns", p);
+            out += label;
+        }
+        out += ",max_ns,sql\n";
+        for (const auto& e : snapshot(byStatement)) {
+            for (int m = 0; m < MetricCount; ++m) {
+                const LatencyHistogram& h = e[static_cast<Metric>(m)];
+                if (!h.count()) continue;
+                char head[96];
+                std::snprintf(head, sizeof head, "%016llx,", static_cast<unsigned long long>(e.fingerprint));
+                out += head;
+                out += byStatement ? "*" : e.connectionName.empty() ? std::to_string(e.connection) : e.connectionName;
+                out += ',';
+                out += names[m];
+                std::snprintf(head, sizeof head, ",%llu,%.0f", static_cast<unsigned long long>(h.count()), h.mean());
+                out += head;
+                for (double p : percentiles) out += "," + std::to_string(h.percentile(p));
+                out += "," + std::to_string(h.max()) + ",\"";
+                for (char c : e.sql) out += c == '"' ? std::string("\"\"") : std::string(1, c);
+                out += "\"\n";
+            }
+        }
+        return out;
+    }
+
+private:
+    static constexpr size_t kSlots = 4096;
+
+    struct Series {
+        uint64_t fingerprint;
+        uint32_t connection;
+        detail::AtomicHistogram metrics[MetricCount];
+    };
+
+    struct Slot {
+        std::atomic<Series*> series{nullptr};
+    };
+
+    struct Shard {
+        std::atomic<uint64_t> generation{0};
+        std::atomic<uint64_t> dropped{0};
+        Slot slots[kSlots];
+        ~Shard() {
+            for (auto& s : slots) delete s.series.load(std::memory_order_relaxed);
+        }
+    };
+
+    const uint64_t id_;
+    std::atomic<uint64_t> generation_{0};
+    mutable std::mutex mutex_;   // shard list, names; never taken while recording
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::unordered_map<std::thread::id, Shard*> byThread_;
+    std::unordered_map<uint64_t, std::string> statements_;
+    std::vector<std::string> connectionNames_;
+
+    static uint64_t nextRegistryId() {
+        static std::atomic<uint64_t> next{1};
+        return next.fetch_add(1);
+    }
+
+    // The calling thread's shard, remembered in a thread_local so the lock
+    // is only taken the first time a thread records (or when it switches
+    // between registries)
+    Shard& shard() {
+        thread_local uint64_t cachedId = 0;
+        thread_local Shard* cached = nullptr;
+        if (cachedId == id_) return *cached;
+        std::lock_guard<std::mutex> lock(mutex_);
+        Shard*& s = byThread_[std::this_thread::get_id()];
+        if (!s) {
+            shards_.push_back(std::make_unique<Shard>());
+            s = shards_.back().get();
+            s->generation.store(generation_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        cachedId = id_;
+        cached = s;
+        return *s;
+    }
+
+    // Owning thread only: a series is published with a release store once
+    // its key is set, so readers never see a half-built one
+    static Series* find(Shard& s, uint64_t fingerprint, uint32_t connection) {
+        uint64_t h = detail::mix64(fingerprint ^ (uint64_t(connection) << 32 | connection));
+        for (size_t probe = 0; probe < 16; ++probe) {
+            Slot& slot = s.slots[(h + probe) & (kSlots - 1)];
+            Series* series = slot.series.load(std::memory_order_relaxed);
+            if (!series) {
+                series = new Series{fingerprint, connection, {}};
+                slot.series.store(series, std::memory_order_release);
+                return series;
+            }
+            if (series->fingerprint == fingerprint && series->connection == connection) return series;
+        }
+        return nullptr;
+    }
+};
+
+// Feeds one connection's statement latencies into a StatementLatency
+class LatencyTracker {
+public:
+    LatencyTracker(Database& db, StatementLatency& stats, const std::string& name = std::string())
+        : db_(db), stats_(stats), connection_(stats.newConnection(name)) {
+        timing_ = db_.addTimingListener([this](Database::Timing event, sqlite3_stmt* stmt, const char* sql, uint64_t ns) {
+            uint64_t fp = stmt ? fingerprint(stmt) : fingerprint(sql);
+            switch (event) {
+            case Database::Timing::Prepare: stats_.record(fp, connection_, StatementLatency::Prepare, ns); return;
+            case Database::Timing::Step: stats_.record(fp, connection_, StatementLatency::Step, ns); return;
+            default: break;
+            }
+            stats_.record(fp, connection_, StatementLatency::Total, ns);
+            if (committing_) {
+                committing_ = false;
+                stats_.record(fp, connection_, StatementLatency::Commit, static_cast<uint64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - commitStart_).count()));
+            }
+        });
+        commit_ = db_.addCommitListener([this] {
+            committing_ = true;
+            commitStart_ = std::chrono::steady_clock::now();
+        });
+    }
+
+    ~LatencyTracker() {
+        db_.removeListener(timing_);
+        db_.removeListener(commit_);
+    }
+
+    LatencyTracker(const LatencyTracker&) = delete;
+    LatencyTracker& operator=(const LatencyTracker&) = delete;
+
+private:
+    struct Cached {
+        std::string raw;
+        uint64_t fingerprint;
+    };
+
+    Database& db_;
+    StatementLatency& stats_;
+    uint32_t connection_;
+    int timing_ = 0;
+    int commit_ = 0;
+    bool committing_ = false;
+    std::chrono::steady_clock::time_point commitStart_;
+    // Statements by the address of their SQL text, confirmed against a
+    // copy as in QueryProfiler; the last one is remembered since a
+    // statement reports several timings in a row
+    std::unordered_map<const char*, Cached> byText_;
+    std::unordered_map<std::string, uint64_t> scripts_;
+    const char* lastText_ = nullptr;
+    const Cached* last_ = nullptr;
+
+    uint64_t fingerprint(sqlite3_stmt* stmt) {
+        const char* text = sqlite3_sql(stmt);
+        if (!text) return 0;
+        if (text == lastText_ && last_->raw == text) return last_->fingerprint;
+        auto cached = byText_.find(text);
+        if (cached == byText_.end() || cached->second.raw != text) {
+            uint64_t fp = describe(text);
+            if (byText_.size() >= detail::kSqlTextCacheLimit) byText_.clear();
+            cached = byText_.insert_or_assign(text, Cached{text, fp}).first;
+        }
+        lastText_ = text;
+        last_ = &cached->second;
+        return last_->fingerprint;
+    }
+
+    // execute() scripts are identified by content: their text is transient
+    uint64_t fingerprint(const char* sql) {
+        auto it = scripts_.find(sql);
+        if (it == scripts_.end()) {
+            if (scripts_.size() >= detail::kSqlTextCacheLimit) scripts_.clear();
+            it = scripts_.emplace(sql, describe(sql)).first;
+        }
+        return it->second;
+    }
+
+    uint64_t describe(const char* text) {
+        std::string sql = detail::normalizeSql(text);
+        uint64_t fp = detail::hashKey(std::string_view(sql));
+        stats_.describe(fp, std::move(sql));
+        return fp;
+    }
+};
+
+// ---------------------------------
+// Live metrics
+// ---------------------------------
+namespace detail {
+
+// The WAL of a database as seen without a connection: the -wal file's
+// size, and mxFrame, nBackfill and the page size from the WAL index header
+// at the start of the -shm file (two 48-byte copies of the header, then
+// the checkpoint info; native byte order). Returns false if the copies
+// differ, i.e. the header is mid-update; a database with no -shm file
+// (not in WAL mode, or no connection open) reads as all zeros.
+struct WalState {
+    uint64_t walBytes = 0;
+    uint32_t frames = 0;       // valid frames in the WAL
+    uint32_t backfilled = 0;   // of those, copied into the database
+    uint32_t pageSize = 0;
+};
+
+inline bool readWalState(const std::string& database, WalState& out) {
+    out = WalState();
+#if defined(__unix__) || defined(__APPLE__)
+    struct stat st;
+    if (::stat((database + "-wal").c_str(), &st) == 0) out.walBytes = static_cast<uint64_t>(st.st_size);
+    int fd = ::open((database + "-shm").c_str(), O_RDONLY);
+    if (fd < 0) return true;
+    unsigned char header[100];
+    bool ok = ::pread(fd, header, sizeof header, 0) == static_cast<ssize_t>(sizeof header) &&
+              std::memcmp(header, header + 48, 48) == 0;
+    ::close(fd);
+    if (!ok) return false;
+    uint16_t pageSize;
+    std::memcpy(&pageSize, header + 14, 2);
+    std::memcpy(&out.frames, header + 16, 4);
+    std::memcpy(&out.backfilled, header + 96, 4);
+    out.pageSize = pageSize == 1 ? 65536 : pageSize;
+    out.backfilled = std::min(out.backfilled, out.frames);
+#else
+    (void)database;
+#endif
+    return true;
+}
+
+// Layout of a metrics segment, shared with tools/rdb_top.cpp. Everything
+// a reader needs is an address-free lock-free atomic, so readers in other
+// processes never block a writer; the top statement table is published
+// under a sequence counter (odd while being rewritten).
+struct MetricsLayout {
+    static constexpr uint32_t kVersion = 1;
+    static constexpr size_t kSlots = 256;
+    static constexpr size_t kTop = 32;
+    static constexpr size_t kSqlBytes = 200;
+
+    // One connection; written only by the thread using it
+    struct alignas(64) Slot {
+        std::atomic<uint32_t> inUse;
+        std::atomic<uint64_t> statements;
+        std::atomic<uint64_t> busyRetries;
+        std::atomic<uint64_t> cacheHits;
+        std::atomic<uint64_t> cacheMisses;
+    };
+
+    struct TopStatement {
+        std::atomic<uint64_t> fingerprint;
+        std::atomic<uint64_t> calls;
+        std::atomic<uint64_t> totalNs;
+        std::atomic<uint64_t> p99Ns;
+        char sql[kSqlBytes];
+    };
+
+    char magic[8];                        // "RDBMETR1"
+    uint32_t version;
+    uint32_t size;                        // sizeof(MetricsLayout)
+    uint64_t pid;
+    char database[256];
+    std::atomic<uint64_t> startedNs;      // system_clock, ns since the epoch
+    std::atomic<uint64_t> heartbeatNs;    // last sample
+
+    // File gauges, sampled
+    std::atomic<uint64_t> walBytes;
+    std::atomic<uint64_t> walFrames;      // frames in the WAL index
+    std::atomic<uint64_t> checkpointLag;  // of those, not yet copied into the database
+
+    // Connection pools, sampled
+    std::atomic<uint64_t> poolSize;
+    std::atomic<uint64_t> poolInUse;
+    std::atomic<uint64_t> poolAcquires;
+    std::atomic<uint64_t> poolWaits;
+    std::atomic<uint64_t> poolWaitNs;
+
+    // Totals of connections that have detached
+    std::atomic<uint64_t> retiredStatements;
+    std::atomic<uint64_t> retiredBusyRetries;
+    std::atomic<uint64_t> retiredCacheHits;
+    std::atomic<uint64_t> retiredCacheMisses;
+
+    Slot slots[kSlots];
+
+    std::atomic<uint64_t> topSequence;
+    std::atomic<uint32_t> topCount;
+    TopStatement top[kTop];
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+              "metrics segment needs lock-free 64-bit atomics");
+
+// Relaxed increment for a counter with a single writer: no locked instruction
+inline void bump(std::atomic<uint64_t>& c, uint64_t n = 1) {
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+} // namespace detail
+
+// Per-process counters published in a POSIX shared-memory segment
+// ("/rdb.<pid>", i.e. /dev/shm/rdb.<pid> on Linux) for tools/rdb_top.cpp to
+// watch from outside the process. Connections publish through
+// MetricsTracker, each into its own cache-line slot with plain atomic
+// stores, so the hot path takes no lock and shares no cache line. A
+// sampler thread refreshes the slower gauges every interval: WAL size and
+// checkpoint lag (from the WAL index in the -shm file), pool counters,
+// and the top statements of a StatementLatency.
+//
+// On platforms without POSIX shared memory the segment is ordinary
+// process memory: the API works, but rdb-top cannot see it.
+//
+//   MetricsSegment metrics("app.db");
+//   MetricsTracker tracker(db, metrics);   // per connection
+//   metrics.watch(pool);
+//   metrics.watch(latency);                // StatementLatency, for top statements
+class MetricsSegment {
+public:
+    struct Options {
+        std::string name;                              // default "/rdb.<pid>"
+        std::chrono::milliseconds interval{1000};
+    };
+
+    explicit MetricsSegment(const std::string& database) : MetricsSegment(database, Options()) {}
+    MetricsSegment(const std::string& database, Options options) : database_(database), options_(options) {
+#if defined(__unix__) || defined(__APPLE__)
+        if (options_.name.empty()) options_.name = "/rdb." + std::to_string(::getpid());
+        int fd = ::shm_open(options_.name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+        if (fd >= 0) {
+            void* p = ::ftruncate(fd, sizeof(detail::MetricsLayout)) == 0
+                ? ::mmap(nullptr, sizeof(detail::MetricsLayout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                : MAP_FAILED;
+            ::close(fd);
+            if (p != MAP_FAILED) {
+                layout_ = static_cast<detail::MetricsLayout*>(p);
+                shared_ = true;
+            } else {
+                ::shm_unlink(options_.name.c_str());
+            }
+        }
+        if (!shared_) RDB_THROW(SQLiteException("Cannot create metrics segment " + options_.name));
+        uint64_t pid = static_cast<uint64_t>(::getpid());
+#else
+        uint64_t pid = 0;
+#endif
+        if (!layout_) {
+            private_ = std::make_unique<detail::MetricsLayout>();
+            layout_ = private_.get();
+        }
+        // A fresh mapping is zero-filled; the atomics need no construction
+        std::memcpy(layout_->magic, "RDBMETR1", 8);
+        layout_->version = detail::MetricsLayout::kVersion;
+        layout_->size = sizeof(detail::MetricsLayout);
+        layout_->pid = pid;
+        std::snprintf(layout_->database, sizeof layout_->database, "%s", database.c_str());
+        layout_->startedNs.store(wallNs(), std::memory_order_relaxed);
+        sample();
+        thread_ = std::thread([this] { run(); });
+    }
+
+    ~MetricsSegment() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        thread_.join();
+#if defined(__unix__) || defined(__APPLE__)
+        if (shared_) {
+            ::munmap(layout_, sizeof(detail::MetricsLayout));
+            ::shm_unlink(options_.name.c_str());
+        }
+#endif
+    }
+
+    MetricsSegment(const MetricsSegment&) = delete;
+    MetricsSegment& operator=(const MetricsSegment&) = delete;
+
+    // Pools and latency registries must outlive the segment or be unwatched
+    void watch(const ConnectionPool& pool) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pools_.push_back(&pool);
+    }
+    void unwatch(const ConnectionPool& pool) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pools_.erase(std::remove(pools_.begin(), pools_.end(), &pool), pools_.end());
+    }
+    void watch(const StatementLatency& latency) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        latency_ = &latency;
+    }
+    void unwatch(const StatementLatency& latency) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (latency_ == &latency) latency_ = nullptr;
+    }
+
+    const std::string& name() const { return options_.name; }
+    bool shared() const { return shared_; }
+    detail::MetricsLayout& layout() { return *layout_; }
+
+    // Refresh the sampled gauges now rather than at the next interval
+    void sample() {
+        std::lock_guard<std::mutex> sampling(sampleMutex_);
+        detail::MetricsLayout& m = *layout_;
+        sampleWal(m);
+        std::vector<const ConnectionPool*> pools;
+        const StatementLatency* latency;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pools = pools_;
+            latency = latency_;
+        }
+        ConnectionPool::Stats total;
+        for (const ConnectionPool* pool : pools) {
+            ConnectionPool::Stats s = pool->stats();
+            total.size += s.size;
+            total.inUse += s.inUse;
+            total.acquires += s.acquires;
+            total.waits += s.waits;
+            total.waitTime += s.waitTime;
+        }
+        m.poolSize.store(total.size, std::memory_order_relaxed);
+        m.poolInUse.store(total.inUse, std::memory_order_relaxed);
+        m.poolAcquires.store(total.acquires, std::memory_order_relaxed);
+        m.poolWaits.store(total.waits, std::memory_order_relaxed);
+        m.poolWaitNs.store(static_cast<uint64_t>(total.waitTime.count()), std::memory_order_relaxed);
+        if (latency) publishTop(m, latency->snapshot(true));
+        m.heartbeatNs.store(wallNs(), std::memory_order_release);
+    }
+
+private:
+    std::string database_;
+    Options options_;
+    detail::MetricsLayout* layout_ = nullptr;
+    std::unique_ptr<detail::MetricsLayout> private_;
+    bool shared_ = false;
+    std::mutex mutex_;         // watched objects, stopping_
+    std::mutex sampleMutex_;   // one sampler at a time
+    std::condition_variable wake_;
+    bool stopping_ = false;
+    std::vector<const ConnectionPool*> pools_;
+    const StatementLatency* latency_ = nullptr;
+    std::thread thread_;
+
+    static uint64_t wallNs() {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count());
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!wake_.wait_for(lock, options_.interval, [this] { return stopping_; })) {
+            lock.unlock();
+            sample();
+            lock.lock();
+        }
+    }
+
+    void sampleWal(detail::MetricsLayout& m) {
+        detail::WalState w;
+        if (!detail::readWalState(database_, w)) return;
+        m.walBytes.store(w.walBytes, std::memory_order_relaxed);
+        m.walFrames.store(w.frames, std::memory_order_relaxed);
+        m.checkpointLag.store(w.frames - w.backfilled, std::memory_order_relaxed);
+    }
+
+    static void publishTop(detail::MetricsLayout& m, std::vector<StatementLatency::Entry> entries) {
+        if (entries.size() > detail::MetricsLayout::kTop) entries.resize(detail::MetricsLayout::kTop);
+        m.topSequence.fetch_add(1, std::memory_order_acq_rel);   // odd: rewriting
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const auto& e = entries[i];
+            auto& t = m.top[i];
+            t.fingerprint.store(e.fingerprint, std::memory_order_relaxed);
+            t.calls.store(e.total.count(), std::memory_order_relaxed);
+            t.totalNs.store(static_cast<uint64_t>(e.total.mean() * static_cast<double>(e.total.count())),
+                            std::memory_order_relaxed);
+            t.p99Ns.store(e.total.percentile(99), std::memory_order_relaxed);
+            std::snprintf(t.sql, sizeof t.sql, "%s", e.sql.c_str());
+        }
+        m.topCount.store(static_cast<uint32_t>(entries.size()), std::memory_order_relaxed);
+        m.topSequence.fetch_add(1, std::memory_order_release);
+    }
+};
+
+// Publishes one connection's counters into a MetricsSegment slot:
+// statements finished, busy-handler retries, and page cache hits and
+// misses (sqlite3_db_status, refreshed every 64 statements). Busy retries
+// are counted through Database::addBusyListener, so later changes to the
+// timeout must go through setBusyTimeout().
+class MetricsTracker {
+public:
+    MetricsTracker(Database& db, MetricsSegment& segment) : db_(db), segment_(segment) {
+        auto& slots = segment_.layout().slots;
+        for (auto& s : slots) {
+            uint32_t expected = 0;
+            if (s.inUse.compare_exchange_strong(expected, 1, std::memory_order_acq_rel)) {
+                slot_ = &s;
+                break;
+            }
+        }
+        if (!slot_) return;   // more connections than slots: this one goes uncounted
+        slot_->statements.store(0, std::memory_order_relaxed);
+        slot_->busyRetries.store(0, std::memory_order_relaxed);
+        slot_->cacheHits.store(0, std::memory_order_relaxed);
+        slot_->cacheMisses.store(0, std::memory_order_relaxed);
+        int high;
+        sqlite3_db_status(db_.get(), SQLITE_DBSTATUS_CACHE_HIT, &baseHits_, &high, 0);
+        sqlite3_db_status(db_.get(), SQLITE_DBSTATUS_CACHE_MISS, &baseMisses_, &high, 0);
+        busy_ = db_.addBusyListener([this](int, uint64_t) { detail::bump(slot_->busyRetries); });
+
+        timing_ = db_.addTimingListener([this](Database::Timing event, sqlite3_stmt*, const char*, uint64_t) {
+            if (event != Database::Timing::Finish && event != Database::Timing::Execute) return;
+            detail::bump(slot_->statements);
+            if ((++finished_ & 63) == 0) refreshCache();
+        });
+    }
+
+    ~MetricsTracker() {
+        if (!slot_) return;
+        db_.removeListener(timing_);
+        db_.removeListener(busy_);
+        refreshCache();
+        auto& m = segment_.layout();
+        m.retiredStatements.fetch_add(slot_->statements.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        m.retiredBusyRetries.fetch_add(slot_->busyRetries.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        m.retiredCacheHits.fetch_add(slot_->cacheHits.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        m.retiredCacheMisses.fetch_add(slot_->cacheMisses.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        slot_->inUse.store(0, std::memory_order_release);
+    }
+
+    MetricsTracker(const MetricsTracker&) = delete;
+    MetricsTracker& operator=(const MetricsTracker&) = delete;
+
+private:
+    Database& db_;
+    MetricsSegment& segment_;
+    detail::MetricsLayout::Slot* slot_ = nullptr;
+    int timing_ = 0;
+    int busy_ = 0;
+    int baseHits_ = 0, baseMisses_ = 0;
+    uint64_t finished_ = 0;
+
+    void refreshCache() {
+        int hits, misses, high;
+        sqlite3_db_status(db_.get(), SQLITE_DBSTATUS_CACHE_HIT, &hits, &high, 0);
+        sqlite3_db_status(db_.get(), SQLITE_DBSTATUS_CACHE_MISS, &misses, &high, 0);
+        slot_->cacheHits.store(static_cast<uint64_t>(static_cast<unsigned>(hits - baseHits_)), std::memory_order_relaxed);
+        slot_->cacheMisses.store(static_cast<uint64_t>(static_cast<unsigned>(misses - baseMisses_)), std::memory_order_relaxed);
+    }
+};
+
+// ---------------------------------
+// OpenMetrics export
+// ---------------------------------
+namespace detail {
+
+// Metric families in first-seen order, so sources can add samples one at
+// a time while each family's samples still come out together
+class MetricsText {
+public:
+    enum class Format { OpenMetrics, Prometheus };
+    using Labels = std::vector<std::pair<const char*, std::string>>;
+
+    void counter(const std::string& name, const char* help, const Labels& labels, double value) {
+        add(name, "counter", help, "_total", labels, number(value));
+    }
+    void counter(const std::string& name, const char* help, const Labels& labels, uint64_t value) {
+        add(name, "counter", help, "_total", labels, std::to_string(value));
+    }
+    void gauge(const std::string& name, const char* help, const Labels& labels, double value) {
+        add(name, "gauge", help, "", labels, number(value));
+    }
+    void gauge(const std::string& name, const char* help, const Labels& labels, uint64_t value) {
+        add(name, "gauge", help, "", labels, std::to_string(value));
+    }
+
+    // A nanosecond LatencyHistogram as cumulative buckets in seconds. Each
+    // recorded bucket counts toward the first bound at or above its top, so
+    // counts are exact to the histogram's own 1.6% resolution.
+    void histogram(const std::string& name, const char* help, const Labels& labels, const LatencyHistogram& h,
+                   const std::vector<double>& bounds) {
+        std::vector<uint64_t> below(bounds.size() + 1, 0);
+        const auto& counts = h.counts();
+        size_t bound = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            if (!counts[i]) continue;
+            double high = static_cast<double>(LatencyHistogram::bucketHigh(i)) / 1e9;
+            while (bound < bounds.size() && bounds[bound] < high) ++bound;
+            below[bound] += counts[i];
+        }
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i <= bounds.size(); ++i) {
+            cumulative += below[i];
+            Labels l = labels;
+            l.emplace_back("le", i < bounds.size() ? number(bounds[i]) : "+Inf");
+            add(name, "histogram", help, "_bucket", l, std::to_string(cumulative));
+        }
+        add(name, "histogram", help, "_count", labels, std::to_string(h.count()));
+        add(name, "histogram", help, "_sum", labels, number(static_cast<double>(h.sum()) / 1e9));
+    }
+
+    // Prometheus text format 0.0.4 differs in naming counters by their
+    // _total sample, and has no # UNIT lines or # EOF terminator
+    std::string str(Format format) const {
+        std::string out;
+        for (const auto& f : families_) {
+            std::string named = f.name;
+            if (format == Format::Prometheus && f.type == "counter") named += "_total";
+            out += "# TYPE " + named + " " + f.type + "\n";
+            if (format == Format::OpenMetrics && !f.unit.empty()) out += "# UNIT " + named + " " + f.unit + "\n";
+            out += "# HELP " + named + " " + f.help + "\n";
+            out += f.samples;
+        }
+        if (format == Format::OpenMetrics) out += "# EOF\n";
+        return out;
+    }
+
+    static std::string number(double v) {
+        if (std::isinf(v)) return v > 0 ? "+Inf" : "-Inf";
+        if (std::isnan(v)) return "NaN";
+        // Shortest of 15 or 17 digits that reads back as v
+        char buf[32];
+        std::snprintf(buf, sizeof buf, "%.15g", v);
+        if (std::strtod(buf, nullptr) != v) std::snprintf(buf, sizeof buf, "%.17g", v);
+        return buf;
+    }
+
+private:
+    struct Family {
+        std::string name, type, help, unit, samples;
+    };
+    std::vector<Family> families_;
+    std::unordered_map<std::string, size_t> index_;
+
+    void add(const std::string& name, const char* type, const char* help, const char* suffix, const Labels& labels,
+             const std::string& value) {
+        auto [it, added] = index_.emplace(name, families_.size());
+        if (added) {
+            Family f{name, type, help, "", ""};
+            for (const char* unit : {"seconds", "bytes"}) {
+                std::string tail = std::string("_") + unit;
+                if (name.size() > tail.size() && name.compare(name.size() - tail.size(), tail.size(), tail) == 0)
+                    f.unit = unit;
+            }
+            families_.push_back(std::move(f));
+        }
+        std::string& out = families_[it->second].samples;
+        out += name;
+        out += suffix;
+        if (!labels.empty()) {
+            out += '{';
+            for (size_t i = 0; i < labels.size(); ++i) {
+                if (i) out += ',';
+                out += labels[i].first;
+                out += "=\"";
+                for (char c : labels[i].second) {
+                    if (c == '\\') out += "\\\\";
+                    else if (c == '"') out += "\\\"";
+                    else if (c == '\n') out += "\\n";
+                    else out += c;
+                }
+                out += '"';
+            }
+            out += '}';
+        }
+        out += ' ';
+        out += value;
+        out += '\n';
+    }
+};
+
+} // namespace detail
+
+// Renders rdb's statistics as OpenMetrics (or Prometheus) text: SQLite's
+// process-wide memory counters, and whatever has been watched - page
+// cache and memory figures and WAL checkpoint progress per connection,
+// ConnectionPool counters, QueryProfiler statements, StatementLatency
+// histograms, IncrementalVacuum, KeyFilter and TableMirror counters.
+// Every metric name starts with Options::prefix and the watched object's
+// name is a label.
+//
+// writeFile() writes Prometheus text atomically (a temporary file, then a
+// rename), which is what node_exporter's textfile collector reads, and
+// writeEvery() does so on a background thread. That thread reads the
+// watched objects while their connections are in use: Database status,
+// ConnectionPool, StatementLatency and IncrementalVacuum are safe to read
+// that way, but QueryProfiler, KeyFilter and TableMirror are not, so
+// export those with render() or writeFile() from the thread using them.
+//
+//   OpenMetricsExporter metrics;
+//   metrics.watch(db, "main");
+//   metrics.watch(pool, "readers");
+//   metrics.watch(latency, "app");
+//   metrics.writeEvery("/var/lib/node_exporter/textfile/app.prom", std::chrono::seconds(15));
+class OpenMetricsExporter {
+public:
+    using Format = detail::MetricsText::Format;
+
+    struct Options {
+        std::string prefix = "rdb";
+        // Histogram bucket bounds, in seconds
+        std::vector<double> buckets{0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025,
+                                    0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+        bool perConnection = false;   // StatementLatency series per connection, not merged
+    };
+
+    OpenMetricsExporter() : OpenMetricsExporter(Options()) {}
+    explicit OpenMetricsExporter(Options options) : options_(std::move(options)) {
+        std::sort(options_.buckets.begin(), options_.buckets.end());
+    }
+
+    ~OpenMetricsExporter() { stop(); }
+
+    OpenMetricsExporter(const OpenMetricsExporter&) = delete;
+    OpenMetricsExporter& operator=(const OpenMetricsExporter&) = delete;
+
+    // Watched objects must outlive the exporter or be unwatched
+    void watch(Database& db, const std::string& name) {
+        const char* file = sqlite3_db_filename(db.get(), "main");
+        std::string path = file ? file : "";
+        sqlite3* handle = db.get();
+        add(&db, [this, handle, path, name](detail::MetricsText& out) { renderDatabase(out, handle, path, name); });
+    }
+    void watch(const ConnectionPool& pool, const std::string& name) {
+        add(&pool, [this, &pool, name](detail::MetricsText& out) {
+            auto s = pool.stats();
+            const std::string& p = options_.prefix;
+            detail::MetricsText::Labels l{{"pool", name}};
+            out.gauge(p + "_pool_connections", "Connections in the pool.", l, static_cast<uint64_t>(s.size));
+            out.gauge(p + "_pool_in_use", "Connections leased out.", l, static_cast<uint64_t>(s.inUse));
+            out.counter(p + "_pool_acquires", "Connections leased.", l, s.acquires);
+            out.counter(p + "_pool_waits", "Acquires that found no free connection.", l, s.waits);
+            out.counter(p + "_pool_wait_seconds", "Time spent waiting for a connection.", l,
+                        static_cast<double>(s.waitTime.count()) / 1e9);
+        });
+    }
+    void watch(const QueryProfiler& profiler, const std::string& name) {
+        add(&profiler, [this, &profiler, name](detail::MetricsText& out) {
+            const std::string& p = options_.prefix;
+            for (const auto& e : profiler.entries()) {
+                detail::MetricsText::Labels l{{"profiler", name}, {"statement", e.sql}};
+                out.counter(p + "_statement_calls", "Statement executions.", l, e.calls);
+                out.counter(p + "_statement_seconds", "Statement execution time.", l, static_cast<double>(e.totalNs) / 1e9);
+                out.gauge(p + "_statement_max_seconds", "Slowest statement execution.", l, static_cast<double>(e.maxNs) / 1e9);
+                out.counter(p + "_statement_full_scan_steps", "Rows stepped over by full table scans.", l, e.fullScanSteps);
+                out.counter(p + "_statement_sorts", "Sort operations.", l, e.sorts);
+                out.counter(p + "_statement_autoindex_rows", "Rows inserted into automatic indexes.", l, e.autoIndexes);
+                out.counter(p + "_statement_vm_steps", "Virtual machine operations.", l, e.vmSteps);
+            }
+        });
+    }
+    void watch(const StatementLatency& latency, const std::string& name) {
+        add(&latency, [this, &latency, name](detail::MetricsText& out) {
+            static const char* const metrics[] = {"prepare", "step", "total", "commit"};
+            for (const auto& e : latency.snapshot(!options_.perConnection)) {
+                for (int m = 0; m < StatementLatency::MetricCount; ++m) {
+                    const auto& h = e[static_cast<StatementLatency::Metric>(m)];
+                    if (!h.count()) continue;
+                    detail::MetricsText::Labels l{{"latency", name}, {"statement", e.sql}, {"metric", metrics[m]}};
+                    if (options_.perConnection) l.emplace_back("connection", e.connectionName);
+                    out.histogram(options_.prefix + "_statement_latency_seconds",
+                                  "Statement prepare, step, total and commit times.", l, h, options_.buckets);
+                }
+            }
+        });
+    }
+    void watch(const IncrementalVacuum& vacuum, const std::string& name) {
+        add(&vacuum, [this, &vacuum, name](detail::MetricsText& out) {
+            auto s = vacuum.stats();
+            const std::string& p = options_.prefix;
+            detail::MetricsText::Labels l{{"vacuum", name}};
+            out.gauge(p + "_vacuum_pages", "Pages in the database file.", l, static_cast<uint64_t>(s.pageCount));
+            out.gauge(p + "_vacuum_free_pages", "Pages on the freelist.", l, static_cast<uint64_t>(s.freelistPages));
+            out.counter(p + "_vacuum_reclaimed_pages", "Free pages returned to the filesystem.", l,
+                        static_cast<uint64_t>(s.reclaimedPages));
+            out.counter(p + "_vacuum_slices", "Incremental vacuum transactions.", l, static_cast<uint64_t>(s.slices));
+            out.gauge(p + "_vacuum_longest_slice_seconds", "Longest incremental vacuum transaction.", l,
+                      static_cast<double>(s.longestSlice.count()) / 1e6);
+        });
+    }
+    void watch(const KeyFilter& filter, const std::string& name) {
+        add(&filter, [this, &filter, name](detail::MetricsText& out) {
+            auto s = filter.stats();
+            const std::string& p = options_.prefix;
+            detail::MetricsText::Labels l{{"filter", name}};
+            out.counter(p + "_filter_queries", "Key filter lookups.", l, s.queries);
+            out.counter(p + "_filter_definite_misses", "Lookups answered without SQLite.", l, s.definiteMisses);
+            out.counter(p + "_filter_false_positives", "Lookups the filter passed that found nothing.", l, s.falsePositives);
+            out.gauge(p + "_filter_keys", "Keys in the filter.", l, static_cast<uint64_t>(s.keys));
+            out.gauge(p + "_filter_memory_bytes", "Filter size.", l, static_cast<uint64_t>(s.memoryBytes));
+        });
+    }
+    template <typename Row>
+    void watch(const TableMirror<Row>& mirror, const std::string& name) {
+        add(&mirror, [this, &mirror, name](detail::MetricsText& out) {
+            auto s = mirror.stats();
+            const std::string& p = options_.prefix;
+            detail::MetricsText::Labels l{{"mirror", name}};
+            out.counter(p + "_mirror_hits", "Lookups served from memory.", l, s.hits);
+            out.counter(p + "_mirror_absent", "Lookups of known missing keys.", l, s.absent);
+            out.counter(p + "_mirror_sql_lookups", "Lookups read through SQL.", l, s.sqlLookups);
+            out.counter(p + "_mirror_reloads", "Full reloads.", l, s.reloads);
+            out.gauge(p + "_mirror_rows", "Rows held.", l, static_cast<uint64_t>(s.rows));
+            out.gauge(p + "_mirror_memory_bytes", "Memory held.", l, static_cast<uint64_t>(s.memoryBytes));
+        });
+    }
+
+    void unwatch(const void* source) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        sources_.erase(std::remove_if(sources_.begin(), sources_.end(), [&](const Source& s) { return s.object == source; }),
+                       sources_.end());
+    }
+
+    std::string render(Format format = Format::OpenMetrics) const {
+        detail::MetricsText out;
+        renderProcess(out);
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& s : sources_) s.render(out);
+        return out.str(format);
+    }
+
+    // Atomically replace path; false if it could not be written
+    bool writeFile(const std::string& path, Format format = Format::Prometheus) const {
+        std::string text = render(format);
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+            if (!out.write(text.data(), static_cast<std::streamsize>(text.size())) || !out.flush()) {
+                std::remove(tmp.c_str());
+                return false;
+            }
+        }
+        if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Write path now and then every interval until stop() or destruction
+    void writeEvery(const std::string& path, std::chrono::milliseconds interval, Format format = Format::Prometheus) {
+        stop();
+        stopping_ = false;
+        thread_ = std::thread([this, path, interval, format] {
+            std::unique_lock<std::mutex> lock(wakeMutex_);
+            do {
+                lock.unlock();
+                writeFile(path, format);
+                lock.lock();
+            } while (!wake_.wait_for(lock, interval, [this] { return stopping_; }));
+        });
+    }
+
+    void stop() {
+        if (!thread_.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(wakeMutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        thread_.join();
+    }
+
+private:
+    struct Source {
+        const void* object;
+        std::function<void(detail::MetricsText&)> render;
+    };
+
+    Options options_;
+    mutable std::mutex mutex_;
+    std::vector<Source> sources_;
+    std::mutex wakeMutex_;
+    std::condition_variable wake_;
+    bool stopping_ = false;
+    std::thread thread_;
+
+    void add(const void* object, std::function<void(detail::MetricsText&)> render) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        sources_.push_back({object, std::move(render)});
+    }
+
+    void renderProcess(detail::MetricsText& out) const {
+        const std::string& p = options_.prefix;
+        sqlite3_int64 current, high;
+        sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &current, &high, 0);
+        out.gauge(p + "_sqlite_memory_bytes", "Memory held by SQLite's allocator.", {}, static_cast<uint64_t>(current));
+        out.gauge(p + "_sqlite_memory_highwater_bytes", "Most memory SQLite's allocator has held.", {},
+                  static_cast<uint64_t>(high));
+        sqlite3_status64(SQLITE_STATUS_MALLOC_COUNT, &current, &high, 0);
+        out.gauge(p + "_sqlite_allocations", "Outstanding SQLite allocations.", {}, static_cast<uint64_t>(current));
+        sqlite3_status64(SQLITE_STATUS_MALLOC_SIZE, &current, &high, 0);
+        out.gauge(p + "_sqlite_largest_allocation_bytes", "Largest single allocation requested.", {},
+                  static_cast<uint64_t>(high));
+    }
+
+    void renderDatabase(detail::MetricsText& out, sqlite3* db, const std::string& path, const std::string& name) const {
+        const std::string& p = options_.prefix;
+        detail::MetricsText::Labels l{{"database", name}};
+        auto status = [db](int op) {
+            int current = 0, high = 0;
+            sqlite3_db_status(db, op, &current, &high, 0);
+            return static_cast<uint64_t>(static_cast<unsigned>(current));
+        };
+        out.gauge(p + "_db_cache_bytes", "Page cache memory.", l, status(SQLITE_DBSTATUS_CACHE_USED));
+        out.counter(p + "_db_cache_hits", "Page cache hits.", l, status(SQLITE_DBSTATUS_CACHE_HIT));
+        out.counter(p + "_db_cache_misses", "Page cache misses.", l, status(SQLITE_DBSTATUS_CACHE_MISS));
+        out.counter(p + "_db_cache_writes", "Dirty pages written at commit.", l, status(SQLITE_DBSTATUS_CACHE_WRITE));
+        out.counter(p + "_db_cache_spills", "Dirty pages written mid-transaction to free the cache.", l,
+                    status(SQLITE_DBSTATUS_CACHE_SPILL));
+        out.gauge(p + "_db_schema_bytes", "Memory holding the schema.", l, status(SQLITE_DBSTATUS_SCHEMA_USED));
+        out.gauge(p + "_db_statement_bytes", "Memory holding prepared statements.", l, status(SQLITE_DBSTATUS_STMT_USED));
+        out.gauge(p + "_db_lookaside_slots", "Lookaside slots in use.", l, status(SQLITE_DBSTATUS_LOOKASIDE_USED));
+        detail::WalState w;
+        if (path.empty() || !detail::readWalState(path, w)) return;
+        uint64_t lag = w.frames - w.backfilled;
+        out.gauge(p + "_db_wal_bytes", "Size of the -wal file.", l, w.walBytes);
+        out.gauge(p + "_db_wal_frames", "Valid frames in the WAL.", l, static_cast<uint64_t>(w.frames));
+        out.gauge(p + "_db_wal_backfilled_frames", "WAL frames copied into the database by checkpoints.", l,
+                  static_cast<uint64_t>(w.backfilled));
+        out.gauge(p + "_db_checkpoint_lag_frames", "WAL frames not yet checkpointed.", l, lag);
+        out.gauge(p + "_db_checkpoint_lag_bytes", "WAL page data not yet checkpointed.", l, lag * w.pageSize);
+    }
+};
+
+// ---------------------------------
+// Query timelines
+// ---------------------------------
+namespace detail {
+
+inline void appendJsonString(std::string& out, const std::string& s) {
+    out += '"';
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += static_cast<char>(c);
+        } else if (c < 0x20) {
+            char buf[8];
+            std::snprintf(buf, sizeof buf, "\\u%04x", c);
+            out += buf;
+        } else {
+            out += static_cast<char>(c);
+        }
+    }
+    out += '"';
+}
+
+} // namespace detail
+
+// Per-thread timeline of where connections spend their time, written as
+// Chrome Trace Event JSON for Perfetto (ui.perfetto.dev) or
+// chrome://tracing: prepares, statements (first step to last, one span
+// however many rows), execute() scripts, explicit transactions, busy
+// waits and WAL checkpoints. Each recording thread gets its own track and
+// ring buffer of Options::eventsPerThread events, the oldest overwritten
+// once it is full; the ring's lock is only contended while write() or
+// clear() copies it.
+//
+//   QueryTimeline timeline;
+//   TimelineTracker tracker(db, timeline, "writer");   // per connection
+//   timeline.nameThread("worker 1");                   // optional, per thread
+//   ... run the workload ...
+//   timeline.save("trace.json");
+class QueryTimeline {
+public:
+    enum class Kind : uint8_t { Prepare, Statement, Execute, Transaction, Busy, BusyTimeout, Checkpoint };
+
+    struct Options {
+        size_t eventsPerThread = 65536;
+    };
+
+    QueryTimeline() : QueryTimeline(Options()) {}
+    explicit QueryTimeline(Options options)
+        : options_(options), id_(nextRegistryId()), origin_(std::chrono::steady_clock::now()) {
+        options_.eventsPerThread = std::max<size_t>(options_.eventsPerThread, 1);
+    }
+
+    QueryTimeline(const QueryTimeline&) = delete;
+    QueryTimeline& operator=(const QueryTimeline&) = delete;
+
+    // Label the calling thread's track
+    void nameThread(const std::string& name) {
+        Ring& r = ring();
+        std::lock_guard<std::mutex> lock(mutex_);
+        r.name = name;
+    }
+
+    // Id of an event or connection name; taken once per distinct text by
+    // TimelineTracker
+    uint32_t intern(const std::string& text) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto [it, added] = ids_.emplace(text, static_cast<uint32_t>(names_.size()));
+        if (added) names_.push_back(text);
+        return it->second;
+    }
+
+    // Nanoseconds since construction
+    uint64_t nowNs() const {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - origin_).count());
+    }
+
+    // Into the calling thread's ring; count is the statement's steps, the
+    // busy wait's retry number or the frames checkpointed
+    void record(Kind kind, uint32_t name, uint32_t connection, uint64_t beginNs, uint64_t durationNs, uint32_t count = 0) {
+        Ring& r = ring();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.events[r.written++ % r.events.size()] = Event{beginNs, durationNs, name, connection, count, kind};
+    }
+
+    // Events overwritten before they could be written out
+    uint64_t dropped() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t n = 0;
+        for (const auto& r : rings_) {
+            std::lock_guard<std::mutex> ringLock(r->mutex);
+            if (r->written > r->events.size()) n += r->written - r->events.size();
+        }
+        return n;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& r : rings_) {
+            std::lock_guard<std::mutex> ringLock(r->mutex);
+            r->written = 0;
+        }
+    }
+
+    // Chrome Trace Event JSON: one complete ("X") event per span, in
+    // microseconds, on one track per recording thread
+    void write(std::ostream& out) const {
+        static const char* const categories[] = {"prepare", "statement", "execute", "transaction", "busy", "busy", "checkpoint"};
+        static const char* const countNames[] = {"", "steps", "", "", "retry", "retries", "frames"};
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::string json = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+                           "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"rdb\"}}";
+        std::vector<Event> events;
+        for (size_t t = 0; t < rings_.size(); ++t) {
+            const Ring& r = *rings_[t];
+            json += ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" + std::to_string(t + 1) + ",\"args\":{\"name\":";
+            detail::appendJsonString(json, r.name.empty() ? "thread " + std::to_string(t + 1) : r.name);
+            json += "}}";
+            {
+                std::lock_guard<std::mutex> ringLock(r.mutex);
+                size_t size = r.events.size();
+                uint64_t first = r.written > size ? r.written - size : 0;
+                events.clear();
+                for (uint64_t i = first; i < r.written; ++i) events.push_back(r.events[i % size]);
+            }
+            for (const Event& e : events) {
+                auto k = static_cast<size_t>(e.kind);
+                char head[160];
+                if (e.kind == Kind::BusyTimeout)   // instant event, thread scoped
+                    std::snprintf(head, sizeof head, ",\n{\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%zu,\"ts\":%llu.%03u",
+                                  t + 1, static_cast<unsigned long long>(e.begin / 1000), static_cast<unsigned>(e.begin % 1000));
+                else
+                    std::snprintf(head, sizeof head, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%llu.%03u,\"dur\":%llu.%03u",
+                                  t + 1, static_cast<unsigned long long>(e.begin / 1000), static_cast<unsigned>(e.begin % 1000),
+                                  static_cast<unsigned long long>(e.duration / 1000), static_cast<unsigned>(e.duration % 1000));
+                json += head;
+                json += ",\"cat\":\"";
+                json += categories[k];
+                json += "\",\"name\":";
+                detail::appendJsonString(json, e.name < names_.size() ? names_[e.name] : std::string());
+                json += ",\"args\":{\"connection\":";
+                detail::appendJsonString(json, e.connection < names_.size() ? names_[e.connection] : std::string());
+                if (*countNames[k]) json += ",\"" + std::string(countNames[k]) + "\":" + std::to_string(e.count);
+                json += "}}";
+            }
+            out << json;
+            json.clear();
+        }
+        out << json << "\n]}\n";
+    }
+
+    bool save(const std::string& path) const {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        write(out);
+        return static_cast<bool>(out.flush());
+    }
+
+private:
+    struct Event {
+        uint64_t begin;
+        uint64_t duration;
+        uint32_t name;
+        uint32_t connection;
+        uint32_t count;
+        Kind kind;
+    };
+
+    struct Ring {
+        mutable std::mutex mutex;
+        std::vector<Event> events;
+        uint64_t written = 0;
+        std::string name;   // guarded by the timeline's mutex
+    };
+
+    Options options_;
+    const uint64_t id_;
+    const std::chrono::steady_clock::time_point origin_;
+    mutable std::mutex mutex_;   // ring list, names; never taken while recording
+    std::vector<std::unique_ptr<Ring>> rings_;
+    std::unordered_map<std::thread::id, Ring*> byThread_;
+    std::vector<std::string> names_;
+    std::unordered_map<std::string, uint32_t> ids_;
+
+    static uint64_t nextRegistryId() {
+        static std::atomic<uint64_t> next{1};
+        return next.fetch_add(1);
+    }
+
+    // The calling thread's ring, cached as in StatementLatency::shard()
+    Ring& ring() {
+        thread_local uint64_t cachedId = 0;
+        thread_local Ring* cached = nullptr;
+        if (cachedId == id_) return *cached;
+        std::lock_guard<std::mutex> lock(mutex_);
+        Ring*& r = byThread_[std::this_thread::get_id()];
+        if (!r) {
+            rings_.push_back(std::make_unique<Ring>());
+            r = rings_.back().get();
+            r->events.resize(options_.eventsPerThread);
+        }
+        cachedId = id_;
+        cached = r;
+        return *r;
+    }
+};
+
+// Records one connection's activity into a QueryTimeline. Busy waits come
+// from Database::addBusyListener and automatic checkpoints from
+// Database::addCheckpointListener, so set the connection's busy timeout
+// and checkpoint threshold through Database while a tracker is attached.
+class TimelineTracker {
 public:
-    SQLiteException(const std::string& msg) : std::runtime_error(msg) {}
+    TimelineTracker(Database& db, QueryTimeline& timeline, const std::string& name = std::string())
+        : db_(db), timeline_(timeline) {
+        connection_ = timeline_.intern(name.empty() ? "connection" : name);
+        names_.busy = timeline_.intern("busy wait");
+        names_.timeout = timeline_.intern("busy timeout");
+        names_.transaction = timeline_.intern("transaction");
+        names_.checkpoint = timeline_.intern("checkpoint");
+        inTransaction_ = !sqlite3_get_autocommit(db_.get());
+
+        timing_ = db_.addTimingListener([this](Database::Timing event, sqlite3_stmt* stmt, const char* sql, uint64_t ns) {
+            switch (event) {
+            case Database::Timing::Prepare: {
+                uint64_t now = timeline_.nowNs();
+                timeline_.record(QueryTimeline::Kind::Prepare, nameOf(stmt), connection_, before(now, ns), ns);
+                return;
+            }
+            case Database::Timing::Step: {
+                uint64_t now = timeline_.nowNs();
+                Open& o = open(stmt);
+                if (!o.steps++) o.begin = before(now, ns);
+                o.end = now;
+                return;
+            }
+            case Database::Timing::Finish: {
+                uint64_t begin, end;
+                uint32_t steps = 0;
+                auto it = std::find_if(open_.rbegin(), open_.rend(), [stmt](const Open& o) { return o.stmt == stmt; });
+                if (it != open_.rend()) {
+                    begin = it->begin;
+                    end = it->end;
+                    steps = it->steps;
+                    open_.erase(std::next(it).base());
+                } else {
+                    end = timeline_.nowNs();
+                    begin = before(end, ns);
+                }
+                timeline_.record(QueryTimeline::Kind::Statement, nameOf(stmt), connection_, begin, end - begin, steps);
+                transition(begin, end);
+                return;
+            }
+            case Database::Timing::Execute: {
+                uint64_t now = timeline_.nowNs();
+                timeline_.record(QueryTimeline::Kind::Execute, nameOf(sql), connection_, before(now, ns), ns);
+                transition(before(now, ns), now);
+                return;
+            }
+            }
+        });
+        busy_ = db_.addBusyListener([this](int count, uint64_t slept) {
+            uint64_t now = timeline_.nowNs();
+            if (slept) timeline_.record(QueryTimeline::Kind::Busy, names_.busy, connection_, before(now, slept), slept,
+                                        static_cast<uint32_t>(count + 1));
+            else timeline_.record(QueryTimeline::Kind::BusyTimeout, names_.timeout, connection_, now, 0,
+                                  static_cast<uint32_t>(count));
+        });
+        checkpoint_ = db_.addCheckpointListener([this](const char*, int, int done, uint64_t ns) {
+            uint64_t now = timeline_.nowNs();
+            timeline_.record(QueryTimeline::Kind::Checkpoint, names_.checkpoint, connection_, before(now, ns), ns,
+                             static_cast<uint32_t>(std::max(done, 0)));
+        });
+    }
+
+    ~TimelineTracker() {
+        db_.removeListener(timing_);
+        db_.removeListener(busy_);
+        db_.removeListener(checkpoint_);
+    }
+
+    TimelineTracker(const TimelineTracker&) = delete;
+    TimelineTracker& operator=(const TimelineTracker&) = delete;
+
+private:
+    // A statement between its first step and its Finish
+    struct Open {
+        sqlite3_stmt* stmt;
+        uint64_t begin, end;
+        uint32_t steps;
+    };
+
+    struct Cached {
+        std::string raw;
+        uint32_t name;
+    };
+
+    Database& db_;
+    QueryTimeline& timeline_;
+    uint32_t connection_ = 0;
+    struct {
+        uint32_t busy, timeout, transaction, checkpoint;
+    } names_{};
+    int timing_ = 0;
+    int busy_ = 0;
+    int checkpoint_ = 0;
+    bool inTransaction_ = false;
+    uint64_t transactionBegin_ = 0;
+    std::vector<Open> open_;
+    // Statement names by the address of their SQL text, as in LatencyTracker
+    // and bounded the same way
+    std::unordered_map<const char*, Cached> byText_;
+    std::unordered_map<std::string, uint32_t> scripts_;
+    const char* lastText_ = nullptr;
+    const Cached* last_ = nullptr;
+
+    static uint64_t before(uint64_t end, uint64_t ns) { return end > ns ? end - ns : 0; }
+
+    Open& open(sqlite3_stmt* stmt) {
+        for (auto it = open_.rbegin(); it != open_.rend(); ++it)
+            if (it->stmt == stmt) return *it;
+        open_.push_back(Open{stmt, 0, 0, 0});
+        return open_.back();
+    }
+
+    uint32_t nameOf(sqlite3_stmt* stmt) {
+        const char* text = sqlite3_sql(stmt);
+        if (!text) return nameOf("");
+        if (text == lastText_ && last_->raw == text) return last_->name;
+        auto cached = byText_.find(text);
+        if (cached == byText_.end() || cached->second.raw != text) {
+            if (byText_.size() >= detail::kSqlTextCacheLimit) byText_.clear();
+            cached = byText_.insert_or_assign(text, Cached{text, timeline_.intern(detail::normalizeSql(text))}).first;
+        }
+        lastText_ = text;
+        last_ = &cached->second;
+        return last_->name;
+    }
+
+    uint32_t nameOf(const char* sql) {
+        auto it = scripts_.find(sql);
+        if (it == scripts_.end()) {
+            if (scripts_.size() >= detail::kSqlTextCacheLimit) scripts_.clear();
+            it = scripts_.emplace(sql, timeline_.intern(detail::normalizeSql(sql))).first;
+        }
+        return it->second;
+    }
+
+    // Explicit transactions, from the autocommit flag after each statement
+    void transition(uint64_t begin, uint64_t end) {
+        bool in = !sqlite3_get_autocommit(db_.get());
+        if (in && !inTransaction_) transactionBegin_ = begin;
+        else if (!in && inTransaction_)
+            timeline_.record(QueryTimeline::Kind::Transaction, names_.transaction, connection_, transactionBegin_,
+                             end - transactionBegin_);
+        inTransaction_ = in;
+    }
 };
 
 // ---------------------------------
-// Database
+// Allocation accounting
 // ---------------------------------
-class Database {
-    sqlite3* db_ = nullptr;
+namespace detail {
+
+// SQLite's allocator, counting into the calling thread's allocationCount.
+// A realloc counts as one allocation of the new size.
+struct CountingSqliteAllocator {
+    static sqlite3_mem_methods& original() {
+        static sqlite3_mem_methods methods{};
+        return methods;
+    }
+    static void* xMalloc(int n) {
+        ++allocationCount.sqliteAllocations;
+        allocationCount.sqliteBytes += static_cast<uint64_t>(n);
+        return original().xMalloc(n);
+    }
+    static void* xRealloc(void* p, int n) {
+        ++allocationCount.sqliteAllocations;
+        allocationCount.sqliteBytes += static_cast<uint64_t>(n);
+        return original().xRealloc(p, n);
+    }
+    static void xFree(void* p) { original().xFree(p); }
+    static int xSize(void* p) { return original().xSize(p); }
+    static int xRoundup(int n) { return original().xRoundup(n); }
+    static int xInit(void* app) { return original().xInit(app); }
+    static void xShutdown(void* app) { original().xShutdown(app); }
+};
+
+} // namespace detail
 
+// Memory allocated per statement fingerprint, split into what SQLite
+// allocated (through its wrapped allocator) and what operator new
+// allocated, which covers rdb's own result rows and strings as well as
+// the caller's. A statement's execution runs from its first step to its
+// last, so work the caller does between steps - building SQLResults
+// rows, copying column text - counts toward it; statements stepped
+// inside another's execution count toward both.
+//
+// install() must run before SQLite is first used (before any database is
+// opened). Operator new is only counted in programs where exactly one
+// source file defines RDB_COUNT_NEW before including rdb.h, which
+// replaces the global operator new and delete. Allocations SQLite serves
+// from a connection's lookaside buffer never reach the allocator; call
+// sqlite3_config(SQLITE_CONFIG_LOOKASIDE, 0, 0) before install() to count
+// every one.
+//
+//   AllocationProfile::install();              // first thing in main()
+//   AllocationProfile allocations;
+//   AllocationTracker tracker(db, allocations);
+//   ... run the workload ...
+//   for (auto& e : allocations.entries())
+//       std::cout << e.execution.heapBytes / e.executions << " B/exec " << e.sql << "\n";
+class AllocationProfile {
 public:
-    Database(const std::string& filename) {
-        if (sqlite3_open(filename.c_str(), &db_) != SQLITE_OK) {
-            throw SQLiteException(sqlite3_errmsg(db_));
+    struct Entry {
+        uint64_t fingerprint = 0;
+        std::string sql;              // normalised
+        uint64_t prepares = 0;
+        uint64_t executions = 0;      // including execute() scripts
+        AllocationCount prepare;
+        AllocationCount execution;
+    };
+
+    // Wrap SQLite's allocator (SQLITE_CONFIG_MALLOC); false once SQLite has
+    // been initialised, when its allocator can no longer be replaced
+    static bool install() {
+        static std::mutex mutex;
+        static bool done = false;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (done) return true;
+        sqlite3_mem_methods& original = detail::CountingSqliteAllocator::original();
+        if (sqlite3_config(SQLITE_CONFIG_GETMALLOC, &original) != SQLITE_OK) return false;
+        using A = detail::CountingSqliteAllocator;
+        sqlite3_mem_methods counting{&A::xMalloc, &A::xFree, &A::xRealloc, &A::xSize,
+                                     &A::xRoundup, &A::xInit, &A::xShutdown, original.pAppData};
+        done = sqlite3_config(SQLITE_CONFIG_MALLOC, &counting) == SQLITE_OK;
+        return done;
+    }
+
+    AllocationProfile() = default;
+    AllocationProfile(const AllocationProfile&) = delete;
+    AllocationProfile& operator=(const AllocationProfile&) = delete;
+
+    // Called by AllocationTracker once per distinct statement text
+    void describe(uint64_t fingerprint, std::string sql) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Entry& e = entries_[fingerprint];
+        e.fingerprint = fingerprint;
+        if (e.sql.empty()) e.sql = std::move(sql);
+    }
+
+    void record(uint64_t fingerprint, Database::Timing event, const AllocationCount& delta) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Entry& e = entries_[fingerprint];
+        if (event == Database::Timing::Prepare) {
+            ++e.prepares;
+            e.prepare += delta;
+        } else {
+            ++e.executions;
+            e.execution += delta;
+        }
+    }
+
+    // Most bytes allocated (both kinds, prepare and execution) first
+    std::vector<Entry> entries() const {
+        std::vector<Entry> out;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (const auto& [fp, e] : entries_)
+                if (e.prepares || e.executions) out.push_back(e);
         }
+        auto bytes = [](const Entry& e) {
+            return e.prepare.sqliteBytes + e.prepare.heapBytes + e.execution.sqliteBytes + e.execution.heapBytes;
+        };
+        std::sort(out.begin(), out.end(), [&](const Entry& a, const Entry& b) { return bytes(a) > bytes(b); });
+        return out;
     }
 
-    ~Database() { if (db_) sqlite3_close(db_); }
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& [fp, e] : entries_) {
+            e.prepares = e.executions = 0;
+            e.prepare = e.execution = AllocationCount();
+        }
+    }
 
-    Database(const Database&) = delete;
-    Database& operator=(const Database&) = delete;
+private:
+    mutable std::mutex mutex_;
+    std::unordered_map<uint64_t, Entry> entries_;
+};
 
-    Database(Database&& other) noexcept : db_(other.db_) { other.db_ = nullptr; }
-    Database& operator=(Database&& other) noexcept {
-        if (db_) sqlite3_close(db_);
-        db_ = other.db_;
-        other.db_ = nullptr;
-        return *this;
+// Feeds one connection's allocations into an AllocationProfile
+class AllocationTracker {
+public:
+    AllocationTracker(Database& db, AllocationProfile& profile) : db_(db), profile_(profile) {
+        listener_ = db_.addAllocationListener([this](Database::Timing event, sqlite3_stmt* stmt, const char* sql,
+                                                     const AllocationCount& delta) {
+            profile_.record(stmt ? fingerprint(stmt) : fingerprint(sql), event, delta);
+        });
     }
 
-    sqlite3* get() { return db_; }
+    ~AllocationTracker() { db_.removeListener(listener_); }
 
-    std::unique_ptr<class Statement> prepare(const std::string& sql);
+    AllocationTracker(const AllocationTracker&) = delete;
+    AllocationTracker& operator=(const AllocationTracker&) = delete;
 
-    void execute(const std::string& sql) {
-        char* errmsg = nullptr;
-        if (sqlite3_exec(db_, sql.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK) {
-            std::string msg = errmsg ? errmsg : "Unknown error";
-            sqlite3_free(errmsg);
-            throw SQLiteException(msg);
+private:
+    struct Cached {
+        std::string raw;
+        uint64_t fingerprint;
+    };
+
+    Database& db_;
+    AllocationProfile& profile_;
+    int listener_ = 0;
+    // Statements by the address of their SQL text, as in LatencyTracker
+    // and bounded the same way
+    std::unordered_map<const char*, Cached> byText_;
+    std::unordered_map<std::string, uint64_t> scripts_;
+
+    uint64_t fingerprint(sqlite3_stmt* stmt) {
+        const char* text = sqlite3_sql(stmt);
+        if (!text) return 0;
+        auto cached = byText_.find(text);
+        if (cached == byText_.end() || cached->second.raw != text) {
+            uint64_t fp = describe(text);
+            if (byText_.size() >= detail::kSqlTextCacheLimit) byText_.clear();
+            cached = byText_.insert_or_assign(text, Cached{text, fp}).first;
         }
+        return cached->second.fingerprint;
     }
 
-    // RAII transaction
-    class Transaction {
-        Database& db_;
-        bool active_ = true;
-    public:
-        Transaction(Database& db) : db_(db) { db_.execute("BEGIN;"); }
-        ~Transaction() { if(active_) db_.execute("ROLLBACK;"); }
-        void commit() { db_.execute("COMMIT;"); active_ = false; }
-        void rollback() { db_.execute("ROLLBACK;"); active_ = false; }
-    };
+    uint64_t fingerprint(const char* sql) {
+        auto it = scripts_.find(sql);
+        if (it == scripts_.end()) {
+            if (scripts_.size() >= detail::kSqlTextCacheLimit) scripts_.clear();
+            it = scripts_.emplace(sql, describe(sql)).first;
+        }
+        return it->second;
+    }
+
+    uint64_t describe(const char* text) {
+        std::string sql = detail::normalizeSql(text);
+        uint64_t fp = detail::hashKey(std::string_view(sql));
+        profile_.describe(fp, std::move(sql));
+        return fp;
+    }
 };
 
 // ---------------------------------
-// Statement
+// Plan regressions
 // ---------------------------------
-class Statement {
-    friend class DBConnect;
-    sqlite3_stmt* stmt_ = nullptr;
+namespace detail {
+
+// EXPLAIN QUERY PLAN of a statement's text: one detail line per step,
+// indented two spaces per level. "SCAN TABLE t" and "SEARCH TABLE t" as
+// printed before SQLite 3.36 read as "SCAN t" and "SEARCH t", so stored
+// plans survive an upgrade. Empty for statements without a plan (DDL,
+// PRAGMA, transaction control) and for text that no longer compiles.
+// Runs on the raw handle, so no listener sees it.
+inline std::string explainPlan(sqlite3* db, const char* sql) {
+    std::string text = std::string("EXPLAIN QUERY PLAN ") + sql;
+    sqlite3_stmt* q = nullptr;
+    if (sqlite3_prepare_v2(db, text.c_str(), -1, &q, nullptr) != SQLITE_OK) {
+        sqlite3_finalize(q);
+        return std::string();
+    }
+    std::unordered_map<int, size_t> depth;
+    std::string out;
+    while (sqlite3_step(q) == SQLITE_ROW) {
+        auto parent = depth.find(sqlite3_column_int(q, 1));
+        size_t d = parent == depth.end() ? 0 : parent->second + 1;
+        depth[sqlite3_column_int(q, 0)] = d;
+        const char* detail = reinterpret_cast<const char*>(sqlite3_column_text(q, 3));
+        std::string line = detail ? detail : "";
+        for (std::string_view verb : {"SCAN TABLE ", "SEARCH TABLE "})
+            if (line.compare(0, verb.size(), verb) == 0) line.erase(verb.size() - 6, 6);
+        out.append(d * 2, ' ');
+        out += line;
+        out += '\n';
+    }
+    sqlite3_finalize(q);
+    return out;
+}
+
+// Steps of `after` that make it worse than `before`, one reason each: a
+// full scan, a temp b-tree (ORDER BY, GROUP BY, DISTINCT), an automatic
+// index, or an index scan of a table `before` searched. Steps `before`
+// already had, as many times, are not reasons.
+inline std::vector<std::string> planRegressions(const std::string& before, const std::string& after) {
+    auto steps = [](const std::string& plan) {
+        std::vector<std::string> out;
+        for (size_t start = 0; start < plan.size();) {
+            size_t end = plan.find('\n', start);
+            if (end == std::string::npos) end = plan.size();
+            size_t first = plan.find_first_not_of(' ', start);
+            if (first < end) out.push_back(plan.substr(first, end - first));
+            start = end + 1;
+        }
+        return out;
+    };
+    auto startsWith = [](const std::string& s, std::string_view prefix) { return s.compare(0, prefix.size(), prefix) == 0; };
+    // The table (or alias) after SCAN or SEARCH
+    auto table = [](const std::string& step) {
+        size_t start = step.find(' ') + 1;
+        return step.substr(start, step.find(' ', start) - start);
+    };
+
+    std::unordered_map<std::string, int> old;
+    std::unordered_set<std::string> searched;
+    for (auto& step : steps(before)) {
+        ++old[step];
+        if (startsWith(step, "SEARCH ")) searched.insert(table(step));
+    }
+    std::vector<std::string> reasons;
+    for (auto& step : steps(after)) {
+        auto it = old.find(step);
+        if (it != old.end() && it->second > 0) {
+            --it->second;
+            continue;
+        }
+        bool scan = startsWith(step, "SCAN ");
+        if (step.find(" AUTOMATIC ") != std::string::npos) reasons.push_back("automatic index: " + step);
+        else if (startsWith(step, "USE TEMP B-TREE")) reasons.push_back("temp b-tree: " + step);
+        else if (scan && step.find(" USING ") == std::string::npos && step.find(" VIRTUAL TABLE ") == std::string::npos &&
+                 step != "SCAN CONSTANT ROW")
+            reasons.push_back("full scan: " + step);
+        else if (scan && searched.count(table(step))) reasons.push_back("index scan instead of search: " + step);
+    }
+    return reasons;
+}
 
+} // namespace detail
+
+// Watches the plans of the statements a connection prepares and warns
+// when one turns worse than its baseline, typically after a schema change
+// or ANALYZE: a new full scan, temp b-tree or automatic index, or an index
+// scan of a table that used to be searched.
+//
+// A normalised statement's first plan is its baseline, kept in the
+// rdb_plan_baseline table of a sidecar database ("<database>-plans" by
+// default) so baselines outlive the process and a plan that flipped
+// across a restart is still caught. Plans are taken with EXPLAIN QUERY
+// PLAN (for unbound parameters) when a statement text is prepared for the
+// first time, when it is prepared again after the schema version moved
+// (DDL and ANALYZE both move it), and when SQLite re-prepares a statement
+// the application keeps. Only the main schema's version is compared.
+//
+// Every plan counts the executions that ran under it, so a regression's
+// latency impact reads as baseline against current mean; the baseline's
+// counts are written to the sidecar by flush() and the destructor. A
+// worse plan is reported once, to onRegression or else std::cerr, and
+// stays current beside the baseline until accept() makes it the
+// baseline. A changed plan that is not worse replaces the baseline.
+//
+//   PlanMonitor plans(db);
+//   db.execute("ANALYZE");
+//   ... run the workload ...
+//   for (auto& e : plans.regressions())
+//       std::cout << e.sql << ": " << e.baseline.meanNs() << " -> " << e.current.meanNs() << " ns\n";
+class PlanMonitor {
 public:
-    Statement(sqlite3* db, const std::string& sql) {
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt_, nullptr) != SQLITE_OK) {
-            throw SQLiteException(sqlite3_errmsg(db));
+    struct Plan {
+        uint64_t hash = 0;
+        std::string text;           // EXPLAIN QUERY PLAN detail lines
+        uint64_t calls = 0;         // executions that ran under this plan
+        uint64_t totalNs = 0;
+        uint64_t maxNs = 0;
+
+        double meanNs() const { return calls ? static_cast<double>(totalNs) / static_cast<double>(calls) : 0.0; }
+    };
+
+    struct Entry {
+        uint64_t fingerprint = 0;
+        std::string sql;                    // normalised
+        Plan baseline;
+        Plan current;                       // the baseline unless the plan changed
+        std::vector<std::string> reasons;   // why current is worse; empty if it is not
+    };
+
+    struct Options {
+        // Baseline database; empty for "<database>-plans", ":memory:" to
+        // keep baselines only as long as the monitor (as for in-memory
+        // databases)
+        std::string sidecar;
+        bool adoptChanges = true;           // changed plans that are not worse become the baseline
+        std::function<void(const Entry&)> onRegression;
+    };
+
+    explicit PlanMonitor(Database& db) : PlanMonitor(db, Options()) {}
+
+    PlanMonitor(Database& db, Options options) : db_(db), options_(std::move(options)) {
+        std::string path = options_.sidecar;
+        if (path.empty()) {
+            const char* file = sqlite3_db_filename(db_.get(), "main");
+            if (file && *file) path = std::string(file) + "-plans";
+        }
+        if (!path.empty() && path != ":memory:") openSidecar(path);
+        timing_ = db_.addTimingListener([this](Database::Timing event, sqlite3_stmt* stmt, const char*, uint64_t ns) {
+            if (!stmt) return;
+            if (event == Database::Timing::Prepare) prepared(stmt);
+            else if (event == Database::Timing::Finish) finished(stmt, ns);
+        });
+    }
+
+    ~PlanMonitor() {
+        db_.removeListener(timing_);
+        flush();
+        sqlite3_finalize(version_);
+    }
+
+    PlanMonitor(const PlanMonitor&) = delete;
+    PlanMonitor& operator=(const PlanMonitor&) = delete;
+
+    // Every statement with a plan, most time spent first
+    std::vector<Entry> entries() const {
+        std::vector<Entry> out;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (const auto& [fp, t] : tracked_)
+                if (!t.entry.baseline.text.empty()) out.push_back(view(t));
         }
+        auto total = [](const Entry& e) { return e.baseline.totalNs + (e.current.hash != e.baseline.hash ? e.current.totalNs : 0); };
+        std::sort(out.begin(), out.end(), [&](const Entry& a, const Entry& b) { return total(a) > total(b); });
+        return out;
     }
 
-    ~Statement() { if(stmt_) sqlite3_finalize(stmt_); }
+    // Statements whose current plan is worse than the baseline, most time
+    // spent under the worse plan first
+    std::vector<Entry> regressions() const {
+        std::vector<Entry> out;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (const auto& [fp, t] : tracked_)
+                if (!t.entry.reasons.empty()) out.push_back(view(t));
+        }
+        std::sort(out.begin(), out.end(), [](const Entry& a, const Entry& b) { return a.current.totalNs > b.current.totalNs; });
+        return out;
+    }
 
-    Statement(const Statement&) = delete;
-    Statement& operator=(const Statement&) = delete;
+    // Make a statement's current plan its baseline, e.g. once a regression
+    // has been judged acceptable; false if its plan has not changed
+    bool accept(uint64_t fingerprint) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = tracked_.find(fingerprint);
+        if (it == tracked_.end() || it->second.entry.current.text.empty()) return false;
+        rebase(it->second, std::move(it->second.entry.current));
+        return true;
+    }
 
-    Statement(Statement&& other) noexcept : stmt_(other.stmt_) { other.stmt_ = nullptr; }
-    Statement& operator=(Statement&& other) noexcept {
-        if(stmt_) sqlite3_finalize(stmt_);
-        stmt_ = other.stmt_;
-        other.stmt_ = nullptr;
-        return *this;
+    // Add the baselines' execution counts to the sidecar
+    void flush() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!sidecar_) return;
+        std::vector<Tracked*> pending;
+        for (auto& [fp, t] : tracked_)
+            if (t.stored && t.entry.baseline.calls > t.flushedCalls) pending.push_back(&t);
+        if (pending.empty()) return;
+        auto q = sidecar_->tryPrepare(
+            "UPDATE rdb_plan_baseline SET calls = calls + ?1, total_ns = total_ns + ?2, max_ns = max(max_ns, ?3) "
+            "WHERE fingerprint = ?4 AND plan_hash = ?5;");
+        if (!q) return fail();
+        if (!sidecar_->tryExecute("BEGIN;")) return fail();
+        for (Tracked* t : pending) {
+            const Plan& p = t->entry.baseline;
+            (*q)->bindInt64(1, static_cast<int64_t>(p.calls - t->flushedCalls));
+            (*q)->bindInt64(2, static_cast<int64_t>(p.totalNs - t->flushedNs));
+            (*q)->bindInt64(3, static_cast<int64_t>(p.maxNs));
+            (*q)->bindInt64(4, static_cast<int64_t>(t->entry.fingerprint));
+            (*q)->bindInt64(5, static_cast<int64_t>(p.hash));
+            Status st = (*q)->tryStep();
+            (*q)->reset();
+            if (!st) {
+                sidecar_->tryExecute("ROLLBACK;");
+                return fail();
+            }
+        }
+        if (!sidecar_->tryExecute("COMMIT;")) {
+            sidecar_->tryExecute("ROLLBACK;");
+            return fail();
+        }
+        for (Tracked* t : pending) {
+            t->flushedCalls = t->entry.baseline.calls;
+            t->flushedNs = t->entry.baseline.totalNs;
+        }
     }
 
-    // Positional binding
-    void bind(int index, int val) { sqlite3_bind_int(stmt_, index, val); }
-    void bind(int index, double val) { sqlite3_bind_double(stmt_, index, val); }
-    void bind(int index, const std::string& val) {
-        sqlite3_bind_text(stmt_, index, val.c_str(), -1, SQLITE_TRANSIENT);
+    // The last sidecar error; baselines are still kept in memory
+    std::string error() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return error_;
     }
 
-    // Named binding
-    void bind(const std::string& name, int val) {
-        int idx = sqlite3_bind_parameter_index(stmt_, name.c_str());
-        if(idx) sqlite3_bind_int(stmt_, idx, val);
+private:
+    struct Tracked {
+        Entry entry;                // current is empty while it matches the baseline
+        int64_t schemaVersion = -1; // when the current plan was taken
+        bool stored = false;        // baseline row is in the sidecar
+        uint64_t flushedCalls = 0;
+        uint64_t flushedNs = 0;
+    };
+
+    struct Prepared {
+        Tracked* tracked;
+        uint64_t planHash;          // the plan it was compiled with, as far as we know
+        int reprepares;
+    };
+
+    struct Cached {
+        std::string raw;
+        uint64_t fingerprint;
+    };
+
+    Database& db_;
+    Options options_;
+    int timing_ = 0;
+    mutable std::mutex mutex_;
+    std::optional<Database> sidecar_;
+    std::string error_;
+    std::unordered_map<uint64_t, Tracked> tracked_;
+    // Statements prepared and not yet finished; one run again later is
+    // resolved through its fingerprint
+    std::unordered_map<sqlite3_stmt*, Prepared> statements_;
+    // Fingerprints by the address of the statement text, as in
+    // LatencyTracker and bounded the same way
+    std::unordered_map<const char*, Cached> byText_;
+    sqlite3_stmt* version_ = nullptr;
+    unsigned dataVersion_ = 0;
+    int64_t schemaVersion_ = -1;
+    std::vector<Entry> reports_;
+
+    void openSidecar(const std::string& path) {
+        auto opened = Database::tryOpen(path);
+        if (!opened) {
+            error_ = opened.status().message();
+            return;
+        }
+        sidecar_.emplace(std::move(*opened));
+        sidecar_->setBusyTimeout(1000);
+        // Baselines are advisory: WAL without fsync on commit keeps a new
+        // statement's first prepare cheap
+        Status st = sidecar_->tryExecute(
+            "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL;"
+            "CREATE TABLE IF NOT EXISTS rdb_plan_baseline("
+            "fingerprint INTEGER PRIMARY KEY, sql TEXT NOT NULL, plan TEXT NOT NULL, plan_hash INTEGER NOT NULL,"
+            "calls INTEGER NOT NULL DEFAULT 0, total_ns INTEGER NOT NULL DEFAULT 0, max_ns INTEGER NOT NULL DEFAULT 0,"
+            "updated INTEGER NOT NULL);");
+        if (!st) {
+            error_ = sidecar_->errorMessage();
+            sidecar_.reset();
+            return;
+        }
+        auto rows = sidecar_->tryPrepare(
+            "SELECT fingerprint, sql, plan, plan_hash, calls, total_ns, max_ns FROM rdb_plan_baseline;");
+        if (!rows) {
+            error_ = sidecar_->errorMessage();
+            sidecar_.reset();
+            return;
+        }
+        while ((*rows)->tryStep().row()) {
+            uint64_t fp = static_cast<uint64_t>((*rows)->getInt64(0));
+            Tracked& t = tracked_[fp];
+            t.entry.fingerprint = fp;
+            t.entry.sql = (*rows)->getText(1);
+            Plan& p = t.entry.baseline;
+            p.text = (*rows)->getText(2);
+            p.hash = static_cast<uint64_t>((*rows)->getInt64(3));
+            t.flushedCalls = p.calls = static_cast<uint64_t>((*rows)->getInt64(4));
+            t.flushedNs = p.totalNs = static_cast<uint64_t>((*rows)->getInt64(5));
+            p.maxNs = static_cast<uint64_t>((*rows)->getInt64(6));
+            t.stored = true;
+        }
     }
-    void bind(const std::string& name, double val) {
-        int idx = sqlite3_bind_parameter_index(stmt_, name.c_str());
-        if(idx) sqlite3_bind_double(stmt_, idx, val);
+
+    void fail() { error_ = sidecar_->errorMessage(); }
+
+    // PRAGMA schema_version, stepped only when the pager's data version
+    // (SQLITE_FCNTL_DATA_VERSION) has moved. It moves on this connection's
+    // own commits and when it starts a read transaction after another
+    // connection committed, which SQLite does before re-preparing a
+    // statement for a changed schema.
+    int64_t schemaVersion() {
+        unsigned dataVersion = 0;
+        bool counted = sqlite3_file_control(db_.get(), "main", SQLITE_FCNTL_DATA_VERSION, &dataVersion) == SQLITE_OK;
+        if (counted && schemaVersion_ >= 0 && dataVersion == dataVersion_) return schemaVersion_;
+        if (!version_ && sqlite3_prepare_v2(db_.get(), "PRAGMA main.schema_version;", -1, &version_, nullptr) != SQLITE_OK)
+            return -1;
+        int64_t v = sqlite3_step(version_) == SQLITE_ROW ? sqlite3_column_int64(version_, 0) : -1;
+        sqlite3_reset(version_);
+        // The pragma's own read transaction may have moved the counter
+        if (counted) sqlite3_file_control(db_.get(), "main", SQLITE_FCNTL_DATA_VERSION, &dataVersion_);
+        schemaVersion_ = counted ? v : -1;
+        return v;
     }
-    void bind(const std::string& name, const std::string& val) {
-        int idx = sqlite3_bind_parameter_index(stmt_, name.c_str());
-        if(idx) sqlite3_bind_text(stmt_, idx, val.c_str(), -1, SQLITE_TRANSIENT);
+
+    uint64_t fingerprint(const char* text) {
+        auto cached = byText_.find(text);
+        if (cached == byText_.end() || cached->second.raw != text) {
+            std::string sql = detail::normalizeSql(text);
+            uint64_t fp = detail::hashKey(std::string_view(sql));
+            if (byText_.size() >= detail::kSqlTextCacheLimit) byText_.clear();
+            cached = byText_.insert_or_assign(text, Cached{text, fp}).first;
+        }
+        return cached->second.fingerprint;
     }
 
-    bool step() {
-        int rc = sqlite3_step(stmt_);
-        if(rc == SQLITE_ROW) return true;
-        if(rc == SQLITE_DONE) return false;
-        throw SQLiteException(sqlite3_errmsg(sqlite3_db_handle(stmt_)));
+    // The statement's entry, replanned if the schema moved since its plan
+    // was taken; called with mutex_ held
+    Tracked& tracked(uint64_t fp, const char* text) {
+        Tracked& t = tracked_[fp];
+        if (t.entry.fingerprint == 0) {
+            t.entry.fingerprint = fp;
+            t.entry.sql = detail::normalizeSql(text);
+        }
+        if (t.schemaVersion < 0 || t.schemaVersion != schemaVersion()) plan(t, text);
+        return t;
     }
 
-    void reset() { sqlite3_reset(stmt_); }
+    Entry view(const Tracked& t) const {
+        Entry e = t.entry;
+        if (e.current.text.empty()) e.current = e.baseline;
+        return e;
+    }
 
-    int getInt(int col) { return sqlite3_column_int(stmt_, col); }
-    double getDouble(int col) { return sqlite3_column_double(stmt_, col); }
-    std::string getText(int col) {
-        const char* txt = reinterpret_cast<const char*>(sqlite3_column_text(stmt_, col));
-        return txt ? txt : "";
+    void prepared(sqlite3_stmt* stmt) {
+        const char* text = sqlite3_sql(stmt);
+        if (!text || sqlite3_stmt_isexplain(stmt)) return;
+        uint64_t fp = fingerprint(text);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            Tracked& t = tracked(fp, text);
+            // Statements finalized without a step never finish
+            if (statements_.size() >= detail::kSqlTextCacheLimit) statements_.clear();
+            statements_[stmt] = {&t, currentHash(t), sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_REPREPARE, 0)};
+        }
+        deliver();
     }
 
-    // Map each row using a lambda
-    void forEachRow(const std::function<void(Statement&)>& fn) {
-        while(step()) fn(*this);
-        reset();
+    void finished(sqlite3_stmt* stmt, uint64_t ns) {
+        const char* text = sqlite3_sql(stmt);
+        if (!text || sqlite3_stmt_isexplain(stmt)) return;
+        std::unique_lock<std::mutex> lock(mutex_);
+        Tracked* t = nullptr;
+        uint64_t planHash = 0;
+        auto it = statements_.find(stmt);
+        if (it != statements_.end()) {
+            t = it->second.tracked;
+            planHash = it->second.planHash;
+            if (sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_REPREPARE, 0) != it->second.reprepares) {
+                plan(*t, text);
+                planHash = currentHash(*t);
+            }
+            statements_.erase(it);
+        } else {
+            // Run again after its first finish, or prepared before the
+            // monitor was attached
+            t = &tracked(fingerprint(text), text);
+            planHash = currentHash(*t);
+        }
+        Entry& e = t->entry;
+        Plan* p = planHash == e.baseline.hash ? &e.baseline
+                : planHash == e.current.hash && !e.current.text.empty() ? &e.current : nullptr;
+        if (p && !p->text.empty()) {
+            ++p->calls;
+            p->totalNs += ns;
+            p->maxNs = std::max(p->maxNs, ns);
+        }
+        lock.unlock();
+        deliver();
     }
 
-    // Generic row-to-struct mapping
-    template<typename T>
-    std::vector<T> mapRows(std::function<T(Statement&)> mapper) {
-        std::vector<T> results;
-        forEachRow([&](Statement& row){ results.push_back(mapper(row)); });
-        return results;
+    // Regressions found by plan(), reported once mutex_ is released so the
+    // callback may read the monitor. Only the connection's thread plans.
+    void deliver() {
+        if (reports_.empty()) return;
+        std::vector<Entry> reports;
+        reports.swap(reports_);
+        for (const auto& e : reports) report(e);
     }
 
-    // Fetch single column as vector
-    template<typename T>
-    std::vector<T> column(int colIndex);
-};
+    static uint64_t currentHash(const Tracked& t) {
+        return t.entry.current.text.empty() ? t.entry.baseline.hash : t.entry.current.hash;
+    }
 
-// ---------------------------------
-// Database::prepare
-// ---------------------------------
-inline std::unique_ptr<Statement> Database::prepare(const std::string& sql) {
-    return std::make_unique<Statement>(db_, sql);
-}
+    // Take the statement's plan now and compare it with the baseline;
+    // called with mutex_ held
+    void plan(Tracked& t, const char* text) {
+        t.schemaVersion = schemaVersion();
+        std::string now = detail::explainPlan(db_.get(), text);
+        if (now.empty()) return;
+        uint64_t hash = detail::hashKey(std::string_view(now));
+        Entry& e = t.entry;
+        if (e.baseline.text.empty()) {
+            rebase(t, Plan{hash, std::move(now), 0, 0, 0});
+            return;
+        }
+        if (hash == e.baseline.hash) {
+            e.current = Plan();
+            e.reasons.clear();
+            return;
+        }
+        if (hash == e.current.hash && !e.current.text.empty()) return;
+        std::vector<std::string> reasons = detail::planRegressions(e.baseline.text, now);
+        if (reasons.empty() && options_.adoptChanges) {
+            rebase(t, Plan{hash, std::move(now), 0, 0, 0});
+            return;
+        }
+        e.current = Plan{hash, std::move(now), 0, 0, 0};
+        e.reasons = std::move(reasons);
+        if (!e.reasons.empty()) reports_.push_back(view(t));
+    }
 
-// ---------------------------------
-// Template specializations
-// ---------------------------------
-template<>
-inline std::vector<int> Statement::column<int>(int colIndex) {
-    std::vector<int> res;
-    while(step()) res.push_back(getInt(colIndex));
-    reset();
-    return res;
-}
+    // Replace the baseline, in memory and in the sidecar
+    void rebase(Tracked& t, Plan baseline) {
+        Entry& e = t.entry;
+        e.baseline = std::move(baseline);
+        e.current = Plan();
+        e.reasons.clear();
+        t.flushedCalls = e.baseline.calls;
+        t.flushedNs = e.baseline.totalNs;
+        t.stored = false;
+        if (!sidecar_) return;
+        auto q = sidecar_->tryPrepare(
+            "INSERT OR REPLACE INTO rdb_plan_baseline(fingerprint, sql, plan, plan_hash, calls, total_ns, max_ns, updated) "
+            "VALUES(?, ?, ?, ?, ?, ?, ?, CAST(strftime('%s', 'now') AS INTEGER));");
+        if (!q) return fail();
+        (*q)->bindInt64(1, static_cast<int64_t>(e.fingerprint));
+        (*q)->bind(2, e.sql);
+        (*q)->bind(3, e.baseline.text);
+        (*q)->bindInt64(4, static_cast<int64_t>(e.baseline.hash));
+        (*q)->bindInt64(5, static_cast<int64_t>(e.baseline.calls));
+        (*q)->bindInt64(6, static_cast<int64_t>(e.baseline.totalNs));
+        (*q)->bindInt64(7, static_cast<int64_t>(e.baseline.maxNs));
+        if (!(*q)->tryStep()) return fail();
+        t.stored = true;
+    }
 
-template<>
-inline std::vector<double> Statement::column<double>(int colIndex) {
-    std::vector<double> res;
-    while(step()) res.push_back(getDouble(colIndex));
-    reset();
-    return res;
-}
+    void report(const Entry& e) {
+        if (options_.onRegression) {
+            options_.onRegression(e);
+            return;
+        }
+        std::cerr << "rdb: query plan regression: " << e.sql << "\n";
+        for (const auto& reason : e.reasons) std::cerr << "  " << reason << "\n";
+        std::cerr << "  baseline (" << e.baseline.calls << " calls, mean " << e.baseline.meanNs() / 1000.0
+                  << " us):\n" << indent(e.baseline.text) << "  now:\n" << indent(e.current.text);
+    }
 
-template<>
-inline std::vector<std::string> Statement::column<std::string>(int colIndex) {
-    std::vector<std::string> res;
-    while(step()) res.push_back(getText(colIndex));
-    reset();
-    return res;
-}
+    static std::string indent(const std::string& plan) {
+        std::string out;
+        for (size_t start = 0; start < plan.size();) {
+            size_t end = plan.find('\n', start);
+            if (end == std::string::npos) end = plan.size();
+            out += "    " + plan.substr(start, end - start) + "\n";
+            start = end + 1;
+        }
+        return out;
+    }
+};
 
 // ---------------------------------
 // PHP-like API (compatible with old sl_sqlite3 interface)
@@ -218,38 +7567,50 @@ public:
 class DBConnect {
 private:
     std::unique_ptr<Database> db_;
+    std::unique_ptr<SchemaCatalog> catalog_;
+    WorkloadLog* captureLog_ = nullptr;
+    std::unique_ptr<WorkloadCapture> capture_;
+    AllocationProfile* allocationProfile_ = nullptr;
+    std::unique_ptr<AllocationTracker> allocationTracker_;
     
     void executeQuery(SQLResults* results, const std::string& sql) {
-        try {
-            results->clear();
-            auto stmt = db_->prepare(sql);
-            
-            // Get column count
-            int column_count = sqlite3_column_count(stmt->stmt_);
-            
-            // Fetch all rows
-            while (stmt->step()) {
-                SQLRow row;
-                for (int i = 0; i < column_count; i++) {
-                    const char* col_name = sqlite3_column_name(stmt->stmt_, i);
-                    const char* col_text = reinterpret_cast<const char*>(
-                        sqlite3_column_text(stmt->stmt_, i)
-                    );
-                    row[col_name ? col_name : ""] = col_text ? col_text : "";
-                }
-                results->results.push_back(row);
-            }
-            
-            results->num_rows = results->results.size();
-            results->num_fields = column_count;
-            results->num_tuples = results->num_rows;
-            results->row_iterator = results->results.begin();
-            
-        } catch (const SQLiteException& e) {
-            results->error_message = e.what();
+        results->clear();
+        auto prepared = db_->tryPrepare(sql);
+        if (!prepared) {
+            results->error_message = db_->errorMessage();
             results->num_rows = 0;
             results->num_fields = 0;
+            return;
         }
+        auto& stmt = *prepared;
+
+        // Get column count
+        int column_count = sqlite3_column_count(stmt->stmt_);
+
+        // Fetch all rows
+        Status st;
+        while ((st = stmt->tryStep()).row()) {
+            SQLRow row;
+            for (int i = 0; i < column_count; i++) {
+                const char* col_name = sqlite3_column_name(stmt->stmt_, i);
+                const char* col_text = reinterpret_cast<const char*>(
+                    sqlite3_column_text(stmt->stmt_, i)
+                );
+                row[col_name ? col_name : ""] = col_text ? col_text : "";
+            }
+            results->results.push_back(row);
+        }
+        if (!st) {
+            results->error_message = db_->errorMessage();
+            results->num_rows = 0;
+            results->num_fields = 0;
+            return;
+        }
+
+        results->num_rows = results->results.size();
+        results->num_fields = column_count;
+        results->num_tuples = results->num_rows;
+        results->row_iterator = results->results.begin();
     }
     
 public:
@@ -262,7 +7623,28 @@ public:
     
     // Initialize/open database
     void open(const std::string& filename) {
+        catalog_.reset();
+        capture_.reset();
+        allocationTracker_.reset();
         db_ = std::make_unique<Database>(filename);
+        if (captureLog_) capture_ = std::make_unique<WorkloadCapture>(*db_, *captureLog_);
+        if (allocationProfile_) allocationTracker_ = std::make_unique<AllocationTracker>(*db_, *allocationProfile_);
+    }
+    
+    // Record every statement into log (see WorkloadCapture); nullptr stops.
+    // Capture follows the connection across open().
+    void capture(WorkloadLog* log) {
+        capture_.reset();
+        captureLog_ = log;
+        if (log && db_) capture_ = std::make_unique<WorkloadCapture>(*db_, *log);
+    }
+
+    // Account allocations per statement (see AllocationProfile); nullptr
+    // stops. Like capture, this follows the connection across open().
+    void accountAllocations(AllocationProfile* profile) {
+        allocationTracker_.reset();
+        allocationProfile_ = profile;
+        if (profile && db_) allocationTracker_ = std::make_unique<AllocationTracker>(*db_, *profile);
     }
     
     // Query with results (PHP-like)
@@ -276,10 +7658,8 @@ public:
     
     // Query without results (for INSERT, UPDATE, DELETE)
     void query(const std::string& sql) {
-        try {
-            db_->execute(sql);
-        } catch (const SQLiteException& e) {
-            std::cerr << "Query error: " << e.what() << std::endl;
+        if (!db_->tryExecute(sql)) {
+            std::cerr << "Query error: " << db_->errorMessage() << std::endl;
         }
     }
     
@@ -307,11 +7687,14 @@ public:
     }
     
     // Check if table exists
+    // Answered from a SchemaCatalog that is reloaded only when the schema
+    // changes. The name must match exactly, as with the sqlite_master
+    // query this replaced, though the catalog itself ignores case.
     bool does_table_exist(const std::string& table_name) {
-        SQLResults results;
-        std::string sql = "SELECT name FROM sqlite_master WHERE type='table' AND name='" + table_name + "';";
-        query(&results, sql);
-        return results.num_rows > 0;
+        if (!catalog_) catalog_ = std::make_unique<SchemaCatalog>(*db_);
+        else catalog_->refreshIfChanged();
+        const SchemaCatalog::Table* t = catalog_->table(table_name);
+        return t && !t->view && t->name == table_name;
     }
     
     // Get underlying Database object for advanced operations
@@ -333,3 +7716,44 @@ inline std::string sql_escape(const std::string& src) {
 }
 
 } // namespace rdb
+
+// Counting global operator new/delete for AllocationProfile; define
+// RDB_COUNT_NEW in exactly one source file, before including rdb.h
+#ifdef RDB_COUNT_NEW
+// GCC pairs the malloc below with its own idea of operator new once both
+// are visible in one translation unit
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void* operator new(std::size_t n) {
+    ++rdb::detail::allocationCount.heapAllocations;
+    rdb::detail::allocationCount.heapBytes += n;
+    for (;;) {
+        if (void* p = std::malloc(n ? n : 1)) return p;
+        std::new_handler handler = std::get_new_handler();
+#if RDB_EXCEPTIONS
+        if (!handler) throw std::bad_alloc();
+#else
+        if (!handler) std::abort();
+#endif
+        handler();
+    }
+}
+void* operator new[](std::size_t n) { return ::operator new(n); }
+void* operator new(std::size_t n, const std::nothrow_t&) noexcept {
+    ++rdb::detail::allocationCount.heapAllocations;
+    rdb::detail::allocationCount.heapBytes += n;
+    return std::malloc(n ? n : 1);
+}
+void* operator new[](std::size_t n, const std::nothrow_t& tag) noexcept { return ::operator new(n, tag); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
@@ -0,0 +1,1474 @@
+// rdb-bench: the measurements behind the figures quoted for rdb's
+// features, one named case each, so they can be repeated on other
+// hardware or after a change.
+//
+//   g++ -std=c++17 -O2 -Iinclude tools/rdb_bench.cpp -lsqlite3 -pthread -o rdb-bench
+//   ./rdb-bench                      # every case
+//   ./rdb-bench array                # named cases only
+//   ./rdb-bench --scale 0.1 array    # a tenth of the rows, for a quick run
+//
+// Cases:
+//   array      IN lists: bindArray vs a temp table vs SQL text (1M rows)
+//   vector     exact, SQL and IVF nearest-neighbour search (1M x 128-d;
+//              add -march=native to use the AVX2 kernels)
+//   keyfilter  KeyFilter::contains vs an indexed SELECT for absent keys (1M keys)
+//   mirror     TableMirror::get vs a prepared SELECT (100k rows, 1M gets)
+//   kvstore    KVStore puts, gets, multiGet and scans vs statements prepared per call
+//   queue      Queue claim/ack throughput and claim latency per consumer count
+//   pager      KeysetPager vs LIMIT/OFFSET at pages 1, 2000 and 19000 (1M rows)
+//   blob       a 64 MB blob written and read whole vs through BlobStream,
+//              with peak RSS (each side runs in its own process)
+//   trystep    a failing insert through step() + catch vs tryStep()
+//   pool       first query on a fresh connection vs a warmed ConnectionPool
+//   warmer     index lookups on a cold file vs after PageCacheWarmer, whole
+//              file and one index (needs dbstat)
+//   catalog    does_table_exist vs the sqlite_master query it replaced,
+//              SchemaCatalog lookups and reloads (205-table schema)
+//   optimize   a query on a skewed table before and after an
+//              OptimizeScheduler pass (300k rows)
+//   profiler   QueryProfiler overhead, and a workload before and after the
+//              IndexAdvisor's suggestions (200k orders)
+//   vacuum     IncrementalVacuum reclaiming a 90%-deleted file while a
+//              writer runs, with the writer's latency
+//   capture    statement cost with and without a WorkloadCapture attached
+//   histogram  LatencyHistogram record cost and percentile error
+//   latency    statement cost with a LatencyTracker attached
+//   metrics    statement cost with a MetricsTracker attached
+//   timeline   statement cost with a TimelineTracker attached
+//   allocation allocations per execution through DBConnect vs a stepped
+//              statement, and AllocationTracker's cost
+//   plans      statement cost with a PlanMonitor attached, and a regression
+//              it reports when an index is dropped
+//
+// Options:
+//   --dir PATH     where file databases are created and removed (default /tmp)
+//   --scale X      multiplies every row count (default 1)
+//   --threads LIST comma-separated thread counts for the concurrent cases (default 1,4,16)
+//   --list         print the cases and exit
+//
+// Times are wall clock, means over the repetitions shown; run on an idle
+// machine and compare runs of the same build.
+//
+// RDB_COUNT_NEW is defined so the allocation case can count heap
+// allocations; every case pays its thread-local increment per new/delete.
+
+#define RDB_COUNT_NEW
+#include "../include/rdb.h"
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+struct Options {
+    std::string dir = "/tmp";
+    double scale = 1;
+    std::vector<unsigned> threads{1, 4, 16};
+    std::vector<std::string> cases;
+};
+
+using Clock = std::chrono::steady_clock;
+
+double usSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+// Mean microseconds per call of fn over n calls
+template<typename F>
+double usPerCall(size_t n, F&& fn) {
+    auto start = Clock::now();
+    for (size_t i = 0; i < n; ++i) fn(i);
+    return usSince(start) / static_cast<double>(n);
+}
+
+// Something attached for the duration of a measurement (a tracker, a
+// listener); released when the pointer goes
+using Attached = std::shared_ptr<void>;
+
+// ns per call of fn under each configuration. Configurations take turns
+// for a round each, and each keeps its best round: the overhead cases look
+// for differences of tens of ns, below the noise between single runs.
+std::vector<double> interleaved(size_t n, const std::vector<std::function<Attached()>>& configs,
+                                const std::function<void(size_t)>& fn) {
+    const size_t rounds = 5;
+    std::vector<double> best(configs.size(), 0);
+    for (size_t r = 0; r < rounds; ++r) {
+        for (size_t c = 0; c < configs.size(); ++c) {
+            Attached attached = configs[c]();
+            double ns = usPerCall(std::max<size_t>(n / rounds, 1), fn) * 1000;
+            best[c] = r ? std::min(best[c], ns) : ns;
+        }
+    }
+    return best;
+}
+
+size_t scaled(const Options& o, size_t rows) {
+    return std::max<size_t>(static_cast<size_t>(static_cast<double>(rows) * o.scale), 1);
+}
+
+// A fresh database file under --dir, removed (with its -wal and -shm)
+// when the case is done
+class TempFile {
+public:
+    TempFile(const Options& o, const std::string& name) : path_(o.dir + "/rdb-bench-" + name + ".db") { remove(); }
+    ~TempFile() { remove(); }
+    const std::string& path() const { return path_; }
+
+private:
+    std::string path_;
+    void remove() {
+        for (const char* suffix : {"", "-wal", "-shm", "-journal"}) std::remove((path_ + suffix).c_str());
+    }
+};
+
+void header(const std::string& title) { std::cout << "\n" << title << "\n"; }
+
+std::string fixed(double v, int precision) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(precision) << v;
+    return out.str();
+}
+
+// One labelled figure, values aligned in a column
+void line(const std::string& label, const std::string& value) {
+    std::cout << "  " << std::left << std::setw(36) << label << std::right << value << "\n";
+}
+
+// Peak resident set size of this process so far, in MB
+double peakRssMb() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<double>(usage.ru_maxrss) / 1024;   // KiB on Linux
+}
+
+// Runs fn in a child process so that peakRssMb() inside it measures fn
+// alone, not whatever earlier cases left behind
+void isolated(const std::function<void()>& fn) {
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int rc = 0;
+        try {
+            fn();
+        } catch (const std::exception& e) {
+            std::cerr << "rdb-bench: " << e.what() << "\n";
+            rc = 1;
+        }
+        std::cout.flush();
+        std::_Exit(rc);
+    }
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        throw std::runtime_error("child process failed");
+}
+
+// Point SELECTs on a small in-memory table, for the cases that measure
+// what an attached tracker adds to each statement
+class PointQueries {
+public:
+    static constexpr size_t rows = 10000;
+
+    explicit PointQueries(rdb::Database& db) : db_(db) {
+        db.execute("CREATE TABLE t(id INTEGER PRIMARY KEY, name TEXT);");
+        rdb::Database::Transaction tx(db);
+        auto insert = db.prepare("INSERT INTO t(name) VALUES (?);");
+        for (size_t i = 0; i < rows; ++i) {
+            insert->bind(1, "name " + std::to_string(i));
+            insert->step();
+            insert->reset();
+        }
+        tx.commit();
+        select_ = db.prepare("SELECT name FROM t WHERE id = ?;");
+    }
+
+    // The same prepared statement, rebound
+    void bound(size_t i) {
+        select_->bindInt64(1, static_cast<int64_t>(i % rows + 1));
+        select_->step();
+        select_->reset();
+    }
+
+    // A new statement per call with the key in the SQL text, as
+    // DBConnect-style code does
+    void literal(size_t i) { db_.execute("SELECT name FROM t WHERE id = " + std::to_string(i % rows + 1) + ";"); }
+
+private:
+    rdb::Database& db_;
+    std::unique_ptr<rdb::Statement> select_;
+};
+
+// ---------------------------------
+// array: Statement::bindArray
+// ---------------------------------
+
+void array(const Options& o) {
+    size_t rows = scaled(o, 1000000);
+    header("array: IN lists of random ids over " + std::to_string(rows) + " rows, in-memory, ms per query");
+    rdb::Database db(":memory:");
+    db.execute("CREATE TABLE t(id INTEGER PRIMARY KEY, v INTEGER);");
+    {
+        rdb::Database::Transaction tx(db);
+        auto insert = db.prepare("INSERT INTO t(id, v) VALUES (?1, ?1 * 7);");
+        for (size_t i = 1; i <= rows; ++i) {
+            insert->bindInt64(1, static_cast<int64_t>(i));
+            insert->step();
+            insert->reset();
+        }
+        tx.commit();
+    }
+
+    auto viaArray = db.prepare("SELECT sum(v) FROM t WHERE id IN rdb_array(?1);");
+    db.execute("CREATE TEMP TABLE ids(id INTEGER PRIMARY KEY);");
+    auto fill = db.prepare("INSERT OR IGNORE INTO ids(id) VALUES (?);");
+    auto viaTemp = db.prepare("SELECT sum(v) FROM t WHERE id IN (SELECT id FROM ids);");
+
+    std::mt19937_64 rng(42);
+    std::uniform_int_distribution<int64_t> pick(1, static_cast<int64_t>(rows));
+    std::cout << "  ids       bindArray   temp table   SQL text\n";
+    for (size_t count : {10, 100, 1000, 10000}) {
+        size_t reps = std::max<size_t>(20000 / count, 5);
+        std::vector<std::vector<int64_t>> lists(reps);
+        for (auto& l : lists)
+            for (size_t i = 0; i < count; ++i) l.push_back(pick(rng));
+
+        double a = usPerCall(reps, [&](size_t r) {
+            viaArray->bindArray(1, lists[r]);
+            viaArray->step();
+            viaArray->reset();
+        });
+        double t = usPerCall(reps, [&](size_t r) {
+            rdb::Database::Transaction tx(db);
+            db.execute("DELETE FROM ids;");
+            for (int64_t id : lists[r]) {
+                fill->bindInt64(1, id);
+                fill->step();
+                fill->reset();
+            }
+            viaTemp->step();
+            viaTemp->reset();
+            tx.commit();
+        });
+        double s = usPerCall(reps, [&](size_t r) {
+            std::string sql = "SELECT sum(v) FROM t WHERE id IN (";
+            for (size_t i = 0; i < lists[r].size(); ++i) sql += (i ? "," : "") + std::to_string(lists[r][i]);
+            auto q = db.prepare(sql + ");");
+            q->step();
+        });
+        std::cout << "  " << std::left << std::setw(8) << count << std::right << std::setw(11) << fixed(a / 1000, 3)
+                  << std::setw(13) << fixed(t / 1000, 3) << std::setw(11) << fixed(s / 1000, 3) << "\n";
+    }
+}
+
+// ---------------------------------
+// vector: distance functions and VectorIndex
+// ---------------------------------
+
+void vector(const Options& o) {
+    const size_t rows = scaled(o, 1000000), dims = 128, k = 10;
+    header("vector: " + std::to_string(rows) + " x " + std::to_string(dims) +
+           "-d vectors, file database, top-" + std::to_string(k) + ", ms per query");
+    TempFile file(o, "vector");
+    rdb::Database db(file.path());
+    rdb::registerVectorFunctions(db);
+    db.execute("CREATE TABLE v(id INTEGER PRIMARY KEY, f BLOB, q BLOB);");
+
+    std::mt19937 rng(7);
+    std::normal_distribution<float> normal;
+    auto randomVector = [&] {
+        std::vector<float> out(dims);
+        for (float& x : out) x = normal(rng);
+        return out;
+    };
+    auto quantize = [](const std::vector<float>& f) {
+        std::vector<int8_t> out(f.size());
+        for (size_t i = 0; i < f.size(); ++i) out[i] = static_cast<int8_t>(std::clamp(f[i] * 40.0f, -127.0f, 127.0f));
+        return out;
+    };
+    {
+        rdb::Database::Transaction tx(db);
+        auto insert = db.prepare("INSERT INTO v(f, q) VALUES (?, ?);");
+        for (size_t i = 0; i < rows; ++i) {
+            auto f = randomVector();
+            auto q = quantize(f);
+            insert->bindBlob(1, f.data(), static_cast<int>(f.size() * sizeof(float)));
+            insert->bindBlob(2, q.data(), static_cast<int>(q.size()));
+            insert->step();
+            insert->reset();
+        }
+        tx.commit();
+    }
+
+    const size_t queries = 5;
+    std::vector<std::vector<float>> probes;
+    for (size_t i = 0; i < queries; ++i) probes.push_back(randomVector());
+
+    rdb::VectorIndex exact(db, "v", "f", dims, rdb::VectorMetric::L2);
+    exact.search(probes[0].data(), k);   // warm the OS cache
+    line("exact scan (VectorIndex::search)",
+         fixed(usPerCall(queries, [&](size_t i) { exact.search(probes[i].data(), k); }) / 1000, 1));
+
+    auto ordered = db.prepare("SELECT id FROM v ORDER BY vec_l2(f, ?1) LIMIT 10;");
+    line("ORDER BY vec_l2(...) LIMIT", fixed(usPerCall(queries, [&](size_t i) {
+        ordered->bindBlob(1, probes[i].data(), static_cast<int>(dims * sizeof(float)));
+        while (ordered->step()) {}
+        ordered->reset();
+    }) / 1000, 1));
+
+    rdb::VectorIndex int8(db, "v", "q", dims, rdb::VectorMetric::Cosine, rdb::VectorType::Int8);
+    std::vector<std::vector<int8_t>> quantized;
+    for (const auto& p : probes) quantized.push_back(quantize(p));
+    line("int8 cosine exact scan",
+         fixed(usPerCall(queries, [&](size_t i) { int8.search(quantized[i].data(), k); }) / 1000, 1));
+
+    size_t lists = std::max<size_t>(static_cast<size_t>(std::sqrt(static_cast<double>(rows))), 1);
+    auto start = Clock::now();
+    exact.buildIvf(lists);
+    line("IVF build, " + std::to_string(lists) + " lists (total)", fixed(usSince(start) / 1000, 0));
+    for (size_t n : {1, 4, 16}) {
+        double ms = usPerCall(queries, [&](size_t i) { exact.searchIvf(probes[i].data(), k, n); }) / 1000;
+        line("IVF probes=" + std::to_string(n), fixed(ms, 1));
+    }
+}
+
+// ---------------------------------
+// keyfilter: KeyFilter
+// ---------------------------------
+
+void keyfilter(const Options& o) {
+    const size_t rows = scaled(o, 1000000);
+    header("keyfilter: " + std::to_string(rows) + " TEXT keys, lookups of keys that are not there");
+    TempFile file(o, "keyfilter");
+    rdb::Database db(file.path());
+    db.execute("CREATE TABLE events(id INTEGER PRIMARY KEY, dedup_key TEXT); CREATE INDEX events_key ON events(dedup_key);");
+    {
+        rdb::Database::Transaction tx(db);
+        auto insert = db.prepare("INSERT INTO events(dedup_key) VALUES (?);");
+        for (size_t i = 0; i < rows; ++i) {
+            insert->bindText(1, "key-" + std::to_string(i));
+            insert->step();
+            insert->reset();
+        }
+        tx.commit();
+    }
+
+    rdb::KeyFilter filter(db, "events", "dedup_key", 0.01);
+    auto start = Clock::now();
+    filter.build(rows * 2);
+    line("build, sized for 2x the rows (ms)", fixed(usSince(start) / 1000, 1));
+
+    std::vector<std::string> missing;
+    for (size_t i = 0; i < rows; ++i) missing.push_back("missing-" + std::to_string(i));
+    size_t hits = 0;
+    line("KeyFilter::contains (ns)", fixed(usPerCall(rows, [&](size_t i) { hits += filter.contains(missing[i]); }) * 1000, 0));
+
+    auto select = db.prepare("SELECT 1 FROM events WHERE dedup_key = ?;");
+    size_t lookups = std::min<size_t>(rows, 200000);
+    line("indexed SELECT (ns)", fixed(usPerCall(lookups, [&](size_t i) {
+        select->bindText(1, missing[i]);
+        hits += select->step();
+        select->reset();
+    }) * 1000, 0));
+
+    auto stats = filter.stats();
+    line("filter size (MB)", fixed(static_cast<double>(stats.memoryBytes) / 1e6, 1));
+    line("false positives, estimated (%)", fixed(stats.estimatedFalsePositiveRate * 100, 3));
+    line("false positives, observed (%)", fixed(stats.observedFalsePositiveRate * 100, 3));
+
+    std::string sidecar = file.path() + ".bloom";
+    filter.save(sidecar);
+    rdb::KeyFilter reloaded(db, "events", "dedup_key", 0.01);
+    start = Clock::now();
+    bool loaded = reloaded.load(sidecar);
+    line("sidecar load (ms)", loaded ? fixed(usSince(start) / 1000, 1) : "failed");
+    std::remove(sidecar.c_str());
+    line("keys reported present", std::to_string(hits));
+}
+
+// ---------------------------------
+// mirror: TableMirror
+// ---------------------------------
+
+void mirror(const Options& o) {
+    const size_t rows = scaled(o, 100000), gets = scaled(o, 1000000);
+    header("mirror: " + std::to_string(rows) + "-row table, in-memory, random primary key lookups, ns per get");
+    rdb::Database db(":memory:");
+    db.execute("CREATE TABLE products(id INTEGER PRIMARY KEY, name TEXT, price REAL);");
+    {
+        rdb::Database::Transaction tx(db);
+        auto insert = db.prepare("INSERT INTO products(id, name, price) VALUES (?, ?, ?);");
+        for (size_t i = 1; i <= rows; ++i) {
+            insert->bindInt64(1, static_cast<int64_t>(i));
+            insert->bind(2, "product " + std::to_string(i));
+            insert->bind(3, static_cast<double>(i) * 0.25);
+            insert->step();
+            insert->reset();
+        }
+        tx.commit();
+    }
+
+    struct Product {
+        int64_t id;
+        std::string name;
+        double price;
+    };
+    auto decode = [](rdb::Statement& row) { return Product{row.getInt64(0), row.getText(1), row.getDouble(2)}; };
+    rdb::TableMirror<Product> products(db, "products", "id, name, price", decode);
+
+    std::mt19937_64 rng(3);
+    std::uniform_int_distribution<int64_t> pick(1, static_cast<int64_t>(rows));
+    std::vector<int64_t> keys(gets);
+    for (auto& k : keys) k = pick(rng);
+
+    double total = 0;
+    line("TableMirror::get", fixed(usPerCall(gets, [&](size_t i) {
+        if (const Product* p = products.get(keys[i])) total += p->price;
+    }) * 1000, 0));
+    auto select = db.prepare("SELECT id, name, price FROM products WHERE id = ?;");
+    line("prepared SELECT, row decoded", fixed(usPerCall(gets, [&](size_t i) {
+        select->bindInt64(1, keys[i]);
+        if (select->step()) total += decode(*select).price;
+        select->reset();
+    }) * 1000, 0));
+    line("sum of prices read", fixed(total, 0));
+}
+
+// ---------------------------------
+// kvstore: KVStore
+// ---------------------------------
+
+void kvstore(const Options& o) {
+    const size_t keys = scaled(o, 200000);
+    header("kvstore: " + std::to_string(keys) + " keys, 100-byte values, file database, WAL, synchronous=NORMAL");
+    TempFile file(o, "kvstore");
+    rdb::Database db(file.path());
+    db.execute("PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL;");
+    rdb::KVStore kv(db, "kv");
+
+    std::vector<std::pair<std::string, std::string>> items;
+    for (size_t i = 0; i < keys; ++i) {
+        std::string value(100, static_cast<char>('a' + i % 26));
+        items.emplace_back("user:" + std::to_string(i), std::move(value));
+    }
+    auto perSecond = [](size_t n, double us) { return fixed(static_cast<double>(n) / us * 1e6 / 1000, 0) + "k/s"; };
+
+    auto start = Clock::now();
+    kv.putBatch(items);
+    line("putBatch", perSecond(keys, usSince(start)));
+
+    db.execute("CREATE TABLE raw(k TEXT PRIMARY KEY, v BLOB) WITHOUT ROWID;");
+    start = Clock::now();
+    {
+        rdb::Database::Transaction tx(db);
+        for (const auto& [k, v] : items) {
+            auto insert = db.prepare("INSERT OR REPLACE INTO raw(k, v) VALUES (?, ?);");
+            insert->bindText(1, k);
+            insert->bindBlob(2, v.data(), static_cast<int>(v.size()));
+            insert->step();
+        }
+        tx.commit();
+    }
+    line("prepare + INSERT OR REPLACE each", perSecond(keys, usSince(start)));
+
+    std::mt19937_64 rng(5);
+    std::uniform_int_distribution<size_t> pick(0, keys - 1);
+    std::vector<size_t> order(keys);
+    for (auto& i : order) i = pick(rng);
+
+    size_t found = 0;
+    double us = usPerCall(keys, [&](size_t i) { found += kv.get(items[order[i]].first).has_value(); });
+    line("KVStore::get", perSecond(1, us));
+    us = usPerCall(keys, [&](size_t i) {
+        auto select = db.prepare("SELECT v FROM raw WHERE k = ?;");
+        select->bindText(1, items[order[i]].first);
+        found += select->step();
+    });
+    line("prepare + SELECT each", perSecond(1, us));
+
+    std::vector<std::string_view> batch;
+    start = Clock::now();
+    for (size_t i = 0; i < keys; ++i) {
+        batch.push_back(items[order[i]].first);
+        if (batch.size() == 100 || i + 1 == keys) {
+            for (const auto& v : kv.multiGet(batch)) found += v.has_value();
+            batch.clear();
+        }
+    }
+    line("multiGet, 100 keys per call", perSecond(keys, usSince(start)));
+
+    size_t scanned = 0;
+    start = Clock::now();
+    for (auto it = kv.scanPrefix("user:"); it.valid(); it.next()) scanned += it.value().size() > 0;
+    line("scanPrefix", perSecond(scanned, usSince(start)));
+    line("keys found", std::to_string(found));
+}
+
+// ---------------------------------
+// queue: Queue
+// ---------------------------------
+
+void queue(const Options& o) {
+    const size_t jobs = scaled(o, 100000);
+    header("queue: " + std::to_string(jobs) + " 64-byte jobs in 3 lanes, file database, WAL, synchronous=NORMAL,\n"
+           "  a connection per consumer, claim(32) then batch ack");
+    std::cout << "  threads    jobs/s   claim p50   claim p99   enqueueBatch\n";
+    for (unsigned threads : o.threads) {
+        TempFile file(o, "queue");
+        {
+            rdb::Database db(file.path());
+            db.execute("PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL;");
+        }
+        double enqueueRate;
+        {
+            rdb::Database db(file.path());
+            rdb::Queue producer(db, "jobs");
+            const size_t perLane = jobs / 3 + 1;
+            std::vector<std::string> payloads(perLane, std::string(64, 'j'));
+            auto start = Clock::now();
+            for (int lane = 0; lane < 3; ++lane) producer.enqueueBatch(payloads, lane);
+            enqueueRate = static_cast<double>(perLane * 3) / usSince(start) * 1e6;
+        }
+
+        std::vector<rdb::LatencyHistogram> claims(threads);
+        std::atomic<size_t> done(0);
+        auto consume = [&](unsigned t) {
+            rdb::Database db(file.path());
+            db.execute("PRAGMA synchronous=NORMAL;");
+            db.setBusyTimeout(5000);
+            rdb::Queue worker(db, "jobs");
+            for (;;) {
+                auto start = Clock::now();
+                auto batch = worker.claim(32);
+                claims[t].record(static_cast<uint64_t>(usSince(start) * 1000));
+                if (batch.empty()) return;
+                done += worker.ack(batch);
+            }
+        };
+        auto start = Clock::now();
+        std::vector<std::thread> pool;
+        for (unsigned t = 0; t < threads; ++t) pool.emplace_back(consume, t);
+        for (auto& t : pool) t.join();
+        double elapsed = usSince(start);
+
+        rdb::LatencyHistogram all;
+        for (const auto& h : claims) all.merge(h);
+        std::cout << "  " << std::setw(7) << threads << std::setw(10) << fixed(static_cast<double>(done) / elapsed * 1e6, 0)
+                  << std::setw(9) << fixed(static_cast<double>(all.percentile(50)) / 1000, 0) << " us"
+                  << std::setw(9) << fixed(static_cast<double>(all.percentile(99)) / 1000, 0) << " us"
+                  << std::setw(11) << fixed(enqueueRate, 0) << "/s\n";
+    }
+}
+
+// ---------------------------------
+// pager: KeysetPager
+// ---------------------------------
+
+void pager(const Options& o) {
+    const size_t rows = scaled(o, 1000000), pageSize = 50;
+    header("pager: " + std::to_string(rows) + " rows, index on (grp, id), " + std::to_string(pageSize) +
+           " rows per page, us per page");
+    TempFile file(o, "pager");
+    rdb::Database db(file.path());
+    db.execute("CREATE TABLE t(id INTEGER PRIMARY KEY, grp INTEGER NOT NULL, title TEXT);");
+    {
+        rdb::Database::Transaction tx(db);
+        auto insert = db.prepare("INSERT INTO t(grp, title) VALUES (?, ?);");
+        for (size_t i = 0; i < rows; ++i) {
+            insert->bindInt64(1, static_cast<int64_t>(i % 97));
+            insert->bind(2, "title " + std::to_string(i));
+            insert->step();
+            insert->reset();
+        }
+        tx.commit();
+    }
+    db.execute("CREATE INDEX t_grp_id ON t(grp, id);");
+
+    const size_t pages = rows / pageSize;
+    std::vector<size_t> marks{1, 2000, 19000};
+    marks.erase(std::remove_if(marks.begin(), marks.end(), [&](size_t p) { return p > pages; }), marks.end());
+
+    rdb::KeysetPager keyset(db, "SELECT grp, id, title FROM t", {{"grp", false}, {"id", false}}, pageSize);
+    size_t seen = 0;
+    auto onRow = [&](rdb::Statement&) { ++seen; };
+    auto offset = db.prepare("SELECT grp, id, title FROM t ORDER BY grp, id LIMIT ?1 OFFSET ?2;");
+    std::string token;
+    size_t page = 1;
+    for (size_t mark : marks) {
+        while (page < mark) {
+            token = keyset.fetch(token, onRow);
+            ++page;
+        }
+        double k = usPerCall(20, [&](size_t) { keyset.fetch(token, onRow); });
+        double f = usPerCall(mark > 1000 ? 3 : 20, [&](size_t) {
+            offset->bindInt64(1, static_cast<int64_t>(pageSize));
+            offset->bindInt64(2, static_cast<int64_t>((mark - 1) * pageSize));
+            while (offset->step()) ++seen;
+            offset->reset();
+        });
+        line("page " + std::to_string(mark) + ": keyset / OFFSET", fixed(k, 0) + " / " + fixed(f, 0));
+    }
+}
+
+// ---------------------------------
+// blob: BlobStream
+// ---------------------------------
+
+void blob(const Options& o) {
+    const size_t bytes = scaled(o, 64) << 20, chunkSize = 1 << 20;
+    header("blob: one " + std::to_string(bytes >> 20) + " MB blob, file database, 2 MB page cache, " +
+           std::to_string(chunkSize >> 20) + " MB chunks");
+    auto open = [&](const TempFile& file) {
+        auto db = std::make_unique<rdb::Database>(file.path());
+        db->execute("PRAGMA cache_size=-2048;");
+        db->execute("CREATE TABLE blobs(id INTEGER PRIMARY KEY, data BLOB);");
+        return db;
+    };
+    auto report = [](const std::string& label, double writeUs, double readUs) {
+        line(label, "write " + fixed(writeUs / 1000, 0) + " ms  read " + fixed(readUs / 1000, 0) +
+                        " ms  peak RSS " + fixed(peakRssMb(), 0) + " MB");
+    };
+
+    isolated([&] {
+        TempFile file(o, "blob");
+        auto db = open(file);
+        auto start = Clock::now();
+        {
+            std::vector<unsigned char> value(bytes);
+            for (size_t i = 0; i < bytes; ++i) value[i] = static_cast<unsigned char>(i * 31);
+            auto insert = db->prepare("INSERT INTO blobs(id, data) VALUES (1, ?);");
+            insert->bindBlob(1, value.data(), static_cast<int>(bytes));
+            insert->step();
+        }
+        double write = usSince(start);
+        start = Clock::now();
+        auto select = db->prepare("SELECT data FROM blobs WHERE id = 1;");
+        select->step();
+        auto value = select->getBlob(0);
+        report("bindBlob / getBlob (whole value)", write, usSince(start));
+    });
+
+    isolated([&] {
+        TempFile file(o, "blob");
+        auto db = open(file);
+        std::vector<unsigned char> chunk(chunkSize);
+        auto start = Clock::now();
+        {
+            rdb::Database::Transaction tx(*db);
+            auto insert = db->prepare("INSERT INTO blobs(id, data) VALUES (1, ?);");
+            insert->bindZeroBlob(1, static_cast<int64_t>(bytes));
+            insert->step();
+            {
+                // An open blob handle counts as a running statement, so it
+                // must close before the commit
+                rdb::BlobStream out(*db, "blobs", "data", 1, true);
+                for (size_t offset = 0; offset < bytes; offset += chunkSize) {
+                    for (size_t i = 0; i < chunkSize; ++i) chunk[i] = static_cast<unsigned char>((offset + i) * 31);
+                    out.write(chunk);
+                }
+            }
+            tx.commit();
+        }
+        double write = usSince(start);
+        start = Clock::now();
+        rdb::BlobStream in(*db, "blobs", "data", 1);
+        while (in.read(chunk)) {}
+        report("BlobStream, chunked", write, usSince(start));
+    });
+}
+
+// ---------------------------------
+// trystep: Statement::tryStep
+// ---------------------------------
+
+void trystep(const Options& o) {
+    const size_t inserts = scaled(o, 200000);
+    header("trystep: " + std::to_string(inserts) + " duplicate-key inserts into a UNIQUE column, in-memory, ns per insert");
+    rdb::Database db(":memory:");
+    db.execute("CREATE TABLE t(k INTEGER UNIQUE); INSERT INTO t(k) VALUES (1);");
+    auto insert = db.prepare("INSERT INTO t(k) VALUES (1);");
+
+    size_t failed = 0;
+    double thrown = usPerCall(inserts, [&](size_t) {
+        try {
+            insert->step();
+        } catch (const rdb::SQLiteException&) {
+            ++failed;
+        }
+        insert->reset();
+    });
+    line("step() + catch", fixed(thrown * 1000, 0));
+
+    double returned = usPerCall(inserts, [&](size_t) {
+        failed += insert->tryStep().constraint();
+        insert->reset();
+    });
+    line("tryStep()", fixed(returned * 1000, 0));
+    line("constraint failures", std::to_string(failed));
+}
+
+// ---------------------------------
+// pool: ConnectionPool warm-up
+// ---------------------------------
+
+void pool(const Options& o) {
+    const size_t rows = scaled(o, 2000000), tables = 60, poolSize = 4;
+    header("pool: " + std::to_string(tables) + "-table schema, " + std::to_string(rows) +
+           "-row indexed table, file database, OS cache warm");
+    TempFile file(o, "pool");
+    {
+        rdb::Database db(file.path());
+        rdb::Database::Transaction tx(db);
+        for (size_t i = 0; i < tables; ++i) {
+            std::string t = "t" + std::to_string(i);
+            db.execute("CREATE TABLE " + t + "(id INTEGER PRIMARY KEY, a TEXT, b INTEGER, c REAL);"
+                       "CREATE INDEX " + t + "_b ON " + t + "(b);");
+        }
+        db.execute("CREATE TABLE users(id INTEGER PRIMARY KEY, email TEXT NOT NULL, name TEXT);");
+        auto insert = db.prepare("INSERT INTO users(email, name) VALUES (?, ?);");
+        for (size_t i = 0; i < rows; ++i) {
+            insert->bind(1, "user" + std::to_string(i) + "@example.com");
+            insert->bind(2, "name " + std::to_string(i));
+            insert->step();
+            insert->reset();
+        }
+        db.execute("CREATE UNIQUE INDEX users_email ON users(email);");
+        tx.commit();
+    }
+
+    const std::string sql = "SELECT id, name FROM users WHERE email = ?;";
+    std::mt19937_64 rng(3);
+    std::uniform_int_distribution<size_t> pick(0, rows - 1);
+    auto email = [&] { return "user" + std::to_string(pick(rng)) + "@example.com"; };
+    auto lookup = [&](rdb::Statement& q) {
+        q.bind(1, email());
+        bool found = q.step();
+        q.reset();
+        return found;
+    };
+
+    const size_t fresh = 20;
+    line("fresh connection, first query (us)", fixed(usPerCall(fresh, [&](size_t) {
+        rdb::Database db(file.path());
+        lookup(*db.prepare(sql));
+    }), 0));
+
+    rdb::StatementManifest manifest;
+    size_t byEmail = manifest.add("byEmail", sql, true);
+    rdb::ConnectionPool connections(file.path(), poolSize, manifest);
+    const auto& report = connections.warmup();
+    line("pool of " + std::to_string(poolSize) + ", warm-up (ms, total)",
+         fixed(static_cast<double>(report.elapsed.count()) / 1000, 1));
+    line("pages read while touching", std::to_string(report.pages));
+
+    // Hold every lease so each connection answers exactly one first query
+    std::vector<rdb::ConnectionPool::Lease> leases;
+    for (size_t i = 0; i < poolSize; ++i) leases.push_back(connections.acquire());
+    line("pooled, first query (us)",
+         fixed(usPerCall(poolSize, [&](size_t i) { lookup(leases[i].statement(byEmail)); }), 0));
+    line("pooled, later queries (us)",
+         fixed(usPerCall(10000, [&](size_t i) { lookup(leases[i % poolSize].statement(byEmail)); }), 1));
+}
+
+// ---------------------------------
+// warmer: PageCacheWarmer
+// ---------------------------------
+
+// Writes the file's dirty pages back and drops it from the OS page cache,
+// so the next reads go to disk
+void evict(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("cannot open " + path);
+    fsync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+}
+
+void warmer(const Options& o) {
+    const size_t rows = scaled(o, 1000000), lookups = 200;
+    TempFile file(o, "warmer");
+    {
+        rdb::Database db(file.path());
+        rdb::Database::Transaction tx(db);
+        db.execute("CREATE TABLE items(id INTEGER PRIMARY KEY, sku TEXT NOT NULL, payload TEXT);");
+        auto insert = db.prepare("INSERT INTO items(sku, payload) VALUES (?, ?);");
+        for (size_t i = 0; i < rows; ++i) {
+            insert->bind(1, "sku-" + std::to_string(i * 7919 % rows));
+            insert->bind(2, std::string(100, static_cast<char>('a' + i % 26)));
+            insert->step();
+            insert->reset();
+        }
+        db.execute("CREATE INDEX items_sku ON items(sku);");
+        tx.commit();
+    }
+    rdb::Database db(file.path());
+    auto size = db.prepare("SELECT page_count * page_size FROM pragma_page_count, pragma_page_size;");
+    size->step();
+    double mb = static_cast<double>(size->getInt64(0)) / (1 << 20);
+    // Each line starts from a file evicted with POSIX_FADV_DONTNEED
+    header("warmer: " + fixed(mb, 0) + " MB file, evicted before each line, " + std::to_string(lookups) +
+           " index lookups, ms to warm / us per lookup");
+
+    std::mt19937_64 rng(11);
+    std::uniform_int_distribution<size_t> pick(0, rows - 1);
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < lookups; ++i) keys.push_back("sku-" + std::to_string(pick(rng)));
+    auto lookup = [&] {
+        rdb::Database reader(file.path());
+        reader.execute("PRAGMA cache_size=0;");
+        auto q = reader.prepare("SELECT id FROM items WHERE sku = ?;");
+        return usPerCall(lookups, [&](size_t i) {
+            q->bind(1, keys[i]);
+            q->step();
+            q->reset();
+        });
+    };
+    auto warm = [&](rdb::PageCacheWarmer::Options options) {
+        evict(file.path());
+        auto start = Clock::now();
+        rdb::PageCacheWarmer w(db, std::move(options));
+        w.wait();
+        if (!w.error().empty()) throw std::runtime_error(w.error());
+        return usSince(start) / 1000;
+    };
+
+    evict(file.path());
+    line("cold", "- / " + fixed(lookup(), 1));
+    double ms = warm({});
+    line("whole file warmed", fixed(ms, 0) + " / " + fixed(lookup(), 1));
+    ms = warm({{"items_sku"}});
+    line("items_sku warmed (dbstat)", fixed(ms, 0) + " / " + fixed(lookup(), 1));
+    rdb::PageCacheWarmer::Options capped;
+    capped.bytesPerSecond = 100 << 20;
+    line("whole file at 100 MB/s", fixed(warm(capped), 0) + " / -");
+}
+
+// ---------------------------------
+// catalog: SchemaCatalog and DBConnect::does_table_exist
+// ---------------------------------
+
+void catalog(const Options& o) {
+    const size_t tables = 200, views = 5, calls = scaled(o, 100000);
+    header("catalog: " + std::to_string(tables + views) + "-table schema, file database, " + std::to_string(calls) +
+           " calls, ns per call");
+    TempFile file(o, "catalog");
+    rdb::DBConnect conn;
+    conn.open(file.path());
+    rdb::Database& db = *conn.getDatabase();
+    {
+        rdb::Database::Transaction tx(db);
+        for (size_t i = 0; i < tables; ++i) {
+            std::string t = "t" + std::to_string(i);
+            db.execute("CREATE TABLE " + t + "(id INTEGER PRIMARY KEY, a TEXT NOT NULL, b INTEGER DEFAULT 0);"
+                       "CREATE INDEX " + t + "_a ON " + t + "(a);");
+        }
+        for (size_t i = 0; i < views; ++i)
+            db.execute("CREATE VIEW v" + std::to_string(i) + " AS SELECT id FROM t" + std::to_string(i) + ";");
+        tx.commit();
+    }
+    std::vector<std::string> names;
+    for (size_t i = 0; i < tables; ++i) names.push_back("t" + std::to_string(i * 37 % tables));
+
+    size_t found = 0;
+    double ns = usPerCall(calls, [&](size_t i) {
+        // The sqlite_master query does_table_exist ran before SchemaCatalog
+        rdb::SQLResults results;
+        conn.query(&results, "SELECT name FROM sqlite_master WHERE type='table' AND name='" + names[i % tables] + "';");
+        found += results.num_rows > 0;
+    }) * 1000;
+    line("sqlite_master query", fixed(ns, 0));
+    ns = usPerCall(calls, [&](size_t i) { found += conn.does_table_exist(names[i % tables]); }) * 1000;
+    line("does_table_exist", fixed(ns, 0));
+
+    rdb::SchemaCatalog schema(db);
+    ns = usPerCall(calls, [&](size_t i) { found += schema.hasTable(names[i % tables]); }) * 1000;
+    line("SchemaCatalog::hasTable", fixed(ns, 0));
+    ns = usPerCall(calls, [&](size_t) { found += schema.refreshIfChanged(); }) * 1000;
+    line("SchemaCatalog::refreshIfChanged", fixed(ns, 0));
+    line("SchemaCatalog::reload (us)", fixed(usPerCall(20, [&](size_t) { schema.reload(); }), 0));
+    line("tables found", std::to_string(found));
+}
+
+// ---------------------------------
+// optimize: OptimizeScheduler
+// ---------------------------------
+
+void optimize(const Options& o) {
+    const size_t rows = scaled(o, 300000);
+    header("optimize: " + std::to_string(rows) + " rows, skewed flag column, no statistics, in-memory");
+    rdb::Database db(":memory:");
+    db.execute("CREATE TABLE t(id INTEGER PRIMARY KEY, cust INTEGER, flag INTEGER, note TEXT);");
+    {
+        rdb::Database::Transaction tx(db);
+        auto insert = db.prepare("INSERT INTO t(cust, flag, note) VALUES (?, ?, 'x');");
+        for (size_t i = 0; i < rows; ++i) {
+            insert->bindInt64(1, static_cast<int64_t>(i % 5000));
+            insert->bindInt64(2, i % 100 == 0 ? 1 : 0);   // 99% of rows have flag 0
+            insert->step();
+            insert->reset();
+        }
+        tx.commit();
+    }
+    db.execute("CREATE INDEX t_cust ON t(cust); CREATE INDEX t_flag ON t(flag);");
+
+    const std::string sql = "SELECT count(*) FROM t WHERE flag = 0 AND cust = ?1";
+    auto query = db.prepare(sql + ";");
+    auto time = [&] {
+        return usPerCall(20, [&](size_t i) {
+            query->bindInt64(1, static_cast<int64_t>(i * 97 % 5000));
+            query->step();
+            query->reset();
+        });
+    };
+    rdb::OptimizeScheduler::Options options;
+    options.watch = {sql};
+    options.onClose = false;
+    rdb::OptimizeScheduler scheduler(db, options);
+
+    double before = time();
+    auto start = Clock::now();
+    auto report = scheduler.run();
+    double pass = usSince(start);
+    query = db.prepare(sql + ";");   // replanned with the new statistics
+    double after = time();
+    auto trim = [](const std::string& plan) {
+        size_t first = plan.find_first_not_of(" \n"), last = plan.find_last_not_of(" \n");
+        return first == std::string::npos ? std::string() : plan.substr(first, last - first + 1);
+    };
+    for (const auto& change : report.planChanges) {
+        line("plan before", trim(change.before));
+        line("plan after", trim(change.after));
+    }
+    line("query before / after (us)", fixed(before, 0) + " / " + fixed(after, 1));
+    line("pass: ANALYZE statements / ms", std::to_string(report.analyzed.size()) + " / " + fixed(pass / 1000, 1));
+}
+
+// ---------------------------------
+// profiler: QueryProfiler and IndexAdvisor
+// ---------------------------------
+
+void profiler(const Options& o) {
+    const size_t orders = scaled(o, 200000), customers = std::max<size_t>(orders / 10, 1);
+    header("profiler: " + std::to_string(orders) + " orders, " + std::to_string(customers) + " customers, in-memory");
+    rdb::Database db(":memory:");
+    db.execute("CREATE TABLE customers(id INTEGER PRIMARY KEY, email TEXT, region TEXT);"
+               "CREATE TABLE orders(id INTEGER PRIMARY KEY, customer_id INTEGER, status TEXT, created INTEGER, total REAL);");
+    {
+        rdb::Database::Transaction tx(db);
+        auto customer = db.prepare("INSERT INTO customers(email, region) VALUES (?, ?);");
+        for (size_t i = 0; i < customers; ++i) {
+            customer->bind(1, "c" + std::to_string(i) + "@example.com");
+            customer->bind(2, "region" + std::to_string(i % 50));
+            customer->step();
+            customer->reset();
+        }
+        auto order = db.prepare("INSERT INTO orders(customer_id, status, created, total) VALUES (?, ?, ?, ?);");
+        const char* statuses[] = {"new", "paid", "shipped", "done"};
+        for (size_t i = 0; i < orders; ++i) {
+            order->bindInt64(1, static_cast<int64_t>(i * 7 % customers + 1));
+            order->bind(2, std::string(statuses[i % 4]));
+            order->bindInt64(3, static_cast<int64_t>(i));
+            order->bind(4, static_cast<double>(i % 1000));
+            order->step();
+            order->reset();
+        }
+        tx.commit();
+    }
+
+    // Statement cost with and without the profiler attached
+    auto point = db.prepare("SELECT email FROM customers WHERE id = ?;");
+    auto pointLookup = [&](size_t i) {
+        point->bindInt64(1, static_cast<int64_t>(i % customers + 1));
+        point->step();
+        point->reset();
+    };
+    const size_t calls = scaled(o, 1000000);
+    double plain = usPerCall(calls, pointLookup) * 1000;
+    double profiled;
+    {
+        rdb::QueryProfiler overhead(db);
+        profiled = usPerCall(calls, pointLookup) * 1000;
+    }
+    line("point SELECT, plain (ns)", fixed(plain, 0));
+    line("point SELECT, profiled (ns)", fixed(profiled, 0));
+
+    struct Query {
+        std::string label;
+        size_t calls;
+        std::string sql;
+        std::unique_ptr<rdb::Statement> stmt;
+        std::function<void(rdb::Statement&, size_t)> bind;
+    };
+    std::vector<Query> workload;
+    workload.push_back({"customer/status/created", 100,
+                        "SELECT count(*) FROM orders WHERE customer_id = ? AND status = ? AND created > ?;", nullptr,
+                        [&](rdb::Statement& q, size_t i) {
+                            q.bindInt64(1, static_cast<int64_t>(i * 13 % customers + 1));
+                            q.bind(2, std::string("paid"));
+                            q.bindInt64(3, static_cast<int64_t>(orders / 2));
+                        }});
+    workload.push_back({"region join", 3,
+                        "SELECT sum(o.total) FROM orders o JOIN customers c ON c.id = o.customer_id "
+                        "WHERE c.region = ?;", nullptr,
+                        [](rdb::Statement& q, size_t i) { q.bind(1, "region" + std::to_string(i)); }});
+    workload.push_back({"email lookup", 200, "SELECT id FROM customers WHERE email = ?;", nullptr,
+                        [&](rdb::Statement& q, size_t i) {
+                            q.bind(1, "c" + std::to_string(i * 31 % customers) + "@example.com");
+                        }});
+    auto run = [&](Query& q) {
+        q.stmt = db.prepare(q.sql);   // planned with the indexes that exist now
+        auto start = Clock::now();
+        for (size_t i = 0; i < q.calls; ++i) {
+            q.bind(*q.stmt, i);
+            while (q.stmt->step()) {}
+            q.stmt->reset();
+        }
+        return usSince(start) / 1000;
+    };
+
+    std::vector<double> before;
+    rdb::QueryProfiler profile(db);
+    for (auto& q : workload) before.push_back(run(q));
+    auto start = Clock::now();
+    auto suggestions = rdb::IndexAdvisor(db).advise(profile.entries());
+    line("IndexAdvisor::advise (ms)", fixed(usSince(start) / 1000, 0));
+    for (const auto& s : suggestions) {
+        std::cout << "  " << s.sql << "\n";
+        db.execute(s.sql);
+    }
+    for (size_t i = 0; i < workload.size(); ++i) {
+        auto& q = workload[i];
+        double after = run(q);
+        line(q.label + " x" + std::to_string(q.calls) + " (ms)", fixed(before[i], 1) + " -> " + fixed(after, 2));
+    }
+}
+
+// ---------------------------------
+// vacuum: IncrementalVacuum
+// ---------------------------------
+
+void vacuum(const Options& o) {
+    const size_t rows = scaled(o, 200000);
+    TempFile file(o, "vacuum");
+    rdb::Database db(file.path());
+    rdb::IncrementalVacuum::enable(db);
+    db.execute("PRAGMA journal_mode=WAL;");
+    db.execute("CREATE TABLE t(id INTEGER PRIMARY KEY, body BLOB);");
+    {
+        rdb::Database::Transaction tx(db);
+        auto insert = db.prepare("INSERT INTO t(body) VALUES (zeroblob(500));");
+        for (size_t i = 0; i < rows; ++i) {
+            insert->step();
+            insert->reset();
+        }
+        tx.commit();
+    }
+    db.execute("DELETE FROM t WHERE id % 10 != 0; PRAGMA wal_checkpoint(TRUNCATE);");
+    auto fileMb = [&] {
+        std::ifstream in(file.path(), std::ios::binary | std::ios::ate);
+        return static_cast<double>(in.tellg()) / (1 << 20);
+    };
+    header("vacuum: " + std::to_string(rows) + " x 500-byte rows, 90% deleted (" + fixed(fileMb(), 0) +
+           " MB file), WAL,\n  5 ms slice budget, a writer inserting every 20 ms");
+
+    // The writer's pauses are the idle windows the vacuum works in
+    std::atomic<bool> stop(false);
+    rdb::LatencyHistogram writes;
+    std::thread writer([&] {
+        rdb::Database w(file.path());
+        w.setBusyTimeout(1000);
+        auto insert = w.prepare("INSERT INTO t(body) VALUES (zeroblob(500));");
+        while (!stop) {
+            auto start = Clock::now();
+            insert->step();
+            insert->reset();
+            writes.record(static_cast<uint64_t>(usSince(start) * 1000));
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+    });
+
+    rdb::IncrementalVacuum::Options options;
+    options.sliceBudget = std::chrono::milliseconds(5);
+    options.idleAfter = std::chrono::milliseconds(10);
+    options.interval = std::chrono::milliseconds(5);
+    rdb::IncrementalVacuum::Stats stats;
+    auto start = Clock::now();
+    {
+        rdb::IncrementalVacuum vacuum(file.path(), options);
+        do {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            stats = vacuum.stats();
+        } while (stats.error.empty() && (stats.slices == 0 || stats.freelistPages >= options.minFreePages) &&
+                 usSince(start) < 60e6);
+    }
+    double elapsed = usSince(start);
+    stop = true;
+    writer.join();
+    if (!stats.error.empty()) throw std::runtime_error(stats.error);
+    db.execute("PRAGMA wal_checkpoint(TRUNCATE);");
+
+    line("slices / pages reclaimed", std::to_string(stats.slices) + " / " + std::to_string(stats.reclaimedPages));
+    line("run time (ms)", fixed(elapsed / 1000, 0));
+    line("longest slice (ms)", fixed(static_cast<double>(stats.longestSlice.count()) / 1000, 1));
+    line("file after checkpoint (MB)", fixed(fileMb(), 0));
+    line("writer p50 / max (ms)", fixed(static_cast<double>(writes.percentile(50)) / 1e6, 2) + " / " +
+                                      fixed(static_cast<double>(writes.max()) / 1e6, 1));
+}
+
+// ---------------------------------
+// capture: WorkloadCapture
+// ---------------------------------
+
+void capture(const Options& o) {
+    const size_t calls = scaled(o, 500000);
+    header("capture: point SELECTs on an in-memory table, WorkloadLog on a file, ns per statement");
+    rdb::Database db(":memory:");
+    PointQueries q(db);
+    auto bound = [&](size_t i) { q.bound(i); };
+    auto literal = [&](size_t i) { q.literal(i); };
+
+    const std::string path = o.dir + "/rdb-bench-capture.log";
+    double plainBound = usPerCall(calls, bound) * 1000;
+    double plainLiteral = usPerCall(calls / 10, literal) * 1000;
+    double capturedBound, capturedLiteral;
+    uint64_t events;
+    {
+        rdb::WorkloadLog log(path);
+        rdb::WorkloadCapture capturing(db, log);
+        capturedBound = usPerCall(calls, bound) * 1000;
+        capturedLiteral = usPerCall(calls / 10, literal) * 1000;
+        log.flush();
+        events = log.events();
+    }
+    std::remove(path.c_str());
+    line("prepared, plain / captured", fixed(plainBound, 0) + " / " + fixed(capturedBound, 0));
+    line("SQL per call, plain / captured", fixed(plainLiteral, 0) + " / " + fixed(capturedLiteral, 0));
+    line("statements logged", std::to_string(events));
+}
+
+// ---------------------------------
+// histogram: LatencyHistogram
+// ---------------------------------
+
+void histogram(const Options& o) {
+    const size_t samples = scaled(o, 1000000);
+    header("histogram: " + std::to_string(samples) + " uniform samples in [1 us, 10 ms]");
+    std::mt19937_64 rng(9);
+    std::uniform_int_distribution<uint64_t> ns(1000, 10000000);
+    std::vector<uint64_t> values(samples);
+    for (auto& v : values) v = ns(rng);
+
+    rdb::LatencyHistogram h;
+    line("record (ns)", fixed(usPerCall(samples, [&](size_t i) { h.record(values[i]); }) * 1000, 1));
+    std::sort(values.begin(), values.end());
+    for (double p : {50.0, 99.0, 99.9}) {
+        auto exact = static_cast<double>(values[std::min(samples - 1, static_cast<size_t>(p / 100 * samples))]);
+        double error = (static_cast<double>(h.percentile(p)) - exact) / exact * 100;
+        line("p" + fixed(p, p < 99.5 ? 0 : 1) + " error vs exact (%)", fixed(error, 2));
+    }
+}
+
+// ---------------------------------
+// latency: StatementLatency and LatencyTracker
+// ---------------------------------
+
+void latency(const Options& o) {
+    const size_t calls = scaled(o, 1000000);
+    header("latency: point SELECTs on an in-memory table, ns per call");
+    rdb::Database db(":memory:");
+    PointQueries q(db);
+    auto bound = [&](size_t i) { q.bound(i); };
+    auto literal = [&](size_t i) { q.literal(i); };
+
+    uint64_t sink = 0;
+    line("steady_clock::now()", fixed(usPerCall(calls, [&](size_t) {
+        sink += static_cast<uint64_t>(Clock::now().time_since_epoch().count());
+    }) * 1000, 1));
+    rdb::StatementLatency stats;
+    uint32_t connection = stats.newConnection("bench");
+    line("StatementLatency::record", fixed(usPerCall(calls, [&](size_t i) {
+        stats.record(i % 64, connection, rdb::StatementLatency::Step, i);
+    }) * 1000, 1));
+
+    std::vector<std::function<Attached()>> configs{
+        [] { return nullptr; },
+        [&] {
+            int listener = db.addTimingListener([&](rdb::Database::Timing, sqlite3_stmt*, const char*, uint64_t ns) { sink += ns; });
+            return Attached(nullptr, [&db, listener](void*) { db.removeListener(listener); });
+        },
+        [&] { return std::make_shared<rdb::LatencyTracker>(db, stats, "bench"); },
+    };
+    auto prepared = interleaved(calls, configs, bound);
+    auto literals = interleaved(calls / 10, configs, literal);
+    line("prepared, plain", fixed(prepared[0], 0));
+    line("prepared, empty timing listener", fixed(prepared[1], 0));
+    line("prepared, LatencyTracker", fixed(prepared[2], 0));
+    line("SQL per call, plain / tracked", fixed(literals[0], 0) + " / " + fixed(literals[2], 0));
+}
+
+// ---------------------------------
+// metrics: MetricsSegment and MetricsTracker
+// ---------------------------------
+
+void metrics(const Options& o) {
+    const size_t calls = scaled(o, 1000000);
+    header("metrics: point SELECTs on an in-memory table, ns per call");
+    rdb::Database db(":memory:");
+    PointQueries q(db);
+    rdb::MetricsSegment segment(":memory:");
+    uint64_t sink = 0;
+    std::vector<std::function<Attached()>> configs{
+        [] { return nullptr; },
+        [&] {
+            int listener = db.addTimingListener([&](rdb::Database::Timing, sqlite3_stmt*, const char*, uint64_t ns) { sink += ns; });
+            return Attached(nullptr, [&db, listener](void*) { db.removeListener(listener); });
+        },
+        [&] { return std::make_shared<rdb::MetricsTracker>(db, segment); },
+    };
+    auto ns = interleaved(calls, configs, [&](size_t i) { q.bound(i); });
+    line("plain", fixed(ns[0], 0));
+    line("empty timing listener", fixed(ns[1], 0));
+    line("MetricsTracker", fixed(ns[2], 0));
+}
+
+// ---------------------------------
+// timeline: QueryTimeline and TimelineTracker
+// ---------------------------------
+
+void timeline(const Options& o) {
+    const size_t calls = scaled(o, 1000000);
+    header("timeline: point SELECTs on an in-memory table, ns per call");
+    rdb::Database db(":memory:");
+    PointQueries q(db);
+    rdb::QueryTimeline events;
+    uint64_t sink = 0;
+    std::vector<std::function<Attached()>> configs{
+        [] { return nullptr; },
+        [&] {
+            int listener = db.addTimingListener([&](rdb::Database::Timing, sqlite3_stmt*, const char*, uint64_t ns) { sink += ns; });
+            return Attached(nullptr, [&db, listener](void*) { db.removeListener(listener); });
+        },
+        [&] { return std::make_shared<rdb::TimelineTracker>(db, events, "bench"); },
+    };
+    auto ns = interleaved(calls, configs, [&](size_t i) { q.bound(i); });
+    line("plain", fixed(ns[0], 0));
+    line("empty timing listener", fixed(ns[1], 0));
+    line("TimelineTracker", fixed(ns[2], 0));
+
+    std::ostringstream trace;
+    auto start = Clock::now();
+    events.write(trace);
+    line("write(), one full ring (ms)", fixed(usSince(start) / 1000, 1));
+}
+
+// ---------------------------------
+// allocation: AllocationProfile and AllocationTracker
+// ---------------------------------
+
+void allocation(const Options& o) {
+    header("allocation: SQLite and heap allocations per execution, in-memory");
+    // install() must precede SQLite's initialisation, so the case runs in
+    // a child that shuts SQLite down first (no connections are open)
+    isolated([&] {
+        sqlite3_shutdown();
+        if (!rdb::AllocationProfile::install()) throw std::runtime_error("AllocationProfile::install failed");
+
+        rdb::DBConnect conn;
+        conn.open(":memory:");
+        rdb::Database& db = *conn.getDatabase();
+        db.execute("CREATE TABLE t(id INTEGER PRIMARY KEY, name TEXT, score REAL);"
+                   "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 1000) "
+                   "INSERT INTO t(name, score) SELECT 'name ' || i, i * 0.5 FROM n;");
+        const std::string sql = "SELECT id, name, score FROM t";
+
+        rdb::AllocationProfile profile;
+        conn.accountAllocations(&profile);
+        rdb::SQLResults results;
+        for (int i = 0; i < 10; ++i) conn.query(&results, sql + ";");
+        size_t length = 0;
+        auto stepped = db.prepare(sql + " WHERE id > 0;");
+        for (int i = 0; i < 10; ++i) {
+            while (stepped->step()) length += stepped->getText(1).size();
+            stepped->reset();
+        }
+        for (const auto& e : profile.entries()) {
+            if (e.executions == 0 || e.sql.find("FROM t") == std::string::npos) continue;
+            const auto& c = e.execution;
+            line(e.sql.find("WHERE") == std::string::npos ? "1000 rows, DBConnect::query" : "1000 rows, stepped with getText",
+                 std::to_string(c.heapAllocations / e.executions) + " heap (" +
+                     std::to_string(c.heapBytes / e.executions / 1024) + " KB), " +
+                     std::to_string(c.sqliteAllocations / e.executions) + " SQLite");
+        }
+        conn.accountAllocations(nullptr);
+
+        rdb::Database pointDb(":memory:");
+        PointQueries q(pointDb);
+        rdb::AllocationProfile points;
+        std::vector<std::function<Attached()>> configs{
+            [] { return nullptr; },
+            [&] { return std::make_shared<rdb::AllocationTracker>(pointDb, points); },
+        };
+        auto ns = interleaved(scaled(o, 1000000), configs, [&](size_t i) { q.bound(i); });
+        line("point SELECT, plain / tracked (ns)", fixed(ns[0], 0) + " / " + fixed(ns[1], 0));
+    });
+}
+
+// ---------------------------------
+// plans: PlanMonitor
+// ---------------------------------
+
+void plans(const Options& o) {
+    const size_t calls = scaled(o, 1000000);
+    header("plans: point SELECTs on an in-memory table, ns per call");
+    rdb::Database db(":memory:");
+    PointQueries q(db);
+    rdb::PlanMonitor::Options options;
+    options.sidecar = ":memory:";
+    uint64_t sink = 0;
+    std::vector<std::function<Attached()>> configs{
+        [] { return nullptr; },
+        [&] {
+            int listener = db.addTimingListener([&](rdb::Database::Timing, sqlite3_stmt*, const char*, uint64_t ns) { sink += ns; });
+            return Attached(nullptr, [&db, listener](void*) { db.removeListener(listener); });
+        },
+        [&] { return std::make_shared<rdb::PlanMonitor>(db, options); },
+    };
+    auto ns = interleaved(calls, configs, [&](size_t i) { q.bound(i); });
+    line("plain", fixed(ns[0], 0));
+    line("empty timing listener", fixed(ns[1], 0));
+    line("PlanMonitor", fixed(ns[2], 0));
+
+    // A kept statement whose index is dropped under it
+    const size_t rows = scaled(o, 100000);
+    db.execute("CREATE TABLE events(id INTEGER PRIMARY KEY, kind INTEGER, at INTEGER);");
+    {
+        rdb::Database::Transaction tx(db);
+        auto insert = db.prepare("INSERT INTO events(kind, at) VALUES (?, ?);");
+        for (size_t i = 0; i < rows; ++i) {
+            insert->bindInt64(1, static_cast<int64_t>(i % 1000));
+            insert->bindInt64(2, static_cast<int64_t>(i));
+            insert->step();
+            insert->reset();
+        }
+        tx.commit();
+    }
+    db.execute("CREATE INDEX events_at ON events(at);");
+    std::vector<std::string> reported;
+    options.onRegression = [&](const rdb::PlanMonitor::Entry& e) {
+        for (const auto& r : e.reasons) reported.push_back(r);
+    };
+    rdb::PlanMonitor monitor(db, options);
+    auto select = db.prepare("SELECT kind FROM events WHERE at = ?;");
+    auto run = [&](size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            select->bindInt64(1, static_cast<int64_t>(i * 7919 % rows));
+            select->step();
+            select->reset();
+        }
+    };
+    run(1000);
+    db.execute("DROP INDEX events_at;");
+    run(100);
+    // The monitor steps PRAGMA schema_version only when the data version
+    // moved, not for every statement it sees
+    size_t versionSteps = 0, texts = 1000;
+    int trace = db.addTraceListener(SQLITE_TRACE_STMT, [&](unsigned, void*, void* x) {
+        versionSteps += std::strstr(static_cast<const char*>(x), "schema_version") != nullptr;
+    });
+    for (size_t i = 0; i < texts; ++i) db.prepare("SELECT kind FROM events WHERE id = " + std::to_string(i) + ";")->step();
+    db.removeListener(trace);
+    line("schema_version reads / SQL texts", std::to_string(versionSteps) + " / " + std::to_string(texts));
+    for (const auto& r : reported) line("reported", r);
+    for (const auto& e : monitor.regressions())
+        line("mean before / after DROP INDEX (us)",
+             fixed(e.baseline.meanNs() / 1000, 1) + " / " + fixed(e.current.meanNs() / 1000, 0));
+}
+
+// ---------------------------------
+// Cases
+// ---------------------------------
+
+struct Case {
+    const char* name;
+    void (*run)(const Options&);
+};
+
+const Case cases[] = {
+    {"array", array},
+    {"vector", vector},
+    {"keyfilter", keyfilter},
+    {"mirror", mirror},
+    {"kvstore", kvstore},
+    {"queue", queue},
+    {"pager", pager},
+    {"blob", blob},
+    {"trystep", trystep},
+    {"pool", pool},
+    {"warmer", warmer},
+    {"catalog", catalog},
+    {"optimize", optimize},
+    {"profiler", profiler},
+    {"vacuum", vacuum},
+    {"capture", capture},
+    {"histogram", histogram},
+    {"latency", latency},
+    {"metrics", metrics},
+    {"timeline", timeline},
+    {"allocation", allocation},
+    {"plans", plans},
+};
+
+void usage() {
+    std::cerr << "usage: rdb-bench [--dir PATH] [--scale X] [--threads 1,4,16] [--list] [CASE...]\n";
+    std::exit(2);
+}
+
+std::vector<unsigned> list(const std::string& s) {
+    std::vector<unsigned> out;
+    std::stringstream in(s);
+    std::string item;
+    while (std::getline(in, item, ',')) out.push_back(static_cast<unsigned>(std::stoul(item)));
+    if (out.empty() || std::find(out.begin(), out.end(), 0u) != out.end()) usage();
+    return out;
+}
+
+Options parse(int argc, char** argv) {
+    Options o;
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) usage();
+            return argv[++i];
+        };
+        if (a == "--dir") o.dir = value();
+        else if (a == "--scale") o.scale = std::stod(value());
+        else if (a == "--threads") o.threads = list(value());
+        else if (a == "--list") {
+            for (const auto& c : cases) std::cout << c.name << "\n";
+            std::exit(0);
+        } else if (!a.empty() && a[0] == '-') usage();
+        else o.cases.push_back(a);
+    }
+    if (o.scale <= 0) usage();
+    for (const auto& name : o.cases)
+        if (std::none_of(std::begin(cases), std::end(cases), [&](const Case& c) { return name == c.name; })) usage();
+    return o;
+}
+
+} // namespace
+
+int main(int argc, char** argv) try {
+    Options o = parse(argc, argv);
+    std::cout << "rdb-bench: SQLite " << sqlite3_libversion() << ", " << std::thread::hardware_concurrency()
+              << " hardware threads, scale " << o.scale << "\n";
+    for (const auto& c : cases)
+        if (o.cases.empty() || std::find(o.cases.begin(), o.cases.end(), c.name) != o.cases.end()) c.run(o);
+    return 0;
+} catch (const std::exception& e) {
+    std::cerr << "rdb-bench: " << e.what() << "\n";
+    return 1;
+}
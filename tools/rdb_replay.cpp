@@ -0,0 +1,238 @@
+// rdb-replay: replays a workload captured with rdb::WorkloadCapture against
+// a copy of the database and reports latency percentiles, overall and per
+// statement, beside the latencies seen at capture time.
+//
+//   g++ -std=c++17 -O2 -Iinclude tools/rdb_replay.cpp -lsqlite3 -pthread -o rdb-replay
+//   ./rdb-replay [options] workload.rdbw app.db
+//
+// Each captured connection's statements run in order on one replay
+// connection, so transactions stay intact. Options:
+//   --threads N      replay connections (default: one per captured
+//                    connection; captured connection c runs on c % N)
+//   --speed X        pacing relative to capture; 2 = twice as fast,
+//                    0 = as fast as possible (default 1)
+//   --copy PATH      where to copy the database (default DB.replay)
+//   --in-place       replay against DB itself
+//   --busy-timeout MS   (default 5000)
+//   --top N          statements to list (default 10)
+
+#include "../include/rdb.h"
+#include <filesystem>
+#include <iomanip>
+#include <map>
+#include <sstream>
+
+namespace {
+
+struct Options {
+    std::string log, db, copy;
+    bool inPlace = false;
+    unsigned threads = 0;
+    double speed = 1.0;
+    int busyTimeout = 5000;
+    size_t top = 10;
+};
+
+struct Sample {
+    uint32_t statement;
+    uint64_t capturedNs;
+    uint64_t replayNs;
+    bool failed;
+};
+
+void usage() {
+    std::cerr << "usage: rdb-replay [--threads N] [--speed X] [--copy PATH | --in-place]\n"
+                 "                  [--busy-timeout MS] [--top N] LOG DATABASE\n";
+    std::exit(2);
+}
+
+Options parse(int argc, char** argv) {
+    Options o;
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) usage();
+            return argv[++i];
+        };
+        if (a == "--threads") o.threads = static_cast<unsigned>(std::stoul(value()));
+        else if (a == "--speed") o.speed = std::stod(value());
+        else if (a == "--copy") o.copy = value();
+        else if (a == "--in-place") o.inPlace = true;
+        else if (a == "--busy-timeout") o.busyTimeout = std::stoi(value());
+        else if (a == "--top") o.top = std::stoul(value());
+        else if (!a.empty() && a[0] == '-') usage();
+        else positional.push_back(a);
+    }
+    if (positional.size() != 2) usage();
+    o.log = positional[0];
+    o.db = positional[1];
+    if (o.copy.empty()) o.copy = o.db + ".replay";
+    return o;
+}
+
+// Copy the database with any WAL, so uncheckpointed commits come along
+void copyDatabase(const std::string& from, const std::string& to) {
+    namespace fs = std::filesystem;
+    for (const char* suffix : {"-wal", "-shm"}) fs::remove(to + suffix);
+    fs::copy_file(from, to, fs::copy_options::overwrite_existing);
+    if (fs::exists(from + "-wal")) fs::copy_file(from + "-wal", to + "-wal", fs::copy_options::overwrite_existing);
+}
+
+uint64_t percentile(const std::vector<uint64_t>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t i = static_cast<size_t>(std::ceil(p / 100.0 * static_cast<double>(sorted.size())));
+    return sorted[std::min(sorted.size(), std::max<size_t>(i, 1)) - 1];
+}
+
+std::string us(uint64_t ns) {
+    std::ostringstream s;
+    s << std::fixed << std::setprecision(ns < 10000 ? 2 : 0) << static_cast<double>(ns) / 1000.0;
+    return s.str();
+}
+
+void replay(const Options& o, const rdb::Workload& w, const std::vector<const rdb::WorkloadEvent*>& events,
+            std::chrono::steady_clock::time_point t0, std::vector<Sample>& out, std::string& error) {
+    auto opened = rdb::Database::tryOpen(o.inPlace ? o.db : o.copy);
+    if (!opened) {
+        error = opened.status().message();
+        return;
+    }
+    rdb::Database& db = *opened;
+    db.setBusyTimeout(o.busyTimeout);
+    std::unordered_map<uint32_t, std::unique_ptr<rdb::Statement>> cache;
+    out.reserve(events.size());
+    for (const rdb::WorkloadEvent* e : events) {
+        if (o.speed > 0)
+            std::this_thread::sleep_until(t0 + std::chrono::nanoseconds(static_cast<int64_t>(static_cast<double>(e->startNs) / o.speed)));
+        auto start = std::chrono::steady_clock::now();
+        auto& stmt = cache[e->statement];
+        bool failed = false;
+        if (!stmt) {
+            auto prepared = db.tryPrepare(w.statements[e->statement]);
+            if (prepared) stmt = std::move(*prepared);
+            else failed = true;
+        }
+        if (stmt) {
+            for (size_t i = 0; i < e->params.size(); ++i) e->params[i].bind(*stmt, static_cast<int>(i + 1));
+            rdb::Status st;
+            while ((st = stmt->tryStep()).row()) {}
+            failed = !st;
+            stmt->reset();
+            // Schema changes can leave cached statements for dropped objects
+            if (failed) stmt.reset();
+        }
+        uint64_t ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+        out.push_back({e->statement, e->durationNs, ns, failed});
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options o = parse(argc, argv);
+
+    rdb::Workload w;
+    std::ifstream in(o.log, std::ios::binary);
+    if (!in || !w.load(in)) {
+        std::cerr << "rdb-replay: " << o.log << " is not a workload log\n";
+        return 1;
+    }
+    if (!o.inPlace) {
+        try {
+            copyDatabase(o.db, o.copy);
+        } catch (const std::exception& e) {
+            std::cerr << "rdb-replay: " << e.what() << "\n";
+            return 1;
+        }
+    }
+
+    unsigned threads = o.threads ? o.threads : std::max(1u, w.connections);
+    if (threads < w.connections)
+        std::cerr << "rdb-replay: note: " << w.connections << " captured connections share " << threads
+                  << " replay connections\n";
+
+    // Per replay connection, in original start order
+    std::vector<std::vector<const rdb::WorkloadEvent*>> queues(threads);
+    for (const auto& e : w.events) queues[e.connection % threads].push_back(&e);
+    for (auto& q : queues)
+        std::stable_sort(q.begin(), q.end(), [](auto* a, auto* b) { return a->startNs < b->startNs; });
+    // Pacing is relative to the first captured statement
+    uint64_t first = UINT64_MAX;
+    for (const auto& e : w.events) first = std::min(first, e.startNs);
+
+    std::vector<std::vector<Sample>> samples(threads);
+    std::vector<std::string> errors(threads);
+    auto t0 = std::chrono::steady_clock::now() - std::chrono::nanoseconds(
+        o.speed > 0 && first != UINT64_MAX ? static_cast<int64_t>(static_cast<double>(first) / o.speed) : 0);
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t)
+        workers.emplace_back([&, t] { replay(o, w, queues[t], t0, samples[t], errors[t]); });
+    for (auto& t : workers) t.join();
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    for (const auto& e : errors)
+        if (!e.empty()) {
+            std::cerr << "rdb-replay: " << e << "\n";
+            return 1;
+        }
+
+    struct PerStatement {
+        std::vector<uint64_t> captured, replayed;
+        uint64_t total = 0, failed = 0;
+    };
+    std::map<uint32_t, PerStatement> per;
+    std::vector<uint64_t> capturedAll, replayedAll;
+    uint64_t failed = 0;
+    for (const auto& s : samples)
+        for (const auto& x : s) {
+            auto& p = per[x.statement];
+            p.captured.push_back(x.capturedNs);
+            p.replayed.push_back(x.replayNs);
+            p.total += x.replayNs;
+            p.failed += x.failed;
+            failed += x.failed;
+            capturedAll.push_back(x.capturedNs);
+            replayedAll.push_back(x.replayNs);
+        }
+    std::sort(capturedAll.begin(), capturedAll.end());
+    std::sort(replayedAll.begin(), replayedAll.end());
+
+    std::cout << "events " << replayedAll.size() << "  statements " << w.statements.size() << "  connections "
+              << threads << "  errors " << failed << "\n"
+              << "wall " << std::fixed << std::setprecision(3) << wall << " s  throughput " << std::setprecision(0)
+              << (wall > 0 ? static_cast<double>(replayedAll.size()) / wall : 0) << " stmt/s\n\n";
+    const double ps[] = {50, 90, 99, 99.9};
+    std::cout << std::left << std::setw(10) << "latency us" << std::right;
+    for (const char* label : {"p50", "p90", "p99", "p99.9"}) std::cout << std::setw(10) << label;
+    std::cout << std::setw(10) << "max" << "\n";
+    auto row = [&](const char* name, const std::vector<uint64_t>& v) {
+        std::cout << std::left << std::setw(10) << name << std::right;
+        for (double p : ps) std::cout << std::setw(10) << us(percentile(v, p));
+        std::cout << std::setw(10) << us(v.empty() ? 0 : v.back()) << "\n";
+    };
+    row("captured", capturedAll);
+    row("replay", replayedAll);
+
+    std::vector<std::pair<uint32_t, PerStatement*>> order;
+    for (auto& [id, p] : per) {
+        std::sort(p.captured.begin(), p.captured.end());
+        std::sort(p.replayed.begin(), p.replayed.end());
+        order.push_back({id, &p});
+    }
+    std::sort(order.begin(), order.end(), [](auto& a, auto& b) { return a.second->total > b.second->total; });
+    if (order.size() > o.top) order.resize(o.top);
+    std::cout << "\nby total replay time (us: p50 p99 captured -> replay)\n";
+    for (auto& [id, p] : order) {
+        std::string sql = rdb::detail::normalizeSql(w.statements[id]);
+        if (sql.size() > 70) sql = sql.substr(0, 67) + "...";
+        std::cout << std::setw(8) << p->replayed.size() << "  " << us(percentile(p->captured, 50)) << " "
+                  << us(percentile(p->captured, 99)) << " -> " << us(percentile(p->replayed, 50)) << " "
+                  << us(percentile(p->replayed, 99));
+        if (p->failed) std::cout << "  errors " << p->failed;
+        std::cout << "\n          " << sql << "\n";
+    }
+    return 0;
+}
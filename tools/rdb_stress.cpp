@@ -0,0 +1,274 @@
+// rdb-stress: runs rdb's thread-safe pieces from several threads at once,
+// for the concurrency claims made about them. Build it with
+// ThreadSanitizer; a clean run prints "ok" for each case and TSan reports
+// nothing.
+//
+//   g++ -std=c++17 -O1 -g -fsanitize=thread -Iinclude tools/rdb_stress.cpp -lsqlite3 -pthread -o rdb-stress
+//   ./rdb-stress                     # every case
+//   ./rdb-stress latency             # named cases only
+//
+// Cases:
+//   latency    LatencyTrackers on several connections recording into one
+//              StatementLatency while other threads snapshot() and reset()
+//   timeline   TimelineTrackers on several connections recording into one
+//              QueryTimeline while another thread writes it out and clears it
+//   plans      a PlanMonitor whose connection keeps dropping and recreating
+//              an index while other threads read regressions() and accept()
+//
+// Options:
+//   --dir PATH      where file databases are created and removed (default /tmp)
+//   --seconds N     how long each case runs (default 2)
+//   --threads N     worker threads per case (default 4)
+//   --list          print the cases and exit
+
+#include "../include/rdb.h"
+#include <sstream>
+
+namespace {
+
+struct Options {
+    std::string dir = "/tmp";
+    double seconds = 2;
+    unsigned threads = 4;
+    std::vector<std::string> cases;
+};
+
+// A fresh database file under --dir, removed (with its -wal, -shm and a
+// PlanMonitor's -plans sidecar) when the case is done
+class TempFile {
+public:
+    TempFile(const Options& o, const std::string& name) : path_(o.dir + "/rdb-stress-" + name + ".db") { remove(); }
+    ~TempFile() { remove(); }
+    const std::string& path() const { return path_; }
+
+private:
+    std::string path_;
+    void remove() {
+        for (const char* suffix : {"", "-wal", "-shm", "-journal", "-plans", "-plans-wal", "-plans-shm"})
+            std::remove((path_ + suffix).c_str());
+    }
+};
+
+// Runs each fn on its own thread until --seconds have passed; fn is given
+// its index and the stop flag to poll
+void together(const Options& o, const std::vector<std::function<void(size_t, const std::atomic<bool>&)>>& fns) {
+    std::atomic<bool> stop(false);
+    std::vector<std::string> errors(fns.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < fns.size(); ++i)
+        threads.emplace_back([&, i] {
+            try {
+                fns[i](i, stop);
+            } catch (const std::exception& e) {
+                errors[i] = e.what();
+            }
+        });
+    std::this_thread::sleep_for(std::chrono::duration<double>(o.seconds));
+    stop = true;
+    for (auto& t : threads) t.join();
+    for (const auto& e : errors)
+        if (!e.empty()) throw std::runtime_error(e);
+}
+
+// ---------------------------------
+// latency: StatementLatency
+// ---------------------------------
+
+void latency(const Options& o) {
+    TempFile file(o, "latency");
+    {
+        rdb::Database db(file.path());
+        db.execute("PRAGMA journal_mode=WAL;"
+                   "CREATE TABLE t(id INTEGER PRIMARY KEY, v INTEGER);"
+                   "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 1000) "
+                   "INSERT INTO t(v) SELECT i FROM n;");
+    }
+    rdb::StatementLatency stats;
+    std::atomic<uint64_t> statements(0), snapshots(0), resets(0);
+
+    std::vector<std::function<void(size_t, const std::atomic<bool>&)>> fns;
+    for (unsigned t = 0; t < o.threads; ++t)
+        fns.push_back([&](size_t i, const std::atomic<bool>& stop) {
+            rdb::Database db(file.path());
+            db.execute("PRAGMA synchronous=NORMAL;");
+            db.setBusyTimeout(5000);
+            rdb::LatencyTracker tracker(db, stats, "worker " + std::to_string(i));
+            auto select = db.prepare("SELECT v FROM t WHERE id = ?;");
+            for (int64_t n = 0; !stop; ++n) {
+                select->bindInt64(1, n % 1000 + 1);
+                select->step();
+                select->reset();
+                // New statement text each time, so the text caches fill and empty
+                db.execute("UPDATE t SET v = v + 1 WHERE id = " + std::to_string(n % 1000 + 1) + ";");
+                statements += 2;
+            }
+        });
+    fns.push_back([&](size_t, const std::atomic<bool>& stop) {
+        while (!stop) {
+            for (bool byStatement : {false, true}) stats.snapshot(byStatement);
+            ++snapshots;
+        }
+    });
+    fns.push_back([&](size_t, const std::atomic<bool>& stop) {
+        while (!stop) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            stats.reset();
+            ++resets;
+        }
+    });
+    together(o, fns);
+    std::cout << "latency: ok, " << statements << " statements, " << snapshots << " snapshots, " << resets
+              << " resets\n";
+}
+
+// ---------------------------------
+// timeline: QueryTimeline
+// ---------------------------------
+
+void timeline(const Options& o) {
+    TempFile file(o, "timeline");
+    {
+        rdb::Database db(file.path());
+        db.execute("PRAGMA journal_mode=WAL; CREATE TABLE t(id INTEGER PRIMARY KEY, v INTEGER);");
+    }
+    rdb::QueryTimeline::Options options;
+    options.eventsPerThread = 1024;   // small rings, so they wrap while being written out
+    rdb::QueryTimeline events(options);
+    std::atomic<uint64_t> statements(0), dumps(0);
+
+    std::vector<std::function<void(size_t, const std::atomic<bool>&)>> fns;
+    for (unsigned t = 0; t < o.threads; ++t)
+        fns.push_back([&](size_t i, const std::atomic<bool>& stop) {
+            events.nameThread("worker " + std::to_string(i));
+            rdb::Database db(file.path());
+            db.execute("PRAGMA synchronous=NORMAL;");
+            db.setBusyTimeout(5000);
+            rdb::TimelineTracker tracker(db, events, "connection " + std::to_string(i));
+            auto insert = db.prepare("INSERT INTO t(v) VALUES (?);");
+            auto select = db.prepare("SELECT count(*) FROM t WHERE v = ?;");
+            for (int64_t n = 0; !stop; ++n) {
+                rdb::Database::Transaction tx(db);
+                insert->bindInt64(1, n);
+                insert->step();
+                insert->reset();
+                tx.commit();
+                select->bindInt64(1, n);
+                select->step();
+                select->reset();
+                statements += 2;
+            }
+        });
+    fns.push_back([&](size_t, const std::atomic<bool>& stop) {
+        while (!stop) {
+            std::ostringstream trace;
+            events.write(trace);
+            events.dropped();
+            if (++dumps % 2 == 0) events.clear();
+        }
+    });
+    together(o, fns);
+    std::cout << "timeline: ok, " << statements << " statements, " << dumps << " dumps\n";
+}
+
+// ---------------------------------
+// plans: PlanMonitor
+// ---------------------------------
+
+void plans(const Options& o) {
+    TempFile file(o, "plans");
+    rdb::Database db(file.path());
+    db.execute("CREATE TABLE t(id INTEGER PRIMARY KEY, a INTEGER, b INTEGER);"
+               "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 2000) "
+               "INSERT INTO t(a, b) SELECT i % 100, i FROM n;");
+    rdb::PlanMonitor::Options options;
+    options.onRegression = [](const rdb::PlanMonitor::Entry&) {};
+    rdb::PlanMonitor monitor(db, options);
+    std::atomic<uint64_t> statements(0), flips(0), reads(0), accepted(0);
+
+    // The connection's own thread: statements, literal-embedded ones that
+    // fill the text caches, and an index dropped and recreated under them
+    std::vector<std::function<void(size_t, const std::atomic<bool>&)>> fns;
+    fns.push_back([&](size_t, const std::atomic<bool>& stop) {
+        auto byB = db.prepare("SELECT a FROM t WHERE b = ?;");
+        for (int64_t n = 0; !stop; ++n) {
+            if (n % 100 == 0) {
+                db.execute(n % 200 == 0 ? "CREATE INDEX IF NOT EXISTS t_b ON t(b);" : "DROP INDEX IF EXISTS t_b;");
+                ++flips;
+            }
+            byB->bindInt64(1, n % 2000);
+            byB->step();
+            byB->reset();
+            db.execute("SELECT count(*) FROM t WHERE a = " + std::to_string(n % 100) + ";");
+            statements += 2;
+        }
+    });
+    for (unsigned t = 1; t < o.threads; ++t)
+        fns.push_back([&](size_t, const std::atomic<bool>& stop) {
+            while (!stop) {
+                for (const auto& e : monitor.regressions())
+                    if (e.current.calls % 2) accepted += monitor.accept(e.fingerprint);
+                monitor.entries();
+                monitor.error();
+                ++reads;
+            }
+        });
+    together(o, fns);
+    monitor.flush();
+    std::cout << "plans: ok, " << statements << " statements, " << flips << " index flips, " << reads
+              << " regressions() reads, " << accepted << " accepted\n";
+}
+
+// ---------------------------------
+// Cases
+// ---------------------------------
+
+struct Case {
+    const char* name;
+    void (*run)(const Options&);
+};
+
+const Case cases[] = {
+    {"latency", latency},
+    {"timeline", timeline},
+    {"plans", plans},
+};
+
+void usage() {
+    std::cerr << "usage: rdb-stress [--dir PATH] [--seconds N] [--threads N] [--list] [CASE...]\n";
+    std::exit(2);
+}
+
+Options parse(int argc, char** argv) {
+    Options o;
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) usage();
+            return argv[++i];
+        };
+        if (a == "--dir") o.dir = value();
+        else if (a == "--seconds") o.seconds = std::stod(value());
+        else if (a == "--threads") o.threads = static_cast<unsigned>(std::stoul(value()));
+        else if (a == "--list") {
+            for (const auto& c : cases) std::cout << c.name << "\n";
+            std::exit(0);
+        } else if (!a.empty() && a[0] == '-') usage();
+        else o.cases.push_back(a);
+    }
+    if (o.seconds <= 0 || o.threads == 0) usage();
+    for (const auto& name : o.cases)
+        if (std::none_of(std::begin(cases), std::end(cases), [&](const Case& c) { return name == c.name; })) usage();
+    return o;
+}
+
+} // namespace
+
+int main(int argc, char** argv) try {
+    Options o = parse(argc, argv);
+    for (const auto& c : cases)
+        if (o.cases.empty() || std::find(o.cases.begin(), o.cases.end(), c.name) != o.cases.end()) c.run(o);
+    return 0;
+} catch (const std::exception& e) {
+    std::cerr << "rdb-stress: " << e.what() << "\n";
+    return 1;
+}
@@ -0,0 +1,249 @@
+// rdb-top: live view of a process's rdb::MetricsSegment, read from shared
+// memory without touching the process: connections, statement and busy
+// retry rates, page cache hit ratio, pool waits, WAL size and checkpoint
+// lag, and the top statements when the process publishes a
+// StatementLatency.
+//
+//   g++ -std=c++17 -O2 -Iinclude tools/rdb_top.cpp -lsqlite3 -pthread -o rdb-top
+//   ./rdb-top                  # the only segment, or a list to choose from
+//   ./rdb-top 1234             # process 1234 (segment /rdb.1234)
+//   ./rdb-top /myname          # a segment created with Options::name
+// Options:
+//   --interval S   refresh period (default 1)
+//   --once         print one sample (rates over the interval) and exit
+//   --top N        statements to show (default 10)
+
+#include "../include/rdb.h"
+#include <csignal>
+#include <dirent.h>
+#include <iomanip>
+#include <map>
+#include <sstream>
+
+namespace {
+
+using Layout = rdb::detail::MetricsLayout;
+
+struct Options {
+    std::string name;
+    double interval = 1;
+    bool once = false;
+    size_t top = 10;
+};
+
+struct TopStatement {
+    uint64_t fingerprint, calls, totalNs, p99Ns;
+    std::string sql;
+};
+
+// Everything read from the segment at one instant
+struct Sample {
+    std::chrono::steady_clock::time_point at;
+    uint64_t heartbeatNs = 0, startedNs = 0;
+    uint64_t connections = 0, statements = 0, busyRetries = 0, cacheHits = 0, cacheMisses = 0;
+    uint64_t walBytes = 0, walFrames = 0, checkpointLag = 0;
+    uint64_t poolSize = 0, poolInUse = 0, poolAcquires = 0, poolWaits = 0, poolWaitNs = 0;
+    std::vector<TopStatement> top;
+};
+
+volatile std::sig_atomic_t interrupted = 0;
+
+void usage() {
+    std::cerr << "usage: rdb-top [--interval S] [--once] [--top N] [PID | /NAME]\n";
+    std::exit(2);
+}
+
+std::vector<std::string> segments() {
+    std::vector<std::string> out;
+    if (DIR* dir = ::opendir("/dev/shm")) {
+        while (dirent* e = ::readdir(dir))
+            if (std::strncmp(e->d_name, "rdb.", 4) == 0) out.push_back(std::string("/") + e->d_name);
+        ::closedir(dir);
+    }
+    return out;
+}
+
+const Layout* map(const std::string& name) {
+    int fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (::fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(Layout))
+        p = ::mmap(nullptr, sizeof(Layout), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) return nullptr;
+    auto m = static_cast<const Layout*>(p);
+    if (std::memcmp(m->magic, "RDBMETR1", 8) != 0 || m->version != Layout::kVersion || m->size != sizeof(Layout)) {
+        ::munmap(p, sizeof(Layout));
+        return nullptr;
+    }
+    return m;
+}
+
+Sample read(const Layout& m) {
+    auto get = [](const std::atomic<uint64_t>& a) { return a.load(std::memory_order_relaxed); };
+    Sample s;
+    s.at = std::chrono::steady_clock::now();
+    s.heartbeatNs = m.heartbeatNs.load(std::memory_order_acquire);
+    s.startedNs = get(m.startedNs);
+    s.statements = get(m.retiredStatements);
+    s.busyRetries = get(m.retiredBusyRetries);
+    s.cacheHits = get(m.retiredCacheHits);
+    s.cacheMisses = get(m.retiredCacheMisses);
+    for (const auto& slot : m.slots) {
+        if (!slot.inUse.load(std::memory_order_acquire)) continue;
+        ++s.connections;
+        s.statements += get(slot.statements);
+        s.busyRetries += get(slot.busyRetries);
+        s.cacheHits += get(slot.cacheHits);
+        s.cacheMisses += get(slot.cacheMisses);
+    }
+    s.walBytes = get(m.walBytes);
+    s.walFrames = get(m.walFrames);
+    s.checkpointLag = get(m.checkpointLag);
+    s.poolSize = get(m.poolSize);
+    s.poolInUse = get(m.poolInUse);
+    s.poolAcquires = get(m.poolAcquires);
+    s.poolWaits = get(m.poolWaits);
+    s.poolWaitNs = get(m.poolWaitNs);
+    // Sequence-counter read: retry while the table is being rewritten
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        uint64_t before = m.topSequence.load(std::memory_order_acquire);
+        if (before & 1) {
+            std::this_thread::yield();
+            continue;
+        }
+        std::vector<TopStatement> top;
+        uint32_t n = std::min<uint32_t>(m.topCount.load(std::memory_order_relaxed), Layout::kTop);
+        for (uint32_t i = 0; i < n; ++i) {
+            const auto& t = m.top[i];
+            char sql[Layout::kSqlBytes];
+            std::memcpy(sql, t.sql, sizeof sql);
+            sql[sizeof sql - 1] = '\0';
+            top.push_back({get(t.fingerprint), get(t.calls), get(t.totalNs), get(t.p99Ns), sql});
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (m.topSequence.load(std::memory_order_relaxed) == before) {
+            s.top = std::move(top);
+            break;
+        }
+    }
+    return s;
+}
+
+std::string bytes(uint64_t n) {
+    std::ostringstream s;
+    s << std::fixed << std::setprecision(1);
+    if (n >= (1ull << 30)) s << static_cast<double>(n) / (1ull << 30) << " GB";
+    else if (n >= (1ull << 20)) s << static_cast<double>(n) / (1ull << 20) << " MB";
+    else if (n >= (1ull << 10)) s << static_cast<double>(n) / (1ull << 10) << " KB";
+    else s << n << " B";
+    return s.str();
+}
+
+std::string duration(uint64_t secs) {
+    std::ostringstream s;
+    if (secs >= 86400) s << secs / 86400 << "d";
+    if (secs >= 3600) s << (secs / 3600) % 24 << "h";
+    if (secs >= 60) s << (secs / 60) % 60 << "m";
+    s << secs % 60 << "s";
+    return s.str();
+}
+
+void show(const Layout& m, const Sample& prev, const Sample& cur, const Options& o) {
+    double dt = std::chrono::duration<double>(cur.at - prev.at).count();
+    auto rate = [&](uint64_t a, uint64_t b) { return dt > 0 && b >= a ? static_cast<double>(b - a) / dt : 0.0; };
+    uint64_t now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+
+    std::ostringstream out;
+    out << std::fixed;
+    out << "rdb-top  pid " << m.pid << "  " << m.database << "  up "
+        << duration(now > cur.startedNs ? (now - cur.startedNs) / 1000000000ull : 0);
+    if (now > cur.heartbeatNs && now - cur.heartbeatNs > 5000000000ull) out << "  [stale: no sample for "
+        << duration((now - cur.heartbeatNs) / 1000000000ull) << "]";
+    out << "\n\n";
+
+    uint64_t hits = cur.cacheHits - std::min(cur.cacheHits, prev.cacheHits);
+    uint64_t misses = cur.cacheMisses - std::min(cur.cacheMisses, prev.cacheMisses);
+    out << "connections " << cur.connections << "   statements/s " << std::setprecision(0)
+        << rate(prev.statements, cur.statements) << "   busy retries/s " << rate(prev.busyRetries, cur.busyRetries)
+        << "   cache hit " << std::setprecision(1)
+        << (hits + misses ? 100.0 * static_cast<double>(hits) / static_cast<double>(hits + misses) : 100.0) << "%\n";
+    if (cur.poolSize) {
+        uint64_t waits = cur.poolWaits - std::min(cur.poolWaits, prev.poolWaits);
+        uint64_t waitNs = cur.poolWaitNs - std::min(cur.poolWaitNs, prev.poolWaitNs);
+        out << "pool " << cur.poolSize << " connections, " << cur.poolInUse << " in use   acquires/s "
+            << std::setprecision(0) << rate(prev.poolAcquires, cur.poolAcquires) << "   waits/s "
+            << rate(prev.poolWaits, cur.poolWaits) << "   mean wait " << std::setprecision(2)
+            << (waits ? static_cast<double>(waitNs) / static_cast<double>(waits) / 1e6 : 0.0) << " ms\n";
+    }
+    out << "WAL " << bytes(cur.walBytes) << ", " << cur.walFrames << " frames   checkpoint lag "
+        << cur.checkpointLag << " frames\n";
+
+    if (!cur.top.empty()) {
+        std::map<uint64_t, uint64_t> before;
+        for (const auto& t : prev.top) before[t.fingerprint] = t.calls;
+        out << "\n" << std::right << std::setw(10) << "calls/s" << std::setw(10) << "mean us" << std::setw(10)
+            << "p99 us" << std::setw(12) << "total s" << "  statement\n";
+        for (size_t i = 0; i < cur.top.size() && i < o.top; ++i) {
+            const auto& t = cur.top[i];
+            auto it = before.find(t.fingerprint);
+            std::string sql = t.sql.size() > 80 ? t.sql.substr(0, 77) + "..." : t.sql;
+            out << std::setprecision(0) << std::setw(10) << (it == before.end() ? 0.0 : rate(it->second, t.calls))
+                << std::setprecision(1) << std::setw(10)
+                << (t.calls ? static_cast<double>(t.totalNs) / static_cast<double>(t.calls) / 1000.0 : 0.0)
+                << std::setw(10) << static_cast<double>(t.p99Ns) / 1000.0 << std::setprecision(2) << std::setw(12)
+                << static_cast<double>(t.totalNs) / 1e9 << "  " << sql << "\n";
+        }
+    }
+    if (!o.once) std::cout << "\x1b[H\x1b[2J";
+    std::cout << out.str() << std::flush;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options o;
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) usage();
+            return argv[++i];
+        };
+        if (a == "--interval") o.interval = std::stod(value());
+        else if (a == "--once") o.once = true;
+        else if (a == "--top") o.top = std::stoul(value());
+        else if (!a.empty() && a[0] == '-') usage();
+        else if (o.name.empty()) o.name = a[0] == '/' ? a : "/rdb." + a;
+        else usage();
+    }
+    if (o.name.empty()) {
+        auto found = segments();
+        if (found.size() != 1) {
+            std::cerr << (found.empty() ? "rdb-top: no rdb metrics segments in /dev/shm\n"
+                                        : "rdb-top: several segments; pick one:\n");
+            for (const auto& s : found) std::cerr << "  " << s << "\n";
+            return 1;
+        }
+        o.name = found[0];
+    }
+    const Layout* m = map(o.name);
+    if (!m) {
+        std::cerr << "rdb-top: cannot open metrics segment " << o.name << "\n";
+        return 1;
+    }
+
+    std::signal(SIGINT, [](int) { interrupted = 1; });
+    auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(o.interval));
+    Sample prev = read(*m);
+    while (!interrupted) {
+        std::this_thread::sleep_for(period);
+        Sample cur = read(*m);
+        show(*m, prev, cur, o);
+        prev = std::move(cur);
+        if (o.once) break;
+    }
+    ::munmap(const_cast<Layout*>(m), sizeof(Layout));
+    return 0;
+}
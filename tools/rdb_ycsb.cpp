@@ -0,0 +1,405 @@
+// rdb-ycsb: YCSB core workloads A-F over rdb's ConnectionPool, for
+// measuring throughput and tail latency as threads and connections scale.
+//
+//   g++ -std=c++17 -O2 -Iinclude tools/rdb_ycsb.cpp -lsqlite3 -pthread -o rdb-ycsb
+//   ./rdb-ycsb --records 100000 --workloads ABCDEF --threads 1,2,4,8 --pool 0
+//
+// Workloads, as in YCSB's core properties:
+//   A  50% read, 50% update                 zipfian
+//   B  95% read,  5% update                 zipfian
+//   C  100% read                            zipfian
+//   D  95% read,  5% insert                 latest (recent inserts are hot)
+//   E  95% scan,  5% insert                 zipfian start, uniform 1..max-scan
+//   F  50% read, 50% read-modify-write      zipfian
+// Keys are "user" + FNV-1a hash of the record number, records have
+// --fields text fields of --field-length bytes, and updates write one
+// random field. Zipfian draws are scrambled by hashing so hot keys are
+// spread across the key space; Latest counts back from the newest insert.
+//
+// The table is loaded once and the workloads run in the order given
+// against it (D and E grow it). Each (threads, pool) pair gets a fresh
+// ConnectionPool; --pool 0 means one connection per thread, and a pool
+// smaller than the thread count measures contention for connections.
+// Options:
+//   --db PATH            (default ycsb.db; recreated unless --no-load)
+//   --records N          (default 100000)
+//   --workloads LETTERS  (default ABCDEF)
+//   --threads LIST       comma separated (default 1)
+//   --pool LIST          comma separated (default 0)
+//   --duration S         seconds per run (default 10)
+//   --fields N --field-length N --max-scan N --zipf THETA
+//   --no-load            reuse an existing loaded database
+
+#include "../include/rdb.h"
+#include <atomic>
+#include <iomanip>
+#include <random>
+#include <sstream>
+
+namespace {
+
+struct Options {
+    std::string db = "ycsb.db";
+    uint64_t records = 100000;
+    std::string workloads = "ABCDEF";
+    std::vector<unsigned> threads{1};
+    std::vector<unsigned> pools{0};
+    double duration = 10;
+    int fields = 10;
+    int fieldLength = 100;
+    int maxScan = 100;
+    double theta = 0.99;
+    bool load = true;
+};
+
+enum Op { Read, Update, Insert, Scan, ReadModifyWrite, OpCount };
+const char* const opNames[OpCount] = {"READ", "UPDATE", "INSERT", "SCAN", "RMW"};
+
+struct Workload {
+    char name;
+    double mix[OpCount];   // proportions
+    bool latest;           // D's request distribution
+};
+
+const Workload workloads[] = {
+    {'A', {0.50, 0.50, 0, 0, 0}, false},
+    {'B', {0.95, 0.05, 0, 0, 0}, false},
+    {'C', {1.00, 0, 0, 0, 0}, false},
+    {'D', {0.95, 0, 0.05, 0, 0}, true},
+    {'E', {0, 0, 0.05, 0.95, 0}, false},
+    {'F', {0.50, 0, 0, 0, 0.50}, false},
+};
+
+void usage() {
+    std::cerr << "usage: rdb-ycsb [--db PATH] [--records N] [--workloads ABCDEF] [--threads 1,2,4]\n"
+                 "                [--pool 0,4] [--duration S] [--fields N] [--field-length N]\n"
+                 "                [--max-scan N] [--zipf THETA] [--no-load]\n";
+    std::exit(2);
+}
+
+std::vector<unsigned> list(const std::string& s) {
+    std::vector<unsigned> out;
+    std::stringstream in(s);
+    std::string item;
+    while (std::getline(in, item, ',')) out.push_back(static_cast<unsigned>(std::stoul(item)));
+    if (out.empty()) usage();
+    return out;
+}
+
+Options parse(int argc, char** argv) {
+    Options o;
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) usage();
+            return argv[++i];
+        };
+        if (a == "--db") o.db = value();
+        else if (a == "--records") o.records = std::stoull(value());
+        else if (a == "--workloads") o.workloads = value();
+        else if (a == "--threads") o.threads = list(value());
+        else if (a == "--pool") o.pools = list(value());
+        else if (a == "--duration") o.duration = std::stod(value());
+        else if (a == "--fields") o.fields = std::stoi(value());
+        else if (a == "--field-length") o.fieldLength = std::stoi(value());
+        else if (a == "--max-scan") o.maxScan = std::stoi(value());
+        else if (a == "--zipf") o.theta = std::stod(value());
+        else if (a == "--no-load") o.load = false;
+        else usage();
+    }
+    if (!o.records || o.fields < 1 || o.maxScan < 1) usage();
+    return o;
+}
+
+uint64_t fnv64(uint64_t v) {
+    uint64_t h = 0xCBF29CE484222325ULL;
+    for (int i = 0; i < 8; ++i) {
+        h ^= v & 0xff;
+        h *= 1099511628211ULL;
+        v >>= 8;
+    }
+    return h;
+}
+
+std::string key(uint64_t n) { return "user" + std::to_string(fnv64(n)); }
+
+// Gray et al.'s "Quickly generating billion-record synthetic databases"
+// generator, as YCSB uses; grow() extends zeta incrementally for Latest
+class Zipfian {
+public:
+    Zipfian(uint64_t items, double theta) : theta_(theta), alpha_(1.0 / (1.0 - theta)), zeta2_(zeta(0, 2)) {
+        grow(items);
+    }
+
+    void grow(uint64_t items) {
+        if (items <= items_) return;
+        zetan_ += zeta(items_, items);
+        items_ = items;
+        eta_ = (1 - std::pow(2.0 / static_cast<double>(items_), 1 - theta_)) / (1 - zeta2_ / zetan_);
+    }
+
+    uint64_t next(std::mt19937_64& rng) {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        double uz = u * zetan_;
+        if (uz < 1) return 0;
+        if (uz < 1 + std::pow(0.5, theta_)) return std::min<uint64_t>(1, items_ - 1);
+        auto v = static_cast<uint64_t>(static_cast<double>(items_) * std::pow(eta_ * u - eta_ + 1, alpha_));
+        return std::min(v, items_ - 1);
+    }
+
+private:
+    double theta_, alpha_, zeta2_;
+    double zetan_ = 0, eta_ = 0;
+    uint64_t items_ = 0;
+
+    double zeta(uint64_t from, uint64_t to) const {
+        double sum = 0;
+        for (uint64_t i = from; i < to; ++i) sum += 1.0 / std::pow(static_cast<double>(i + 1), theta_);
+        return sum;
+    }
+};
+
+std::string us(uint64_t ns) {
+    std::ostringstream s;
+    s << std::fixed << std::setprecision(ns < 10000 ? 1 : 0) << static_cast<double>(ns) / 1000.0;
+    return s.str();
+}
+
+struct Statements {
+    rdb::StatementManifest manifest;
+    size_t read, insert, scan;
+    std::vector<size_t> update;   // one per field
+};
+
+Statements statements(const Options& o) {
+    Statements s;
+    s.read = s.manifest.add("read", "SELECT * FROM usertable WHERE ycsb_key = ?", true);
+    std::string columns = "ycsb_key", params = "?";
+    for (int f = 0; f < o.fields; ++f) {
+        std::string field = "field" + std::to_string(f);
+        s.update.push_back(s.manifest.add("update" + std::to_string(f),
+                                          "UPDATE usertable SET " + field + " = ? WHERE ycsb_key = ?"));
+        columns += ", " + field;
+        params += ", ?";
+    }
+    s.insert = s.manifest.add("insert", "INSERT INTO usertable(" + columns + ") VALUES(" + params + ")");
+    s.scan = s.manifest.add("scan", "SELECT * FROM usertable WHERE ycsb_key >= ? ORDER BY ycsb_key LIMIT ?");
+    return s;
+}
+
+std::string value(std::mt19937_64& rng, int length) {
+    std::string v(static_cast<size_t>(length), ' ');
+    for (auto& c : v) c = static_cast<char>(' ' + rng() % 95);
+    return v;
+}
+
+void insertRecord(rdb::Statement& stmt, uint64_t n, const Options& o, std::mt19937_64& rng) {
+    stmt.bindText(1, key(n));
+    for (int f = 0; f < o.fields; ++f) stmt.bindText(f + 2, value(rng, o.fieldLength));
+}
+
+bool load(const Options& o, const Statements& s) {
+    for (const char* suffix : {"", "-wal", "-shm"}) std::remove((o.db + suffix).c_str());
+    rdb::Database db(o.db);
+    std::string ddl = "CREATE TABLE usertable(ycsb_key TEXT PRIMARY KEY";
+    for (int f = 0; f < o.fields; ++f) ddl += ", field" + std::to_string(f) + " TEXT";
+    db.execute("PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL; " + ddl + ") WITHOUT ROWID;");
+    rdb::PreparedStatements prepared(db, s.manifest);
+    std::mt19937_64 rng(42);
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t n = 0; n < o.records;) {
+        rdb::Database::Transaction tx(db);
+        for (uint64_t end = std::min(o.records, n + 1000); n < end; ++n) {
+            rdb::Statement& ins = prepared[s.insert];
+            insertRecord(ins, n, o, rng);
+            if (!ins.tryStep().done()) {
+                std::cerr << "rdb-ycsb: load failed: " << db.errorMessage() << "\n";
+                return false;
+            }
+        }
+        tx.commit();
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "load: " << o.records << " records in " << std::fixed << std::setprecision(2) << secs << " s ("
+              << std::setprecision(0) << static_cast<double>(o.records) / secs << " records/s)\n";
+    return true;
+}
+
+struct Result {
+    rdb::LatencyHistogram latency[OpCount];
+    uint64_t errors = 0;
+};
+
+struct Run {
+    char workload;
+    unsigned threads, pool;
+    double opsPerSecond;
+};
+
+Run run(const Options& o, const Statements& s, const Workload& w, unsigned threads, unsigned poolSize,
+        std::atomic<uint64_t>& inserted) {
+    rdb::ConnectionPool pool(o.db, poolSize, s.manifest, [](rdb::Database& db) {
+        db.setBusyTimeout(10000);
+        return db.tryExecute("PRAGMA synchronous=NORMAL;");
+    });
+    Zipfian base(inserted.load(), o.theta);
+    std::vector<Result> results(threads);
+    std::atomic<uint64_t> nextInsert(inserted.load());
+    std::atomic<bool> stop(false);
+
+    auto worker = [&](unsigned t) {
+        std::mt19937_64 rng(1000 + t + static_cast<uint64_t>(w.name) * 7919);
+        Zipfian zipf = base;
+        Result& r = results[t];
+        std::discrete_distribution<int> pick(std::begin(w.mix), std::end(w.mix));
+
+        // Key of an existing record under the workload's distribution
+        auto chooseKey = [&]() -> uint64_t {
+            uint64_t n = inserted.load(std::memory_order_relaxed);
+            if (w.latest) {
+                zipf.grow(n);
+                return n - 1 - zipf.next(rng);
+            }
+            return fnv64(zipf.next(rng)) % n;
+        };
+        auto read = [&](rdb::ConnectionPool::Lease& lease, uint64_t k) {
+            rdb::Statement& q = lease.statement(s.read);
+            q.bindText(1, key(k));
+            rdb::Status st;
+            while ((st = q.tryStep()).row()) {}
+            return st.done();
+        };
+        auto update = [&](rdb::ConnectionPool::Lease& lease, uint64_t k) {
+            rdb::Statement& u = lease.statement(s.update[rng() % s.update.size()]);
+            u.bindText(1, value(rng, o.fieldLength));
+            u.bindText(2, key(k));
+            return u.tryStep().done();
+        };
+
+        while (!stop.load(std::memory_order_relaxed)) {
+            int op = pick(rng);
+            auto start = std::chrono::steady_clock::now();
+            bool ok;
+            {
+                auto lease = pool.acquire();
+                switch (op) {
+                case Read: ok = read(lease, chooseKey()); break;
+                case Update: ok = update(lease, chooseKey()); break;
+                case ReadModifyWrite: {
+                    uint64_t k = chooseKey();
+                    ok = read(lease, k) && update(lease, k);
+                    break;
+                }
+                case Scan: {
+                    rdb::Statement& q = lease.statement(s.scan);
+                    q.bindText(1, key(chooseKey()));
+                    q.bind(2, 1 + static_cast<int>(rng() % static_cast<uint64_t>(o.maxScan)));
+                    rdb::Status st;
+                    while ((st = q.tryStep()).row()) {}
+                    ok = st.done();
+                    break;
+                }
+                default: {
+                    uint64_t n = nextInsert.fetch_add(1);
+                    rdb::Statement& ins = lease.statement(s.insert);
+                    insertRecord(ins, n, o, rng);
+                    ok = ins.tryStep().done();
+                    // Readers only pick keys below the highest completed insert
+                    if (ok) {
+                        uint64_t seen = inserted.load();
+                        while (seen < n + 1 && !inserted.compare_exchange_weak(seen, n + 1)) {}
+                    }
+                    break;
+                }
+                }
+            }
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            if (ok) r.latency[op].record(static_cast<uint64_t>(ns));
+            else ++r.errors;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    auto begin = std::chrono::steady_clock::now();
+    for (unsigned t = 0; t < threads; ++t) workers.emplace_back(worker, t);
+    std::this_thread::sleep_for(std::chrono::duration<double>(o.duration));
+    stop = true;
+    for (auto& t : workers) t.join();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    Result total;
+    for (const auto& r : results) {
+        for (int op = 0; op < OpCount; ++op) total.latency[op].merge(r.latency[op]);
+        total.errors += r.errors;
+    }
+    uint64_t ops = 0;
+    for (const auto& h : total.latency) ops += h.count();
+    double rate = static_cast<double>(ops) / secs;
+    std::cout << "\nworkload " << w.name << "  threads " << threads << "  pool " << pool.size() << "  ops " << ops
+              << "  errors " << total.errors << "  " << std::fixed << std::setprecision(0) << rate << " ops/s  "
+              << rate / threads << " ops/s/thread\n";
+    std::cout << "  " << std::left << std::setw(8) << "op" << std::right << std::setw(10) << "count";
+    for (const char* label : {"mean", "p50", "p95", "p99", "p99.9", "max"}) std::cout << std::setw(9) << label;
+    std::cout << "  (us)\n";
+    for (int op = 0; op < OpCount; ++op) {
+        const auto& h = total.latency[op];
+        if (!h.count()) continue;
+        std::cout << "  " << std::left << std::setw(8) << opNames[op] << std::right << std::setw(10) << h.count()
+                  << std::setw(9) << us(static_cast<uint64_t>(h.mean()));
+        for (double p : {50.0, 95.0, 99.0, 99.9}) std::cout << std::setw(9) << us(h.percentile(p));
+        std::cout << std::setw(9) << us(h.max()) << "\n";
+    }
+    std::cout << std::flush;
+    return {w.name, threads, static_cast<unsigned>(pool.size()), rate};
+}
+
+} // namespace
+
+int main(int argc, char** argv) try {
+    Options o = parse(argc, argv);
+    Statements s = statements(o);
+    std::cout << "rdb-ycsb: SQLite " << sqlite3_libversion() << ", " << std::thread::hardware_concurrency()
+              << " hardware threads\n";
+    if (o.load && !load(o, s)) return 1;
+
+    std::atomic<uint64_t> inserted(o.records);
+    if (!o.load) {
+        rdb::Database db(o.db);
+        auto count = db.prepare("SELECT count(*) FROM usertable");
+        if (count->step()) inserted = static_cast<uint64_t>(count->getInt64(0));
+    }
+
+    std::vector<Run> runs;
+    for (char name : o.workloads) {
+        const Workload* w = nullptr;
+        for (const auto& candidate : workloads)
+            if (candidate.name == std::toupper(static_cast<unsigned char>(name))) w = &candidate;
+        if (!w) usage();
+        for (unsigned threads : o.threads) {
+            std::vector<unsigned> sizes;
+            for (unsigned pool : o.pools)
+                if (std::find(sizes.begin(), sizes.end(), pool ? pool : threads) == sizes.end())
+                    sizes.push_back(pool ? pool : threads);
+            for (unsigned pool : sizes) runs.push_back(run(o, s, *w, threads, pool, inserted));
+        }
+    }
+
+    // Scaling summary: throughput relative to each workload's first run
+    std::cout << "\nsummary\n  workload threads  pool       ops/s  ops/s/thread  speedup\n";
+    double baseline = 0;
+    char current = 0;
+    for (const auto& r : runs) {
+        if (r.workload != current) {
+            current = r.workload;
+            baseline = r.opsPerSecond / r.threads;
+        }
+        std::cout << "  " << std::setw(8) << r.workload << std::setw(8) << r.threads << std::setw(6) << r.pool
+                  << std::setw(12) << std::setprecision(0) << r.opsPerSecond << std::setw(14)
+                  << r.opsPerSecond / r.threads << std::setw(9) << std::setprecision(2)
+                  << (baseline > 0 ? r.opsPerSecond / baseline : 0) << "\n";
+    }
+    return 0;
+} catch (const std::exception& e) {
+    std::cerr << "rdb-ycsb: " << e.what() << "\n";
+    return 1;
+}